@@ -52,6 +52,7 @@ extern "C" {
 #include "sas.h"
 #include "httpconnection.h"
 #include "servercaps.h"
+#include "async_dispatcher.h"
 
 typedef enum { SCSCF=0, PCSCF=1, ICSCF=2, BGCF=5, AS=6, IBCF=7 } Node;
 
@@ -194,7 +195,8 @@ public:
           SAS::TrailId trail,
           Node node_functionality,
           Initiator initiator,
-          NodeRole role);
+          NodeRole role,
+          AsyncDispatcher* dispatcher=NULL);
 
   /// Destructor.
   ~RalfACR();
@@ -357,6 +359,7 @@ private:
   std::string hdr_contents(pjsip_hdr* hdr);
 
   HttpConnection* _ralf;
+  AsyncDispatcher* _dispatcher;
   SAS::TrailId _trail;
 
   Initiator _initiator;
@@ -447,8 +450,12 @@ public:
   /// @param ralf                 HttpConnection class set up to connect to
   ///                             Ralf cluster.
   /// @param node_functionality   Node-Functionality value to set in ACRs.
+  /// @param dispatcher           Thread pool used to send ACRs without
+  ///                             blocking the calling thread.  If NULL, ACRs
+  ///                             are sent synchronously.
   RalfACRFactory(HttpConnection* ralf,
-                 Node node_functionality);
+                 Node node_functionality,
+                 AsyncDispatcher* dispatcher=NULL);
 
   /// Destructor.
   ~RalfACRFactory();
@@ -464,6 +471,7 @@ public:
 private:
   HttpConnection* _ralf;
   Node _node_functionality;
+  AsyncDispatcher* _dispatcher;
 };
 
 #endif
@@ -0,0 +1,145 @@
+/**
+ * @file admission_controller.h  Per-class admission control for received SIP requests.
+ *
+ * Project Clearwater - IMS in the Cloud
+ * Copyright (C) 2014  Metaswitch Networks Ltd
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or (at your
+ * option) any later version, along with the "Special Exception" for use of
+ * the program along with SSL, set forth below. This program is distributed
+ * in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+ * without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details. You should have received a copy of the GNU General Public
+ * License along with this program.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ *
+ * The author can be reached by email at clearwater@metaswitch.com or by
+ * post at Metaswitch Networks Ltd, 100 Church St, Enfield EN2 6BQ, UK
+ *
+ * Special Exception
+ * Metaswitch Networks Ltd  grants you permission to copy, modify,
+ * propagate, and distribute a work formed by combining OpenSSL with The
+ * Software, or a work derivative of such a combination, even if such
+ * copying, modification, propagation, or distribution would otherwise
+ * violate the terms of the GPL. You must comply with the GPL in all
+ * respects for all of the code used other than OpenSSL.
+ * "OpenSSL" means OpenSSL toolkit software distributed by the OpenSSL
+ * Project and licensed under the OpenSSL Licenses, or a work based on such
+ * software and licensed under the OpenSSL Licenses.
+ * "OpenSSL Licenses" means the OpenSSL License and Original SSLeay License
+ * under which the OpenSSL Project distributes the OpenSSL toolkit software,
+ * as those licenses appear in the file LICENSE-OPENSSL.
+ */
+
+#ifndef ADMISSION_CONTROLLER_H__
+#define ADMISSION_CONTROLLER_H__
+
+#include <pthread.h>
+#include <time.h>
+#include <stdint.h>
+
+#include <atomic>
+#include <vector>
+
+/// Admission control for received requests, with a separate token bucket for
+/// each class of traffic.  Each class's bucket is filled at a rate measured
+/// in microseconds of processing per second, and each admitted request takes
+/// tokens equal to the measured mean processing cost of its class, so
+/// expensive classes are throttled harder than cheap ones.  The fill rate of
+/// each bucket adapts, in the same way as LoadMonitor, to keep the latency of
+/// the class at its own target.
+///
+/// This is used as well as the LoadMonitor when target latencies are
+/// configured for the classes.  The LoadMonitor still limits the overall
+/// rate, and is penalized when downstream servers report overload, while
+/// this divides the admitted traffic between the classes.  Giving the class
+/// that completes existing sessions a higher target than the others means
+/// established calls are shed last.
+class AdmissionController
+{
+public:
+  /// Constructor.
+  ///
+  /// @param target_latencies - The target latency for each class (in
+  ///                           microseconds).  The number of entries sets
+  ///                           the number of classes.
+  AdmissionController(const std::vector<int>& target_latencies);
+  ~AdmissionController();
+
+  /// Returns true if a request in the specified class should be processed,
+  /// or false if it should be rejected.
+  bool admit_request(int cls);
+
+  /// Records the completion of an admitted request.
+  ///
+  /// @param latency_us    - The total time taken to process the request,
+  ///                        including queuing.
+  /// @param service_us    - The time spent processing the request, which is
+  ///                        used as its cost.
+  void request_complete(int cls,
+                        unsigned long latency_us,
+                        unsigned long service_us);
+
+  /// Returns the target latency of a class (in microseconds).
+  int get_target_latency(int cls);
+
+  /// Returns the current smoothed latency of a class (in microseconds).
+  int get_current_latency(int cls);
+
+  /// Returns the current rate limit of a class (in requests per second).
+  int get_rate_limit(int cls);
+
+  /// Returns the number of requests in a class rejected since the last call.
+  uint_fast64_t get_rejected(int cls);
+
+  /// Tuning parameters.  The bucket for each class holds enough tokens for
+  /// MAX_BURST requests and initially fills at INITIAL_RATE requests per
+  /// second, never dropping below MIN_RATE.  The rate is reviewed every
+  /// ADJUST_REQUESTS completions.  Costs and latencies are smoothed with the
+  /// given weight for each new sample.
+  static const int MAX_BURST = 20;
+  static const int INITIAL_RATE = 10;
+  static const int MIN_RATE = 10;
+  static const int ADJUST_REQUESTS = 20;
+  static const int INITIAL_COST_US = 1000;
+  static constexpr double SMOOTHING = 0.1;
+  static constexpr double DECREASE_FACTOR = 0.5;
+  static constexpr double INCREASE_FACTOR = 0.5;
+
+private:
+  struct TrafficClass
+  {
+    pthread_mutex_t lock;
+    int target_latency_us;
+    double smoothed_latency_us;
+    double cost_us;
+
+    // Token bucket, in microseconds of processing.
+    double rate;
+    double tokens;
+    struct timespec replenish_time;
+
+    // Requests completed and processing admitted since the rate was last
+    // reviewed.
+    int completed;
+    double admitted_cost_us;
+    struct timespec adjust_time;
+
+    std::atomic<uint_fast64_t> rejected;
+  };
+
+  /// Tops up the bucket for the time since it was last replenished.  Must be
+  /// called with the class lock held.
+  void replenish(TrafficClass& tc);
+
+  /// Reviews the fill rate of the bucket.  Must be called with the class
+  /// lock held.
+  void adjust_rate(TrafficClass& tc);
+
+  std::vector<TrafficClass*> _classes;
+};
+
+#endif
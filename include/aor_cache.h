@@ -0,0 +1,102 @@
+/**
+ * @file aor_cache.h  Process-local cache of registration data for lookups.
+ *
+ * Project Clearwater - IMS in the Cloud
+ * Copyright (C) 2014  Metaswitch Networks Ltd
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or (at your
+ * option) any later version, along with the "Special Exception" for use of
+ * the program along with SSL, set forth below. This program is distributed
+ * in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+ * without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details. You should have received a copy of the GNU General Public
+ * License along with this program.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ *
+ * The author can be reached by email at clearwater@metaswitch.com or by
+ * post at Metaswitch Networks Ltd, 100 Church St, Enfield EN2 6BQ, UK
+ *
+ * Special Exception
+ * Metaswitch Networks Ltd  grants you permission to copy, modify,
+ * propagate, and distribute a work formed by combining OpenSSL with The
+ * Software, or a work derivative of such a combination, even if such
+ * copying, modification, propagation, or distribution would otherwise
+ * violate the terms of the GPL. You must comply with the GPL in all
+ * respects for all of the code used other than OpenSSL.
+ * "OpenSSL" means OpenSSL toolkit software distributed by the OpenSSL
+ * Project and licensed under the OpenSSL Licenses, or a work based on such
+ * software and licensed under the OpenSSL Licenses.
+ * "OpenSSL Licenses" means the OpenSSL License and Original SSLeay License
+ * under which the OpenSSL Project distributes the OpenSSL toolkit software,
+ * as those licenses appear in the file LICENSE-OPENSSL.
+ */
+
+#ifndef AOR_CACHE_H__
+#define AOR_CACHE_H__
+
+#include <stdint.h>
+
+#include <atomic>
+#include <memory>
+#include <string>
+
+#include "regstore.h"
+#include "sharded_lru_cache.h"
+#include "statistic.h"
+
+/// Bounded cache of AoRs read from a registration store, used to avoid
+/// reading and deserializing the whole AoR for every terminating request to
+/// busy subscribers.
+///
+/// Entries are only used for a short time (the staleness limit) after they
+/// were read from the store, because the AoR may be updated by other nodes.
+/// Updates made through this node invalidate the entry immediately.
+class AoRCache
+{
+public:
+  /// Constructor.
+  ///
+  /// @param max_entries      - The maximum number of AoRs cached.
+  /// @param staleness_ms     - How long an entry can be used for after it was
+  ///                           read from the store (in milliseconds).
+  /// @param stats_aggregator - Used to report the cache statistics.
+  AoRCache(int max_entries,
+           int staleness_ms,
+           LastValueCache* stats_aggregator);
+  ~AoRCache();
+
+  /// Returns a copy of the cached AoR, which the caller must delete, or NULL
+  /// if it isn't cached or the entry is too old.  On a miss, generation is
+  /// set to the value to pass to put once the AoR has been read.
+  RegStore::AoR* get(const std::string& aor_id, uint64_t& generation);
+
+  /// Caches a copy of an AoR read from the store.  The AoR isn't cached if
+  /// it has been invalidated since the corresponding get, because the AoR
+  /// read may predate the update.
+  void put(const std::string& aor_id,
+           const RegStore::AoR* aor_data,
+           uint64_t generation);
+
+  /// Removes an AoR from the cache.  This must be called whenever the AoR
+  /// is updated.
+  void invalidate(const std::string& aor_id);
+
+  /// Reports the cache statistics.  This is called by the stack every
+  /// statistics period.
+  void report_stats();
+
+private:
+  /// Cached AoRs are never modified, so can be shared with the caches'
+  /// callers while they are copied.
+  ShardedLRUCache<std::shared_ptr<const RegStore::AoR> > _cache;
+
+  // The sum of the ages of the entries used since the statistics were last
+  // reported.
+  std::atomic<uint_fast64_t> _hit_age_sum_ms;
+  Statistic _statistic;
+};
+
+#endif
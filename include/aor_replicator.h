@@ -0,0 +1,189 @@
+/**
+ * @file aor_replicator.h  Asynchronous replication of AoR updates to a remote store.
+ *
+ * Project Clearwater - IMS in the Cloud
+ * Copyright (C) 2014  Metaswitch Networks Ltd
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or (at your
+ * option) any later version, along with the "Special Exception" for use of
+ * the program along with SSL, set forth below. This program is distributed
+ * in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+ * without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details. You should have received a copy of the GNU General Public
+ * License along with this program.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ *
+ * The author can be reached by email at clearwater@metaswitch.com or by
+ * post at Metaswitch Networks Ltd, 100 Church St, Enfield EN2 6BQ, UK
+ *
+ * Special Exception
+ * Metaswitch Networks Ltd  grants you permission to copy, modify,
+ * propagate, and distribute a work formed by combining OpenSSL with The
+ * Software, or a work derivative of such a combination, even if such
+ * copying, modification, propagation, or distribution would otherwise
+ * violate the terms of the GPL. You must comply with the GPL in all
+ * respects for all of the code used other than OpenSSL.
+ * "OpenSSL" means OpenSSL toolkit software distributed by the OpenSSL
+ * Project and licensed under the OpenSSL Licenses, or a work based on such
+ * software and licensed under the OpenSSL Licenses.
+ * "OpenSSL Licenses" means the OpenSSL License and Original SSLeay License
+ * under which the OpenSSL Project distributes the OpenSSL toolkit software,
+ * as those licenses appear in the file LICENSE-OPENSSL.
+ */
+
+#ifndef AOR_REPLICATOR_H__
+#define AOR_REPLICATOR_H__
+
+#include <pthread.h>
+#include <stdint.h>
+
+#include <atomic>
+#include <deque>
+#include <map>
+#include <set>
+#include <string>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+
+#include "regstore.h"
+#include "statistic.h"
+
+/// Replicates updates made to AoRs in the local registration store to the
+/// remote (geo-redundant) store in the background, so the round trip to the
+/// remote site isn't part of the time taken to process a request.
+///
+/// What is replicated is the set of bindings and subscriptions each update
+/// added, changed or removed, rather than the whole AoR, so bindings added
+/// directly to the remote store by the other site are kept.  Changes to an
+/// AoR are written in the order they were made.  While changes are waiting
+/// to be written, later changes to the same AoR are combined with them, so
+/// a busy AoR is written once with the combined changes.  Failed writes are
+/// retried with exponential backoff.  The number of AoRs with changes
+/// waiting is bounded.  Changes that don't fit, or that still can't be
+/// written after several attempts, are dropped and the AoR is marked as out
+/// of step.  The next update to the AoR then replicates the whole local AoR
+/// rather than just its changes, replacing the bindings and subscriptions in
+/// the remote store.
+class AoRReplicator
+{
+public:
+  /// Constructor.
+  ///
+  /// @param remote_store     - The store changes are written to.
+  /// @param num_threads      - The number of threads writing to the store.
+  /// @param max_pending      - The maximum number of AoRs with changes
+  ///                           waiting to be written.
+  /// @param stats_aggregator - Used to report the replication statistics.
+  AoRReplicator(RegStore* remote_store,
+                int num_threads,
+                int max_pending,
+                LastValueCache* stats_aggregator);
+
+  /// Destructor.  Any changes not yet written are discarded.
+  ~AoRReplicator();
+
+  /// Queues the changes made by an update to an AoR, given the AoR as it
+  /// was read and as it was written.
+  void replicate(const std::string& aor_id,
+                 const RegStore::AoR* original,
+                 const RegStore::AoR* updated);
+
+  /// Returns the number of AoRs with changes waiting to be written.
+  int pending();
+
+  /// Reports the replication statistics.  This is called by the stack every
+  /// statistics period.
+  void report_stats();
+
+  static const int MAX_ATTEMPTS = 8;
+  static const int MAX_WRITES_PER_ATTEMPT = 3;
+  static const int INITIAL_BACKOFF_MS = 100;
+  static const int MAX_BACKOFF_MS = 10000;
+
+private:
+  /// Changes to an AoR that haven't been written yet.
+  struct Change
+  {
+    Change(const std::string& aor_id);
+
+    /// Holds the bindings and subscriptions added or changed.
+    RegStore::AoR updated;
+    std::set<std::string> removed_bindings;
+    std::set<std::string> removed_subscriptions;
+    int notify_cseq;
+
+    /// Whether updated holds the whole local AoR, so bindings and
+    /// subscriptions it doesn't have are removed from the remote store.
+    bool full;
+
+    /// When the oldest of the changes was made.
+    uint64_t queued_ms;
+
+    /// The number of failed attempts to write the changes.
+    int attempts;
+  };
+
+  static void* thread_func(void* p);
+  void run();
+
+  /// Writes the changes to the remote store, returning false if this fails.
+  bool write(const std::string& aor_id, const Change* change);
+
+  /// Makes the change replace the remote AoR with the given one.
+  static void make_full(Change* change, const RegStore::AoR* aor_data);
+
+  /// Adds the later changes to the earlier ones.
+  static void merge(Change* earlier, const Change* later);
+
+  /// Applies changes to an AoR read from the remote store.
+  static void apply(const Change* change, RegStore::AoR* aor_data);
+
+  static bool same_binding(const RegStore::AoR::Binding* b1,
+                           const RegStore::AoR::Binding* b2);
+  static bool same_subscription(const RegStore::AoR::Subscription* s1,
+                                const RegStore::AoR::Subscription* s2);
+
+  static uint64_t now_ms();
+
+  RegStore* _remote_store;
+  size_t _max_pending;
+
+  pthread_mutex_t _lock;
+  pthread_cond_t _cond;
+  bool _terminated;
+
+  /// Changes waiting to be written, by AoR.
+  std::unordered_map<std::string, Change*> _pending;
+
+  /// AoRs whose changes can be written now, oldest first.
+  std::deque<std::string> _ready;
+
+  /// AoRs waiting to retry a failed write, by retry time.
+  std::multimap<uint64_t, std::string> _delayed;
+
+  /// AoRs being written.  Any changes made meanwhile wait in _pending until
+  /// the write finishes, to keep the changes in order.
+  std::unordered_set<std::string> _writing;
+
+  /// AoRs whose changes have been dropped, so the next change must replicate
+  /// the whole AoR.
+  std::unordered_set<std::string> _dirty;
+
+  std::vector<pthread_t> _threads;
+
+  // Statistics since they were last reported.
+  std::atomic<uint_fast64_t> _queued;
+  std::atomic<uint_fast64_t> _combined;
+  std::atomic<uint_fast64_t> _written;
+  std::atomic<uint_fast64_t> _retries;
+  std::atomic<uint_fast64_t> _dropped;
+  std::atomic<uint_fast64_t> _lag_sum_ms;
+  std::atomic<uint_fast64_t> _max_lag_ms;
+  Statistic _statistic;
+};
+
+#endif
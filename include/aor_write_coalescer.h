@@ -0,0 +1,124 @@
+/**
+ * @file aor_write_coalescer.h  Combines concurrent updates to the same AoR.
+ *
+ * Project Clearwater - IMS in the Cloud
+ * Copyright (C) 2014  Metaswitch Networks Ltd
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or (at your
+ * option) any later version, along with the "Special Exception" for use of
+ * the program along with SSL, set forth below. This program is distributed
+ * in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+ * without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details. You should have received a copy of the GNU General Public
+ * License along with this program.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ *
+ * The author can be reached by email at clearwater@metaswitch.com or by
+ * post at Metaswitch Networks Ltd, 100 Church St, Enfield EN2 6BQ, UK
+ *
+ * Special Exception
+ * Metaswitch Networks Ltd  grants you permission to copy, modify,
+ * propagate, and distribute a work formed by combining OpenSSL with The
+ * Software, or a work derivative of such a combination, even if such
+ * copying, modification, propagation, or distribution would otherwise
+ * violate the terms of the GPL. You must comply with the GPL in all
+ * respects for all of the code used other than OpenSSL.
+ * "OpenSSL" means OpenSSL toolkit software distributed by the OpenSSL
+ * Project and licensed under the OpenSSL Licenses, or a work based on such
+ * software and licensed under the OpenSSL Licenses.
+ * "OpenSSL Licenses" means the OpenSSL License and Original SSLeay License
+ * under which the OpenSSL Project distributes the OpenSSL toolkit software,
+ * as those licenses appear in the file LICENSE-OPENSSL.
+ */
+
+#ifndef AOR_WRITE_COALESCER_H__
+#define AOR_WRITE_COALESCER_H__
+
+#include <pthread.h>
+#include <stdint.h>
+
+#include <atomic>
+#include <functional>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "regstore.h"
+#include "statistic.h"
+
+/// Combines concurrent updates to the same AoR, so they are made with a
+/// single read-modify-write of the store rather than each reading and
+/// writing the AoR and all but one having to retry.
+///
+/// An update to an AoR that no other thread is writing is made immediately.
+/// Updates that arrive while the AoR is being written are queued, and when
+/// the write finishes the thread with the oldest queued update makes all the
+/// queued updates as a single batch, in the order they arrived.  Batches
+/// therefore form during the store round trip, and no delay is added to
+/// updates of AoRs that aren't busy.
+class AoRWriteCoalescer
+{
+public:
+  /// Makes a batch of updates to an AoR, setting the results of each.
+  typedef std::function<void(std::vector<RegStore::Update*>&)> Writer;
+
+  /// Constructor.
+  ///
+  /// @param stats_aggregator - Used to report the coalescing statistics.
+  AoRWriteCoalescer(LastValueCache* stats_aggregator);
+  ~AoRWriteCoalescer();
+
+  /// Makes an update to an AoR, possibly combined with other updates to the
+  /// same AoR.  The batch is passed to the writer on the calling thread or
+  /// on the thread of another update in the batch.  Returns once the update
+  /// has been written and its results set.
+  void update(const std::string& aor_id,
+              RegStore::Update& update,
+              const Writer& writer);
+
+  /// Reports the coalescing statistics.  This is called by the stack every
+  /// statistics period.
+  void report_stats();
+
+  static const int NUM_SHARDS = 16;
+
+private:
+  struct Waiter
+  {
+    RegStore::Update* update;
+    bool done;
+  };
+
+  /// The state of an AoR with updates in progress.
+  struct Slot
+  {
+    Slot() : writing(false) {}
+
+    bool writing;
+    std::vector<Waiter*> queue;
+  };
+
+  struct Shard
+  {
+    pthread_mutex_t lock;
+
+    // Signalled whenever a batch finishes.
+    pthread_cond_t cond;
+    std::unordered_map<std::string, Slot> slots;
+  };
+
+  Shard& shard(const std::string& aor_id);
+
+  Shard _shards[NUM_SHARDS];
+
+  // Statistics since they were last reported.
+  std::atomic<uint_fast64_t> _updates;
+  std::atomic<uint_fast64_t> _batches;
+  std::atomic<uint_fast64_t> _max_batch_size;
+  Statistic _statistic;
+};
+
+#endif
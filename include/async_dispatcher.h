@@ -0,0 +1,110 @@
+/**
+ * @file async_dispatcher.h  Thread pool for blocking operations such as HTTP queries.
+ *
+ * Project Clearwater - IMS in the Cloud
+ * Copyright (C) 2014  Metaswitch Networks Ltd
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or (at your
+ * option) any later version, along with the "Special Exception" for use of
+ * the program along with SSL, set forth below. This program is distributed
+ * in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+ * without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details. You should have received a copy of the GNU General Public
+ * License along with this program.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ *
+ * The author can be reached by email at clearwater@metaswitch.com or by
+ * post at Metaswitch Networks Ltd, 100 Church St, Enfield EN2 6BQ, UK
+ *
+ * Special Exception
+ * Metaswitch Networks Ltd  grants you permission to copy, modify,
+ * propagate, and distribute a work formed by combining OpenSSL with The
+ * Software, or a work derivative of such a combination, even if such
+ * copying, modification, propagation, or distribution would otherwise
+ * violate the terms of the GPL. You must comply with the GPL in all
+ * respects for all of the code used other than OpenSSL.
+ * "OpenSSL" means OpenSSL toolkit software distributed by the OpenSSL
+ * Project and licensed under the OpenSSL Licenses, or a work based on such
+ * software and licensed under the OpenSSL Licenses.
+ * "OpenSSL Licenses" means the OpenSSL License and Original SSLeay License
+ * under which the OpenSSL Project distributes the OpenSSL toolkit software,
+ * as those licenses appear in the file LICENSE-OPENSSL.
+ */
+
+#ifndef ASYNC_DISPATCHER_H__
+#define ASYNC_DISPATCHER_H__
+
+#include <pthread.h>
+
+#include <deque>
+#include <functional>
+#include <vector>
+
+/// Pool of threads that run blocking operations (typically HTTP queries to
+/// Homestead, the XDMS or Ralf) on behalf of the SIP worker threads, so a
+/// slow server ties up one of these threads rather than a worker thread.
+///
+/// Each operation can have a completion callback, which is posted back to
+/// the worker threads once the operation has run.  The operation and the
+/// completion are never run concurrently, so the operation can pass its
+/// results to the completion through state that they share (but which
+/// nothing else touches until the completion runs).
+///
+/// Every completion is run exactly once, even if the dispatcher is stopped
+/// before the operation gets a thread - in that case the operation is
+/// skipped, so completions must cope with the operation not having run.
+class AsyncDispatcher
+{
+public:
+  /// Constructor.
+  ///
+  /// @param num_threads  - The number of threads in the pool.
+  AsyncDispatcher(int num_threads);
+
+  /// Destructor.  Stops the dispatcher if it hasn't already been stopped.
+  ~AsyncDispatcher();
+
+  /// Queues an operation to be run on one of the pool threads.
+  ///
+  /// @param operation    - The blocking operation.
+  /// @param completion   - Callback to run on a worker thread after the
+  ///                       operation has been run (or skipped).  May be
+  ///                       empty, in which case nothing is run on
+  ///                       completion.
+  void dispatch(const std::function<void()>& operation,
+                const std::function<void()>& completion=nullptr);
+
+  /// Stops the threads, waiting for any operations that are running to
+  /// finish.  Operations that haven't started, and any dispatched after
+  /// this, are skipped and their completions posted straight away.  This
+  /// must be called while the worker threads are still running, so the
+  /// completions resume their transactions normally.
+  void stop();
+
+  /// Returns the number of operations waiting for a thread.
+  int queue_size();
+
+private:
+  struct Operation
+  {
+    std::function<void()> operation;
+    std::function<void()> completion;
+  };
+
+  static void* thread_func(void* p);
+  void run();
+
+  /// Posts the completion for an operation (if it has one) and frees it.
+  static void complete(Operation* op);
+
+  pthread_mutex_t _lock;
+  pthread_cond_t _cond;
+  std::deque<Operation*> _q;
+  bool _stopped;
+  std::vector<pthread_t> _threads;
+};
+
+#endif
@@ -57,6 +57,7 @@ extern "C" {
 #include "stack.h"
 #include "pjmodule.h"
 #include "acr.h"
+#include "slab_cache.h"
 
 
 /// Class implementing basic SIP proxy functionality.  Various methods in
@@ -99,7 +100,7 @@ protected:
   class UACTsx;
 
   /// Class tracking the UAS-related state for a proxied transaction.
-  class UASTsx
+  class UASTsx : public SlabAllocated
   {
 
   public:
@@ -262,7 +263,7 @@ protected:
   /// Class implementing the UAC side of a proxied transaction.  There may be
   /// multiple instances of this class for a single proxied transaction if it
   /// is forked.
-  class UACTsx
+  class UACTsx : public SlabAllocated
   {
   public:
     /// UAC Transaction constructor
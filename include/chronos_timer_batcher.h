@@ -0,0 +1,176 @@
+/**
+ * @file chronos_timer_batcher.h  Batching of Chronos timer updates.
+ *
+ * Project Clearwater - IMS in the Cloud
+ * Copyright (C) 2014  Metaswitch Networks Ltd
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or (at your
+ * option) any later version, along with the "Special Exception" for use of
+ * the program along with SSL, set forth below. This program is distributed
+ * in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+ * without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details. You should have received a copy of the GNU General Public
+ * License along with this program.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ *
+ * The author can be reached by email at clearwater@metaswitch.com or by
+ * post at Metaswitch Networks Ltd, 100 Church St, Enfield EN2 6BQ, UK
+ *
+ * Special Exception
+ * Metaswitch Networks Ltd  grants you permission to copy, modify,
+ * propagate, and distribute a work formed by combining OpenSSL with The
+ * Software, or a work derivative of such a combination, even if such
+ * copying, modification, propagation, or distribution would otherwise
+ * violate the terms of the GPL. You must comply with the GPL in all
+ * respects for all of the code used other than OpenSSL.
+ * "OpenSSL" means OpenSSL toolkit software distributed by the OpenSSL
+ * Project and licensed under the OpenSSL Licenses, or a work based on such
+ * software and licensed under the OpenSSL Licenses.
+ * "OpenSSL Licenses" means the OpenSSL License and Original SSLeay License
+ * under which the OpenSSL Project distributes the OpenSSL toolkit software,
+ * as those licenses appear in the file LICENSE-OPENSSL.
+ */
+
+#ifndef CHRONOS_TIMER_BATCHER_H__
+#define CHRONOS_TIMER_BATCHER_H__
+
+#include <pthread.h>
+#include <stdint.h>
+
+#include <atomic>
+#include <deque>
+#include <functional>
+#include <string>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+
+#include "chronosconnection.h"
+#include "sas.h"
+#include "statistic.h"
+
+/// Sends updates and deletions of existing Chronos timers in batches from
+/// background threads, rather than one request at a time while handling
+/// each SIP request.
+///
+/// Operations are held for a short window before being sent.  If a timer is
+/// updated or deleted again while an earlier operation on it is waiting,
+/// the operations are combined and only the latest is sent, so a burst of
+/// re-registrations that each refresh every binding's timer sends one
+/// request per timer.  Operations on the same timer are sent in the order
+/// they were made.  If too many operations are waiting, new ones are sent
+/// straight away by the caller.
+///
+/// Creating timers isn't batched, as the caller needs the timer's ID.
+class ChronosTimerBatcher
+{
+public:
+  /// Called with the timer's new ID if Chronos changes it when the timer is
+  /// updated.
+  typedef std::function<void(const std::string& timer_id)> IdChangedCallback;
+
+  /// Constructor.
+  ///
+  /// @param chronos          - The connection used to send the operations.
+  /// @param window_ms        - How long operations are held before being
+  ///                           sent.
+  /// @param max_batch_size   - The maximum number of operations sent by a
+  ///                           thread in one batch.  A batch is sent early
+  ///                           if this many operations are waiting.
+  /// @param num_threads      - The number of threads sending batches.
+  /// @param max_pending      - The maximum number of operations waiting.
+  /// @param stats_aggregator - Used to report the batching statistics.
+  ChronosTimerBatcher(ChronosConnection* chronos,
+                      int window_ms,
+                      int max_batch_size,
+                      int num_threads,
+                      int max_pending,
+                      LastValueCache* stats_aggregator);
+
+  /// Destructor.  Sends any operations still waiting.
+  ~ChronosTimerBatcher();
+
+  /// Queues an update to an existing timer, to pop at the given time (in
+  /// seconds since the epoch).  The interval sent to Chronos is worked out
+  /// from this when the update is sent, so it doesn't include the time the
+  /// update waited.
+  void set_timer(const std::string& timer_id,
+                 int expires,
+                 const std::string& callback_uri,
+                 const std::string& opaque,
+                 const IdChangedCallback& id_changed,
+                 SAS::TrailId trail);
+
+  /// Queues the deletion of a timer.
+  void delete_timer(const std::string& timer_id, SAS::TrailId trail);
+
+  /// Returns the number of operations waiting to be sent.
+  int pending();
+
+  /// Reports the batching statistics.  This is called by the stack every
+  /// statistics period.
+  void report_stats();
+
+private:
+  /// An operation on a timer.
+  struct Operation
+  {
+    bool is_delete;
+    std::string timer_id;
+    int expires;
+    std::string callback_uri;
+    std::string opaque;
+    IdChangedCallback id_changed;
+    SAS::TrailId trail;
+  };
+
+  /// Queues the operation, or sends it straight away if the queue is full.
+  void queue(Operation* op);
+
+  /// Sends the operation, returning false if Chronos rejects it.
+  bool send(Operation* op);
+
+  static void* thread_func(void* p);
+  void run();
+
+  static uint64_t now_ms();
+
+  ChronosConnection* _chronos;
+  int _window_ms;
+  size_t _max_batch_size;
+  size_t _max_pending;
+
+  pthread_mutex_t _lock;
+  pthread_cond_t _cond;
+  bool _terminated;
+
+  /// Operations waiting to be sent, by timer ID.
+  std::unordered_map<std::string, Operation*> _pending;
+
+  /// Timers with operations waiting, oldest first, with the time the
+  /// operation was queued.
+  std::deque<std::pair<std::string, uint64_t> > _queue;
+
+  /// Timers with operations being sent.  Any operations on them queued
+  /// meanwhile aren't sent until these finish, to keep them in order.
+  std::unordered_set<std::string> _sending;
+
+  std::vector<pthread_t> _threads;
+
+  // Statistics since they were last reported.
+  std::atomic<uint_fast64_t> _queued;
+  std::atomic<uint_fast64_t> _combined;
+  std::atomic<uint_fast64_t> _sent;
+  std::atomic<uint_fast64_t> _failed;
+  std::atomic<uint_fast64_t> _overflowed;
+  std::atomic<uint_fast64_t> _batches;
+  std::atomic<uint_fast64_t> _batched;
+  std::atomic<uint_fast64_t> _max_batch;
+  std::atomic<uint_fast64_t> _max_depth;
+  Statistic _statistic;
+};
+
+#endif
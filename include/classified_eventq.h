@@ -0,0 +1,460 @@
+/**
+ * @file classified_eventq.h  Multi-class event queue with per-class depth limits.
+ *
+ * Project Clearwater - IMS in the Cloud
+ * Copyright (C) 2014  Metaswitch Networks Ltd
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or (at your
+ * option) any later version, along with the "Special Exception" for use of
+ * the program along with SSL, set forth below. This program is distributed
+ * in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+ * without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details. You should have received a copy of the GNU General Public
+ * License along with this program.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ *
+ * The author can be reached by email at clearwater@metaswitch.com or by
+ * post at Metaswitch Networks Ltd, 100 Church St, Enfield EN2 6BQ, UK
+ *
+ * Special Exception
+ * Metaswitch Networks Ltd  grants you permission to copy, modify,
+ * propagate, and distribute a work formed by combining OpenSSL with The
+ * Software, or a work derivative of such a combination, even if such
+ * copying, modification, propagation, or distribution would otherwise
+ * violate the terms of the GPL. You must comply with the GPL in all
+ * respects for all of the code used other than OpenSSL.
+ * "OpenSSL" means OpenSSL toolkit software distributed by the OpenSSL
+ * Project and licensed under the OpenSSL Licenses, or a work based on such
+ * software and licensed under the OpenSSL Licenses.
+ * "OpenSSL Licenses" means the OpenSSL License and Original SSLeay License
+ * under which the OpenSSL Project distributes the OpenSSL toolkit software,
+ * as those licenses appear in the file LICENSE-OPENSSL.
+ */
+
+#ifndef CLASSIFIED_EVENTQ_H__
+#define CLASSIFIED_EVENTQ_H__
+
+#include <pthread.h>
+#include <time.h>
+
+#include <stdint.h>
+
+#include <deque>
+#include <unordered_map>
+#include <vector>
+
+/// Event queue that holds items in a number of priority classes.  Items are
+/// normally popped from the highest priority (lowest numbered) non-empty
+/// class, and are FIFO within a class.  So that lower priority classes are
+/// not starved under sustained load, a class that has been passed over for
+/// more than the starvation limit consecutive pops while it had items
+/// queued is served next, which guarantees each class a minimum share of
+/// the pops.  Items can be pushed with an ordering key (for example a hash
+/// of the SIP Call-ID).  An item is never popped ahead of an item with the
+/// same key that was pushed before it, even if it is in a higher priority
+/// class, so related items keep their order.  Each class can have a maximum
+/// depth, in which
+/// case attempts to push to a full class fail immediately rather than
+/// blocking, so the caller can reject the work.
+///
+/// The queue supports the same deadlock detection as eventq - it is deemed
+/// deadlocked if there are items on the queue and nothing has been popped
+/// for longer than the configured threshold.
+template<class T>
+class classified_eventq
+{
+public:
+  /// Constructor.
+  ///
+  /// @param max_depths  - The maximum depth of each class (zero means the
+  ///                      class is unbounded).  The number of entries sets the
+  ///                      number of classes.
+  /// @param starvation_limit
+  ///                    - The number of times a non-empty class can be passed
+  ///                      over before it is served ahead of higher priority
+  ///                      classes (zero means strict priority).
+  classified_eventq(const std::vector<unsigned int>& max_depths,
+                    unsigned int starvation_limit=0) :
+    _max_depths(max_depths),
+    _queues(max_depths.size()),
+    _starvation_limit(starvation_limit),
+    _passed_over(max_depths.size(), 0),
+    _next_seq(0),
+    _front_seq(0),
+    _size(0),
+    _num_waiters(0),
+    _terminated(false),
+    _deadlock_threshold(0)
+  {
+    pthread_mutex_init(&_m, NULL);
+    pthread_cond_init(&_cond, NULL);
+    clock_gettime(CLOCK_MONOTONIC, &_service_time);
+  }
+
+  ~classified_eventq()
+  {
+    pthread_cond_destroy(&_cond);
+    pthread_mutex_destroy(&_m);
+  }
+
+  /// Returns the number of priority classes.
+  int num_classes() const
+  {
+    return _queues.size();
+  }
+
+  /// Terminates the queue.  Any blocked pops return false, as do any future
+  /// pushes and pops.
+  void terminate()
+  {
+    pthread_mutex_lock(&_m);
+    _terminated = true;
+    pthread_cond_broadcast(&_cond);
+    pthread_mutex_unlock(&_m);
+  }
+
+  /// Returns true if the queue has been terminated.
+  bool is_terminated()
+  {
+    pthread_mutex_lock(&_m);
+    bool terminated = _terminated;
+    pthread_mutex_unlock(&_m);
+    return terminated;
+  }
+
+  /// Sets the deadlock detection threshold (in milliseconds).  Zero disables
+  /// deadlock detection.
+  void set_deadlock_threshold(unsigned int threshold)
+  {
+    _deadlock_threshold = threshold;
+  }
+
+  /// Returns true if the queue has items on it but has not been serviced for
+  /// longer than the deadlock threshold.
+  bool is_deadlocked()
+  {
+    bool deadlocked = false;
+
+    if (_deadlock_threshold > 0)
+    {
+      pthread_mutex_lock(&_m);
+      if (_size > 0)
+      {
+        struct timespec now;
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        unsigned long idle_ms = (now.tv_sec - _service_time.tv_sec) * 1000 +
+                                (now.tv_nsec - _service_time.tv_nsec) / 1000000;
+        deadlocked = (idle_ms > _deadlock_threshold);
+      }
+      pthread_mutex_unlock(&_m);
+    }
+
+    return deadlocked;
+  }
+
+  /// Restarts the deadlock detection clock.  This is used when extra capacity
+  /// has been added to service the queue, to give it time to take effect.
+  void reset_deadlock_detection()
+  {
+    pthread_mutex_lock(&_m);
+    clock_gettime(CLOCK_MONOTONIC, &_service_time);
+    pthread_mutex_unlock(&_m);
+  }
+
+  /// Pushes an item on to the specified class.  Returns false (without
+  /// queuing the item) if the class is full or the queue has been terminated.
+  /// If force is set the class depth limit is ignored - this is used for
+  /// work that must not be dropped.  If key is non-zero, the item isn't
+  /// popped until all the items queued before it with the same key have
+  /// been.
+  bool push(T item, int cls, bool force=false, size_t key=0)
+  {
+    bool pushed = false;
+
+    pthread_mutex_lock(&_m);
+    if ((!_terminated) &&
+        ((force) ||
+         (_max_depths[cls] == 0) ||
+         (_queues[cls].size() < _max_depths[cls])))
+    {
+      if (_size == 0)
+      {
+        // The queue was empty so restart the deadlock detection clock.
+        clock_gettime(CLOCK_MONOTONIC, &_service_time);
+      }
+      Entry e = {item, key, ++_next_seq};
+      _queues[cls].push_back(e);
+      if (key != 0)
+      {
+        _keys[key].push_back(e.seq);
+      }
+      ++_size;
+      pushed = true;
+      pthread_cond_signal(&_cond);
+    }
+    pthread_mutex_unlock(&_m);
+
+    return pushed;
+  }
+
+  /// Puts an item back at the front of the specified class, so it is the
+  /// next item popped from that class, and ahead of any queued items with
+  /// the same key.  This is used to return items that were popped but not
+  /// processed, and so ignores the class depth limit.  Returns false if the
+  /// queue has been terminated.
+  bool push_front(T item, int cls, size_t key=0)
+  {
+    bool pushed = false;
+
+    pthread_mutex_lock(&_m);
+    if (!_terminated)
+    {
+      if (_size == 0)
+      {
+        clock_gettime(CLOCK_MONOTONIC, &_service_time);
+      }
+      Entry e = {item, key, --_front_seq};
+      _queues[cls].push_front(e);
+      if (key != 0)
+      {
+        _keys[key].push_front(e.seq);
+      }
+      ++_size;
+      pushed = true;
+      pthread_cond_signal(&_cond);
+    }
+    pthread_mutex_unlock(&_m);
+
+    return pushed;
+  }
+
+  /// Pops the oldest item from the highest priority non-empty class, blocking
+  /// until an item is available.  Returns false if the queue is terminated.
+  bool pop(T& item)
+  {
+    pthread_mutex_lock(&_m);
+
+    wait_for_items();
+
+    bool popped = false;
+    if (!_terminated)
+    {
+      popped = pop_locked(item);
+      clock_gettime(CLOCK_MONOTONIC, &_service_time);
+    }
+
+    pthread_mutex_unlock(&_m);
+
+    return popped;
+  }
+
+  /// Pops a batch of items with a single lock acquisition, blocking until at
+  /// least one item is available.  Items are appended to the supplied vector
+  /// in the order they would have been returned by pop.
+  ///
+  /// The batch size adapts to the queue depth - the queued items are shared
+  /// between this caller and any other callers blocked waiting for items, so
+  /// a single caller doesn't take work that idle callers could be processing
+  /// in parallel.  When there are no idle callers the whole batch is taken.
+  ///
+  /// @returns             - the number of items popped, or zero if the queue
+  ///                        is terminated.
+  size_t pop_batch(std::vector<T>& items, size_t max_items)
+  {
+    pthread_mutex_lock(&_m);
+
+    wait_for_items();
+
+    size_t popped = 0;
+    if (!_terminated)
+    {
+      size_t share = (_size + _num_waiters) / (_num_waiters + 1);
+      size_t batch = (share < max_items) ? share : max_items;
+      if (batch < 1)
+      {
+        batch = 1;
+      }
+
+      T item;
+      while ((popped < batch) && (pop_locked(item)))
+      {
+        items.push_back(item);
+        ++popped;
+      }
+      clock_gettime(CLOCK_MONOTONIC, &_service_time);
+    }
+
+    pthread_mutex_unlock(&_m);
+
+    return popped;
+  }
+
+  /// Returns the total number of items on the queue.
+  int size()
+  {
+    pthread_mutex_lock(&_m);
+    int size = _size;
+    pthread_mutex_unlock(&_m);
+    return size;
+  }
+
+  /// Returns the number of items queued in the specified class.
+  int size(int cls)
+  {
+    pthread_mutex_lock(&_m);
+    int size = _queues[cls].size();
+    pthread_mutex_unlock(&_m);
+    return size;
+  }
+
+  /// Returns the number of callers blocked waiting for items - that is, the
+  /// number of idle consumers.
+  int num_waiters()
+  {
+    pthread_mutex_lock(&_m);
+    int waiters = _num_waiters;
+    pthread_mutex_unlock(&_m);
+    return waiters;
+  }
+
+  /// Returns the maximum depth of the specified class (zero if unbounded).
+  unsigned int max_depth(int cls) const
+  {
+    return _max_depths[cls];
+  }
+
+private:
+  /// Waits until the queue is non-empty or terminated.  Must be called with
+  /// the lock held.
+  void wait_for_items()
+  {
+    while ((!_terminated) && (_size == 0))
+    {
+      ++_num_waiters;
+      pthread_cond_wait(&_cond, &_m);
+      --_num_waiters;
+    }
+  }
+
+  /// Returns the position of the oldest item in a class that can be popped
+  /// - that is, that has no items with the same key queued before it - or
+  /// -1 if there isn't one.  Must be called with the lock held.
+  int first_poppable(int cls)
+  {
+    for (size_t ii = 0; ii < _queues[cls].size(); ++ii)
+    {
+      const Entry& e = _queues[cls][ii];
+      if ((e.key == 0) || (_keys[e.key].front() == e.seq))
+      {
+        return ii;
+      }
+    }
+    return -1;
+  }
+
+  /// Pops the oldest poppable item from the highest priority class that has
+  /// one, or from the highest priority class that has reached the
+  /// starvation limit.  Must be called with the lock held.  Returns false if
+  /// the queue is empty.
+  bool pop_locked(T& item)
+  {
+    // The oldest item on the queue can always be popped, so there is always
+    // a class with a poppable item if the queue isn't empty.
+    int cls = -1;
+    int pos = -1;
+    for (size_t ii = 0; ii < _queues.size(); ++ii)
+    {
+      int ii_pos = first_poppable(ii);
+      if (ii_pos != -1)
+      {
+        if (cls == -1)
+        {
+          cls = ii;
+          pos = ii_pos;
+        }
+
+        if ((_starvation_limit > 0) &&
+            (_passed_over[ii] >= _starvation_limit))
+        {
+          cls = ii;
+          pos = ii_pos;
+          break;
+        }
+      }
+    }
+
+    if (cls == -1)
+    {
+      return false;
+    }
+
+    // Every other class with items waiting has been passed over.
+    for (size_t ii = 0; ii < _queues.size(); ++ii)
+    {
+      if ((int)ii == cls)
+      {
+        _passed_over[ii] = 0;
+      }
+      else if (!_queues[ii].empty())
+      {
+        ++_passed_over[ii];
+      }
+    }
+
+    typename std::deque<Entry>::iterator i = _queues[cls].begin() + pos;
+    item = i->item;
+    if (i->key != 0)
+    {
+      std::unordered_map<size_t, std::deque<int64_t> >::iterator k = _keys.find(i->key);
+      k->second.pop_front();
+      if (k->second.empty())
+      {
+        _keys.erase(k);
+      }
+    }
+    _queues[cls].erase(i);
+    --_size;
+    return true;
+  }
+
+  /// A queued item.  Items pushed to the back of the queue have increasing
+  /// sequence numbers, and items pushed to the front decreasing negative
+  /// ones, so the oldest item has the lowest.
+  struct Entry
+  {
+    T item;
+    size_t key;
+    int64_t seq;
+  };
+
+  std::vector<unsigned int> _max_depths;
+  std::vector<std::deque<Entry> > _queues;
+
+  // The sequence numbers of the items queued with each key, oldest first.
+  std::unordered_map<size_t, std::deque<int64_t> > _keys;
+
+  // Number of consecutive pops each class has been passed over for while it
+  // had items queued.
+  unsigned int _starvation_limit;
+  std::vector<unsigned int> _passed_over;
+  int64_t _next_seq;
+  int64_t _front_seq;
+  int _size;
+
+  // Number of callers blocked waiting for items.
+  size_t _num_waiters;
+  bool _terminated;
+
+  unsigned int _deadlock_threshold;
+
+  // Time the queue was last serviced (or became non-empty).
+  struct timespec _service_time;
+
+  pthread_mutex_t _m;
+  pthread_cond_t _cond;
+};
+
+#endif
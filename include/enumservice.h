@@ -48,6 +48,7 @@
 #include "sas.h"
 #include "baseresolver.h"
 #include "dnsresolver.h"
+#include "regex_cache.h"
 
 /// @class EnumService
 ///
@@ -64,8 +65,9 @@ public:
   virtual std::string lookup_uri_from_user(const std::string& user, SAS::TrailId trail) const = 0;
 
   // Parse a string of the form !<regex>!<replace>! into a regular expression
-  // and a replacement string.
-  static bool parse_regex_replace(const std::string& regex_replace, boost::regex& regex, std::string& replace);
+  // and a replacement string.  The regular expression comes from the regex
+  // cache, as the same expressions are returned by many ENUM queries.
+  static bool parse_regex_replace(const std::string& regex_replace, RegexCache::Regex& regex, std::string& replace);
 
   // Converts an input user to an Application Unique String by stripping out
   // invalid characters, specifically anything other than 0-9 and + for the
@@ -93,7 +95,7 @@ private:
   struct NumberPrefix
   {
     std::string prefix;
-    boost::regex match;
+    RegexCache::Regex match;
     std::string replace;
   };
 
@@ -127,14 +129,14 @@ private:
   class Rule
   {
   public:
-    Rule(const boost::regex& regex,
+    Rule(const RegexCache::Regex& regex,
          const std::string& replace,
          bool terminal,
          int order,
          int preference);
 
     // Whether this rule matches.
-    inline bool matches(const std::string& string) const { return boost::regex_search(string, _regex); };
+    inline bool matches(const std::string& string) const { return boost::regex_search(string, *_regex); };
     // Whether this rule is terminal.
     inline bool is_terminal() const { return _terminal; }
     // Apply the regular expression match/replace processing for this rule.
@@ -144,7 +146,7 @@ private:
 
   private:
     // The regular expression and replacement for this rule.
-    boost::regex _regex;
+    RegexCache::Regex _regex;
     std::string _replace;
     // Whether this rule is terminal.
     bool _terminal;
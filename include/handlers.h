@@ -129,7 +129,8 @@ public:
                               std::string private_id,
                               RegStore::AoR* previous_aor_data,
                               RegStore* remote_store,
-                              bool is_primary);
+                              bool is_primary,
+                              RegStore::AoR* prefetched_aor_data = NULL);
 
 protected:
   const Config* _cfg;
@@ -0,0 +1,141 @@
+/**
+ * @file hss_profile_cache.h  Node-wide cache of subscriber profiles read from Homestead.
+ *
+ * Project Clearwater - IMS in the Cloud
+ * Copyright (C) 2014  Metaswitch Networks Ltd
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or (at your
+ * option) any later version, along with the "Special Exception" for use of
+ * the program along with SSL, set forth below. This program is distributed
+ * in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+ * without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details. You should have received a copy of the GNU General Public
+ * License along with this program.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ *
+ * The author can be reached by email at clearwater@metaswitch.com or by
+ * post at Metaswitch Networks Ltd, 100 Church St, Enfield EN2 6BQ, UK
+ *
+ * Special Exception
+ * Metaswitch Networks Ltd  grants you permission to copy, modify,
+ * propagate, and distribute a work formed by combining OpenSSL with The
+ * Software, or a work derivative of such a combination, even if such
+ * copying, modification, propagation, or distribution would otherwise
+ * violate the terms of the GPL. You must comply with the GPL in all
+ * respects for all of the code used other than OpenSSL.
+ * "OpenSSL" means OpenSSL toolkit software distributed by the OpenSSL
+ * Project and licensed under the OpenSSL Licenses, or a work based on such
+ * software and licensed under the OpenSSL Licenses.
+ * "OpenSSL Licenses" means the OpenSSL License and Original SSLeay License
+ * under which the OpenSSL Project distributes the OpenSSL toolkit software,
+ * as those licenses appear in the file LICENSE-OPENSSL.
+ */
+
+#ifndef HSS_PROFILE_CACHE_H__
+#define HSS_PROFILE_CACHE_H__
+
+#include <stdint.h>
+
+#include <deque>
+#include <map>
+#include <string>
+#include <vector>
+
+#include "ifchandler.h"
+#include "sharded_lru_cache.h"
+#include "statistic.h"
+
+/// Bounded cache of the subscriber profiles (registration state, iFCs,
+/// associated URIs and charging addresses) returned by Homestead, keyed by
+/// public user identity.  This is shared by all transactions, so calls to
+/// the same subscriber don't each need a Homestead round trip.
+///
+/// Entries are only used for a limited time (the TTL) after they were read,
+/// because the profile may be changed by provisioning or by other nodes.
+/// The registrar warms the cache with the profile read when a subscriber
+/// registers, keyed by every identity in the implicit registration set, and
+/// extends the TTL of those entries to the registration expiry, up to a
+/// maximum.  Registration state changes made through this node invalidate
+/// the entry immediately, along with the entries for the associated URIs.
+/// Other changes (for example to the iFCs by provisioning) aren't seen until
+/// the entry expires, so may not be seen for the maximum extended TTL.
+class HSSProfileCache
+{
+public:
+  /// A cached profile.  The iFCs share the parsed Homestead document, which
+  /// is never modified, so profiles can be copied between threads.
+  struct Profile
+  {
+    std::string regstate;
+    std::map<std::string, Ifcs> ifcs_map;
+    std::vector<std::string> associated_uris;
+    std::deque<std::string> ccfs;
+    std::deque<std::string> ecfs;
+  };
+
+  /// Constructor.
+  ///
+  /// @param max_entries      - The maximum number of profiles cached.
+  /// @param ttl_ms           - How long an entry can be used for after it was
+  ///                           read from Homestead (in milliseconds).
+  /// @param max_ttl_ms       - The longest an entry can be extended to be
+  ///                           used for from now (in milliseconds).
+  /// @param stats_aggregator - Used to report the cache statistics.
+  HSSProfileCache(int max_entries,
+                  int ttl_ms,
+                  int max_ttl_ms,
+                  LastValueCache* stats_aggregator);
+  ~HSSProfileCache();
+
+  /// Copies the cached profile for a public user identity into profile, and
+  /// returns true, if there is a fresh enough entry.  If registered_only is
+  /// set, entries for subscribers that aren't registered aren't used.  On a
+  /// miss, generation is set to the value to pass to put once the profile
+  /// has been read.
+  bool get(const std::string& public_user_identity,
+           bool registered_only,
+           Profile& profile,
+           uint64_t& generation);
+
+  /// Caches a profile read from Homestead.  The profile isn't cached if the
+  /// identity has been invalidated since the corresponding get, because the
+  /// profile read may predate the change.
+  void put(const std::string& public_user_identity,
+           const Profile& profile,
+           uint64_t generation);
+
+  /// Caches a profile for each of the public user identities in an implicit
+  /// registration set.  As for put, each entry isn't cached if its identity
+  /// has been invalidated since generation was returned (by invalidate).
+  void put_set(const std::vector<std::string>& public_user_identities,
+               const Profile& profile,
+               uint64_t generation);
+
+  /// Allows the cached profiles for the public user identities to be used
+  /// for at least ttl_ms (capped at the maximum TTL) from now.  Identities
+  /// that aren't cached, or that have been invalidated since generation was
+  /// returned (by invalidate), are ignored.
+  void extend(const std::vector<std::string>& public_user_identities,
+              uint64_t ttl_ms,
+              uint64_t generation);
+
+  /// Removes the profile for a public user identity from the cache, along
+  /// with the profiles for its cached associated URIs.  This must be called
+  /// whenever the registration state of the subscriber changes.  Returns the
+  /// generation to pass to put (or put_set) to cache the new profile.
+  uint64_t invalidate(const std::string& public_user_identity);
+
+  /// Reports the cache statistics.  This is called by the stack every
+  /// statistics period.
+  void report_stats();
+
+private:
+  ShardedLRUCache<Profile> _cache;
+  uint64_t _max_ttl_ms;
+  Statistic _statistic;
+};
+
+#endif
@@ -50,6 +50,9 @@
 #include "accumulator.h"
 #include "load_monitor.h"
 
+class HSSProfileCache;
+class RequestCoalescer;
+
 /// @class HSSConnection
 ///
 /// Provides a connection to the Homstead service for retrieving user
@@ -58,10 +61,18 @@
 class HSSConnection
 {
 public:
+  /// Constructor.  If profile_cache_size is non-zero, up to that many
+  /// subscriber profiles are cached for profile_cache_ttl_ms after they are
+  /// read, and shared by all transactions.  Profiles kept for a registration
+  /// are cached for up to profile_cache_max_ttl_ms.  Identical requests made
+  /// while one is in progress share its response.
   HSSConnection(const std::string& server,
                 HttpResolver* resolver,
                 LoadMonitor *load_monitor,
-                LastValueCache *stats_aggregator);
+                LastValueCache *stats_aggregator,
+                int profile_cache_size = 0,
+                int profile_cache_ttl_ms = 0,
+                int profile_cache_max_ttl_ms = 0);
   ~HSSConnection();
 
   HTTPCode get_auth_vector(const std::string& private_user_id,
@@ -91,6 +102,16 @@ public:
                                      std::deque<std::string>& ccfs,
                                      std::deque<std::string>& ecfs,
                                      SAS::TrailId trail);
+  HTTPCode update_registration_state(const std::string& public_user_identity,
+                                     const std::string& private_user_identity,
+                                     const std::string& type,
+                                     std::string& regstate,
+                                     std::map<std::string, Ifcs >& service_profiles,
+                                     std::vector<std::string>& associated_uris,
+                                     std::deque<std::string>& ccfs,
+                                     std::deque<std::string>& ecfs,
+                                     uint64_t& profile_generation,
+                                     SAS::TrailId trail);
   HTTPCode update_registration_state(const std::string& public_user_identity,
                                      const std::string& private_user_identity,
                                      const std::string& type,
@@ -122,6 +143,23 @@ public:
                                  SAS::TrailId trail);
   rapidxml::xml_document<>* parse_xml(std::string raw, const std::string& url);
 
+  /// Removes any cached profile for the public user identity (and its
+  /// associated URIs).  This is used when the registration state is changed
+  /// other than through this connection, for example by a network-initiated
+  /// deregistration.
+  void invalidate_cached_profile(const std::string& public_user_identity);
+
+  /// Allows the cached profiles for an implicit registration set to be used
+  /// for ttl_ms (capped at profile_cache_max_ttl_ms) from now.  The
+  /// registrar uses this to keep the profile read when a subscriber
+  /// registers for as long as the registration lasts.  profile_generation is
+  /// the value returned by update_registration_state for the registration,
+  /// so profiles cached after a later change to the registration state
+  /// aren't extended.
+  void extend_cached_profile(const std::vector<std::string>& public_user_identities,
+                             int ttl_ms,
+                             uint64_t profile_generation);
+
   static const std::string REG;
   static const std::string CALL;
   static const std::string DEREG_USER;
@@ -138,7 +176,17 @@ private:
   virtual long get_xml_object(const std::string& path, rapidxml::xml_document<>*& root, SAS::TrailId trail);
   virtual long put_for_xml_object(const std::string& path, std::string body, rapidxml::xml_document<>*& root, SAS::TrailId trail);
 
+  void cache_profile(const std::string& public_user_identity,
+                     const std::string& regstate,
+                     const std::map<std::string, Ifcs>& ifcs_map,
+                     const std::vector<std::string>& associated_uris,
+                     const std::deque<std::string>& ccfs,
+                     const std::deque<std::string>& ecfs,
+                     uint64_t generation);
+
   HttpConnection* _http;
+  HSSProfileCache* _profile_cache;
+  RequestCoalescer* _coalescer;
   StatisticAccumulator _latency_stat;
   StatisticAccumulator _digest_latency_stat;
   StatisticAccumulator _subscription_latency_stat;
@@ -46,6 +46,7 @@
 #include "scscfselector.h"
 #include "servercaps.h"
 #include "acr.h"
+#include "scscf_assignment_cache.h"
 
 
 /// Class implementing common routing functions of an I-CSCF.
@@ -55,7 +56,8 @@ public:
   ICSCFRouter(HSSConnection* hss,
               SCSCFSelector* scscf_selector,
               SAS::TrailId trail,
-              ACR* acr);
+              ACR* acr,
+              SCSCFAssignmentCache* cache);
   virtual ~ICSCFRouter();
 
   int get_scscf(pj_pool_t* pool, pjsip_sip_uri*& scscf_uri);
@@ -65,6 +67,18 @@ protected:
   /// routers.
   virtual int hss_query() = 0;
 
+  /// Returns the key the result of the HSS query is cached under.  This must
+  /// be implemented by the request-type specific routers.
+  virtual std::string cache_key() const = 0;
+
+  /// Looks up the result of the HSS query in the S-CSCF assignment cache,
+  /// returning true (and the status code) if it is found.
+  bool cache_lookup(int& status_code);
+
+  /// Caches the result of an HSS query, if it isn't a transient error,
+  /// along with the S-CSCF selected using it (if any).
+  void cache_update(int status_code, const std::string& selected_scscf="");
+
   /// Parses the HSS response.
   int parse_hss_response(Json::Value& rsp, bool queried_caps);
 
@@ -83,6 +97,12 @@ protected:
   /// The ACR for the request if ACR reported is enabled, NULL otherwise.
   ACR* _acr;
 
+  /// Cache of the results of HSS queries, or NULL if they aren't cached.
+  SCSCFAssignmentCache* _cache;
+
+  /// The cache generation to use when caching the result of a query.
+  uint64_t _cache_generation;
+
   /// Flag which indicates whether or not we have asked the HSS for
   /// capabilities and got a successful response (even if there were no
   /// capabilities specified for this subscriber).
@@ -92,6 +112,10 @@ protected:
   /// transaction.
   ServerCapabilities _hss_rsp;
 
+  /// The S-CSCF selected for an earlier request using the capabilities in
+  /// the cached HSS response, if any.
+  std::string _cached_scscf;
+
   /// The list of S-CSCFs already attempted for this request.
   std::vector<std::string> _attempted_scscfs;
 };
@@ -108,7 +132,8 @@ public:
                 const std::string& impi,
                 const std::string& impu,
                 const std::string& visited_network,
-                const std::string& auth_type);
+                const std::string& auth_type,
+                SCSCFAssignmentCache* cache = NULL);
   ~ICSCFUARouter();
 
 private:
@@ -116,6 +141,9 @@ private:
   /// Perform the HSS UAR query.
   virtual int hss_query();
 
+  /// Returns the key the UAR result is cached under.
+  virtual std::string cache_key() const;
+
   /// The private user identity to use on HSS queries.
   std::string _impi;
 
@@ -139,7 +167,8 @@ public:
                  SAS::TrailId trail,
                  ACR* acr,
                  const std::string& impu,
-                 bool originating);
+                 bool originating,
+                 SCSCFAssignmentCache* cache = NULL);
   ~ICSCFLIRouter();
 
   /// Function to change the _impu we're looking up. This is used after
@@ -151,6 +180,9 @@ private:
   /// Perform the HSS LIR query.
   virtual int hss_query();
 
+  /// Returns the key the LIR result is cached under.
+  virtual std::string cache_key() const;
+
   /// The public user identity to use on HSS queries.
   std::string _impu;
 
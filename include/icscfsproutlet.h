@@ -74,7 +74,8 @@ public:
                  SCSCFSelector* scscf_selector,
                  EnumService* enum_service,
                  bool enforce_global_only_lookups,
-                 bool enforce_user_phone);
+                 bool enforce_user_phone,
+                 SCSCFAssignmentCache* scscf_assignment_cache = NULL);
 
   virtual ~ICSCFSproutlet();
 
@@ -95,6 +96,11 @@ private:
     return _scscf_selector;
   }
 
+  inline SCSCFAssignmentCache* get_scscf_assignment_cache() const
+  {
+    return _scscf_assignment_cache;
+  }
+
   inline EnumService* get_enum_service() const
   {
     return _enum_service;
@@ -121,6 +127,8 @@ private:
 
   SCSCFSelector* _scscf_selector;
 
+  SCSCFAssignmentCache* _scscf_assignment_cache;
+
   ACRFactory* _acr_factory;
 
   EnumService* _enum_service;
@@ -66,14 +66,18 @@ struct AsInvocation
 };
 
 
+/// The compiled form of an iFC - see ifchandler.cpp.
+struct CompiledIfc;
+
 /// A single Initial Filter Criterion (iFC).
+//
+// The iFC is compiled when it is constructed (that is, when the subscriber's
+// profile is read from the HSS) into an immutable program, which is shared
+// between copies of the iFC and is what filter_matches evaluates.
 class Ifc
 {
 public:
-  Ifc(rapidxml::xml_node<>* ifc) :
-    _ifc(ifc)
-  {
-  }
+  Ifc(rapidxml::xml_node<>* ifc);
 
   bool filter_matches(const SessionCase& session_case,
                       bool is_registered,
@@ -84,23 +88,9 @@ public:
   AsInvocation as_invocation() const;
 
 private:
-  static bool spt_matches(const SessionCase& session_case,
-                          bool is_registered,
-                          bool is_initial_registration,
-                          pjsip_msg *msg,
-                          rapidxml::xml_node<>* spt,
-                          std::string ifc_str,
-                          std::string server_name,
-                          SAS::TrailId trail);
-
-  static void invalid_ifc(std::string error,
-                          std::string server_name,
-                          int sas_event_id,
-                          int instance_id,
-                          SAS::TrailId trail);
-
   rapidxml::xml_node<>* _ifc;
   std::string _server_name;
+  std::shared_ptr<const CompiledIfc> _program;
 };
 
 /// A set of iFCs.
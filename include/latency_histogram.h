@@ -0,0 +1,85 @@
+/**
+ * @file latency_histogram.h  Lock-free latency histogram with percentile estimation.
+ *
+ * Project Clearwater - IMS in the Cloud
+ * Copyright (C) 2014  Metaswitch Networks Ltd
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or (at your
+ * option) any later version, along with the "Special Exception" for use of
+ * the program along with SSL, set forth below. This program is distributed
+ * in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+ * without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details. You should have received a copy of the GNU General Public
+ * License along with this program.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ *
+ * The author can be reached by email at clearwater@metaswitch.com or by
+ * post at Metaswitch Networks Ltd, 100 Church St, Enfield EN2 6BQ, UK
+ *
+ * Special Exception
+ * Metaswitch Networks Ltd  grants you permission to copy, modify,
+ * propagate, and distribute a work formed by combining OpenSSL with The
+ * Software, or a work derivative of such a combination, even if such
+ * copying, modification, propagation, or distribution would otherwise
+ * violate the terms of the GPL. You must comply with the GPL in all
+ * respects for all of the code used other than OpenSSL.
+ * "OpenSSL" means OpenSSL toolkit software distributed by the OpenSSL
+ * Project and licensed under the OpenSSL Licenses, or a work based on such
+ * software and licensed under the OpenSSL Licenses.
+ * "OpenSSL Licenses" means the OpenSSL License and Original SSLeay License
+ * under which the OpenSSL Project distributes the OpenSSL toolkit software,
+ * as those licenses appear in the file LICENSE-OPENSSL.
+ */
+
+#ifndef LATENCY_HISTOGRAM_H__
+#define LATENCY_HISTOGRAM_H__
+
+#include <atomic>
+#include <vector>
+#include <string>
+#include <stdint.h>
+
+/// Histogram of latency samples (in microseconds) that can be updated
+/// concurrently from multiple threads without locking.  Samples are recorded
+/// in logarithmically sized buckets (four buckets per power of two, so each
+/// bucket covers at most 25% of its lower bound), which is accurate enough for
+/// reporting percentiles while keeping the histogram small and fixed size.
+class LatencyHistogram
+{
+public:
+  LatencyHistogram();
+  ~LatencyHistogram();
+
+  /// Records a single sample.
+  void record(unsigned long latency_us);
+
+  /// Takes a snapshot of the bucket counts and resets the histogram, so each
+  /// snapshot covers the samples recorded since the previous one.
+  void snapshot(std::vector<uint_fast64_t>& counts);
+
+  /// Estimates the specified percentile (0.0 - 1.0) from a snapshot.  The
+  /// estimate is the upper bound of the bucket containing the percentile, so
+  /// never understates the latency.  Returns zero if there are no samples.
+  static unsigned long percentile(const std::vector<uint_fast64_t>& counts,
+                                  double p);
+
+  /// Returns the total number of samples in a snapshot.
+  static uint_fast64_t total(const std::vector<uint_fast64_t>& counts);
+
+  /// Takes a snapshot and appends the sample count followed by the 50th, 90th,
+  /// 99th and 99.9th percentiles to the supplied statistic values.
+  void report(std::vector<std::string>& values);
+
+  static const int NUM_BUCKETS = 128;
+
+private:
+  static int bucket(unsigned long latency_us);
+  static unsigned long bucket_upper_bound(int bucket);
+
+  std::atomic<uint_fast64_t> _buckets[NUM_BUCKETS];
+};
+
+#endif
@@ -0,0 +1,110 @@
+/**
+ * @file regex_cache.h  Process-wide cache of compiled regular expressions.
+ *
+ * Project Clearwater - IMS in the Cloud
+ * Copyright (C) 2014  Metaswitch Networks Ltd
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or (at your
+ * option) any later version, along with the "Special Exception" for use of
+ * the program along with SSL, set forth below. This program is distributed
+ * in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+ * without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details. You should have received a copy of the GNU General Public
+ * License along with this program.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ *
+ * The author can be reached by email at clearwater@metaswitch.com or by
+ * post at Metaswitch Networks Ltd, 100 Church St, Enfield EN2 6BQ, UK
+ *
+ * Special Exception
+ * Metaswitch Networks Ltd  grants you permission to copy, modify,
+ * propagate, and distribute a work formed by combining OpenSSL with The
+ * Software, or a work derivative of such a combination, even if such
+ * copying, modification, propagation, or distribution would otherwise
+ * violate the terms of the GPL. You must comply with the GPL in all
+ * respects for all of the code used other than OpenSSL.
+ * "OpenSSL" means OpenSSL toolkit software distributed by the OpenSSL
+ * Project and licensed under the OpenSSL Licenses, or a work based on such
+ * software and licensed under the OpenSSL Licenses.
+ * "OpenSSL Licenses" means the OpenSSL License and Original SSLeay License
+ * under which the OpenSSL Project distributes the OpenSSL toolkit software,
+ * as those licenses appear in the file LICENSE-OPENSSL.
+ */
+
+#ifndef REGEX_CACHE_H__
+#define REGEX_CACHE_H__
+
+#include <stdint.h>
+
+#include <atomic>
+#include <memory>
+#include <string>
+
+#include <boost/regex.hpp>
+
+#include "sharded_lru_cache.h"
+#include "statistic.h"
+
+/// Bounded cache of compiled regular expressions, keyed by pattern and
+/// syntax flags.  The patterns in iFCs and ENUM rules come from a small set
+/// of templates shared by many subscribers, so almost every expression that
+/// would be compiled has been compiled before.
+///
+/// Compiled expressions are immutable and shared (matching against a const
+/// boost::regex is thread-safe), so callers can hold on to them after they
+/// have been evicted.  Expressions are compiled without holding a lock.
+class RegexCache
+{
+public:
+  typedef std::shared_ptr<const boost::regex> Regex;
+
+  /// Constructor.
+  ///
+  /// @param max_entries      - The maximum number of expressions cached.
+  /// @param stats_aggregator - Used to report the cache statistics.
+  RegexCache(int max_entries,
+             LastValueCache* stats_aggregator);
+  ~RegexCache();
+
+  /// Returns the compiled form of a regular expression, compiling it if it
+  /// isn't cached.  Returns NULL if the pattern isn't a valid expression
+  /// (which is cached too).
+  Regex get(const std::string& pattern,
+            boost::regex::flag_type flags = boost::regex::normal);
+
+  /// Reports the cache statistics.  This is called by the stack every
+  /// statistics period.
+  void report_stats();
+
+  /// Sets the cache used by compile.  This is set up at start of day, and
+  /// must outlive any users.
+  static void set_instance(RegexCache* instance);
+
+  /// Returns the compiled form of a regular expression, using the process
+  /// wide cache if one has been set up (or compiling the expression if
+  /// not).  Returns NULL if the pattern isn't a valid expression.
+  static Regex compile(const std::string& pattern,
+                       boost::regex::flag_type flags = boost::regex::normal);
+
+private:
+  /// Compiles an expression, returning NULL if it isn't valid.
+  static Regex compile_uncached(const std::string& pattern,
+                                boost::regex::flag_type flags);
+
+  static uint64_t now_us();
+
+  static RegexCache* _instance;
+
+  /// Entries never expire, as the compiled form of a pattern never changes.
+  ShardedLRUCache<Regex> _cache;
+
+  // Statistics since they were last reported, in addition to the cache's.
+  std::atomic<uint_fast64_t> _compile_us;
+  std::atomic<uint_fast64_t> _invalid;
+  Statistic _statistic;
+};
+
+#endif
@@ -45,7 +45,9 @@ extern "C" {
 
 #include <string>
 #include <list>
+#include <functional>
 #include <map>
+#include <vector>
 #include <stdio.h>
 #include <stdlib.h>
 
@@ -54,6 +56,12 @@ extern "C" {
 #include "chronosconnection.h"
 #include "sas.h"
 
+class AoRCache;
+class AsyncDispatcher;
+class AoRWriteCoalescer;
+class AoRReplicator;
+class ChronosTimerBatcher;
+
 class RegStore
 {
 public:
@@ -216,9 +224,28 @@ public:
     Subscriptions _subscriptions;
 
     /// CAS value for this AoR record.  Used when updating an existing record.
-    /// Zero for a new record that has not yet been written to a store.
+    /// Zero for a new record that has not yet been written to a store.  When
+    /// the AoR is stored as separate records this is the CAS of the index.
     uint64_t _cas;
 
+    /// A binding or subscription record as it was read from the store.
+    struct StoredRecord
+    {
+      std::string _data;
+      uint64_t _cas;
+    };
+    typedef std::map<std::string, StoredRecord> StoredRecords;
+
+    /// The following fields are only used when the AoR was read from an index
+    /// record, with its bindings and subscriptions stored as separate records.
+    /// They hold the records as read, so only the records that have changed
+    /// are written back.
+    bool _indexed;
+    std::string _stored_index;
+    int _index_expires;
+    StoredRecords _stored_bindings;
+    StoredRecords _stored_subscriptions;
+
     // SIP URI for this AoR
     std::string _uri;
 
@@ -226,13 +253,63 @@ public:
     friend class RegStore;
   };
 
+  /// Formats used to serialize AoRs in the data store.  Both formats can
+  /// always be read.
+  enum SerializerFormat
+  {
+    /// The original format, which can be read by all releases.  This is
+    /// written by default.
+    FORMAT_LEGACY,
+
+    /// Versioned binary format, with length-prefixed fields and records.
+    /// This is quicker to read and write than the original format, but
+    /// can't be read by older releases, so must only be written once every
+    /// node has been upgraded.
+    FORMAT_BINARY
+  };
+
+  /// Layouts used to store AoRs in the data store.  Both layouts can always
+  /// be read.
+  enum StorageLayout
+  {
+    /// The whole AoR is stored as a single record.
+    LAYOUT_AOR,
+
+    /// The AoR record is an index listing the bindings and subscriptions,
+    /// which are stored as separate records, so updating one binding only
+    /// rewrites that binding.  This reduces the CAS contention and the data
+    /// written for AoRs with many bindings, at the cost of a read per binding.
+    /// The records are always written in the binary format.
+    LAYOUT_PER_BINDING
+  };
+
+  /// Operations that update AoRs, used to report CAS retries.
+  enum Operation
+  {
+    OP_REGISTER,
+    OP_SUBSCRIBE,
+    OP_BINDING_TIMEOUT,
+    OP_DEREGISTER,
+    NUM_OPERATIONS
+  };
+
+  /// Serializes an AoR in the specified format.
+  static std::string serialize_aor(AoR* aor_data, SerializerFormat format);
+
+  /// Deserializes an AoR in either format.  Returns NULL if the data is
+  /// corrupt.  Result is owned by caller and must be freed with delete.
+  static AoR* deserialize_aor(const std::string& aor_id, const std::string& s);
+
   /// Provides the interface to the data store. This is responsible for
   /// updating and getting information from the underlying data store. The
   /// classes that call this class are responsible for retrying the get/set
   /// functions in case of failure.
   class Connector
   {
-    Connector(Store* data_store);
+    Connector(Store* data_store,
+              SerializerFormat write_format,
+              StorageLayout layout,
+              AsyncDispatcher* dispatcher);
 
     ~Connector();
 
@@ -243,17 +320,45 @@ public:
                       int expiry,
                       SAS::TrailId trail);
 
-    std::string serialize_aor(AoR* aor_data);
-    AoR* deserialize_aor(const std::string& aor_id, const std::string& s);
+    AoR* get_indexed_aor_data(const std::string& aor_id,
+                              const std::string& index,
+                              SAS::TrailId trail);
+
+    bool set_indexed_aor_data(const std::string& aor_id,
+                              AoR* aor_data,
+                              int expiry,
+                              SAS::TrailId trail);
+
+    struct RecordRead;
+    void read_records(RecordRead* reads);
 
     Store* _data_store;
 
+    /// The format AoRs are written in.
+    SerializerFormat _write_format;
+
+    /// The layout AoRs are written in.
+    StorageLayout _layout;
+
+    /// Dispatcher used to read the bindings and subscriptions of an AoR in
+    /// the per-binding layout concurrently, or NULL if they are read
+    /// serially.  Not owned.
+    AsyncDispatcher* _dispatcher;
+
     /// RegStore is the only class that can use Connector
     friend class RegStore;
   };
 
   /// Constructor.
-  RegStore(Store* data_store, ChronosConnection* chronos_connection);
+  RegStore(Store* data_store,
+           ChronosConnection* chronos_connection,
+           SerializerFormat write_format = FORMAT_LEGACY,
+           StorageLayout layout = LAYOUT_AOR,
+           AoRCache* cache = NULL,
+           AsyncDispatcher* dispatcher = NULL,
+           AoRWriteCoalescer* coalescer = NULL,
+           AoRReplicator* replicator = NULL,
+           ChronosTimerBatcher* timer_batcher = NULL);
 
   /// Destructor.
   ~RegStore();
@@ -264,6 +369,23 @@ public:
   /// by caller and must be freed with delete.
   AoR* get_aor_data(const std::string& aor_id, SAS::TrailId trail);
 
+  /// Get the data for an address of record for a lookup that won't update
+  /// it (such as finding the targets of a terminating request).  If the
+  /// store has a cache, the data may come from the cache.  May return NULL
+  /// in case of error.  Result is owned by caller and must be freed with
+  /// delete.
+  AoR* lookup_aor_data(const std::string& aor_id, SAS::TrailId trail);
+
+  /// Get the data for several addresses of record.  If the store has an
+  /// asynchronous dispatcher the reads are made concurrently, so this takes
+  /// little longer than reading a single AoR.  Each entry in aor_data is the
+  /// data for the corresponding entry in aor_ids, as returned by
+  /// get_aor_data, so may be NULL in case of error.  Results are owned by
+  /// caller and must be freed with delete.
+  void get_aor_data_batch(const std::vector<std::string>& aor_ids,
+                          std::vector<AoR*>& aor_data,
+                          SAS::TrailId trail);
+
   /// Update the data for a particular address of record.  Writes the data
   /// atomically.  If the underlying data has changed since it was last
   /// read, the update is rejected and this returns false; if the update
@@ -271,15 +393,103 @@ public:
   bool set_aor_data(const std::string& aor_id, AoR* data, bool update_timers, SAS::TrailId trail);
   bool set_aor_data(const std::string& aor_id, AoR* data, bool update_timers, SAS::TrailId trail, bool& all_bindings_expired);
 
+  /// A change to an AoR made by update_aor_data.  If the write fails because
+  /// the AoR has been changed by someone else, the change is made again to
+  /// the newly read data, so it must not rely on earlier attempts.
+  typedef std::function<void(AoR*)> Mutation;
+
+  /// An update to an AoR, with its results.
+  struct Update
+  {
+    const Mutation* mutation;
+    bool update_timers;
+    SAS::TrailId trail;
+    AoR* aor_data;
+    bool all_bindings_expired;
+    int cas_retries;
+  };
+
+  /// Reads an address of record, applies the mutation and writes it back,
+  /// retrying if the AoR is changed by someone else.  If the store has a
+  /// write coalescer, the mutation may be applied together with concurrent
+  /// mutations of the same AoR (in the order they arrived), with a single
+  /// read and write of the store.  Returns the AoR as written, or NULL in
+  /// case of error.  Result is owned by caller and must be freed with
+  /// delete.  all_bindings_expired is set if no bindings remain, but if the
+  /// mutation was combined with others it is only set for the one whose
+  /// change removed the last binding, so the deregistration is only
+  /// reported once.  cas_retries is set to the number of times the write was
+  /// retried.
+  AoR* update_aor_data(const std::string& aor_id,
+                       const Mutation& mutation,
+                       bool update_timers,
+                       SAS::TrailId trail,
+                       bool& all_bindings_expired,
+                       int& cas_retries);
+
+  /// Returns true if updates made through update_aor_data are replicated to
+  /// the remote store in the background, in which case callers mustn't
+  /// write them to the remote store themselves.
+  bool replicates() const { return (_replicator != NULL); }
+
+  /// Queues the changes made by an update for replication to the remote
+  /// store, given the AoR as it was read and as it was written.  Does
+  /// nothing if the store doesn't replicate.  Callers only need to use this
+  /// for updates not made through update_aor_data.
+  void replicate(const std::string& aor_id, const AoR* original, const AoR* updated);
+
+  /// Records the number of times an update had to be retried because the
+  /// AoR was changed by someone else between reading and writing it.  The
+  /// counts are accumulated across all stores and reported as a statistic.
+  static void record_cas_retries(Operation op, int retries);
+
+  /// Gets the CAS retry statistics for reporting (see regstore.cpp).
+  static void get_cas_retry_stats(std::vector<std::string>& stats);
+
   // Send a SIP NOTIFY
   void send_notify(AoR::Subscription* s, int cseq, AoR::Binding* b, std::string b_id, SAS::TrailId trail);
 
 private:
+  static AoR* deserialize_aor_legacy(const std::string& aor_id, const std::string& s);
+  static AoR* deserialize_aor_binary(const std::string& aor_id, const std::string& s);
+
+  struct BatchRead;
+  void read_batch(BatchRead* batch);
+
+  void write_updates(const std::string& aor_id,
+                     std::vector<Update*>& batch,
+                     SAS::TrailId trail);
+  static bool has_bindings(const AoR* aor_data, int now);
+
+  void set_timer_id(const std::string& aor_id,
+                    const std::string& binding_id,
+                    const std::string& old_timer_id,
+                    const std::string& new_timer_id);
+
   int expire_bindings(AoR* aor_data, int now, SAS::TrailId trail);
   void expire_subscriptions(AoR* aor_data, int now);
 
   ChronosConnection* _chronos;
   Connector* _connector;
+
+  /// Cache used for lookups, or NULL if there is no cache.  Not owned.
+  AoRCache* _cache;
+
+  /// Dispatcher used to make the reads for batches concurrently, or NULL if
+  /// they are made serially.  Not owned.
+  AsyncDispatcher* _dispatcher;
+
+  /// Combines concurrent updates to the same AoR, or NULL if each update is
+  /// written separately.  Not owned.
+  AoRWriteCoalescer* _coalescer;
+
+  /// Replicates updates to the remote store, or NULL if callers write to
+  /// the remote store themselves.  Not owned.
+  AoRReplicator* _replicator;
+
+  /// Batches updates and deletions of Chronos timers, or NULL if they are
+  /// sent directly.  Not owned.
+  ChronosTimerBatcher* _timer_batcher;
 };
 
 #endif
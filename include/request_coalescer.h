@@ -0,0 +1,130 @@
+/**
+ * @file request_coalescer.h  Shares the responses to identical concurrent requests.
+ *
+ * Project Clearwater - IMS in the Cloud
+ * Copyright (C) 2014  Metaswitch Networks Ltd
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or (at your
+ * option) any later version, along with the "Special Exception" for use of
+ * the program along with SSL, set forth below. This program is distributed
+ * in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+ * without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details. You should have received a copy of the GNU General Public
+ * License along with this program.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ *
+ * The author can be reached by email at clearwater@metaswitch.com or by
+ * post at Metaswitch Networks Ltd, 100 Church St, Enfield EN2 6BQ, UK
+ *
+ * Special Exception
+ * Metaswitch Networks Ltd  grants you permission to copy, modify,
+ * propagate, and distribute a work formed by combining OpenSSL with The
+ * Software, or a work derivative of such a combination, even if such
+ * copying, modification, propagation, or distribution would otherwise
+ * violate the terms of the GPL. You must comply with the GPL in all
+ * respects for all of the code used other than OpenSSL.
+ * "OpenSSL" means OpenSSL toolkit software distributed by the OpenSSL
+ * Project and licensed under the OpenSSL Licenses, or a work based on such
+ * software and licensed under the OpenSSL Licenses.
+ * "OpenSSL Licenses" means the OpenSSL License and Original SSLeay License
+ * under which the OpenSSL Project distributes the OpenSSL toolkit software,
+ * as those licenses appear in the file LICENSE-OPENSSL.
+ */
+
+#ifndef REQUEST_COALESCER_H__
+#define REQUEST_COALESCER_H__
+
+#include <pthread.h>
+#include <stdint.h>
+
+#include <atomic>
+#include <functional>
+#include <memory>
+#include <string>
+#include <unordered_map>
+
+#include "sas.h"
+#include "statistic.h"
+
+/// Coalesces identical requests that are in progress at the same time.  The
+/// first caller to make a request sends it, and callers making the same
+/// request while it is outstanding wait for it to complete and are given a
+/// copy of its response, rather than sending their own.  Nothing is kept
+/// once the request completes, so callers never see a response to a request
+/// that completed before they asked.
+///
+/// Only requests without side effects (such as HTTP GETs) should be
+/// coalesced, as the server sees one request however many callers made it.
+///
+/// This is used for Homestead queries, which come in bursts for the same
+/// subscriber - for example when a popular user receives several calls at
+/// once.  Each caller that is given a copy of another caller's response logs
+/// an event on its own SAS trail saying so, since the request and response
+/// themselves are only logged on the trail of the caller that sent them.
+class RequestCoalescer
+{
+public:
+  /// Sends a request, filling in the response body and returning the HTTP
+  /// result code.
+  typedef std::function<long(std::string& response)> Request;
+
+  /// Decides whether a response can be given to other callers.
+  typedef std::function<bool(long http_code, const std::string& response)> Shareable;
+
+  /// Constructor.
+  ///
+  /// @param stat_name        - The name of the statistic reporting the
+  ///                           number of requests and how many were
+  ///                           coalesced.
+  /// @param stats_aggregator - Used to report the statistic.
+  RequestCoalescer(const std::string& stat_name,
+                   LastValueCache* stats_aggregator);
+  ~RequestCoalescer();
+
+  /// Sends a request, or waits for the identical request (with the same key)
+  /// that is already in progress.  If the response to that request isn't
+  /// shareable, this caller sends its own request.
+  ///
+  /// @param trail         - The SAS trail of this caller.
+  ///
+  /// @returns             - The HTTP result code.
+  long send(const std::string& key,
+            SAS::TrailId trail,
+            std::string& response,
+            const Request& request,
+            const Shareable& shareable = Shareable());
+
+  /// Reports the statistics.  This is called by the stack every statistics
+  /// period.
+  void report_stats();
+
+private:
+  /// A request in progress.
+  struct Call
+  {
+    Call();
+    ~Call();
+
+    pthread_cond_t cond;
+    bool complete;
+    int waiters;
+    SAS::TrailId trail;
+    bool shared;
+    long http_code;
+    std::string response;
+  };
+
+  pthread_mutex_t _lock;
+  std::unordered_map<std::string, std::shared_ptr<Call> > _calls;
+
+  // Statistics since they were last reported.
+  std::atomic<uint_fast64_t> _requests;
+  std::atomic<uint_fast64_t> _coalesced;
+  std::atomic<uint_fast64_t> _unshared;
+  Statistic _statistic;
+};
+
+#endif
@@ -0,0 +1,126 @@
+/**
+ * @file scscf_assignment_cache.h  Cache of the S-CSCF assignments read by the I-CSCF.
+ *
+ * Project Clearwater - IMS in the Cloud
+ * Copyright (C) 2014  Metaswitch Networks Ltd
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or (at your
+ * option) any later version, along with the "Special Exception" for use of
+ * the program along with SSL, set forth below. This program is distributed
+ * in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+ * without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details. You should have received a copy of the GNU General Public
+ * License along with this program.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ *
+ * The author can be reached by email at clearwater@metaswitch.com or by
+ * post at Metaswitch Networks Ltd, 100 Church St, Enfield EN2 6BQ, UK
+ *
+ * Special Exception
+ * Metaswitch Networks Ltd  grants you permission to copy, modify,
+ * propagate, and distribute a work formed by combining OpenSSL with The
+ * Software, or a work derivative of such a combination, even if such
+ * copying, modification, propagation, or distribution would otherwise
+ * violate the terms of the GPL. You must comply with the GPL in all
+ * respects for all of the code used other than OpenSSL.
+ * "OpenSSL" means OpenSSL toolkit software distributed by the OpenSSL
+ * Project and licensed under the OpenSSL Licenses, or a work based on such
+ * software and licensed under the OpenSSL Licenses.
+ * "OpenSSL Licenses" means the OpenSSL License and Original SSLeay License
+ * under which the OpenSSL Project distributes the OpenSSL toolkit software,
+ * as those licenses appear in the file LICENSE-OPENSSL.
+ */
+
+#ifndef SCSCF_ASSIGNMENT_CACHE_H__
+#define SCSCF_ASSIGNMENT_CACHE_H__
+
+#include <stdint.h>
+
+#include <atomic>
+#include <string>
+
+#include "servercaps.h"
+#include "sharded_lru_cache.h"
+#include "statistic.h"
+
+/// Bounded cache of the results of the UAR and LIR queries made by the
+/// I-CSCF, keyed by the query (the identities, and the request type).  Each
+/// entry records the S-CSCF assigned to the subscriber and any capabilities
+/// the HSS returned, or that the subscriber is unknown (a negative entry), so
+/// repeated requests for the same subscriber don't each need a Homestead
+/// round trip.  If the HSS only returned capabilities, the entry also records
+/// the S-CSCF the I-CSCF selected using them, so later requests are routed to
+/// the same S-CSCF.
+///
+/// Entries are only used for a short time (the TTL) after they were read,
+/// because the assignment changes as subscribers register and deregister.
+/// The I-CSCF routers invalidate an entry as soon as routing to the S-CSCF
+/// it chose fails.
+class SCSCFAssignmentCache
+{
+public:
+  /// A cached query result.
+  struct Assignment
+  {
+    /// PJSIP_SC_OK if the HSS returned an S-CSCF or capabilities, or the
+    /// status code the request is rejected with if the subscriber is
+    /// unknown.
+    int status_code;
+
+    /// Whether the HSS returned capabilities for the subscriber.
+    bool queried_caps;
+
+    /// The S-CSCF and capabilities returned by the HSS.
+    ServerCapabilities caps;
+
+    /// The S-CSCF selected using the capabilities, if the HSS didn't return
+    /// an S-CSCF.
+    std::string selected_scscf;
+  };
+
+  /// Constructor.
+  ///
+  /// @param max_entries      - The maximum number of query results cached.
+  /// @param ttl_ms           - How long an entry can be used for after it was
+  ///                           read from Homestead (in milliseconds).
+  /// @param stats_aggregator - Used to report the cache statistics.
+  SCSCFAssignmentCache(int max_entries,
+                       int ttl_ms,
+                       LastValueCache* stats_aggregator);
+  ~SCSCFAssignmentCache();
+
+  /// Copies the cached result of a query into assignment, and returns true,
+  /// if there is a fresh enough entry.  Generation is set to the value to
+  /// pass to put if the query is then made.
+  bool get(const std::string& key,
+           Assignment& assignment,
+           uint64_t& generation);
+
+  /// Caches the result of a query, unless the result has been invalidated
+  /// since generation was returned.
+  void put(const std::string& key,
+           const Assignment& assignment,
+           uint64_t generation);
+
+  /// Removes the result of a query from the cache.  This must be called when
+  /// routing to the S-CSCF chosen using the result fails.  Returns the
+  /// generation to pass to put to cache the result of a new query.
+  uint64_t invalidate(const std::string& key);
+
+  /// Reports the cache statistics.  This is called by the stack every
+  /// statistics period.
+  void report_stats();
+
+private:
+  ShardedLRUCache<Assignment> _cache;
+
+  // The number of hits on negative entries since the statistics were last
+  // reported.  These are included in the cache's hits.
+  std::atomic<uint_fast64_t> _negative_hits;
+  Statistic _statistic;
+};
+
+#endif
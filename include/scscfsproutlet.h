@@ -166,12 +166,21 @@ public:
   virtual void on_tx_response(pjsip_msg* rsp);
   virtual void on_rx_cancel(int status_code, pjsip_msg* req);
   virtual void on_timer_expiry(void* context);
+  virtual void on_async_complete(void* context);
 
 private:
+  /// Continues processing an initial request once the served user has been
+  /// determined.
+  void process_initial_request(pjsip_msg* req, pjsip_status_code status_code);
+
   /// Determines the session case and the served user for the request,
   /// and links to the appropriate AS Chain.
   pjsip_status_code determine_served_user(pjsip_msg* req);
 
+  /// Creates a new AS chain for the served user (if one is needed) and links
+  /// this service hop to it.
+  pjsip_status_code create_served_user_as_chain(pjsip_msg* req);
+
   /// Gets the served user indicated in the message.
   std::string served_user_from_msg(pjsip_msg* msg);
 
@@ -256,6 +265,29 @@ private:
   /// The link in the owning AsChain for this service hop.
   AsChainLink _as_chain_link;
 
+  /// The served user for which a new AS chain must be created, or empty if
+  /// this service hop continues an existing chain (or provides no services).
+  std::string _new_chain_served_user;
+
+  /// The initial request, held while the served user's data is read from the
+  /// HSS.
+  pjsip_msg* _parked_req;
+
+  /// The result of reading the served user's data from the HSS
+  /// asynchronously.  This is filled in on a dispatcher thread and passed
+  /// back as the context of on_async_complete.
+  struct HSSReadResult
+  {
+    HSSReadResult() : success(false), registered(false) {}
+
+    bool success;
+    bool registered;
+    std::vector<std::string> uris;
+    Ifcs ifcs;
+    std::deque<std::string> ccfs;
+    std::deque<std::string> ecfs;
+  };
+
   /// Data retrieved from HSS for this service hop.
   bool _hss_data_cached;
   bool _registered;
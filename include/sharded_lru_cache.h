@@ -0,0 +1,417 @@
+/**
+ * @file sharded_lru_cache.h  Bounded, sharded LRU cache template.
+ *
+ * Project Clearwater - IMS in the Cloud
+ * Copyright (C) 2014  Metaswitch Networks Ltd
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or (at your
+ * option) any later version, along with the "Special Exception" for use of
+ * the program along with SSL, set forth below. This program is distributed
+ * in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+ * without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details. You should have received a copy of the GNU General Public
+ * License along with this program.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ *
+ * The author can be reached by email at clearwater@metaswitch.com or by
+ * post at Metaswitch Networks Ltd, 100 Church St, Enfield EN2 6BQ, UK
+ *
+ * Special Exception
+ * Metaswitch Networks Ltd  grants you permission to copy, modify,
+ * propagate, and distribute a work formed by combining OpenSSL with The
+ * Software, or a work derivative of such a combination, even if such
+ * copying, modification, propagation, or distribution would otherwise
+ * violate the terms of the GPL. You must comply with the GPL in all
+ * respects for all of the code used other than OpenSSL.
+ * "OpenSSL" means OpenSSL toolkit software distributed by the OpenSSL
+ * Project and licensed under the OpenSSL Licenses, or a work based on such
+ * software and licensed under the OpenSSL Licenses.
+ * "OpenSSL Licenses" means the OpenSSL License and Original SSLeay License
+ * under which the OpenSSL Project distributes the OpenSSL toolkit software,
+ * as those licenses appear in the file LICENSE-OPENSSL.
+ */
+
+
+#ifndef SHARDED_LRU_CACHE_H__
+#define SHARDED_LRU_CACHE_H__
+
+#include <pthread.h>
+#include <stdint.h>
+#include <time.h>
+
+#include <atomic>
+#include <functional>
+#include <list>
+#include <string>
+#include <unordered_map>
+
+/// Bounded cache of values keyed by string, shared by all threads.  The
+/// cache is split into shards, each with its own lock and LRU list, so
+/// lookups of different keys rarely contend.  Values are copied in and out
+/// of the cache, so V should be cheap to copy (for example a shared_ptr to
+/// an immutable object).
+///
+/// Entries can have a time to live, after which they aren't used.  Callers
+/// that read a value from elsewhere on a miss and then cache it must pass
+/// the generation returned by the miss to put.  If the key has been
+/// invalidated since, the value read may predate the change, so it isn't
+/// cached.  Invalidated keys are remembered (as entries with no value, which
+/// take their place in the LRU list) for this check.  Once one of these has
+/// been evicted, puts to its shard with a generation from before the
+/// invalidation are refused, whatever their key.
+template<class V>
+class ShardedLRUCache
+{
+public:
+  /// Statistics accumulated since they were last read.
+  struct Stats
+  {
+    uint_fast64_t hits;
+    uint_fast64_t misses;
+    uint_fast64_t expired;
+    uint_fast64_t evictions;
+    uint_fast64_t invalidations;
+    size_t entries;
+  };
+
+  /// Constructor.
+  ///
+  /// @param max_entries  - The maximum number of entries cached.  If zero,
+  ///                       nothing is cached.
+  /// @param ttl_ms       - How long an entry can be used for after it was
+  ///                       cached (in milliseconds).  If zero, entries don't
+  ///                       expire.
+  ShardedLRUCache(int max_entries, uint64_t ttl_ms) :
+    _max_shard_entries((max_entries + NUM_SHARDS - 1) / NUM_SHARDS),
+    _ttl_ms(ttl_ms),
+    _generation(0),
+    _hits(0),
+    _misses(0),
+    _expired(0),
+    _evictions(0),
+    _invalidations(0)
+  {
+    for (int ii = 0; ii < NUM_SHARDS; ++ii)
+    {
+      pthread_mutex_init(&_shards[ii].lock, NULL);
+      _shards[ii].invalidated = 0;
+      _shards[ii].min_generation = 0;
+    }
+  }
+
+  ~ShardedLRUCache()
+  {
+    for (int ii = 0; ii < NUM_SHARDS; ++ii)
+    {
+      pthread_mutex_destroy(&_shards[ii].lock);
+    }
+  }
+
+  /// Copies the value cached for a key into value and returns true if there
+  /// is an entry that hasn't expired and (if usable is set) that usable
+  /// accepts.  Generation is set to the value to pass to put if the caller
+  /// goes on to read the value from elsewhere (typically after a miss).  On
+  /// a hit, age_ms (if not NULL) is set to the time since the value was
+  /// cached.
+  bool get(const std::string& key,
+           V& value,
+           uint64_t& generation,
+           const std::function<bool(const V&)>& usable = nullptr,
+           uint64_t* age_ms = NULL)
+  {
+    bool found = false;
+    Shard& s = shard(key);
+    uint64_t now = now_ms();
+
+    // Read the generation before looking up the key, so that an invalidation
+    // that races with the lookup is always seen by put.
+    generation = _generation;
+
+    pthread_mutex_lock(&s.lock);
+
+    typename Entries::iterator i = s.entries.find(key);
+    if ((i != s.entries.end()) && (i->second.valid))
+    {
+      if ((_ttl_ms > 0) && (now > i->second.cached_ms + i->second.ttl_ms))
+      {
+        // Too old to use.  Keep the entry's invalidation generation (if any)
+        // so that put still refuses values read before the invalidation.
+        make_invalid(s, i->second);
+        _expired++;
+      }
+      else if ((!usable) || (usable(i->second.value)))
+      {
+        // Copy the value and move the entry to the front of the LRU list.
+        value = i->second.value;
+        s.lru.splice(s.lru.begin(), s.lru, i->second.lru);
+        if (age_ms != NULL)
+        {
+          *age_ms = now - i->second.cached_ms;
+        }
+        found = true;
+      }
+    }
+
+    pthread_mutex_unlock(&s.lock);
+
+    if (found)
+    {
+      _hits++;
+    }
+    else
+    {
+      _misses++;
+    }
+
+    return found;
+  }
+
+  /// Returns the generation to pass to put for a value that is about to be
+  /// read, for callers that don't look the key up first.
+  uint64_t generation() const
+  {
+    return _generation;
+  }
+
+  /// Caches a value, unless the key has been invalidated since generation
+  /// was returned.  Returns true if the value was cached.
+  bool put(const std::string& key, const V& value, uint64_t generation)
+  {
+    bool cached = false;
+    Shard& s = shard(key);
+
+    pthread_mutex_lock(&s.lock);
+
+    typename Entries::iterator i = s.entries.find(key);
+    uint64_t invalidated = (i != s.entries.end()) ? i->second.invalidated :
+                                                    s.min_generation;
+    if ((_max_shard_entries > 0) && (invalidated <= generation))
+    {
+      Entry& e = (i != s.entries.end()) ? i->second : add(s, key);
+      if (!e.valid)
+      {
+        e.valid = true;
+        s.invalidated--;
+      }
+      e.value = value;
+      e.cached_ms = now_ms();
+      e.ttl_ms = _ttl_ms;
+      s.lru.splice(s.lru.begin(), s.lru, e.lru);
+      evict(s);
+      cached = true;
+    }
+
+    pthread_mutex_unlock(&s.lock);
+
+    return cached;
+  }
+
+  /// Caches a value regardless of any invalidations.  This is for values
+  /// that don't depend on when they were read.
+  void put(const std::string& key, const V& value)
+  {
+    put(key, value, UINT64_MAX);
+  }
+
+  /// Allows the cached value for a key (if there is one) to be used for at
+  /// least ttl_ms from now.  If the key has been invalidated since
+  /// generation was returned, the value cached may have been read by someone
+  /// else after the change, so it isn't extended.
+  void extend(const std::string& key,
+              uint64_t ttl_ms,
+              uint64_t generation = UINT64_MAX)
+  {
+    Shard& s = shard(key);
+    uint64_t now = now_ms();
+
+    pthread_mutex_lock(&s.lock);
+
+    typename Entries::iterator i = s.entries.find(key);
+    if ((i != s.entries.end()) &&
+        (i->second.valid) &&
+        (i->second.invalidated <= generation) &&
+        (i->second.cached_ms + i->second.ttl_ms < now + ttl_ms))
+    {
+      i->second.ttl_ms = now + ttl_ms - i->second.cached_ms;
+    }
+
+    pthread_mutex_unlock(&s.lock);
+  }
+
+  /// Removes the cached value for a key, and stops values read before now
+  /// being cached for it.  Returns true, and copies the value removed into
+  /// old_value (if not NULL), if a value was cached.  Values read after this
+  /// returns can be cached using the generation returned by generation().
+  bool invalidate(const std::string& key, V* old_value = NULL)
+  {
+    bool removed = false;
+    Shard& s = shard(key);
+
+    if (_max_shard_entries == 0)
+    {
+      // Nothing is ever cached.
+      return false;
+    }
+
+    pthread_mutex_lock(&s.lock);
+
+    uint64_t generation = ++_generation;
+
+    typename Entries::iterator i = s.entries.find(key);
+    Entry& e = (i != s.entries.end()) ? i->second : add(s, key);
+    if (e.valid)
+    {
+      if (old_value != NULL)
+      {
+        *old_value = e.value;
+      }
+      make_invalid(s, e);
+      removed = true;
+      _invalidations++;
+    }
+    e.invalidated = generation;
+    s.lru.splice(s.lru.begin(), s.lru, e.lru);
+    evict(s);
+
+    pthread_mutex_unlock(&s.lock);
+
+    return removed;
+  }
+
+  /// Returns the statistics accumulated since this was last called, and the
+  /// number of values cached.
+  void get_stats(Stats& stats)
+  {
+    stats.hits = _hits.exchange(0);
+    stats.misses = _misses.exchange(0);
+    stats.expired = _expired.exchange(0);
+    stats.evictions = _evictions.exchange(0);
+    stats.invalidations = _invalidations.exchange(0);
+    stats.entries = 0;
+
+    for (int ii = 0; ii < NUM_SHARDS; ++ii)
+    {
+      pthread_mutex_lock(&_shards[ii].lock);
+      stats.entries += _shards[ii].entries.size() - _shards[ii].invalidated;
+      pthread_mutex_unlock(&_shards[ii].lock);
+    }
+  }
+
+  static const int NUM_SHARDS = 16;
+
+private:
+  struct Entry
+  {
+    bool valid;
+    V value;
+    uint64_t cached_ms;
+    uint64_t ttl_ms;
+
+    // The generation at which the key was last invalidated, or zero.
+    uint64_t invalidated;
+
+    std::list<std::string>::iterator lru;
+  };
+
+  typedef std::unordered_map<std::string, Entry> Entries;
+
+  struct Shard
+  {
+    pthread_mutex_t lock;
+    Entries entries;
+
+    // Most recently used first.
+    std::list<std::string> lru;
+
+    // The number of entries with no value.
+    size_t invalidated;
+
+    // The latest invalidation generation of any entry evicted from the shard.
+    // Puts of keys that aren't in the shard with an earlier generation are
+    // refused, as they may have been invalidated.
+    uint64_t min_generation;
+  };
+
+  Shard& shard(const std::string& key)
+  {
+    return _shards[std::hash<std::string>()(key) % NUM_SHARDS];
+  }
+
+  /// Adds an entry with no value for a key.  The key may have been
+  /// invalidated and then evicted, so the entry starts with the shard's
+  /// minimum generation.  Must be called with the shard lock held.
+  Entry& add(Shard& s, const std::string& key)
+  {
+    s.lru.push_front(key);
+    Entry& e = s.entries[key];
+    e.valid = false;
+    e.value = V();
+    e.cached_ms = 0;
+    e.ttl_ms = 0;
+    e.invalidated = s.min_generation;
+    e.lru = s.lru.begin();
+    s.invalidated++;
+    return e;
+  }
+
+  /// Drops the value of an entry.  Must be called with the shard lock held.
+  void make_invalid(Shard& s, Entry& e)
+  {
+    e.valid = false;
+    e.value = V();
+    s.invalidated++;
+  }
+
+  /// Evicts the least recently used entries until the shard is within its
+  /// limit.  Must be called with the shard lock held.
+  void evict(Shard& s)
+  {
+    while (s.entries.size() > _max_shard_entries)
+    {
+      typename Entries::iterator i = s.entries.find(s.lru.back());
+      if (i->second.valid)
+      {
+        _evictions++;
+      }
+      else
+      {
+        s.invalidated--;
+      }
+      if (s.min_generation < i->second.invalidated)
+      {
+        s.min_generation = i->second.invalidated;
+      }
+      s.entries.erase(i);
+      s.lru.pop_back();
+    }
+  }
+
+  static uint64_t now_ms()
+  {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+  }
+
+  size_t _max_shard_entries;
+  uint64_t _ttl_ms;
+  Shard _shards[NUM_SHARDS];
+
+  // Incremented whenever a key is invalidated.
+  std::atomic<uint64_t> _generation;
+
+  // Statistics since they were last read.
+  std::atomic<uint_fast64_t> _hits;
+  std::atomic<uint_fast64_t> _misses;
+  std::atomic<uint_fast64_t> _expired;
+  std::atomic<uint_fast64_t> _evictions;
+  std::atomic<uint_fast64_t> _invalidations;
+};
+
+template<class V>
+const int ShardedLRUCache<V>::NUM_SHARDS;
+
+#endif
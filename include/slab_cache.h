@@ -0,0 +1,118 @@
+/**
+ * @file slab_cache.h  Per-thread cache of small fixed size allocations.
+ *
+ * Project Clearwater - IMS in the Cloud
+ * Copyright (C) 2014  Metaswitch Networks Ltd
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or (at your
+ * option) any later version, along with the "Special Exception" for use of
+ * the program along with SSL, set forth below. This program is distributed
+ * in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+ * without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details. You should have received a copy of the GNU General Public
+ * License along with this program.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ *
+ * The author can be reached by email at clearwater@metaswitch.com or by
+ * post at Metaswitch Networks Ltd, 100 Church St, Enfield EN2 6BQ, UK
+ *
+ * Special Exception
+ * Metaswitch Networks Ltd  grants you permission to copy, modify,
+ * propagate, and distribute a work formed by combining OpenSSL with The
+ * Software, or a work derivative of such a combination, even if such
+ * copying, modification, propagation, or distribution would otherwise
+ * violate the terms of the GPL. You must comply with the GPL in all
+ * respects for all of the code used other than OpenSSL.
+ * "OpenSSL" means OpenSSL toolkit software distributed by the OpenSSL
+ * Project and licensed under the OpenSSL Licenses, or a work based on such
+ * software and licensed under the OpenSSL Licenses.
+ * "OpenSSL Licenses" means the OpenSSL License and Original SSLeay License
+ * under which the OpenSSL Project distributes the OpenSSL toolkit software,
+ * as those licenses appear in the file LICENSE-OPENSSL.
+ */
+
+#ifndef SLAB_CACHE_H__
+#define SLAB_CACHE_H__
+
+#include <stddef.h>
+#include <stdint.h>
+
+/// Cache of freed memory blocks for the small objects that are allocated and
+/// freed for every SIP transaction (transaction objects, Sproutlet wrappers
+/// and timer entries).  Each thread keeps its own free lists, one for each of
+/// a small number of size classes, so allocations and frees that hit the
+/// cache take no locks and don't touch the heap.
+///
+/// Transactions are typically created on one worker thread and destroyed on
+/// another (or on a PJSIP timer thread), so each block records the thread
+/// that allocated it.  A block freed on a different thread is pushed back to
+/// its owner's return list (with a single atomic operation), and the owner
+/// moves returned blocks onto its free lists when its own lists run dry.
+/// Without this, blocks would collect on the threads that free them rather
+/// than the threads that allocate them, and most allocations would miss.
+///
+/// Allocations larger than the biggest size class, or that miss the cache,
+/// go to the heap.
+class SlabCache
+{
+public:
+  /// Allocates a block of at least the specified size.
+  static void* alloc(size_t size);
+
+  /// Frees a block allocated with alloc.  The size must match the size
+  /// passed to alloc.
+  static void free(void* block, size_t size);
+
+  /// Returns the number of allocations that were satisfied from the cache
+  /// (hits) and that went to the heap (misses), and the number of blocks
+  /// that were returned to the thread that allocated them by another thread,
+  /// since the last call.
+  static void get_stats(uint_fast64_t& hits,
+                        uint_fast64_t& misses,
+                        uint_fast64_t& remote_frees);
+
+  /// Returns the number of threads whose free lists still exist.  A thread's
+  /// lists are freed once it has exited and all the blocks it allocated have
+  /// been freed.
+  static int live_thread_lists();
+
+  /// The size classes - allocations (plus the header recording the owning
+  /// thread) are rounded up to the next power of two from MIN_BLOCK_SIZE to
+  /// MAX_BLOCK_SIZE.
+  static const size_t MIN_BLOCK_SIZE = 64;
+  static const size_t MAX_BLOCK_SIZE = 2048;
+  static const int NUM_SIZE_CLASSES = 6;
+
+  /// The size of the header at the start of each cached block.
+  static const size_t HEADER_SIZE = 16;
+
+  /// The maximum number of free blocks each thread keeps in each size class.
+  static const int MAX_FREE_BLOCKS = 512;
+
+private:
+  static int size_class(size_t size);
+};
+
+
+/// Base class for objects that should be allocated through the SlabCache.
+/// Deriving from this class overrides operator new and operator delete for
+/// the class (and any classes derived from it).  Classes with virtual
+/// destructors get the correct size on delete, as required by SlabCache.
+class SlabAllocated
+{
+public:
+  static void* operator new(size_t size)
+  {
+    return SlabCache::alloc(size);
+  }
+
+  static void operator delete(void* block, size_t size)
+  {
+    SlabCache::free(block, size);
+  }
+};
+
+#endif
@@ -50,6 +50,7 @@ extern "C" {
 }
 
 #include <list>
+#include <functional>
 #include "sas.h"
 
 class SproutletTsxHelper;
@@ -241,6 +242,21 @@ public:
   ///
   virtual bool timer_running(TimerID id) = 0;
 
+  /// Runs a blocking operation (such as an HTTP query) without holding up
+  /// the worker thread.  The transaction is parked while the operation runs
+  /// and the on_async_complete callback is called on a worker thread with the
+  /// context parameter once it has finished.  If asynchronous operations are
+  /// not enabled the operation is run inline and on_async_complete is called
+  /// before this method returns.
+  ///
+  /// @param  operation    - The operation to run.  This may run on another
+  ///                        thread, so must not send, create or free messages
+  ///                        or manipulate timers.
+  /// @param  context      - Context parameter returned on the callback.
+  ///
+  virtual void run_async(const std::function<void()>& operation,
+                         void* context) = 0;
+
   /// Returns the SAS trail identifier that should be used for any SAS events
   /// related to this service invocation.
   ///
@@ -332,6 +348,12 @@ public:
   ///                        was scheduled.
   virtual void on_timer_expiry(void* context) {}
 
+  /// Called when an operation started with run_async has completed.
+  ///
+  /// @param  context      - The context parameter specified when the
+  ///                        operation was started.
+  virtual void on_async_complete(void* context) {}
+
 protected:
 
   /// Returns a mutable clone of the original request.  This can be modified 
@@ -510,6 +532,15 @@ protected:
   bool timer_running(TimerID id)
     {return _helper->timer_running(id);}
 
+  /// Runs a blocking operation without holding up the worker thread.  The
+  /// on_async_complete callback is called once the operation has completed.
+  ///
+  /// @param  operation    - The operation to run.
+  /// @param  context      - Context parameter returned on the callback.
+  ///
+  void run_async(const std::function<void()>& operation, void* context)
+    {_helper->run_async(operation, context);}
+
   /// Returns the SAS trail identifier that should be used for any SAS events
   /// related to this service invocation.
   ///
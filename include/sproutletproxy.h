@@ -49,6 +49,7 @@
 
 #include "basicproxy.h"
 #include "sproutlet.h"
+#include "async_dispatcher.h"
 
 
 class SproutletWrapper;
@@ -62,11 +63,15 @@ public:
   /// @param  priority      - The pjsip priority to load at.
   /// @param  host_aliases  - The IP addresses/domains that refer to this proxy.
   /// @param  sproutlets    - Sproutlets to load in this proxy.
+  /// @param  async_dispatcher - Thread pool used to run blocking operations
+  ///                         on behalf of Sproutlets.  If NULL, blocking
+  ///                         operations run inline on the worker thread.
   SproutletProxy(pjsip_endpoint* endpt,
                  int priority,
                  const std::string& root_uri,
                  const std::unordered_set<std::string>& host_aliases,
-                 const std::list<Sproutlet*>& sproutlets);
+                 const std::list<Sproutlet*>& sproutlets,
+                 AsyncDispatcher* async_dispatcher=NULL);
 
   /// Destructor.
   virtual ~SproutletProxy();
@@ -103,7 +108,7 @@ protected:
   bool is_host_local(const pj_str_t* host);
 
   /// Defintion of a timer set by an child sproutlet transaction.
-  struct SproutletTimerCallbackData
+  struct SproutletTimerCallbackData : public SlabAllocated
   {
     SproutletProxy* proxy;
     SproutletProxy::UASTsx* uas_tsx;
@@ -122,6 +127,11 @@ protected:
                     SproutletWrapper* sproutlet_wrapper,
                     void* context);
 
+  void run_async(SproutletProxy::UASTsx* uas_tsx,
+                 SproutletWrapper* sproutlet_wrapper,
+                 const std::function<void()>& operation,
+                 void* context);
+
   class UASTsx : public BasicProxy::UASTsx
   {
   public:
@@ -144,6 +154,10 @@ protected:
     void process_timer_pop(SproutletWrapper* tsx,
                            void* context);
 
+    /// Handle completion of an asynchronous operation.
+    void process_async_complete(SproutletWrapper* tsx,
+                                void* context);
+
   protected:
     /// Handles a response to an associated UACTsx.
     virtual void on_new_client_response(UACTsx* uac_tsx,
@@ -167,6 +181,10 @@ protected:
     void cancel_timer(TimerID id);
     bool timer_running(TimerID id);
 
+    void run_async(SproutletWrapper* tsx,
+                   const std::function<void()>& operation,
+                   void* context);
+
     void tx_response(SproutletWrapper* sproutlet,
                      pjsip_tx_data* rsp);
 
@@ -212,6 +230,11 @@ protected:
     } PendingRequest;
     std::queue<PendingRequest> _pending_req_q;
 
+    /// Number of asynchronous operations that have been started by Sproutlets
+    /// on this transaction but have not yet completed.  The UASTsx must not
+    /// be destroyed while any are outstanding.
+    int _pending_async;
+
     /// Parent proxy object
     SproutletProxy* _sproutlet_proxy;
 
@@ -223,6 +246,8 @@ protected:
 
   std::list<Sproutlet*> _sproutlets;
 
+  AsyncDispatcher* _async_dispatcher;
+
   static const pj_str_t STR_SERVICE;
 
   friend class UASTsx;
@@ -230,7 +255,7 @@ protected:
 };
 
 
-class SproutletWrapper : public SproutletTsxHelper
+class SproutletWrapper : public SproutletTsxHelper, public SlabAllocated
 {
 public:
   /// Constructor
@@ -268,6 +293,7 @@ public:
   bool schedule_timer(void* context, TimerID& id, int duration);
   void cancel_timer(TimerID id);
   bool timer_running(TimerID id);
+  void run_async(const std::function<void()>& operation, void* context);
   SAS::TrailId trail() const;
   bool is_uri_reflexive(const pjsip_uri*) const;
   pjsip_sip_uri* get_reflexive_uri(pj_pool_t*) const;
@@ -279,6 +305,7 @@ private:
   void rx_error(int status_code);
   void rx_fork_error(pjsip_event_id_e event, int fork_id);
   void on_timer_pop(void* context);
+  void on_async_complete(void* context);
   void register_tdata(pjsip_tx_data* tdata);
   void deregister_tdata(pjsip_tx_data* tdata);
 
@@ -320,6 +347,11 @@ private:
 
   int _pending_sends;
   int _pending_responses;
+
+  /// Number of asynchronous operations started by the Sproutlet that have not
+  /// yet completed.  The wrapper (and the SproutletTsx) must not be destroyed
+  /// while any are outstanding.
+  int _pending_async;
   pjsip_tx_data* _best_rsp;
 
   bool _complete;
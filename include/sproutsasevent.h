@@ -63,6 +63,7 @@ namespace SASEvent
   const int SCSCF_RETRY = SPROUT_BASE + 0x000024;
   const int SCSCF_SELECTION_FAILED = SPROUT_BASE + 0x000025;
   const int SCSCF_ODI_INVALID = SPROUT_BASE + 0x000026;
+  const int SCSCF_SELECTION_CACHED = SPROUT_BASE + 0x000027;
 
   const int SIPRESOLVE_START = SPROUT_BASE + 0x000030;
   const int SIPRESOLVE_PORT_A_LOOKUP = SPROUT_BASE + 0x000031;
@@ -111,6 +112,7 @@ namespace SASEvent
   const int HTTP_HOMESTEAD_GET_REG = SPROUT_BASE + 0x0000A3;
   const int HTTP_HOMESTEAD_AUTH_STATUS = SPROUT_BASE + 0x0000A4;
   const int HTTP_HOMESTEAD_LOCATION = SPROUT_BASE + 0x0000A5;
+  const int HTTP_HOMESTEAD_COALESCED = SPROUT_BASE + 0x0000A6;
 
   const int HTTP_HOMER_SIMSERVS = SPROUT_BASE + 0x0000B0;
 
@@ -130,6 +132,8 @@ namespace SASEvent
   const int BINDINGS_FROM_TARGETS = SPROUT_BASE + 0x0000D4;
   const int ALL_BINDINGS_FILTERED = SPROUT_BASE + 0x0000D5;
 
+  const int SIP_QUEUE_FULL = SPROUT_BASE + 0x0000D6;
+
 } //namespace SASEvent
 
 #endif
@@ -48,6 +48,8 @@ extern "C" {
 }
 
 #include <string>
+#include <vector>
+#include <functional>
 #include <unordered_set>
 
 #include "sas.h"
@@ -152,12 +154,53 @@ extern pj_status_t init_stack(const std::string& sas_system_name,
                               SIPResolver* sipresolver,
                               int num_pjsip_threads,
                               int num_worker_threads,
+                              int max_worker_threads,
+                              int num_worker_queues,
+                              const std::vector<unsigned int>& max_queue_depths,
+                              int max_worker_batch_size,
                               int record_routing_model,
                               const int default_session_expires,
                               QuiescingManager *quiescing_mgr,
                               LoadMonitor *load_monitor,
+                              const std::vector<int>& target_latencies,
                               const std::string& cdf_domain);
 extern pj_status_t start_stack();
+
+/// Configures the CPUs the PJSIP and worker threads are pinned to when the
+/// stack is started.  Each parameter is a list of CPU groups separated by
+/// semi-colons, each group being a CPU list such as "0-3,8".  PJSIP threads
+/// are assigned to the groups in turn, and worker threads use the group for
+/// their worker queue.  An empty parameter leaves the threads unpinned.  If
+/// numa_local is set, threads also prefer memory from their group's NUMA node.
+extern pj_status_t set_stack_thread_affinity(const std::string& pjsip_cpus,
+                                             const std::string& worker_cpus,
+                                             bool numa_local);
+
+/// Records the name of the component (for example the Sproutlet) handling
+/// the message currently being processed on this worker thread.  This is
+/// used to break down the service time statistics by handler.
+extern void set_rx_msg_handler(const std::string& handler);
+
+/// Queues a callback to be run on one of the worker threads.  This is used
+/// to resume processing once an asynchronous operation has completed.  The
+/// callback is run immediately if the worker threads are not running.
+extern void post_to_worker(const std::function<void()>& callback);
+
+/// Records that the calling thread is starting or has finished blocking on
+/// I/O (for example an HTTP or memcached request).  This is used to decide
+/// whether adding worker threads will help when the worker queues back up.
+/// It has no effect on threads other than the worker threads.
+extern void worker_blocked(bool blocked);
+
+/// Adds a function that reports a component's statistics, which is run
+/// every statistics period along with the reporting of the queue
+/// statistics, rather than on the component's own request path.  The owner
+/// identifies the function to remove_stats_reporter, which must be called
+/// before anything the function uses is destroyed.
+extern void add_stats_reporter(const void* owner,
+                               const std::function<void()>& reporter);
+extern void remove_stats_reporter(const void* owner);
+
 extern void stop_stack();
 extern void unregister_stack_modules(void);
 extern void destroy_stack();
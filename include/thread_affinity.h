@@ -0,0 +1,95 @@
+/**
+ * @file thread_affinity.h  Pinning of threads to CPUs and NUMA nodes.
+ *
+ * Project Clearwater - IMS in the Cloud
+ * Copyright (C) 2014  Metaswitch Networks Ltd
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or (at your
+ * option) any later version, along with the "Special Exception" for use of
+ * the program along with SSL, set forth below. This program is distributed
+ * in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+ * without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details. You should have received a copy of the GNU General Public
+ * License along with this program.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ *
+ * The author can be reached by email at clearwater@metaswitch.com or by
+ * post at Metaswitch Networks Ltd, 100 Church St, Enfield EN2 6BQ, UK
+ *
+ * Special Exception
+ * Metaswitch Networks Ltd  grants you permission to copy, modify,
+ * propagate, and distribute a work formed by combining OpenSSL with The
+ * Software, or a work derivative of such a combination, even if such
+ * copying, modification, propagation, or distribution would otherwise
+ * violate the terms of the GPL. You must comply with the GPL in all
+ * respects for all of the code used other than OpenSSL.
+ * "OpenSSL" means OpenSSL toolkit software distributed by the OpenSSL
+ * Project and licensed under the OpenSSL Licenses, or a work based on such
+ * software and licensed under the OpenSSL Licenses.
+ * "OpenSSL Licenses" means the OpenSSL License and Original SSLeay License
+ * under which the OpenSSL Project distributes the OpenSSL toolkit software,
+ * as those licenses appear in the file LICENSE-OPENSSL.
+ */
+
+#ifndef THREAD_AFFINITY_H__
+#define THREAD_AFFINITY_H__
+
+#include <sched.h>
+
+#include <string>
+#include <vector>
+
+/// Utilities for pinning threads to sets of CPUs.  Each pinned thread records
+/// its placement so the actual layout can be logged and reported in
+/// statistics.
+namespace ThreadAffinity
+{
+  /// Parses a CPU list in the format used by the Linux kernel, for example
+  /// "0-3,8,10-11".  Returns false if the list is invalid or empty.
+  bool parse_cpu_list(const std::string& list, cpu_set_t& cpus);
+
+  /// Formats a CPU set as a CPU list.
+  std::string cpu_list(const cpu_set_t& cpus);
+
+  /// Returns the NUMA node containing all the CPUs in the set, or -1 if the
+  /// CPUs span more than one node (or the node can't be determined).
+  int numa_node(const cpu_set_t& cpus);
+
+  /// Pins the calling thread to the specified CPUs.  If numa_local is set and
+  /// the CPUs are all on a single NUMA node, the thread's memory allocations
+  /// are also made from that node where possible.  The placement is logged
+  /// and recorded against the supplied thread name.
+  ///
+  /// @returns             - true if the thread was pinned.
+  bool pin_thread(const std::string& name,
+                  const cpu_set_t& cpus,
+                  bool numa_local);
+
+  /// Saves the CPU affinity of the calling thread as the process's original
+  /// affinity.  This must be called from the main thread before it is pinned
+  /// to any CPUs.
+  void save_process_cpus();
+
+  /// Resets the calling thread to the process's original CPU affinity (and
+  /// the default memory policy), and records its placement.  Threads inherit
+  /// the affinity of the thread that creates them, so this is used for
+  /// threads with no configured CPU set that are created by a pinned thread.
+  void unpin_thread(const std::string& name);
+
+  /// Records the placement of the calling thread without changing it.  This
+  /// is used for threads with no configured CPU set so the report covers
+  /// every thread.
+  void record_placement(const std::string& name);
+
+  /// Forgets the placement recorded for a thread that has exited.
+  void remove_placement(const std::string& name);
+
+  /// Returns a description of the placement of each recorded thread, in the
+  /// form "<name> cpus=<cpu list> node=<node>".
+  void get_placements(std::vector<std::string>& placements);
+}
+
+#endif
@@ -0,0 +1,87 @@
+/**
+ * @file worker_pool_policy.h  Sizing policy for the worker thread pools.
+ *
+ * Project Clearwater - IMS in the Cloud
+ * Copyright (C) 2014  Metaswitch Networks Ltd
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or (at your
+ * option) any later version, along with the "Special Exception" for use of
+ * the program along with SSL, set forth below. This program is distributed
+ * in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+ * without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details. You should have received a copy of the GNU General Public
+ * License along with this program.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ *
+ * The author can be reached by email at clearwater@metaswitch.com or by
+ * post at Metaswitch Networks Ltd, 100 Church St, Enfield EN2 6BQ, UK
+ *
+ * Special Exception
+ * Metaswitch Networks Ltd  grants you permission to copy, modify,
+ * propagate, and distribute a work formed by combining OpenSSL with The
+ * Software, or a work derivative of such a combination, even if such
+ * copying, modification, propagation, or distribution would otherwise
+ * violate the terms of the GPL. You must comply with the GPL in all
+ * respects for all of the code used other than OpenSSL.
+ * "OpenSSL" means OpenSSL toolkit software distributed by the OpenSSL
+ * Project and licensed under the OpenSSL Licenses, or a work based on such
+ * software and licensed under the OpenSSL Licenses.
+ * "OpenSSL Licenses" means the OpenSSL License and Original SSLeay License
+ * under which the OpenSSL Project distributes the OpenSSL toolkit software,
+ * as those licenses appear in the file LICENSE-OPENSSL.
+ */
+
+#ifndef WORKER_POOL_POLICY_H__
+#define WORKER_POOL_POLICY_H__
+
+/// Policy for sizing the pool of worker threads servicing each worker queue.
+/// Each pool is reviewed once every REVIEW_PERIOD_MS, based on the mean queue
+/// wait over the period and how many of its workers are blocked on I/O or
+/// idle.
+namespace WorkerPoolPolicy
+{
+  /// Period over which queue wait is averaged before deciding whether to
+  /// resize a pool (in milliseconds).
+  const int REVIEW_PERIOD_MS = 1000;
+
+  /// A pool grows if the mean wait is above this while at least half its
+  /// workers are blocked on I/O (adding threads doesn't help if the workers
+  /// are busy on the CPU).
+  const unsigned long GROW_WAIT_US = 10000;
+
+  /// A pool shrinks if the mean wait is below this while more than one of
+  /// its workers is idle.
+  const unsigned long SHRINK_WAIT_US = 1000;
+
+  enum Action
+  {
+    NO_CHANGE,
+    GROW,
+    SHRINK
+  };
+
+  /// Returns queue index's share of a number of threads divided between a
+  /// number of queues.  Any remainder goes to the lowest numbered queues.
+  int queue_share(int num_threads, int num_queues, int index);
+
+  /// Decides whether a pool should grow or shrink.  A pool never grows
+  /// beyond its maximum size or shrinks below its minimum size.
+  ///
+  /// @param mean_wait_us  - The mean queue wait over the review period.
+  /// @param workers       - The current number of workers in the pool.
+  /// @param blocked       - The number of workers blocked on I/O.
+  /// @param idle          - The number of workers waiting for work.
+  /// @param min_workers   - The minimum size of the pool.
+  /// @param max_workers   - The maximum size of the pool.
+  Action review(unsigned long mean_wait_us,
+                int workers,
+                int blocked,
+                int idle,
+                int min_workers,
+                int max_workers);
+}
+
+#endif
@@ -39,6 +39,7 @@
 #include "pjutils.h"
 #include "constants.h"
 #include "custom_headers.h"
+#include "stack.h"
 #include "acr.h"
 
 const pj_time_val ACR::unspec = {-1,0};
@@ -175,8 +176,10 @@ RalfACR::RalfACR(HttpConnection* ralf,
                  SAS::TrailId trail,
                  Node node_functionality,
                  Initiator initiator,
-                 NodeRole role) :
+                 NodeRole role,
+                 AsyncDispatcher* dispatcher) :
   _ralf(ralf),
+  _dispatcher(dispatcher),
   _trail(trail),
   _initiator(initiator),
   _first_req(true),
@@ -645,15 +648,34 @@ void RalfACR::send_message(pj_time_val timestamp)
   LOG_VERBOSE("Sending %s Ralf ACR (%p)",
               ACR::node_name(_node_functionality).c_str(), this);
   std::string path = "/call-id/" + Utils::url_escape(_user_session_id);
-  std::map<std::string, std::string> headers;
-  long rc = _ralf->send_post(path,
-                             headers,
-                             get_message(timestamp),
-                             _trail);
+  std::string message = get_message(timestamp);
+  HttpConnection* ralf = _ralf;
+  SAS::TrailId trail = _trail;
 
-  if (rc != HTTP_OK)
+  // The ACR may be destroyed as soon as this returns, so the send must only
+  // use copies of the data it needs.
+  std::function<void()> send = [ralf, path, message, trail]()
   {
-    LOG_WARNING("Failed to send Ralf ACR message (%p), rc = %ld", this, rc);
+    std::map<std::string, std::string> headers;
+    worker_blocked(true);
+    long rc = ralf->send_post(path, headers, message, trail);
+    worker_blocked(false);
+
+    if (rc != HTTP_OK)
+    {
+      LOG_WARNING("Failed to send Ralf ACR message for %s, rc = %ld",
+                  path.c_str(), rc);
+    }
+  };
+
+  if (_dispatcher != NULL)
+  {
+    // Nothing depends on the result, so don't wait for the send to complete.
+    _dispatcher->dispatch(send);
+  }
+  else
+  {
+    send();
   }
 }
 
@@ -1472,9 +1494,11 @@ std::string RalfACR::hdr_contents(pjsip_hdr* hdr)
 
 /// RalfACRFactory Constructor.
 RalfACRFactory::RalfACRFactory(HttpConnection* ralf,
-                               Node node_functionality) :
+                               Node node_functionality,
+                               AsyncDispatcher* dispatcher) :
   _ralf(ralf),
-  _node_functionality(node_functionality)
+  _node_functionality(node_functionality),
+  _dispatcher(dispatcher)
 {
   LOG_DEBUG("Created RalfACR factory for node type %s",
             ACR::node_name(_node_functionality).c_str());
@@ -1494,6 +1518,11 @@ ACR* RalfACRFactory::get_acr(SAS::TrailId trail,
             ACR::node_name(_node_functionality).c_str(),
             ACR::node_role_str(role).c_str());
 
-  return (ACR*)new RalfACR(_ralf, trail, _node_functionality, initiator, role);
+  return (ACR*)new RalfACR(_ralf,
+                           trail,
+                           _node_functionality,
+                           initiator,
+                           role,
+                           _dispatcher);
 }
 
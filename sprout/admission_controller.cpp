@@ -0,0 +1,236 @@
+/**
+ * @file admission_controller.cpp  Per-class admission control for received SIP requests.
+ *
+ * Project Clearwater - IMS in the Cloud
+ * Copyright (C) 2014  Metaswitch Networks Ltd
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or (at your
+ * option) any later version, along with the "Special Exception" for use of
+ * the program along with SSL, set forth below. This program is distributed
+ * in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+ * without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details. You should have received a copy of the GNU General Public
+ * License along with this program.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ *
+ * The author can be reached by email at clearwater@metaswitch.com or by
+ * post at Metaswitch Networks Ltd, 100 Church St, Enfield EN2 6BQ, UK
+ *
+ * Special Exception
+ * Metaswitch Networks Ltd  grants you permission to copy, modify,
+ * propagate, and distribute a work formed by combining OpenSSL with The
+ * Software, or a work derivative of such a combination, even if such
+ * copying, modification, propagation, or distribution would otherwise
+ * violate the terms of the GPL. You must comply with the GPL in all
+ * respects for all of the code used other than OpenSSL.
+ * "OpenSSL" means OpenSSL toolkit software distributed by the OpenSSL
+ * Project and licensed under the OpenSSL Licenses, or a work based on such
+ * software and licensed under the OpenSSL Licenses.
+ * "OpenSSL Licenses" means the OpenSSL License and Original SSLeay License
+ * under which the OpenSSL Project distributes the OpenSSL toolkit software,
+ * as those licenses appear in the file LICENSE-OPENSSL.
+ */
+
+#include "admission_controller.h"
+#include "log.h"
+
+const int AdmissionController::MAX_BURST;
+const int AdmissionController::INITIAL_RATE;
+const int AdmissionController::MIN_RATE;
+const int AdmissionController::ADJUST_REQUESTS;
+const int AdmissionController::INITIAL_COST_US;
+
+/// Returns the time in seconds from start to end.
+static double elapsed_secs(const struct timespec& start,
+                           const struct timespec& end)
+{
+  return (end.tv_sec - start.tv_sec) +
+         (end.tv_nsec - start.tv_nsec) / 1000000000.0;
+}
+
+
+AdmissionController::AdmissionController(const std::vector<int>& target_latencies) :
+  _classes()
+{
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+
+  for (size_t ii = 0; ii < target_latencies.size(); ++ii)
+  {
+    TrafficClass* tc = new TrafficClass;
+    pthread_mutex_init(&tc->lock, NULL);
+    tc->target_latency_us = target_latencies[ii];
+    tc->smoothed_latency_us = 0;
+    tc->cost_us = INITIAL_COST_US;
+    tc->rate = INITIAL_RATE * tc->cost_us;
+    tc->tokens = MAX_BURST * tc->cost_us;
+    tc->replenish_time = now;
+    tc->completed = 0;
+    tc->admitted_cost_us = 0;
+    tc->adjust_time = now;
+    tc->rejected = 0;
+    _classes.push_back(tc);
+  }
+}
+
+
+AdmissionController::~AdmissionController()
+{
+  for (size_t ii = 0; ii < _classes.size(); ++ii)
+  {
+    pthread_mutex_destroy(&_classes[ii]->lock);
+    delete _classes[ii];
+  }
+}
+
+
+bool AdmissionController::admit_request(int cls)
+{
+  TrafficClass& tc = *_classes[cls];
+
+  pthread_mutex_lock(&tc.lock);
+  replenish(tc);
+  double cost_us = tc.cost_us;
+  bool admit = (tc.tokens >= cost_us);
+  if (admit)
+  {
+    tc.tokens -= cost_us;
+    tc.admitted_cost_us += cost_us;
+  }
+  pthread_mutex_unlock(&tc.lock);
+
+  if (!admit)
+  {
+    ++tc.rejected;
+  }
+
+  return admit;
+}
+
+
+void AdmissionController::request_complete(int cls,
+                                           unsigned long latency_us,
+                                           unsigned long service_us)
+{
+  TrafficClass& tc = *_classes[cls];
+
+  pthread_mutex_lock(&tc.lock);
+
+  if (tc.smoothed_latency_us == 0)
+  {
+    tc.smoothed_latency_us = latency_us;
+  }
+  else
+  {
+    tc.smoothed_latency_us = (1 - SMOOTHING) * tc.smoothed_latency_us +
+                             SMOOTHING * latency_us;
+  }
+
+  // The cost can't be allowed to reach zero, or the class would never run
+  // out of tokens.
+  tc.cost_us = (1 - SMOOTHING) * tc.cost_us + SMOOTHING * service_us;
+  if (tc.cost_us < 1)
+  {
+    tc.cost_us = 1;
+  }
+
+  if (++tc.completed >= ADJUST_REQUESTS)
+  {
+    adjust_rate(tc);
+  }
+
+  pthread_mutex_unlock(&tc.lock);
+}
+
+
+void AdmissionController::replenish(TrafficClass& tc)
+{
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+
+  tc.tokens += tc.rate * elapsed_secs(tc.replenish_time, now);
+  double max_tokens = MAX_BURST * tc.cost_us;
+  if (tc.tokens > max_tokens)
+  {
+    tc.tokens = max_tokens;
+  }
+  tc.replenish_time = now;
+}
+
+
+void AdmissionController::adjust_rate(TrafficClass& tc)
+{
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  double secs = elapsed_secs(tc.adjust_time, now);
+
+  double err = (tc.smoothed_latency_us - tc.target_latency_us) /
+               tc.target_latency_us;
+
+  if (err > 0)
+  {
+    // Latency is above target, so cut the rate in proportion to how far
+    // above target it is (but by no more than half).
+    double decrease = DECREASE_FACTOR * err;
+    tc.rate *= (decrease < 0.5) ? (1 - decrease) : 0.5;
+  }
+  else if ((secs > 0) && (tc.admitted_cost_us / secs >= tc.rate / 2))
+  {
+    // Latency is below target and the class is using a significant part of
+    // its rate, so raise the rate in proportion to the headroom.  The rate
+    // isn't raised if the class isn't using it, so an idle class can't build
+    // up a rate it would take a long time to bring down again.
+    tc.rate *= (1 - INCREASE_FACTOR * err);
+  }
+
+  double min_rate = MIN_RATE * tc.cost_us;
+  if (tc.rate < min_rate)
+  {
+    tc.rate = min_rate;
+  }
+
+  LOG_DEBUG("Admission rate %.0f requests/s (latency %.0fus, target %dus, cost %.0fus)",
+            tc.rate / tc.cost_us,
+            tc.smoothed_latency_us,
+            tc.target_latency_us,
+            tc.cost_us);
+
+  tc.completed = 0;
+  tc.admitted_cost_us = 0;
+  tc.adjust_time = now;
+}
+
+
+int AdmissionController::get_target_latency(int cls)
+{
+  return _classes[cls]->target_latency_us;
+}
+
+
+int AdmissionController::get_current_latency(int cls)
+{
+  TrafficClass& tc = *_classes[cls];
+  pthread_mutex_lock(&tc.lock);
+  int latency = (int)tc.smoothed_latency_us;
+  pthread_mutex_unlock(&tc.lock);
+  return latency;
+}
+
+
+int AdmissionController::get_rate_limit(int cls)
+{
+  TrafficClass& tc = *_classes[cls];
+  pthread_mutex_lock(&tc.lock);
+  int rate = (int)(tc.rate / tc.cost_us);
+  pthread_mutex_unlock(&tc.lock);
+  return rate;
+}
+
+
+uint_fast64_t AdmissionController::get_rejected(int cls)
+{
+  return _classes[cls]->rejected.exchange(0);
+}
@@ -0,0 +1,111 @@
+/**
+ * @file aor_cache.cpp  Process-local cache of registration data for lookups.
+ *
+ * Project Clearwater - IMS in the Cloud
+ * Copyright (C) 2014  Metaswitch Networks Ltd
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or (at your
+ * option) any later version, along with the "Special Exception" for use of
+ * the program along with SSL, set forth below. This program is distributed
+ * in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+ * without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details. You should have received a copy of the GNU General Public
+ * License along with this program.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ *
+ * The author can be reached by email at clearwater@metaswitch.com or by
+ * post at Metaswitch Networks Ltd, 100 Church St, Enfield EN2 6BQ, UK
+ *
+ * Special Exception
+ * Metaswitch Networks Ltd  grants you permission to copy, modify,
+ * propagate, and distribute a work formed by combining OpenSSL with The
+ * Software, or a work derivative of such a combination, even if such
+ * copying, modification, propagation, or distribution would otherwise
+ * violate the terms of the GPL. You must comply with the GPL in all
+ * respects for all of the code used other than OpenSSL.
+ * "OpenSSL" means OpenSSL toolkit software distributed by the OpenSSL
+ * Project and licensed under the OpenSSL Licenses, or a work based on such
+ * software and licensed under the OpenSSL Licenses.
+ * "OpenSSL Licenses" means the OpenSSL License and Original SSLeay License
+ * under which the OpenSSL Project distributes the OpenSSL toolkit software,
+ * as those licenses appear in the file LICENSE-OPENSSL.
+ */
+
+#include <vector>
+
+#include "aor_cache.h"
+#include "stack.h"
+#include "log.h"
+
+AoRCache::AoRCache(int max_entries,
+                   int staleness_ms,
+                   LastValueCache* stats_aggregator) :
+  _cache(max_entries, staleness_ms),
+  _hit_age_sum_ms(0),
+  _statistic("aor_cache_stats", stats_aggregator)
+{
+  add_stats_reporter(this, [this]() { report_stats(); });
+}
+
+
+AoRCache::~AoRCache()
+{
+  remove_stats_reporter(this);
+}
+
+
+RegStore::AoR* AoRCache::get(const std::string& aor_id, uint64_t& generation)
+{
+  std::shared_ptr<const RegStore::AoR> cached;
+  uint64_t age_ms;
+
+  if (!_cache.get(aor_id, cached, generation, nullptr, &age_ms))
+  {
+    return NULL;
+  }
+
+  // Copy the AoR outside the cache's lock.
+  _hit_age_sum_ms += age_ms;
+  return new RegStore::AoR(*cached);
+}
+
+
+void AoRCache::put(const std::string& aor_id,
+                   const RegStore::AoR* aor_data,
+                   uint64_t generation)
+{
+  std::shared_ptr<const RegStore::AoR> copy(new RegStore::AoR(*aor_data));
+  _cache.put(aor_id, copy, generation);
+}
+
+
+void AoRCache::invalidate(const std::string& aor_id)
+{
+  _cache.invalidate(aor_id);
+}
+
+
+/// Reports the number of hits, misses, the hit rate (as a percentage), the
+/// number of entries found to be too old, evictions, invalidations, the mean
+/// age of the entries used (in milliseconds) and the number of entries.
+void AoRCache::report_stats()
+{
+  ShardedLRUCache<std::shared_ptr<const RegStore::AoR> >::Stats stats;
+  _cache.get_stats(stats);
+  uint_fast64_t hit_age_sum_ms = _hit_age_sum_ms.exchange(0);
+
+  std::vector<std::string> values;
+  values.push_back(std::to_string(stats.hits));
+  values.push_back(std::to_string(stats.misses));
+  values.push_back(std::to_string(((stats.hits + stats.misses) > 0) ?
+                                    (stats.hits * 100) / (stats.hits + stats.misses) : 0));
+  values.push_back(std::to_string(stats.expired));
+  values.push_back(std::to_string(stats.evictions));
+  values.push_back(std::to_string(stats.invalidations));
+  values.push_back(std::to_string((stats.hits > 0) ? hit_age_sum_ms / stats.hits : 0));
+  values.push_back(std::to_string(stats.entries));
+  _statistic.report_change(values);
+}
@@ -0,0 +1,615 @@
+/**
+ * @file aor_replicator.cpp  Asynchronous replication of AoR updates to a remote store.
+ *
+ * Project Clearwater - IMS in the Cloud
+ * Copyright (C) 2014  Metaswitch Networks Ltd
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or (at your
+ * option) any later version, along with the "Special Exception" for use of
+ * the program along with SSL, set forth below. This program is distributed
+ * in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+ * without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details. You should have received a copy of the GNU General Public
+ * License along with this program.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ *
+ * The author can be reached by email at clearwater@metaswitch.com or by
+ * post at Metaswitch Networks Ltd, 100 Church St, Enfield EN2 6BQ, UK
+ *
+ * Special Exception
+ * Metaswitch Networks Ltd  grants you permission to copy, modify,
+ * propagate, and distribute a work formed by combining OpenSSL with The
+ * Software, or a work derivative of such a combination, even if such
+ * copying, modification, propagation, or distribution would otherwise
+ * violate the terms of the GPL. You must comply with the GPL in all
+ * respects for all of the code used other than OpenSSL.
+ * "OpenSSL" means OpenSSL toolkit software distributed by the OpenSSL
+ * Project and licensed under the OpenSSL Licenses, or a work based on such
+ * software and licensed under the OpenSSL Licenses.
+ * "OpenSSL Licenses" means the OpenSSL License and Original SSLeay License
+ * under which the OpenSSL Project distributes the OpenSSL toolkit software,
+ * as those licenses appear in the file LICENSE-OPENSSL.
+ */
+
+#include <time.h>
+
+#include "aor_replicator.h"
+#include "stack.h"
+#include "log.h"
+
+const int AoRReplicator::MAX_ATTEMPTS;
+const int AoRReplicator::MAX_WRITES_PER_ATTEMPT;
+const int AoRReplicator::INITIAL_BACKOFF_MS;
+const int AoRReplicator::MAX_BACKOFF_MS;
+
+/// Copies a binding, keeping the destination's pointer to its AoR's URI.
+static void copy_binding(RegStore::AoR::Binding* dst,
+                         const RegStore::AoR::Binding* src)
+{
+  std::string* address_of_record = dst->_address_of_record;
+  *dst = *src;
+  dst->_address_of_record = address_of_record;
+}
+
+
+AoRReplicator::Change::Change(const std::string& aor_id) :
+  updated(aor_id),
+  notify_cseq(0),
+  full(false),
+  queued_ms(now_ms()),
+  attempts(0)
+{
+}
+
+
+AoRReplicator::AoRReplicator(RegStore* remote_store,
+                             int num_threads,
+                             int max_pending,
+                             LastValueCache* stats_aggregator) :
+  _remote_store(remote_store),
+  _max_pending(max_pending),
+  _terminated(false),
+  _queued(0),
+  _combined(0),
+  _written(0),
+  _retries(0),
+  _dropped(0),
+  _lag_sum_ms(0),
+  _max_lag_ms(0),
+  _statistic("remote_replication", stats_aggregator)
+{
+  pthread_mutex_init(&_lock, NULL);
+
+  // Retry times are measured on the monotonic clock, so the condition must
+  // use it too.
+  pthread_condattr_t cond_attr;
+  pthread_condattr_init(&cond_attr);
+  pthread_condattr_setclock(&cond_attr, CLOCK_MONOTONIC);
+  pthread_cond_init(&_cond, &cond_attr);
+  pthread_condattr_destroy(&cond_attr);
+
+  for (int ii = 0; ii < num_threads; ++ii)
+  {
+    pthread_t thread;
+    int rc = pthread_create(&thread, NULL, thread_func, (void*)this);
+    if (rc != 0)
+    {
+      LOG_ERROR("Failed to create remote replication thread (%d)", rc);
+    }
+    else
+    {
+      _threads.push_back(thread);
+    }
+  }
+
+  LOG_STATUS("Started %d remote replication threads", _threads.size());
+
+  add_stats_reporter(this, [this]() { report_stats(); });
+}
+
+
+AoRReplicator::~AoRReplicator()
+{
+  remove_stats_reporter(this);
+
+  pthread_mutex_lock(&_lock);
+  _terminated = true;
+  pthread_cond_broadcast(&_cond);
+  pthread_mutex_unlock(&_lock);
+
+  for (std::vector<pthread_t>::iterator i = _threads.begin();
+       i != _threads.end();
+       ++i)
+  {
+    pthread_join(*i, NULL);
+  }
+
+  if (!_pending.empty())
+  {
+    LOG_WARNING("Discarding unreplicated changes to %d AoRs", _pending.size());
+  }
+
+  for (std::unordered_map<std::string, Change*>::iterator i = _pending.begin();
+       i != _pending.end();
+       ++i)
+  {
+    delete i->second;
+  }
+
+  pthread_cond_destroy(&_cond);
+  pthread_mutex_destroy(&_lock);
+}
+
+
+void AoRReplicator::replicate(const std::string& aor_id,
+                              const RegStore::AoR* original,
+                              const RegStore::AoR* updated)
+{
+  Change* change = new Change(aor_id);
+  bool changed = false;
+
+  for (RegStore::AoR::Bindings::const_iterator i = updated->bindings().begin();
+       i != updated->bindings().end();
+       ++i)
+  {
+    RegStore::AoR::Bindings::const_iterator j = original->bindings().find(i->first);
+    if ((j == original->bindings().end()) ||
+        (!same_binding(i->second, j->second)))
+    {
+      copy_binding(change->updated.get_binding(i->first), i->second);
+      changed = true;
+    }
+  }
+
+  for (RegStore::AoR::Bindings::const_iterator i = original->bindings().begin();
+       i != original->bindings().end();
+       ++i)
+  {
+    if (updated->bindings().find(i->first) == updated->bindings().end())
+    {
+      change->removed_bindings.insert(i->first);
+      changed = true;
+    }
+  }
+
+  for (RegStore::AoR::Subscriptions::const_iterator i = updated->subscriptions().begin();
+       i != updated->subscriptions().end();
+       ++i)
+  {
+    RegStore::AoR::Subscriptions::const_iterator j = original->subscriptions().find(i->first);
+    if ((j == original->subscriptions().end()) ||
+        (!same_subscription(i->second, j->second)))
+    {
+      *change->updated.get_subscription(i->first) = *i->second;
+      changed = true;
+    }
+  }
+
+  for (RegStore::AoR::Subscriptions::const_iterator i = original->subscriptions().begin();
+       i != original->subscriptions().end();
+       ++i)
+  {
+    if (updated->subscriptions().find(i->first) == updated->subscriptions().end())
+    {
+      change->removed_subscriptions.insert(i->first);
+      changed = true;
+    }
+  }
+
+  change->notify_cseq = updated->_notify_cseq;
+
+  if (!changed)
+  {
+    delete change;
+    return;
+  }
+
+  _queued++;
+
+  pthread_mutex_lock(&_lock);
+
+  if (_dirty.erase(aor_id) > 0)
+  {
+    // Earlier changes to this AoR were dropped, so the remote AoR may be
+    // missing changes that this one doesn't repeat.  Replicate the whole AoR.
+    LOG_DEBUG("Replicating all of %s after dropping changes", aor_id.c_str());
+    make_full(change, updated);
+  }
+
+  std::unordered_map<std::string, Change*>::iterator i = _pending.find(aor_id);
+  if (i != _pending.end())
+  {
+    // There are already changes to this AoR waiting, so add these to them.
+    merge(i->second, change);
+    delete change;
+    _combined++;
+  }
+  else if (_pending.size() >= _max_pending)
+  {
+    LOG_DEBUG("Too many AoRs waiting to be replicated - dropping changes to %s",
+              aor_id.c_str());
+    delete change;
+    _dirty.insert(aor_id);
+    _dropped++;
+  }
+  else
+  {
+    _pending[aor_id] = change;
+
+    // If the AoR is being written, the changes are queued when the write
+    // finishes.
+    if (_writing.find(aor_id) == _writing.end())
+    {
+      _ready.push_back(aor_id);
+      pthread_cond_signal(&_cond);
+    }
+  }
+
+  pthread_mutex_unlock(&_lock);
+}
+
+
+int AoRReplicator::pending()
+{
+  pthread_mutex_lock(&_lock);
+  int pending = _pending.size();
+  pthread_mutex_unlock(&_lock);
+  return pending;
+}
+
+
+void* AoRReplicator::thread_func(void* p)
+{
+  // The writes can send NOTIFYs (for bindings that have expired in the
+  // remote store), so the thread must be registered with PJSIP.
+  pj_thread_desc desc;
+  pj_thread_t* thread;
+  if (!pj_thread_is_registered())
+  {
+    pj_status_t status = pj_thread_register("AoRReplicator", desc, &thread);
+    if (status != PJ_SUCCESS)
+    {
+      // LCOV_EXCL_START
+      LOG_ERROR("Failed to register remote replication thread with PJSIP");
+      // LCOV_EXCL_STOP
+    }
+  }
+
+  ((AoRReplicator*)p)->run();
+  return NULL;
+}
+
+
+void AoRReplicator::run()
+{
+  pthread_mutex_lock(&_lock);
+
+  while (!_terminated)
+  {
+    uint64_t now = now_ms();
+
+    // Queue any AoRs that have waited long enough to retry.
+    while ((!_delayed.empty()) && (_delayed.begin()->first <= now))
+    {
+      _ready.push_back(_delayed.begin()->second);
+      _delayed.erase(_delayed.begin());
+    }
+
+    if (_ready.empty())
+    {
+      if (_delayed.empty())
+      {
+        pthread_cond_wait(&_cond, &_lock);
+      }
+      else
+      {
+        uint64_t retry_ms = _delayed.begin()->first;
+        struct timespec ts;
+        ts.tv_sec = retry_ms / 1000;
+        ts.tv_nsec = (retry_ms % 1000) * 1000000;
+        pthread_cond_timedwait(&_cond, &_lock, &ts);
+      }
+      continue;
+    }
+
+    std::string aor_id = _ready.front();
+    _ready.pop_front();
+    Change* change = _pending[aor_id];
+    _pending.erase(aor_id);
+    _writing.insert(aor_id);
+
+    pthread_mutex_unlock(&_lock);
+    bool success = write(aor_id, change);
+    pthread_mutex_lock(&_lock);
+
+    _writing.erase(aor_id);
+    std::unordered_map<std::string, Change*>::iterator later = _pending.find(aor_id);
+
+    if (success)
+    {
+      uint_fast64_t lag_ms = now_ms() - change->queued_ms;
+      _lag_sum_ms += lag_ms;
+      uint_fast64_t max_lag_ms = _max_lag_ms;
+      while ((lag_ms > max_lag_ms) &&
+             (!_max_lag_ms.compare_exchange_weak(max_lag_ms, lag_ms)))
+      {
+      }
+      _written++;
+      delete change;
+    }
+    else if (++change->attempts >= MAX_ATTEMPTS)
+    {
+      LOG_WARNING("Failed to replicate changes to %s after %d attempts - dropping them",
+                  aor_id.c_str(), change->attempts);
+      _dirty.insert(aor_id);
+      _dropped++;
+      delete change;
+    }
+    else
+    {
+      // Combine any changes made during the write with these ones and wait
+      // before trying again.
+      _retries++;
+      if (later != _pending.end())
+      {
+        merge(change, later->second);
+        delete later->second;
+        later->second = change;
+      }
+      else
+      {
+        _pending[aor_id] = change;
+      }
+
+      int backoff_ms = INITIAL_BACKOFF_MS << (change->attempts - 1);
+      if (backoff_ms > MAX_BACKOFF_MS)
+      {
+        backoff_ms = MAX_BACKOFF_MS;
+      }
+      LOG_DEBUG("Failed to replicate changes to %s - retry in %dms",
+                aor_id.c_str(), backoff_ms);
+      _delayed.insert(std::make_pair(now_ms() + backoff_ms, aor_id));
+
+      // Wake a thread to wait for the retry time.
+      pthread_cond_signal(&_cond);
+      continue;
+    }
+
+    if (later != _pending.end())
+    {
+      // Changes were made during the write, so they can be written now.
+      _ready.push_back(aor_id);
+      pthread_cond_signal(&_cond);
+    }
+  }
+
+  pthread_mutex_unlock(&_lock);
+}
+
+
+bool AoRReplicator::write(const std::string& aor_id, const Change* change)
+{
+  // Retry a few times straight away in case the write failed because the
+  // AoR was being changed in the remote store.
+  for (int ii = 0; ii < MAX_WRITES_PER_ATTEMPT; ++ii)
+  {
+    RegStore::AoR* aor_data = _remote_store->get_aor_data(aor_id, 0);
+    if (aor_data == NULL)
+    {
+      return false;
+    }
+
+    apply(change, aor_data);
+    bool success = _remote_store->set_aor_data(aor_id, aor_data, false, 0);
+    delete aor_data;
+
+    if (success)
+    {
+      return true;
+    }
+  }
+
+  return false;
+}
+
+
+void AoRReplicator::make_full(Change* change, const RegStore::AoR* aor_data)
+{
+  change->updated = *aor_data;
+  change->removed_bindings.clear();
+  change->removed_subscriptions.clear();
+  change->full = true;
+}
+
+
+void AoRReplicator::merge(Change* earlier, const Change* later)
+{
+  if (later->full)
+  {
+    // The later changes replace the whole AoR, so the earlier ones don't
+    // matter.
+    earlier->updated = later->updated;
+    earlier->removed_bindings.clear();
+    earlier->removed_subscriptions.clear();
+    earlier->notify_cseq = later->notify_cseq;
+    earlier->full = true;
+    return;
+  }
+
+  for (RegStore::AoR::Bindings::const_iterator i = later->updated.bindings().begin();
+       i != later->updated.bindings().end();
+       ++i)
+  {
+    copy_binding(earlier->updated.get_binding(i->first), i->second);
+    earlier->removed_bindings.erase(i->first);
+  }
+
+  for (std::set<std::string>::const_iterator i = later->removed_bindings.begin();
+       i != later->removed_bindings.end();
+       ++i)
+  {
+    earlier->updated.remove_binding(*i);
+    earlier->removed_bindings.insert(*i);
+  }
+
+  for (RegStore::AoR::Subscriptions::const_iterator i = later->updated.subscriptions().begin();
+       i != later->updated.subscriptions().end();
+       ++i)
+  {
+    *earlier->updated.get_subscription(i->first) = *i->second;
+    earlier->removed_subscriptions.erase(i->first);
+  }
+
+  for (std::set<std::string>::const_iterator i = later->removed_subscriptions.begin();
+       i != later->removed_subscriptions.end();
+       ++i)
+  {
+    earlier->updated.remove_subscription(*i);
+    earlier->removed_subscriptions.insert(*i);
+  }
+
+  earlier->notify_cseq = later->notify_cseq;
+}
+
+
+void AoRReplicator::apply(const Change* change, RegStore::AoR* aor_data)
+{
+  if (change->full)
+  {
+    // Remove the bindings and subscriptions the local AoR doesn't have.
+    std::vector<std::string> removed;
+    for (RegStore::AoR::Bindings::const_iterator i = aor_data->bindings().begin();
+         i != aor_data->bindings().end();
+         ++i)
+    {
+      if (change->updated.bindings().find(i->first) == change->updated.bindings().end())
+      {
+        removed.push_back(i->first);
+      }
+    }
+    for (std::vector<std::string>::const_iterator i = removed.begin();
+         i != removed.end();
+         ++i)
+    {
+      aor_data->remove_binding(*i);
+    }
+
+    removed.clear();
+    for (RegStore::AoR::Subscriptions::const_iterator i = aor_data->subscriptions().begin();
+         i != aor_data->subscriptions().end();
+         ++i)
+    {
+      if (change->updated.subscriptions().find(i->first) == change->updated.subscriptions().end())
+      {
+        removed.push_back(i->first);
+      }
+    }
+    for (std::vector<std::string>::const_iterator i = removed.begin();
+         i != removed.end();
+         ++i)
+    {
+      aor_data->remove_subscription(*i);
+    }
+  }
+
+  for (RegStore::AoR::Bindings::const_iterator i = change->updated.bindings().begin();
+       i != change->updated.bindings().end();
+       ++i)
+  {
+    // Keep the remote store's Chronos timer, as timers aren't replicated.
+    RegStore::AoR::Binding* b = aor_data->get_binding(i->first);
+    std::string timer_id = b->_timer_id;
+    copy_binding(b, i->second);
+    b->_timer_id = timer_id;
+  }
+
+  for (std::set<std::string>::const_iterator i = change->removed_bindings.begin();
+       i != change->removed_bindings.end();
+       ++i)
+  {
+    aor_data->remove_binding(*i);
+  }
+
+  for (RegStore::AoR::Subscriptions::const_iterator i = change->updated.subscriptions().begin();
+       i != change->updated.subscriptions().end();
+       ++i)
+  {
+    *aor_data->get_subscription(i->first) = *i->second;
+  }
+
+  for (std::set<std::string>::const_iterator i = change->removed_subscriptions.begin();
+       i != change->removed_subscriptions.end();
+       ++i)
+  {
+    aor_data->remove_subscription(*i);
+  }
+
+  if (change->notify_cseq > aor_data->_notify_cseq)
+  {
+    aor_data->_notify_cseq = change->notify_cseq;
+  }
+}
+
+
+/// Compares two bindings, ignoring the Chronos timer.
+bool AoRReplicator::same_binding(const RegStore::AoR::Binding* b1,
+                                 const RegStore::AoR::Binding* b2)
+{
+  return ((b1->_uri == b2->_uri) &&
+          (b1->_cid == b2->_cid) &&
+          (b1->_path_headers == b2->_path_headers) &&
+          (b1->_cseq == b2->_cseq) &&
+          (b1->_expires == b2->_expires) &&
+          (b1->_priority == b2->_priority) &&
+          (b1->_params == b2->_params) &&
+          (b1->_private_id == b2->_private_id) &&
+          (b1->_emergency_registration == b2->_emergency_registration));
+}
+
+
+bool AoRReplicator::same_subscription(const RegStore::AoR::Subscription* s1,
+                                      const RegStore::AoR::Subscription* s2)
+{
+  return ((s1->_req_uri == s2->_req_uri) &&
+          (s1->_from_uri == s2->_from_uri) &&
+          (s1->_from_tag == s2->_from_tag) &&
+          (s1->_to_uri == s2->_to_uri) &&
+          (s1->_to_tag == s2->_to_tag) &&
+          (s1->_cid == s2->_cid) &&
+          (s1->_route_uris == s2->_route_uris) &&
+          (s1->_expires == s2->_expires));
+}
+
+
+/// Reports the number of updates queued, the number combined with changes
+/// already waiting, the number of writes to the remote store, failed writes
+/// that will be retried, changes dropped, the number of AoRs with changes
+/// waiting, and the mean and maximum time from a change being made to it
+/// being written (in milliseconds).
+void AoRReplicator::report_stats()
+{
+  uint_fast64_t written = _written.exchange(0);
+  uint_fast64_t lag_sum_ms = _lag_sum_ms.exchange(0);
+
+  std::vector<std::string> values;
+  values.push_back(std::to_string(_queued.exchange(0)));
+  values.push_back(std::to_string(_combined.exchange(0)));
+  values.push_back(std::to_string(written));
+  values.push_back(std::to_string(_retries.exchange(0)));
+  values.push_back(std::to_string(_dropped.exchange(0)));
+  values.push_back(std::to_string(pending()));
+  values.push_back(std::to_string((written > 0) ? lag_sum_ms / written : 0));
+  values.push_back(std::to_string(_max_lag_ms.exchange(0)));
+  _statistic.report_change(values);
+}
+
+
+uint64_t AoRReplicator::now_ms()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
@@ -0,0 +1,181 @@
+/**
+ * @file aor_write_coalescer.cpp  Combines concurrent updates to the same AoR.
+ *
+ * Project Clearwater - IMS in the Cloud
+ * Copyright (C) 2014  Metaswitch Networks Ltd
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or (at your
+ * option) any later version, along with the "Special Exception" for use of
+ * the program along with SSL, set forth below. This program is distributed
+ * in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+ * without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details. You should have received a copy of the GNU General Public
+ * License along with this program.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ *
+ * The author can be reached by email at clearwater@metaswitch.com or by
+ * post at Metaswitch Networks Ltd, 100 Church St, Enfield EN2 6BQ, UK
+ *
+ * Special Exception
+ * Metaswitch Networks Ltd  grants you permission to copy, modify,
+ * propagate, and distribute a work formed by combining OpenSSL with The
+ * Software, or a work derivative of such a combination, even if such
+ * copying, modification, propagation, or distribution would otherwise
+ * violate the terms of the GPL. You must comply with the GPL in all
+ * respects for all of the code used other than OpenSSL.
+ * "OpenSSL" means OpenSSL toolkit software distributed by the OpenSSL
+ * Project and licensed under the OpenSSL Licenses, or a work based on such
+ * software and licensed under the OpenSSL Licenses.
+ * "OpenSSL Licenses" means the OpenSSL License and Original SSLeay License
+ * under which the OpenSSL Project distributes the OpenSSL toolkit software,
+ * as those licenses appear in the file LICENSE-OPENSSL.
+ */
+
+#include "aor_write_coalescer.h"
+#include "stack.h"
+#include "log.h"
+
+const int AoRWriteCoalescer::NUM_SHARDS;
+
+AoRWriteCoalescer::AoRWriteCoalescer(LastValueCache* stats_aggregator) :
+  _updates(0),
+  _batches(0),
+  _max_batch_size(0),
+  _statistic("aor_write_coalescing", stats_aggregator)
+{
+  for (int ii = 0; ii < NUM_SHARDS; ++ii)
+  {
+    pthread_mutex_init(&_shards[ii].lock, NULL);
+    pthread_cond_init(&_shards[ii].cond, NULL);
+  }
+
+  add_stats_reporter(this, [this]() { report_stats(); });
+}
+
+
+AoRWriteCoalescer::~AoRWriteCoalescer()
+{
+  remove_stats_reporter(this);
+
+  for (int ii = 0; ii < NUM_SHARDS; ++ii)
+  {
+    pthread_cond_destroy(&_shards[ii].cond);
+    pthread_mutex_destroy(&_shards[ii].lock);
+  }
+}
+
+
+void AoRWriteCoalescer::update(const std::string& aor_id,
+                               RegStore::Update& update,
+                               const Writer& writer)
+{
+  Shard& s = shard(aor_id);
+  Waiter waiter = {&update, false};
+  bool blocked = false;
+
+  pthread_mutex_lock(&s.lock);
+
+  // References to map elements stay valid as other elements are added.  The
+  // slot is only removed once it has no queued updates, so it remains valid
+  // until this update is done.
+  Slot& slot = s.slots[aor_id];
+  slot.queue.push_back(&waiter);
+
+  while (!waiter.done)
+  {
+    if ((!slot.writing) && (slot.queue.front() == &waiter))
+    {
+      // No write is in progress and this is the oldest queued update, so
+      // make all the queued updates.
+      std::vector<Waiter*> waiters;
+      waiters.swap(slot.queue);
+      slot.writing = true;
+      pthread_mutex_unlock(&s.lock);
+
+      if (waiters.size() > 1)
+      {
+        LOG_DEBUG("Combining %d updates to AoR %s",
+                  (int)waiters.size(), aor_id.c_str());
+      }
+
+      std::vector<RegStore::Update*> batch;
+      for (std::vector<Waiter*>::iterator i = waiters.begin();
+           i != waiters.end();
+           ++i)
+      {
+        batch.push_back((*i)->update);
+      }
+      writer(batch);
+
+      _updates += batch.size();
+      _batches++;
+      uint_fast64_t max_batch_size = _max_batch_size;
+      while ((batch.size() > max_batch_size) &&
+             (!_max_batch_size.compare_exchange_weak(max_batch_size,
+                                                     batch.size())))
+      {
+      }
+
+      pthread_mutex_lock(&s.lock);
+      for (std::vector<Waiter*>::iterator i = waiters.begin();
+           i != waiters.end();
+           ++i)
+      {
+        (*i)->done = true;
+      }
+      slot.writing = false;
+
+      if (slot.queue.empty())
+      {
+        s.slots.erase(aor_id);
+      }
+
+      // Wake the updates in this batch, and the thread with the oldest
+      // update queued since the batch started.
+      pthread_cond_broadcast(&s.cond);
+    }
+    else
+    {
+      if (!blocked)
+      {
+        worker_blocked(true);
+        blocked = true;
+      }
+      pthread_cond_wait(&s.cond, &s.lock);
+    }
+  }
+
+  pthread_mutex_unlock(&s.lock);
+
+  if (blocked)
+  {
+    worker_blocked(false);
+  }
+}
+
+
+/// Reports the number of updates, the number of read-modify-writes made for
+/// them, the largest batch and the number of store round trips saved (each
+/// update combined with another saves a read and a write).
+void AoRWriteCoalescer::report_stats()
+{
+  uint_fast64_t updates = _updates.exchange(0);
+  uint_fast64_t batches = _batches.exchange(0);
+
+  std::vector<std::string> values;
+  values.push_back(std::to_string(updates));
+  values.push_back(std::to_string(batches));
+  values.push_back(std::to_string(_max_batch_size.exchange(0)));
+  values.push_back(std::to_string((updates > batches) ?
+                                    (updates - batches) * 2 : 0));
+  _statistic.report_change(values);
+}
+
+
+AoRWriteCoalescer::Shard& AoRWriteCoalescer::shard(const std::string& aor_id)
+{
+  return _shards[std::hash<std::string>()(aor_id) % NUM_SHARDS];
+}
@@ -0,0 +1,217 @@
+/**
+ * @file async_dispatcher.cpp  Thread pool for blocking operations.
+ *
+ * Project Clearwater - IMS in the Cloud
+ * Copyright (C) 2014  Metaswitch Networks Ltd
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or (at your
+ * option) any later version, along with the "Special Exception" for use of
+ * the program along with SSL, set forth below. This program is distributed
+ * in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+ * without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details. You should have received a copy of the GNU General Public
+ * License along with this program.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ *
+ * The author can be reached by email at clearwater@metaswitch.com or by
+ * post at Metaswitch Networks Ltd, 100 Church St, Enfield EN2 6BQ, UK
+ *
+ * Special Exception
+ * Metaswitch Networks Ltd  grants you permission to copy, modify,
+ * propagate, and distribute a work formed by combining OpenSSL with The
+ * Software, or a work derivative of such a combination, even if such
+ * copying, modification, propagation, or distribution would otherwise
+ * violate the terms of the GPL. You must comply with the GPL in all
+ * respects for all of the code used other than OpenSSL.
+ * "OpenSSL" means OpenSSL toolkit software distributed by the OpenSSL
+ * Project and licensed under the OpenSSL Licenses, or a work based on such
+ * software and licensed under the OpenSSL Licenses.
+ * "OpenSSL Licenses" means the OpenSSL License and Original SSLeay License
+ * under which the OpenSSL Project distributes the OpenSSL toolkit software,
+ * as those licenses appear in the file LICENSE-OPENSSL.
+ */
+
+extern "C" {
+#include <pjlib.h>
+}
+
+#include "async_dispatcher.h"
+#include "stack.h"
+#include "log.h"
+
+AsyncDispatcher::AsyncDispatcher(int num_threads) :
+  _q(),
+  _stopped(false),
+  _threads()
+{
+  pthread_mutex_init(&_lock, NULL);
+  pthread_cond_init(&_cond, NULL);
+
+  for (int ii = 0; ii < num_threads; ++ii)
+  {
+    pthread_t thread;
+    int rc = pthread_create(&thread, NULL, thread_func, (void*)this);
+    if (rc != 0)
+    {
+      LOG_ERROR("Failed to create asynchronous dispatcher thread (%d)", rc);
+    }
+    else
+    {
+      _threads.push_back(thread);
+    }
+  }
+
+  LOG_STATUS("Started %d asynchronous dispatcher threads", _threads.size());
+}
+
+
+AsyncDispatcher::~AsyncDispatcher()
+{
+  stop();
+
+  pthread_cond_destroy(&_cond);
+  pthread_mutex_destroy(&_lock);
+}
+
+
+void AsyncDispatcher::dispatch(const std::function<void()>& operation,
+                               const std::function<void()>& completion)
+{
+  if (_threads.empty())
+  {
+    // There are no threads to run the operation, so run it inline.
+    operation();
+    if (completion)
+    {
+      completion();
+    }
+    return;
+  }
+
+  Operation* op = new Operation;
+  op->operation = operation;
+  op->completion = completion;
+
+  pthread_mutex_lock(&_lock);
+  bool stopped = _stopped;
+  if (!stopped)
+  {
+    _q.push_back(op);
+    pthread_cond_signal(&_cond);
+  }
+  pthread_mutex_unlock(&_lock);
+
+  if (stopped)
+  {
+    // We're shutting down, so fail the operation straight away.
+    LOG_DEBUG("Asynchronous dispatcher stopped, skipping operation");
+    complete(op);
+  }
+}
+
+
+void AsyncDispatcher::stop()
+{
+  pthread_mutex_lock(&_lock);
+  bool stopped = _stopped;
+  _stopped = true;
+  pthread_cond_broadcast(&_cond);
+  pthread_mutex_unlock(&_lock);
+
+  if (stopped)
+  {
+    return;
+  }
+
+  for (std::vector<pthread_t>::iterator i = _threads.begin();
+       i != _threads.end();
+       ++i)
+  {
+    pthread_join(*i, NULL);
+  }
+
+  // The threads have exited, so no-one else is using the queue.  Skip the
+  // operations that didn't get a thread, but still complete them so their
+  // transactions aren't left parked.
+  LOG_STATUS("Asynchronous dispatcher stopped with %d operations queued",
+             _q.size());
+
+  while (!_q.empty())
+  {
+    complete(_q.front());
+    _q.pop_front();
+  }
+}
+
+
+int AsyncDispatcher::queue_size()
+{
+  pthread_mutex_lock(&_lock);
+  int size = _q.size();
+  pthread_mutex_unlock(&_lock);
+  return size;
+}
+
+
+void* AsyncDispatcher::thread_func(void* p)
+{
+  // The completions are posted to the worker threads, but are run inline if
+  // the worker threads have stopped, so the thread must be registered with
+  // PJSIP.
+  pj_thread_desc desc;
+  pj_thread_t* thread;
+  if (!pj_thread_is_registered())
+  {
+    pj_status_t status = pj_thread_register("AsyncDispatcher", desc, &thread);
+    if (status != PJ_SUCCESS)
+    {
+      // LCOV_EXCL_START
+      LOG_ERROR("Failed to register asynchronous dispatcher thread with PJSIP");
+      // LCOV_EXCL_STOP
+    }
+  }
+
+  ((AsyncDispatcher*)p)->run();
+  return NULL;
+}
+
+
+void AsyncDispatcher::run()
+{
+  while (true)
+  {
+    pthread_mutex_lock(&_lock);
+    while ((!_stopped) && (_q.empty()))
+    {
+      pthread_cond_wait(&_cond, &_lock);
+    }
+
+    if (_stopped)
+    {
+      pthread_mutex_unlock(&_lock);
+      break;
+    }
+
+    Operation* op = _q.front();
+    _q.pop_front();
+    pthread_mutex_unlock(&_lock);
+
+    op->operation();
+    complete(op);
+  }
+}
+
+
+void AsyncDispatcher::complete(Operation* op)
+{
+  if (op->completion)
+  {
+    // Hand the completion back to the worker threads.
+    post_to_worker(op->completion);
+  }
+
+  delete op;
+}
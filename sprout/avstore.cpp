@@ -42,6 +42,7 @@
 #include "avstore.h"
 #include "sas.h"
 #include "sproutsasevent.h"
+#include "stack.h"
 
 AvStore::AvStore(Store* data_store) :
   _data_store(data_store)
@@ -64,7 +65,9 @@ bool AvStore::set_av(const std::string& impi,
   Json::FastWriter writer;
   std::string data = writer.write(*av);
   LOG_DEBUG("Set AV for %s\n%s", key.c_str(), data.c_str());
+  worker_blocked(true);
   Store::Status status = _data_store->set_data("av", key, data, cas, AV_EXPIRY, trail);
+  worker_blocked(false);
   std::string operation = "SET";
   if (status != Store::Status::OK)
   {
@@ -97,7 +100,9 @@ Json::Value* AvStore::get_av(const std::string& impi,
   Json::Value* av = NULL;
   std::string key = impi + '\\' + nonce;
   std::string data;
+  worker_blocked(true);
   Store::Status status = _data_store->get_data("av", key, data, cas, trail);
+  worker_blocked(false);
   std::string operation = "GET";
 
   if (status == Store::Status::OK)
@@ -0,0 +1,432 @@
+/**
+ * @file chronos_timer_batcher.cpp  Batching of Chronos timer updates.
+ *
+ * Project Clearwater - IMS in the Cloud
+ * Copyright (C) 2014  Metaswitch Networks Ltd
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or (at your
+ * option) any later version, along with the "Special Exception" for use of
+ * the program along with SSL, set forth below. This program is distributed
+ * in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+ * without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details. You should have received a copy of the GNU General Public
+ * License along with this program.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ *
+ * The author can be reached by email at clearwater@metaswitch.com or by
+ * post at Metaswitch Networks Ltd, 100 Church St, Enfield EN2 6BQ, UK
+ *
+ * Special Exception
+ * Metaswitch Networks Ltd  grants you permission to copy, modify,
+ * propagate, and distribute a work formed by combining OpenSSL with The
+ * Software, or a work derivative of such a combination, even if such
+ * copying, modification, propagation, or distribution would otherwise
+ * violate the terms of the GPL. You must comply with the GPL in all
+ * respects for all of the code used other than OpenSSL.
+ * "OpenSSL" means OpenSSL toolkit software distributed by the OpenSSL
+ * Project and licensed under the OpenSSL Licenses, or a work based on such
+ * software and licensed under the OpenSSL Licenses.
+ * "OpenSSL Licenses" means the OpenSSL License and Original SSLeay License
+ * under which the OpenSSL Project distributes the OpenSSL toolkit software,
+ * as those licenses appear in the file LICENSE-OPENSSL.
+ */
+
+#include <time.h>
+
+#include "chronos_timer_batcher.h"
+#include "stack.h"
+#include "log.h"
+
+ChronosTimerBatcher::ChronosTimerBatcher(ChronosConnection* chronos,
+                                         int window_ms,
+                                         int max_batch_size,
+                                         int num_threads,
+                                         int max_pending,
+                                         LastValueCache* stats_aggregator) :
+  _chronos(chronos),
+  _window_ms(window_ms),
+  _max_batch_size((max_batch_size > 0) ? max_batch_size : 1),
+  _max_pending(max_pending),
+  _terminated(false),
+  _queued(0),
+  _combined(0),
+  _sent(0),
+  _failed(0),
+  _overflowed(0),
+  _batches(0),
+  _batched(0),
+  _max_batch(0),
+  _max_depth(0),
+  _statistic("chronos_timer_batching", stats_aggregator)
+{
+  pthread_mutex_init(&_lock, NULL);
+
+  // Operations are timed on the monotonic clock, so the condition must use
+  // it too.
+  pthread_condattr_t cond_attr;
+  pthread_condattr_init(&cond_attr);
+  pthread_condattr_setclock(&cond_attr, CLOCK_MONOTONIC);
+  pthread_cond_init(&_cond, &cond_attr);
+  pthread_condattr_destroy(&cond_attr);
+
+  // There must be at least one thread, or queued operations would never be
+  // sent.
+  num_threads = (num_threads > 0) ? num_threads : 1;
+
+  for (int ii = 0; ii < num_threads; ++ii)
+  {
+    pthread_t thread;
+    int rc = pthread_create(&thread, NULL, thread_func, (void*)this);
+    if (rc != 0)
+    {
+      LOG_ERROR("Failed to create Chronos timer batching thread (%d)", rc);
+    }
+    else
+    {
+      _threads.push_back(thread);
+    }
+  }
+
+  LOG_STATUS("Started %d Chronos timer batching threads with a %dms window",
+             _threads.size(), _window_ms);
+
+  add_stats_reporter(this, [this]() { report_stats(); });
+}
+
+
+ChronosTimerBatcher::~ChronosTimerBatcher()
+{
+  remove_stats_reporter(this);
+
+  // The threads send any operations still waiting before they exit.
+  pthread_mutex_lock(&_lock);
+  _terminated = true;
+  pthread_cond_broadcast(&_cond);
+  pthread_mutex_unlock(&_lock);
+
+  for (std::vector<pthread_t>::iterator i = _threads.begin();
+       i != _threads.end();
+       ++i)
+  {
+    pthread_join(*i, NULL);
+  }
+
+  for (std::unordered_map<std::string, Operation*>::iterator i = _pending.begin();
+       i != _pending.end();
+       ++i)
+  {
+    delete i->second;
+  }
+
+  pthread_cond_destroy(&_cond);
+  pthread_mutex_destroy(&_lock);
+}
+
+
+void ChronosTimerBatcher::set_timer(const std::string& timer_id,
+                                    int expires,
+                                    const std::string& callback_uri,
+                                    const std::string& opaque,
+                                    const IdChangedCallback& id_changed,
+                                    SAS::TrailId trail)
+{
+  Operation* op = new Operation();
+  op->is_delete = false;
+  op->timer_id = timer_id;
+  op->expires = expires;
+  op->callback_uri = callback_uri;
+  op->opaque = opaque;
+  op->id_changed = id_changed;
+  op->trail = trail;
+  queue(op);
+}
+
+
+void ChronosTimerBatcher::delete_timer(const std::string& timer_id,
+                                       SAS::TrailId trail)
+{
+  Operation* op = new Operation();
+  op->is_delete = true;
+  op->timer_id = timer_id;
+  op->expires = 0;
+  op->trail = trail;
+  queue(op);
+}
+
+
+int ChronosTimerBatcher::pending()
+{
+  pthread_mutex_lock(&_lock);
+  int pending = _pending.size();
+  pthread_mutex_unlock(&_lock);
+  return pending;
+}
+
+
+void ChronosTimerBatcher::queue(Operation* op)
+{
+  _queued++;
+
+  pthread_mutex_lock(&_lock);
+
+  std::unordered_map<std::string, Operation*>::iterator i = _pending.find(op->timer_id);
+  if (i != _pending.end())
+  {
+    // There's already an operation on this timer waiting, so this one
+    // replaces it.
+    delete i->second;
+    i->second = op;
+    _combined++;
+  }
+  else if ((_pending.size() >= _max_pending) &&
+           (_sending.find(op->timer_id) == _sending.end()))
+  {
+    // Too many operations are waiting, so send this one now.  (Operations
+    // on timers being sent are still queued, to keep them in order.)
+    pthread_mutex_unlock(&_lock);
+    LOG_DEBUG("Too many Chronos operations waiting - sending operation on %s directly",
+              op->timer_id.c_str());
+    _overflowed++;
+    worker_blocked(true);
+    send(op);
+    worker_blocked(false);
+    delete op;
+    return;
+  }
+  else
+  {
+    _pending[op->timer_id] = op;
+    _queue.push_back(std::make_pair(op->timer_id, now_ms()));
+
+    uint_fast64_t depth = _pending.size();
+    uint_fast64_t max_depth = _max_depth;
+    while ((depth > max_depth) &&
+           (!_max_depth.compare_exchange_weak(max_depth, depth)))
+    {
+    }
+
+    // Threads only need waking if they're waiting for the queue to become
+    // non-empty, or there's now a full batch to send.
+    if ((_queue.size() == 1) || (_queue.size() == _max_batch_size))
+    {
+      pthread_cond_signal(&_cond);
+    }
+  }
+
+  pthread_mutex_unlock(&_lock);
+}
+
+
+void* ChronosTimerBatcher::thread_func(void* p)
+{
+  // Updating a timer's ID writes to the registration store, which can send
+  // NOTIFYs, so the thread must be registered with PJSIP.
+  pj_thread_desc desc;
+  pj_thread_t* thread;
+  if (!pj_thread_is_registered())
+  {
+    pj_status_t status = pj_thread_register("ChronosTimerBatcher", desc, &thread);
+    if (status != PJ_SUCCESS)
+    {
+      // LCOV_EXCL_START
+      LOG_ERROR("Failed to register Chronos timer batching thread with PJSIP");
+      // LCOV_EXCL_STOP
+    }
+  }
+
+  ((ChronosTimerBatcher*)p)->run();
+  return NULL;
+}
+
+
+void ChronosTimerBatcher::run()
+{
+  std::vector<Operation*> batch;
+
+  pthread_mutex_lock(&_lock);
+
+  while (true)
+  {
+    if (_queue.empty())
+    {
+      if (_terminated)
+      {
+        break;
+      }
+      pthread_cond_wait(&_cond, &_lock);
+      continue;
+    }
+
+    // Send everything that's waiting if there's a full batch or we're
+    // shutting down, otherwise only operations that have waited for the
+    // whole window.
+    uint64_t now = now_ms();
+    bool send_all = (_terminated) || (_queue.size() >= _max_batch_size);
+
+    for (std::deque<std::pair<std::string, uint64_t> >::iterator i = _queue.begin();
+         (i != _queue.end()) && (batch.size() < _max_batch_size);
+        )
+    {
+      if ((!send_all) && (i->second + _window_ms > now))
+      {
+        // Later operations were queued more recently, so aren't due either.
+        break;
+      }
+
+      if (_sending.find(i->first) != _sending.end())
+      {
+        // An earlier operation on this timer is being sent, so wait for it.
+        ++i;
+        continue;
+      }
+
+      batch.push_back(_pending[i->first]);
+      _pending.erase(i->first);
+      _sending.insert(i->first);
+      i = _queue.erase(i);
+    }
+
+    if (batch.empty())
+    {
+      if ((send_all) || (_queue.front().second + _window_ms <= now))
+      {
+        // The operations that are due are all waiting for earlier ones to
+        // be sent.
+        pthread_cond_wait(&_cond, &_lock);
+      }
+      else
+      {
+        uint64_t due_ms = _queue.front().second + _window_ms;
+        struct timespec ts;
+        ts.tv_sec = due_ms / 1000;
+        ts.tv_nsec = (due_ms % 1000) * 1000000;
+        pthread_cond_timedwait(&_cond, &_lock, &ts);
+      }
+      continue;
+    }
+
+    pthread_mutex_unlock(&_lock);
+
+    for (std::vector<Operation*>::iterator i = batch.begin();
+         i != batch.end();
+         ++i)
+    {
+      send(*i);
+    }
+
+    _batches++;
+    _batched += batch.size();
+    uint_fast64_t batch_size = batch.size();
+    uint_fast64_t max_batch = _max_batch;
+    while ((batch_size > max_batch) &&
+           (!_max_batch.compare_exchange_weak(max_batch, batch_size)))
+    {
+    }
+
+    pthread_mutex_lock(&_lock);
+
+    bool later_ops = false;
+    for (std::vector<Operation*>::iterator i = batch.begin();
+         i != batch.end();
+         ++i)
+    {
+      _sending.erase((*i)->timer_id);
+      later_ops = later_ops || (_pending.find((*i)->timer_id) != _pending.end());
+      delete *i;
+    }
+    batch.clear();
+
+    if (later_ops)
+    {
+      // Operations were queued on these timers while they were being sent,
+      // and other threads may be waiting to send them.
+      pthread_cond_broadcast(&_cond);
+    }
+  }
+
+  pthread_mutex_unlock(&_lock);
+}
+
+
+bool ChronosTimerBatcher::send(Operation* op)
+{
+  HTTPCode status;
+  _sent++;
+
+  if (op->is_delete)
+  {
+    status = _chronos->send_delete(op->timer_id, op->trail);
+  }
+  else
+  {
+    // Work out the interval now, as the operation may have waited a while.
+    // If the timer is already due, it pops straight away.
+    int interval = op->expires - time(NULL);
+    if (interval < 0)
+    {
+      interval = 0;
+    }
+
+    std::string timer_id = op->timer_id;
+    status = _chronos->send_put(timer_id,
+                                interval,
+                                op->callback_uri,
+                                op->opaque,
+                                op->trail);
+
+    if ((status == HTTP_OK) &&
+        (timer_id != op->timer_id) &&
+        (op->id_changed))
+    {
+      op->id_changed(timer_id);
+    }
+  }
+
+  if (status != HTTP_OK)
+  {
+    // As when the operations are sent directly, a failure is left for the
+    // next update to the timer to put right.
+    LOG_DEBUG("Chronos operation on timer %s failed (%d)",
+              op->timer_id.c_str(), status);
+    _failed++;
+    return false;
+  }
+
+  return true;
+}
+
+
+/// Reports the number of operations queued, the number combined with an
+/// operation already waiting, the number of requests sent to Chronos, the
+/// number that failed, the number sent directly because the queue was
+/// full, the number of batches, the mean and maximum batch size, the number
+/// of operations waiting and the maximum number waiting.
+void ChronosTimerBatcher::report_stats()
+{
+  uint_fast64_t batches = _batches.exchange(0);
+  uint_fast64_t batched = _batched.exchange(0);
+
+  std::vector<std::string> values;
+  values.push_back(std::to_string(_queued.exchange(0)));
+  values.push_back(std::to_string(_combined.exchange(0)));
+  values.push_back(std::to_string(_sent.exchange(0)));
+  values.push_back(std::to_string(_failed.exchange(0)));
+  values.push_back(std::to_string(_overflowed.exchange(0)));
+  values.push_back(std::to_string(batches));
+  values.push_back(std::to_string((batches > 0) ? batched / batches : 0));
+  values.push_back(std::to_string(_max_batch.exchange(0)));
+  values.push_back(std::to_string(pending()));
+  values.push_back(std::to_string(_max_depth.exchange(0)));
+  _statistic.report_change(values);
+}
+
+
+uint64_t ChronosTimerBatcher::now_ms()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
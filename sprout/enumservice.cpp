@@ -53,7 +53,7 @@ const boost::regex EnumService::CHARS_TO_STRIP_FROM_UAS = boost::regex("([^0-9+]
 const boost::regex DNSEnumService::CHARS_TO_STRIP_FROM_DOMAIN = boost::regex("[^0-9]");
 
 
-bool EnumService::parse_regex_replace(const std::string& regex_replace, boost::regex& regex, std::string& replace)
+bool EnumService::parse_regex_replace(const std::string& regex_replace, RegexCache::Regex& regex, std::string& replace)
 {
   bool success = false;
 
@@ -67,16 +67,9 @@ bool EnumService::parse_regex_replace(const std::string& regex_replace, boost::r
   if (match_replace.size() == 2)
   {
     LOG_DEBUG("Split regex into match=%s, replace=%s", match_replace[0].c_str(), match_replace[1].c_str());
-    try
-    {
-      regex.assign(match_replace[0]);
-      replace = match_replace[1];
-      success = true;
-    }
-    catch (...)
-    {
-      success = false;
-    }
+    regex = RegexCache::compile(match_replace[0]);
+    replace = match_replace[1];
+    success = (regex != NULL);
   }
   else
   {
@@ -204,7 +197,7 @@ std::string JSONEnumService::lookup_uri_from_user(const std::string &user, SAS::
   // URI.
   try
   {
-    uri = boost::regex_replace(aus, pfix->match, pfix->replace);
+    uri = boost::regex_replace(aus, *pfix->match, pfix->replace);
   }
   catch(...) // LCOV_EXCL_START Only throws if expression too complex or similar hard-to-hit conditions
   {
@@ -447,7 +440,7 @@ void DNSEnumService::parse_naptr_reply(const struct ares_naptr_reply* naptr_repl
     if ((strcasecmp((char*)record->service, "e2u+sip") == 0) ||
         (strcasecmp((char*)record->service, "e2u+pstn:sip") == 0))
     {
-      boost::regex regex;
+      RegexCache::Regex regex;
       std::string replace;
       bool terminal = false;
 
@@ -483,7 +476,7 @@ void DNSEnumService::parse_naptr_reply(const struct ares_naptr_reply* naptr_repl
 }
 
 
-DNSEnumService::Rule::Rule(const boost::regex& regex,
+DNSEnumService::Rule::Rule(const RegexCache::Regex& regex,
                            const std::string& replace,
                            bool terminal,
                            int order,
@@ -500,12 +493,12 @@ DNSEnumService::Rule::Rule(const boost::regex& regex,
 std::string DNSEnumService::Rule::replace(const std::string& string, SAS::TrailId trail) const
 {
   // Perform the match and replace.
-  std::string result = boost::regex_replace(string, _regex, _replace);
+  std::string result = boost::regex_replace(string, *_regex, _replace);
   // Log the results.
   SAS::Event event(trail, SASEvent::ENUM_MATCH, 0);
   event.add_static_param(_terminal);
   event.add_var_param(string);
-  event.add_var_param(_regex.str());
+  event.add_var_param(_regex->str());
   event.add_var_param(_replace);
   event.add_var_param(result);
   SAS::report_event(event);
@@ -53,11 +53,14 @@ extern "C" {
 static bool reg_store_access_common(RegStore::AoR** aor_data, bool& previous_aor_data_alloced,
                                     std::string aor_id, RegStore* current_store,
                                     RegStore* remote_store, RegStore::AoR** previous_aor_data,
-                                    SAS::TrailId trail)
+                                    SAS::TrailId trail,
+                                    RegStore::AoR* prefetched_aor_data = NULL)
 {
-  // Find the current bindings for the AoR.
+  // Find the current bindings for the AoR, unless they have already been
+  // read as part of a batch.
   delete *aor_data;
-  *aor_data = current_store->get_aor_data(aor_id, trail);
+  *aor_data = (prefetched_aor_data != NULL) ?
+                prefetched_aor_data : current_store->get_aor_data(aor_id, trail);
   LOG_DEBUG("Retrieved AoR data %p", *aor_data);
 
   if (*aor_data == NULL)
@@ -243,8 +246,10 @@ void RegistrationTimeoutTask::handle_response()
   if (aor_data != NULL)
   {
     // If we have a remote store, try to store this there too.  We don't worry
-    // about failures in this case.
-    if (_cfg->_remote_store != NULL)
+    // about failures in this case.  If the local store replicates updates,
+    // there is nothing to replicate - the only change is to remove expired
+    // bindings, which the remote store does itself whenever the AoR is read.
+    if ((_cfg->_remote_store != NULL) && (!_cfg->_store->replicates()))
     {
       bool ignored;
       RegStore::AoR* remote_aor_data = set_aor_data(_cfg->_remote_store, _aor_id, aor_data, NULL, false, ignored);
@@ -271,9 +276,12 @@ RegStore::AoR* RegistrationTimeoutTask::set_aor_data(RegStore* current_store,
 {
   RegStore::AoR* aor_data = NULL;
   bool previous_aor_data_alloced = false;
+  int cas_retries = -1;
 
   do
   {
+    ++cas_retries;
+
     if (!reg_store_access_common(&aor_data, previous_aor_data_alloced, aor_id,
                                  current_store, remote_store, &previous_aor_data, trail()))
     {
@@ -284,6 +292,11 @@ RegStore::AoR* RegistrationTimeoutTask::set_aor_data(RegStore* current_store,
   }
   while (!current_store->set_aor_data(aor_id, aor_data, is_primary, trail(), all_bindings_expired));
 
+  if (aor_data != NULL)
+  {
+    RegStore::record_cas_retries(RegStore::OP_BINDING_TIMEOUT, cas_retries);
+  }
+
   // If we allocated the AoR, tidy up.
   if (previous_aor_data_alloced)
   {
@@ -391,15 +404,32 @@ HTTPCode DeregistrationTask::parse_request(std::string body)
 
 HTTPCode DeregistrationTask::handle_request()
 {
+  // Read all the AoRs from the local store up front, so the reads can be
+  // made concurrently rather than one at a time.
+  std::vector<std::string> aor_ids;
   for (std::map<std::string, std::string>::iterator it=_bindings.begin(); it!=_bindings.end(); ++it)
   {
-    RegStore::AoR* aor_data = set_aor_data(_cfg->_store, it->first, it->second, NULL, _cfg->_remote_store, true);
+    aor_ids.push_back(it->first);
+
+    // Homestead has deregistered the subscriber, so any cached profile is out
+    // of date.
+    _cfg->_hss->invalidate_cached_profile(it->first);
+  }
+  std::vector<RegStore::AoR*> prefetched_aor_data;
+  _cfg->_store->get_aor_data_batch(aor_ids, prefetched_aor_data, trail());
+
+  size_t ii = 0;
+  for (std::map<std::string, std::string>::iterator it=_bindings.begin(); it!=_bindings.end(); ++it, ++ii)
+  {
+    RegStore::AoR* aor_data = set_aor_data(_cfg->_store, it->first, it->second, NULL, _cfg->_remote_store, true, prefetched_aor_data[ii]);
+    prefetched_aor_data[ii] = NULL;
 
     if (aor_data != NULL)
     {
-      // If we have a remote store, try to store this there too.  We don't worry
-      // about failures in this case.
-      if (_cfg->_remote_store != NULL)
+      // If we have a remote store, try to store this there too (unless the
+      // local store replicates the update itself).  We don't worry about
+      // failures in this case.
+      if ((_cfg->_remote_store != NULL) && (!_cfg->_store->replicates()))
       {
         RegStore::AoR* remote_aor_data = set_aor_data(_cfg->_remote_store, it->first, it->second, aor_data, NULL, false);
         delete remote_aor_data;
@@ -414,6 +444,10 @@ HTTPCode DeregistrationTask::handle_request()
       // LCOV_EXCL_START - local store (used in testing) never fails
       LOG_WARNING("Unable to connect to memcached for AoR %s", it->first.c_str());
       delete aor_data;
+      for (++ii; ii < prefetched_aor_data.size(); ++ii)
+      {
+        delete prefetched_aor_data[ii];
+      }
       return HTTP_SERVER_ERROR;
       // LCOV_EXCL_STOP
     }
@@ -429,22 +463,36 @@ RegStore::AoR* DeregistrationTask::set_aor_data(RegStore* current_store,
                                                 std::string private_id,
                                                 RegStore::AoR* previous_aor_data,
                                                 RegStore* remote_store,
-                                                bool is_primary)
+                                                bool is_primary,
+                                                RegStore::AoR* prefetched_aor_data)
 {
   RegStore::AoR* aor_data = NULL;
+  RegStore::AoR* original_aor_data = NULL;
   bool previous_aor_data_alloced = false;
   bool all_bindings_expired = false;
+  int cas_retries = -1;
 
   do
   {
+    ++cas_retries;
+
+    // The prefetched data (if any) is only valid for the first attempt.
     if (!reg_store_access_common(&aor_data, previous_aor_data_alloced, aor_id,
-                                 current_store, remote_store, &previous_aor_data, trail()))
+                                 current_store, remote_store, &previous_aor_data, trail(),
+                                 (cas_retries == 0) ? prefetched_aor_data : NULL))
     {
       // LCOV_EXCL_START - local store (used in testing) never fails
       break;
       // LCOV_EXCL_STOP
     }
 
+    if (current_store->replicates())
+    {
+      // Keep the AoR as read, to find the changes to replicate.
+      delete original_aor_data;
+      original_aor_data = new RegStore::AoR(*aor_data);
+    }
+
     std::vector<std::string> binding_ids;
 
     for (RegStore::AoR::Bindings::const_iterator i = aor_data->bindings().begin();
@@ -487,6 +535,17 @@ RegStore::AoR* DeregistrationTask::set_aor_data(RegStore* current_store,
   }
   while (!current_store->set_aor_data(aor_id, aor_data, is_primary, trail(), all_bindings_expired));
 
+  if (aor_data != NULL)
+  {
+    RegStore::record_cas_retries(RegStore::OP_DEREGISTER, cas_retries);
+
+    if (original_aor_data != NULL)
+    {
+      current_store->replicate(aor_id, original_aor_data, aor_data);
+    }
+  }
+  delete original_aor_data;
+
   if (private_id == "")
   {
     // Deregister with any application servers
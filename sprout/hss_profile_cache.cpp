@@ -0,0 +1,156 @@
+/**
+ * @file hss_profile_cache.cpp  Node-wide cache of subscriber profiles read from Homestead.
+ *
+ * Project Clearwater - IMS in the Cloud
+ * Copyright (C) 2014  Metaswitch Networks Ltd
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or (at your
+ * option) any later version, along with the "Special Exception" for use of
+ * the program along with SSL, set forth below. This program is distributed
+ * in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+ * without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details. You should have received a copy of the GNU General Public
+ * License along with this program.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ *
+ * The author can be reached by email at clearwater@metaswitch.com or by
+ * post at Metaswitch Networks Ltd, 100 Church St, Enfield EN2 6BQ, UK
+ *
+ * Special Exception
+ * Metaswitch Networks Ltd  grants you permission to copy, modify,
+ * propagate, and distribute a work formed by combining OpenSSL with The
+ * Software, or a work derivative of such a combination, even if such
+ * copying, modification, propagation, or distribution would otherwise
+ * violate the terms of the GPL. You must comply with the GPL in all
+ * respects for all of the code used other than OpenSSL.
+ * "OpenSSL" means OpenSSL toolkit software distributed by the OpenSSL
+ * Project and licensed under the OpenSSL Licenses, or a work based on such
+ * software and licensed under the OpenSSL Licenses.
+ * "OpenSSL Licenses" means the OpenSSL License and Original SSLeay License
+ * under which the OpenSSL Project distributes the OpenSSL toolkit software,
+ * as those licenses appear in the file LICENSE-OPENSSL.
+ */
+
+#include <algorithm>
+
+#include "hss_profile_cache.h"
+#include "hssconnection.h"
+#include "stack.h"
+#include "log.h"
+
+HSSProfileCache::HSSProfileCache(int max_entries,
+                                 int ttl_ms,
+                                 int max_ttl_ms,
+                                 LastValueCache* stats_aggregator) :
+  _cache(max_entries, ttl_ms),
+  _max_ttl_ms(max_ttl_ms),
+  _statistic("hss_profile_cache", stats_aggregator)
+{
+  add_stats_reporter(this, [this]() { report_stats(); });
+}
+
+
+HSSProfileCache::~HSSProfileCache()
+{
+  remove_stats_reporter(this);
+}
+
+
+bool HSSProfileCache::get(const std::string& public_user_identity,
+                          bool registered_only,
+                          Profile& profile,
+                          uint64_t& generation)
+{
+  std::function<bool(const Profile&)> usable;
+  if (registered_only)
+  {
+    usable = [](const Profile& p)
+             { return (p.regstate == HSSConnection::STATE_REGISTERED); };
+  }
+
+  return _cache.get(public_user_identity, profile, generation, usable);
+}
+
+
+void HSSProfileCache::put(const std::string& public_user_identity,
+                          const Profile& profile,
+                          uint64_t generation)
+{
+  _cache.put(public_user_identity, profile, generation);
+}
+
+
+void HSSProfileCache::put_set(const std::vector<std::string>& public_user_identities,
+                              const Profile& profile,
+                              uint64_t generation)
+{
+  for (std::vector<std::string>::const_iterator i = public_user_identities.begin();
+       i != public_user_identities.end();
+       ++i)
+  {
+    _cache.put(*i, profile, generation);
+  }
+}
+
+
+void HSSProfileCache::extend(const std::vector<std::string>& public_user_identities,
+                             uint64_t ttl_ms,
+                             uint64_t generation)
+{
+  ttl_ms = std::min(ttl_ms, _max_ttl_ms);
+
+  for (std::vector<std::string>::const_iterator i = public_user_identities.begin();
+       i != public_user_identities.end();
+       ++i)
+  {
+    _cache.extend(*i, ttl_ms, generation);
+  }
+}
+
+
+uint64_t HSSProfileCache::invalidate(const std::string& public_user_identity)
+{
+  Profile old_profile;
+  if (_cache.invalidate(public_user_identity, &old_profile))
+  {
+    // The registration state is shared by the implicit registration set, so
+    // the profiles cached for the other identities in the set are out of
+    // date too.
+    for (std::vector<std::string>::const_iterator i = old_profile.associated_uris.begin();
+         i != old_profile.associated_uris.end();
+         ++i)
+    {
+      if (*i != public_user_identity)
+      {
+        _cache.invalidate(*i);
+      }
+    }
+  }
+
+  // Read the generation once all the identities have been invalidated.
+  return _cache.generation();
+}
+
+
+/// Reports the number of hits, misses, the hit rate (as a percentage), the
+/// number of entries found to be too old, evictions, invalidations and the
+/// number of entries.
+void HSSProfileCache::report_stats()
+{
+  ShardedLRUCache<Profile>::Stats stats;
+  _cache.get_stats(stats);
+
+  std::vector<std::string> values;
+  values.push_back(std::to_string(stats.hits));
+  values.push_back(std::to_string(stats.misses));
+  values.push_back(std::to_string(((stats.hits + stats.misses) > 0) ?
+                                    (stats.hits * 100) / (stats.hits + stats.misses) : 0));
+  values.push_back(std::to_string(stats.expired));
+  values.push_back(std::to_string(stats.evictions));
+  values.push_back(std::to_string(stats.invalidations));
+  values.push_back(std::to_string(stats.entries));
+  _statistic.report_change(values);
+}
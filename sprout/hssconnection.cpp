@@ -38,6 +38,7 @@
 #include <string>
 #include <memory>
 #include <map>
+#include <algorithm>
 #include <json/reader.h>
 #include <json/writer.h>
 
@@ -47,7 +48,10 @@
 #include "sproutsasevent.h"
 #include "httpconnection.h"
 #include "hssconnection.h"
+#include "hss_profile_cache.h"
+#include "request_coalescer.h"
 #include "accumulator.h"
+#include "stack.h"
 
 const std::string HSSConnection::REG = "reg";
 const std::string HSSConnection::CALL = "call";
@@ -63,7 +67,10 @@ const std::string HSSConnection::STATE_NOT_REGISTERED = "NOT_REGISTERED";
 HSSConnection::HSSConnection(const std::string& server,
                              HttpResolver* resolver,
                              LoadMonitor *load_monitor,
-                             LastValueCache *stats_aggregator) :
+                             LastValueCache *stats_aggregator,
+                             int profile_cache_size,
+                             int profile_cache_ttl_ms,
+                             int profile_cache_max_ttl_ms) :
   _http(new HttpConnection(server,
                            false,
                            resolver,
@@ -71,6 +78,13 @@ HSSConnection::HSSConnection(const std::string& server,
                            load_monitor,
                            stats_aggregator,
                            SASEvent::HttpLogLevel::PROTOCOL)),
+  _profile_cache((profile_cache_size > 0) ?
+                   new HSSProfileCache(profile_cache_size,
+                                       profile_cache_ttl_ms,
+                                       profile_cache_max_ttl_ms,
+                                       stats_aggregator) :
+                   NULL),
+  _coalescer(new RequestCoalescer("hss_coalesced_requests", stats_aggregator)),
   _latency_stat("hss_latency_us", stats_aggregator),
   _digest_latency_stat("hss_digest_latency_us", stats_aggregator),
   _subscription_latency_stat("hss_subscription_latency_us", stats_aggregator),
@@ -82,11 +96,35 @@ HSSConnection::HSSConnection(const std::string& server,
 
 HSSConnection::~HSSConnection()
 {
+  delete _profile_cache;
+  _profile_cache = NULL;
+  delete _coalescer;
+  _coalescer = NULL;
   delete _http;
   _http = NULL;
 }
 
 
+void HSSConnection::invalidate_cached_profile(const std::string& public_user_identity)
+{
+  if (_profile_cache != NULL)
+  {
+    _profile_cache->invalidate(public_user_identity);
+  }
+}
+
+
+void HSSConnection::extend_cached_profile(const std::vector<std::string>& public_user_identities,
+                                          int ttl_ms,
+                                          uint64_t profile_generation)
+{
+  if (_profile_cache != NULL)
+  {
+    _profile_cache->extend(public_user_identities, ttl_ms, profile_generation);
+  }
+}
+
+
 /// Get an Authentication Vector as JSON object. Caller is responsible for deleting.
 HTTPCode HSSConnection::get_auth_vector(const std::string& private_user_identity,
                                         const std::string& public_user_identity,
@@ -155,7 +193,22 @@ HTTPCode HSSConnection::get_json_object(const std::string& path,
 {
   std::string json_data;
 
-  HTTPCode rc = _http->send_get(path, json_data, "", trail);
+  // Identical requests in progress at the same time share the response,
+  // except for AKA authentication vectors, as each challenge must only be
+  // used once.
+  worker_blocked(true);
+  HTTPCode rc = _coalescer->send("GET " + path,
+                                 trail,
+                                 json_data,
+                                 [&](std::string& response)
+                                 {
+                                   return _http->send_get(path, response, "", trail);
+                                 },
+                                 [](long http_code, const std::string& response)
+                                 {
+                                   return (response.find("\"aka\"") == std::string::npos);
+                                 });
+  worker_blocked(false);
   if (rc == HTTP_OK)
   {
     json_object = new Json::Value;
@@ -204,7 +257,11 @@ HTTPCode HSSConnection::put_for_xml_object(const std::string& path,
 {
   std::string raw_data;
 
+  // PUTs change the registration state in the HSS, so they aren't
+  // coalesced - Homestead must see each one.
+  worker_blocked(true);
   HTTPCode http_code = _http->send_put(path, raw_data, body, trail);
+  worker_blocked(false);
 
   if (http_code == HTTP_OK)
   {
@@ -222,7 +279,16 @@ HTTPCode HSSConnection::get_xml_object(const std::string& path,
 {
   std::string raw_data;
 
-  HTTPCode http_code = _http->send_get(path, raw_data, "", trail);
+  // Identical requests in progress at the same time share the response.
+  worker_blocked(true);
+  HTTPCode http_code = _coalescer->send("GET " + path,
+                                        trail,
+                                        raw_data,
+                                        [&](std::string& response)
+                                        {
+                                          return _http->send_get(path, response, "", trail);
+                                        });
+  worker_blocked(false);
 
   if (http_code == HTTP_OK)
   {
@@ -452,6 +518,65 @@ HTTPCode HSSConnection::update_registration_state(const std::string& public_user
                                                   std::deque<std::string>& ecfs,
                                                   SAS::TrailId trail)
 {
+  uint64_t unused_generation;
+  return update_registration_state(public_user_identity,
+                                   private_user_identity,
+                                   type,
+                                   regstate,
+                                   ifcs_map,
+                                   associated_uris,
+                                   ccfs,
+                                   ecfs,
+                                   unused_generation,
+                                   trail);
+}
+
+HTTPCode HSSConnection::update_registration_state(const std::string& public_user_identity,
+                                                  const std::string& private_user_identity,
+                                                  const std::string& type,
+                                                  std::string& regstate,
+                                                  std::map<std::string, Ifcs >& ifcs_map,
+                                                  std::vector<std::string>& associated_uris,
+                                                  std::deque<std::string>& ccfs,
+                                                  std::deque<std::string>& ecfs,
+                                                  uint64_t& profile_generation,
+                                                  SAS::TrailId trail)
+{
+  // Only the results of registrations and calls are cached - the other
+  // request types deregister the subscriber.
+  bool cacheable = ((type == REG) || (type == CALL));
+  uint64_t generation = 0;
+  profile_generation = 0;
+
+  if (_profile_cache != NULL)
+  {
+    if (type == CALL)
+    {
+      // A call only changes the state at Homestead if the subscriber isn't
+      // registered, so only cached profiles for registered subscribers are
+      // used.
+      HSSProfileCache::Profile profile;
+      if (_profile_cache->get(public_user_identity, true, profile, generation))
+      {
+        LOG_DEBUG("Using cached subscriber data for %s", public_user_identity.c_str());
+        regstate = profile.regstate;
+        ifcs_map = profile.ifcs_map;
+        associated_uris = profile.associated_uris;
+        ccfs = profile.ccfs;
+        ecfs = profile.ecfs;
+        return HTTP_OK;
+      }
+    }
+    else
+    {
+      // The registration state is changing, so any cached profile is out of
+      // date.  The profile read for a registration is cached for the whole
+      // implicit registration set, which we don't know yet, using the same
+      // generation.
+      generation = _profile_cache->invalidate(public_user_identity);
+    }
+  }
+
   Utils::StopWatch stopWatch;
   stopWatch.start();
 
@@ -497,7 +622,46 @@ HTTPCode HSSConnection::update_registration_state(const std::string& public_user
     return http_code;
   }
 
-  return decode_homestead_xml(root, regstate, ifcs_map, associated_uris, ccfs, ecfs, false) ? HTTP_OK : HTTP_SERVER_ERROR;
+  if (!decode_homestead_xml(root, regstate, ifcs_map, associated_uris, ccfs, ecfs, false))
+  {
+    return HTTP_SERVER_ERROR;
+  }
+
+  if (_profile_cache != NULL)
+  {
+    if ((type == REG) && (regstate == STATE_REGISTERED))
+    {
+      // Warm the cache for calls to and from any identity in the implicit
+      // registration set.
+      HSSProfileCache::Profile profile;
+      profile.regstate = regstate;
+      profile.ifcs_map = ifcs_map;
+      profile.associated_uris = associated_uris;
+      profile.ccfs = ccfs;
+      profile.ecfs = ecfs;
+
+      std::vector<std::string> identities(associated_uris);
+      if (std::find(identities.begin(), identities.end(), public_user_identity) == identities.end())
+      {
+        identities.push_back(public_user_identity);
+      }
+
+      _profile_cache->put_set(identities, profile, generation);
+      profile_generation = generation;
+    }
+    else if (cacheable)
+    {
+      cache_profile(public_user_identity, regstate, ifcs_map, associated_uris, ccfs, ecfs, generation);
+    }
+    else
+    {
+      // Invalidate again now Homestead has made the change, in case a call
+      // cached the old state while the request was in progress.
+      _profile_cache->invalidate(public_user_identity);
+    }
+  }
+
+  return HTTP_OK;
 }
 
 HTTPCode HSSConnection::get_registration_data(const std::string& public_user_identity,
@@ -525,6 +689,23 @@ HTTPCode HSSConnection::get_registration_data(const std::string& public_user_ide
                                               std::deque<std::string>& ecfs,
                                               SAS::TrailId trail)
 {
+  uint64_t generation = 0;
+
+  if (_profile_cache != NULL)
+  {
+    HSSProfileCache::Profile profile;
+    if (_profile_cache->get(public_user_identity, false, profile, generation))
+    {
+      LOG_DEBUG("Using cached subscriber data for %s", public_user_identity.c_str());
+      regstate = profile.regstate;
+      ifcs_map = profile.ifcs_map;
+      associated_uris = profile.associated_uris;
+      ccfs = profile.ccfs;
+      ecfs = profile.ecfs;
+      return HTTP_OK;
+    }
+  }
+
   Utils::StopWatch stopWatch;
   stopWatch.start();
 
@@ -566,7 +747,37 @@ HTTPCode HSSConnection::get_registration_data(const std::string& public_user_ide
   // Return whether the XML was successfully decoded. The XML can be decoded and
   // not return any IFCs (when the subscriber isn't registered), so a successful
   // response shouldn't be taken as a guarantee of IFCs.
-  return decode_homestead_xml(root, regstate, ifcs_map, associated_uris, ccfs, ecfs, true) ? HTTP_OK : HTTP_SERVER_ERROR;
+  if (!decode_homestead_xml(root, regstate, ifcs_map, associated_uris, ccfs, ecfs, true))
+  {
+    return HTTP_SERVER_ERROR;
+  }
+
+  if (_profile_cache != NULL)
+  {
+    cache_profile(public_user_identity, regstate, ifcs_map, associated_uris, ccfs, ecfs, generation);
+  }
+
+  return HTTP_OK;
+}
+
+
+/// Caches a profile read from Homestead, if no change to the registration
+/// state has been made since generation was read from the cache.
+void HSSConnection::cache_profile(const std::string& public_user_identity,
+                                  const std::string& regstate,
+                                  const std::map<std::string, Ifcs>& ifcs_map,
+                                  const std::vector<std::string>& associated_uris,
+                                  const std::deque<std::string>& ccfs,
+                                  const std::deque<std::string>& ecfs,
+                                  uint64_t generation)
+{
+  HSSProfileCache::Profile profile;
+  profile.regstate = regstate;
+  profile.ifcs_map = ifcs_map;
+  profile.associated_uris = associated_uris;
+  profile.ccfs = ccfs;
+  profile.ecfs = ecfs;
+  _profile_cache->put(public_user_identity, profile, generation);
 }
 
 
@@ -56,13 +56,17 @@ extern "C" {
 ICSCFRouter::ICSCFRouter(HSSConnection* hss,
                          SCSCFSelector* scscf_selector,
                          SAS::TrailId trail,
-                         ACR* acr) :
+                         ACR* acr,
+                         SCSCFAssignmentCache* cache) :
   _hss(hss),
   _scscf_selector(scscf_selector),
   _trail(trail),
   _acr(acr),
+  _cache(cache),
+  _cache_generation(0),
   _queried_caps(false),
   _hss_rsp(),
+  _cached_scscf(),
   _attempted_scscfs()
 {
 }
@@ -84,12 +88,23 @@ int ICSCFRouter::get_scscf(pj_pool_t* pool, pjsip_sip_uri*& scscf_sip_uri)
 {
   int status_code = PJSIP_SC_OK;
   std::string scscf;
+  bool cached_selection = false;
   scscf_sip_uri = NULL;
 
-  if (!_queried_caps)
+  if ((_cache != NULL) && (!_attempted_scscfs.empty()))
+  {
+    // We are retrying because routing to the last S-CSCF failed, so the
+    // cached result that may have selected it can't be trusted.
+    _cache_generation = _cache->invalidate(cache_key());
+  }
+
+  if ((!_queried_caps) &&
+      ((!_attempted_scscfs.empty()) || (!cache_lookup(status_code))))
   {
     // Do the HSS query.
     status_code = hss_query();
+    _cached_scscf = "";
+    cache_update(status_code);
 
     // TS 32.260 table 5.2.1.1 says we should generate an ACR[Event] on
     // completion of a Cx Query.  We therefore send the ACR here, but
@@ -112,6 +127,16 @@ int ICSCFRouter::get_scscf(pj_pool_t* pool, pjsip_sip_uri*& scscf_sip_uri)
       scscf = _hss_rsp.scscf;
       LOG_DEBUG("SCSCF specified by HSS: %s", scscf.c_str());
     }
+    else if ((!_cached_scscf.empty()) &&
+             (std::find(_attempted_scscfs.begin(), _attempted_scscfs.end(),
+                        _cached_scscf) == _attempted_scscfs.end()))
+    {
+      // An earlier request for this subscriber selected an S-CSCF using the
+      // same capabilities, so use it again.
+      scscf = _cached_scscf;
+      cached_selection = true;
+      LOG_DEBUG("SCSCF selected for earlier request: %s", scscf.c_str());
+    }
     else if (_queried_caps)
     {
       // We queried capabilities from the HSS, so select a suitable S-CSCF.
@@ -120,6 +145,14 @@ int ICSCFRouter::get_scscf(pj_pool_t* pool, pjsip_sip_uri*& scscf_sip_uri)
                                          _attempted_scscfs,
                                          _trail);
       LOG_DEBUG("SCSCF selected: %s", scscf.c_str());
+
+      if (!scscf.empty())
+      {
+        // Remember the S-CSCF we selected, so later requests for this
+        // subscriber are routed to the same S-CSCF, as they would be by the
+        // HSS once the S-CSCF has been assigned.
+        cache_update(status_code, scscf);
+      }
     }
 
     if (!scscf.empty())
@@ -150,6 +183,13 @@ int ICSCFRouter::get_scscf(pj_pool_t* pool, pjsip_sip_uri*& scscf_sip_uri)
 
   if (status_code == PJSIP_SC_OK)
   {
+    if (cached_selection)
+    {
+      SAS::Event event(_trail, SASEvent::SCSCF_SELECTION_CACHED, 0);
+      event.add_var_param(scscf);
+      SAS::report_event(event);
+    }
+
     SAS::Event event(_trail, SASEvent::SCSCF_SELECTION_SUCCESS, 0);
     event.add_var_param(scscf);
     event.add_var_param(_hss_rsp.scscf);
@@ -167,6 +207,70 @@ int ICSCFRouter::get_scscf(pj_pool_t* pool, pjsip_sip_uri*& scscf_sip_uri)
 }
 
 
+/// Looks up the result of the HSS query in the S-CSCF assignment cache.
+///
+/// @param status_code   Output parameter holding the status code of the
+///                      cached query.  This is only valid if the function
+///                      returns true.
+bool ICSCFRouter::cache_lookup(int& status_code)
+{
+  SCSCFAssignmentCache::Assignment assignment;
+
+  if ((_cache == NULL) ||
+      (!_cache->get(cache_key(), assignment, _cache_generation)))
+  {
+    return false;
+  }
+
+  LOG_DEBUG("Using cached HSS response for %s, status %d",
+            cache_key().c_str(), assignment.status_code);
+  status_code = assignment.status_code;
+  _queried_caps = assignment.queried_caps;
+  _hss_rsp = assignment.caps;
+  _cached_scscf = assignment.selected_scscf;
+
+  if ((_acr != NULL) &&
+      (status_code == PJSIP_SC_OK))
+  {
+    // Pass the server capabilities to the ACR for reporting.
+    _acr->server_capabilities(_hss_rsp);
+  }
+
+  return true;
+}
+
+
+/// Caches the result of an HSS query.  Results which identify an S-CSCF or
+/// capabilities are cached, as are results saying the subscriber is
+/// unknown, but not transient errors.
+///
+/// @param status_code    The status code of the query.
+/// @param selected_scscf The S-CSCF selected using the capabilities returned
+///                       by the HSS, if one has been.
+void ICSCFRouter::cache_update(int status_code,
+                               const std::string& selected_scscf)
+{
+  if ((_cache != NULL) &&
+      ((status_code == PJSIP_SC_OK) ||
+       (status_code == PJSIP_SC_NOT_FOUND) ||
+       (status_code == PJSIP_SC_FORBIDDEN)))
+  {
+    SCSCFAssignmentCache::Assignment assignment;
+    assignment.status_code = status_code;
+    assignment.queried_caps = false;
+
+    if (status_code == PJSIP_SC_OK)
+    {
+      assignment.queried_caps = _queried_caps;
+      assignment.caps = _hss_rsp;
+      assignment.selected_scscf = selected_scscf;
+    }
+
+    _cache->put(cache_key(), assignment, _cache_generation);
+  }
+}
+
+
 /// Parses the response from the HSS.
 int ICSCFRouter::parse_hss_response(Json::Value& rsp, bool queried_caps)
 {
@@ -260,8 +364,9 @@ ICSCFUARouter::ICSCFUARouter(HSSConnection* hss,
                              const std::string& impi,
                              const std::string& impu,
                              const std::string& visited_network,
-                             const std::string& auth_type) :
-  ICSCFRouter(hss, scscf_selector, trail, acr),
+                             const std::string& auth_type,
+                             SCSCFAssignmentCache* cache) :
+  ICSCFRouter(hss, scscf_selector, trail, acr, cache),
   _impi(impi),
   _impu(impu),
   _visited_network(visited_network),
@@ -329,13 +434,22 @@ int ICSCFUARouter::hss_query()
 }
 
 
+/// Returns the key the UAR result is cached under.  The HSS response depends
+/// on all the parameters of the query.
+std::string ICSCFUARouter::cache_key() const
+{
+  return "UAR " + _impi + " " + _impu + " " + _visited_network + " " + _auth_type;
+}
+
+
 ICSCFLIRouter::ICSCFLIRouter(HSSConnection* hss,
                              SCSCFSelector* scscf_selector,
                              SAS::TrailId trail,
                              ACR* acr,
                              const std::string& impu,
-                             bool originating) :
-  ICSCFRouter(hss, scscf_selector, trail, acr),
+                             bool originating,
+                             SCSCFAssignmentCache* cache) :
+  ICSCFRouter(hss, scscf_selector, trail, acr, cache),
   _impu(impu),
   _originating(originating)
 {
@@ -393,3 +507,8 @@ int ICSCFLIRouter::hss_query()
 }
 
 
+/// Returns the key the LIR result is cached under.
+std::string ICSCFLIRouter::cache_key() const
+{
+  return std::string((_originating) ? "LIR orig " : "LIR term ") + _impu;
+}
@@ -66,10 +66,12 @@ ICSCFSproutlet::ICSCFSproutlet(int port,
                                SCSCFSelector* scscf_selector,
                                EnumService* enum_service,
                                bool enforce_global_only_lookups,
-                               bool enforce_user_phone) :
+                               bool enforce_user_phone,
+                               SCSCFAssignmentCache* scscf_assignment_cache) :
   Sproutlet("icscf", port),
   _hss(hss),
   _scscf_selector(scscf_selector),
+  _scscf_assignment_cache(scscf_assignment_cache),
   _acr_factory(acr_factory),
   _enum_service(enum_service),
   _global_only_lookups(enforce_global_only_lookups),
@@ -211,7 +213,8 @@ void ICSCFSproutletRegTsx::on_rx_initial_request(pjsip_msg* req)
                                             impi,
                                             impu,
                                             visited_network,
-                                            auth_type);
+                                            auth_type,
+                                            _icscf->get_scscf_assignment_cache());
 
   // We have a router, query it for an S-CSCF to use.
   pjsip_sip_uri* scscf_sip_uri = NULL;
@@ -454,7 +457,8 @@ void ICSCFSproutletTsx::on_rx_initial_request(pjsip_msg* req)
                                             trail(),
                                             _acr,
                                             impu,
-                                            _originating);
+                                            _originating,
+                                            _icscf->get_scscf_assignment_cache());
 
   pjsip_sip_uri* scscf_sip_uri = NULL;
 
@@ -36,6 +36,8 @@
 
 #include <boost/regex.hpp>
 #include <cassert>
+#include <algorithm>
+#include <limits>
 
 extern "C" {
 #include <pjlib-util.h>
@@ -49,6 +51,7 @@ extern "C" {
 #include "pjmedia.h"
 
 #include "ifchandler.h"
+#include "regex_cache.h"
 
 #include "sas.h"
 #include "sproutsasevent.h"
@@ -112,32 +115,246 @@ IfcHandler::~IfcHandler()
   // nothing to do
 }
 
-void Ifc::invalid_ifc(std::string error,
-                      std::string server_name,
-                      int sas_event_id,
-                      int instance_id,
-                      SAS::TrailId trail)
+
+// Bits in the session case bitmask of a compiled SessionCase trigger.  There
+// is one bit for each session case in each registration state.
+static unsigned int session_case_bit(const SessionCase& session_case,
+                                     bool is_registered)
 {
-    SAS::Event event(trail, sas_event_id, instance_id);
-    event.add_var_param(server_name);
-    event.add_var_param(error);
-    SAS::report_event(event);
-    throw ifc_error(error.c_str());
+  int index = (session_case == SessionCase::Originating) ? 0 :
+              (session_case == SessionCase::Terminating) ? 1 :
+              (session_case == SessionCase::OriginatingCdiv) ? 2 : 3;
+  return 1u << (index * 2 + (is_registered ? 0 : 1));
 }
 
-/// Test if the SPT matches. Ignores grouping and negation, and just
-// evaluates the service point trigger in the node.
-// @return true if the SPT matches, false if not
-// @throw ifc_error if there is a problem evaluating the trigger.
-bool Ifc::spt_matches(const SessionCase& session_case,  //< The session case
-                      bool is_registered,               //< The registration state
-                      bool is_initial_registration,
-                      pjsip_msg* msg,                   //< The message being matched
-                      xml_node<>* spt,                  //< The Service Point Trigger node
-                      std::string ifc_str,
-                      std::string server_name,
-                      SAS::TrailId trail)
+
+/// A regular expression from a service point trigger, compiled once.  Other
+/// subscribers' iFCs mostly use the same expressions, so the compiled forms
+/// come from the regex cache.  Expressions that are plain strings (as header
+/// names usually are) are matched with a substring search, which gives the
+/// same result.
+class IfcRegex
+{
+public:
+  IfcRegex() :
+    _valid(false),
+    _literal(false)
+  {
+  }
+
+  void compile(const std::string& pattern)
+  {
+    _pattern = pattern;
+    _literal = (!pattern.empty()) &&
+               (pattern.find_first_not_of("ABCDEFGHIJKLMNOPQRSTUVWXYZ"
+                                                "abcdefghijklmnopqrstuvwxyz"
+                                                "0123456789-_") == std::string::npos);
+    if (_literal)
+    {
+      _valid = true;
+    }
+    else
+    {
+      _regex = RegexCache::compile(pattern);
+      _valid = (_regex != NULL);
+    }
+  }
+
+  bool valid() const
+  {
+    return _valid;
+  }
+
+  bool search(const std::string& str) const
+  {
+    return (_literal) ? (str.find(_pattern) != std::string::npos) :
+                        boost::regex_search(str, *_regex);
+  }
+
+private:
+  std::string _pattern;
+  RegexCache::Regex _regex;
+  bool _valid;
+  bool _literal;
+};
+
+
+/// An error found while compiling an iFC.  The XML interpreter only finds
+/// errors when it reaches the invalid element while evaluating a request, so
+/// the compiled form records the error and raises it at the same point, with
+/// the same SAS logging.
+class IfcError
 {
+public:
+  enum Type
+  {
+    NONE,
+    PLAIN,        // Not logged to SAS.
+    INVALID,      // Logged as IFC_INVALID.
+    INVALID_NOAS  // Logged as IFC_INVALID_NOAS.
+  };
+
+  IfcError() :
+    _type(NONE)
+  {
+  }
+
+  /// Records the error, unless an earlier one has been recorded.
+  void set(Type type, const std::string& text)
+  {
+    if (_type == NONE)
+    {
+      _type = type;
+      _text = text;
+    }
+  }
+
+  bool present() const
+  {
+    return (_type != NONE);
+  }
+
+  // @throw ifc_error
+  void raise(const std::string& server_name, SAS::TrailId trail) const
+  {
+    if (_type == INVALID)
+    {
+      SAS::Event event(trail, SASEvent::IFC_INVALID, 0);
+      event.add_var_param(server_name);
+      event.add_var_param(_text);
+      SAS::report_event(event);
+    }
+    else if (_type == INVALID_NOAS)
+    {
+      SAS::Event event(trail, SASEvent::IFC_INVALID_NOAS, 0);
+      SAS::report_event(event);
+    }
+    throw ifc_error(_text);
+  }
+
+private:
+  Type _type;
+  std::string _text;
+};
+
+
+/// A compiled service point trigger.
+struct CompiledSpt
+{
+  enum Class
+  {
+    METHOD,
+    SIP_HEADER,
+    SESSION_CASE,
+    REQUEST_URI,
+    SESSION_DESCRIPTION,
+    UNIMPLEMENTED
+  };
+
+  Class spt_class;
+  std::string class_name;
+  bool negated;
+
+  // Raised before the trigger is evaluated (for example if the class is
+  // missing or a regular expression is invalid).
+  IfcError error;
+
+  // Method triggers.  If the method is REGISTER, the registration types to
+  // match (if any) and an error to raise if none of them match.
+  std::string method;
+  bool is_register;
+  std::vector<int> reg_types;
+  IfcError reg_type_error;
+
+  // SessionCase triggers.
+  unsigned int session_cases;
+
+  // The Header, Line or RequestURI expression, and the Content expression
+  // (if any) with an error to raise the first time it is needed.
+  IfcRegex regex;
+  bool has_content;
+  IfcRegex content;
+  IfcError content_error;
+
+  // Indices of the groups the trigger belongs to, and an error to raise
+  // after the trigger is evaluated.
+  std::vector<size_t> groups;
+  IfcError group_error;
+};
+
+
+/// A compiled iFC.  This is immutable once compiled, so it is shared between
+/// copies of the Ifc (and so between threads).
+struct CompiledIfc
+{
+  // The iFC as text, for SAS logging.
+  std::string ifc_str;
+
+  std::string server_name;
+  IfcError as_error;
+  AsInvocation as_invocation;
+  std::string default_handling;
+  bool default_handling_valid;
+
+  bool has_profile_part;
+  bool profile_part_registered;
+  IfcError profile_part_error;
+
+  bool has_trigger;
+  bool cnf;
+  IfcError cnf_error;
+
+  std::vector<CompiledSpt> spts;
+  size_t num_groups;
+};
+
+
+/// Compiles a service point trigger.  Group IDs are added to group_ids, and
+/// the trigger refers to them by their index in it.
+static void compile_spt(xml_node<>* spt,
+                        std::vector<int32_t>& group_ids,
+                        CompiledSpt& compiled)
+{
+  compiled.spt_class = CompiledSpt::UNIMPLEMENTED;
+  compiled.is_register = false;
+  compiled.session_cases = 0;
+  compiled.has_content = false;
+
+  compiled.negated = false;
+  xml_node<>* neg_node = spt->first_node("ConditionNegated");
+  if (neg_node)
+  {
+    try
+    {
+      compiled.negated = parse_bool(neg_node, "ConditionNegated");
+    }
+    catch (ifc_error err)
+    {
+      compiled.error.set(IfcError::PLAIN, err.what());
+    }
+  }
+
+  for (xml_node<>* group_node = spt->first_node("Group");
+       group_node;
+       group_node = group_node->next_sibling("Group"))
+  {
+    try
+    {
+      int32_t group = parse_integer(group_node, "Group ID", 0, std::numeric_limits<int32_t>::max());
+      size_t index = std::find(group_ids.begin(), group_ids.end(), group) - group_ids.begin();
+      if (index == group_ids.size())
+      {
+        group_ids.push_back(group);
+      }
+      compiled.groups.push_back(index);
+    }
+    catch (ifc_error err)
+    {
+      compiled.group_error.set(IfcError::PLAIN, err.what());
+      break;
+    }
+  }
+
   // Find the class node.
   xml_node<>* node = spt->first_node();
   const char* name = NULL;
@@ -151,186 +368,379 @@ bool Ifc::spt_matches(const SessionCase& session_case,  //< The session case
     {
       if (strcmp(name, "Extension") == 0)
       {
-        invalid_ifc("Missing class for service point trigger", server_name, SASEvent::IFC_INVALID, 0, trail);
-      }
-      else
-      {
-        break;
+        node = NULL;
       }
+      break;
     }
   }
 
   if (!node)
   {
-    invalid_ifc("Missing class for service point trigger", server_name, SASEvent::IFC_INVALID, 0, trail);
+    compiled.error.set(IfcError::INVALID, "Missing class for service point trigger");
+    return;
   }
 
-  // Now interpret the node depending on its class.
-  bool ret = false;
+  compiled.class_name = name;
 
   if (strcmp("Method", name) == 0)
   {
-    // If we have a REGISTER we may need to match on RegistrationType.
-    if ((strcmp("REGISTER", node->value()) == 0) &&
-        (pj_strcmp2(&msg->line.req.method.name, node->value()) == 0))
+    compiled.spt_class = CompiledSpt::METHOD;
+    compiled.method = node->value();
+    compiled.is_register = (compiled.method == "REGISTER");
+
+    xml_node<>* ext = node->next_sibling();
+    if ((compiled.is_register) && (ext) && (strcmp(ext->name(), "Extension") == 0))
     {
-      ret = true;
-      node = node->next_sibling();
-      if (node)
+      for (xml_node<>* reg_type_node = ext->first_node("RegistrationType");
+           reg_type_node;
+           reg_type_node = reg_type_node->next_sibling("RegistrationType"))
       {
-        name = node->name();
-        if (strcmp(name, "Extension") == 0)
+        try
         {
-          for (xml_node<>* reg_type_node = node->first_node("RegistrationType");
-               reg_type_node;
-               reg_type_node = reg_type_node->next_sibling("RegistrationType"))
-          {
-            name = reg_type_node->name();
-            int reg_type = parse_integer(reg_type_node, "registration type", 0, 2);
+          compiled.reg_types.push_back(parse_integer(reg_type_node, "registration type", 0, 2));
+        }
+        catch (ifc_error err)
+        {
+          compiled.reg_type_error.set(IfcError::PLAIN, err.what());
+          break;
+        }
+      }
+    }
+  }
+  else if (strcmp("SIPHeader", name) == 0)
+  {
+    compiled.spt_class = CompiledSpt::SIP_HEADER;
+    xml_node<>* spt_header = node->first_node("Header");
+    xml_node<>* spt_content = node->first_node("Content");
 
-            // Find expiry value from SIP message if it is present to determine
-            // whether we have a de-registration.  Set an arbitrary default value of
-            // an hour.
-            int expiry = PJUtils::max_expires(msg, 3600);
+    if (!spt_header)
+    {
+      compiled.error.set(IfcError::INVALID, "Missing Header element for SIPHeader service point trigger");
+      return;
+    }
 
-            switch (reg_type)
-            {
-            case INITIAL_REGISTRATION:
-              ret = (is_initial_registration && (expiry > 0));
-              break;
-            case REREGISTRATION:
-              ret = (!is_initial_registration && (expiry > 0));
-              break;
-            case DEREGISTRATION:
-              ret = (expiry == 0);
-              break;
-            default:
-              // LCOV_EXCL_START Unreachable
-              LOG_WARNING("Impossible case %d", reg_type);
-              ret = false;
-              break;
-              // LCOV_EXCL_STOP
-            }
+    compiled.regex.compile(get_text_or_cdata(spt_header));
+    if (!compiled.regex.valid())
+    {
+      compiled.error.set(IfcError::INVALID, "Invalid regular expression in Header element for SIPHeader service point trigger");
+    }
 
-            // If we've found a match, break out of the for loop.
-            if (ret)
-            {
-              break;
-            }
-          }
-        }
+    if (spt_content)
+    {
+      compiled.has_content = true;
+      compiled.content.compile(get_text_or_cdata(spt_content));
+      if (!compiled.content.valid())
+      {
+        compiled.content_error.set(IfcError::INVALID, "Invalid regular expression in Content element for SIPHeader service point trigger");
       }
     }
-    else
+  }
+  else if (strcmp("SessionCase", name) == 0)
+  {
+    compiled.spt_class = CompiledSpt::SESSION_CASE;
+    try
     {
-      ret = (pj_strcmp2(&msg->line.req.method.name, node->value()) == 0);
+      switch (parse_integer(node, "session case", 0, 4))
+      {
+      case ORIGINATING_REGISTERED:
+        compiled.session_cases = session_case_bit(SessionCase::Originating, true);
+        break;
+      case TERMINATING_REGISTERED:
+        compiled.session_cases = session_case_bit(SessionCase::Terminating, true);
+        break;
+      case TERMINATING_UNREGISTERED:
+        compiled.session_cases = session_case_bit(SessionCase::Terminating, false);
+        break;
+      case ORIGINATING_UNREGISTERED:
+        compiled.session_cases = session_case_bit(SessionCase::Originating, false);
+        break;
+      case ORIGINATING_CDIV:
+        compiled.session_cases = session_case_bit(SessionCase::OriginatingCdiv, true) |
+                                 session_case_bit(SessionCase::OriginatingCdiv, false);
+        break;
+      default:
+        // LCOV_EXCL_START Unreachable
+        break;
+        // LCOV_EXCL_STOP
+      }
+    }
+    catch (ifc_error err)
+    {
+      compiled.error.set(IfcError::PLAIN, err.what());
     }
   }
-  else if (strcmp("SIPHeader", name) == 0)
+  else if (strcmp("RequestURI", name) == 0)
   {
-    xml_node<>* spt_header = node->first_node("Header");
+    compiled.spt_class = CompiledSpt::REQUEST_URI;
+    compiled.regex.compile(get_text_or_cdata(node));
+    if (!compiled.regex.valid())
+    {
+      compiled.error.set(IfcError::INVALID, "Invalid regular expression in Request URI service point trigger");
+    }
+  }
+  else if (strcmp("SessionDescription", name) == 0)
+  {
+    compiled.spt_class = CompiledSpt::SESSION_DESCRIPTION;
+    xml_node<>* spt_line = node->first_node("Line");
     xml_node<>* spt_content = node->first_node("Content");
-    boost::regex header_regex;
-    boost::regex content_regex;
-    pjsip_hdr* header = NULL;
 
-    if (!spt_header)
+    if (!spt_line)
+    {
+      compiled.error.set(IfcError::INVALID, "Missing Line element for SessionDescription service point trigger");
+      return;
+    }
+
+    compiled.regex.compile(get_text_or_cdata(spt_line));
+    if (!compiled.regex.valid())
+    {
+      compiled.error.set(IfcError::INVALID, "Invalid regular expression in Line element for Session Description service point trigger");
+    }
+
+    if (spt_content)
+    {
+      compiled.has_content = true;
+      compiled.content.compile(get_text_or_cdata(spt_content));
+      if (!compiled.content.valid())
+      {
+        compiled.content_error.set(IfcError::INVALID, "Invalid regular expression in Content element for Session Description service point trigger");
+      }
+    }
+  }
+}
+
+
+/// Compiles an iFC.  Errors are recorded in the compiled form rather than
+/// thrown.
+static void compile_ifc(xml_node<>* ifc, CompiledIfc& compiled)
+{
+  rapidxml::print(std::back_inserter(compiled.ifc_str), *ifc, 0);
+
+  compiled.as_invocation.default_handling = SESSION_CONTINUED;
+  compiled.as_invocation.include_register_request = false;
+  compiled.as_invocation.include_register_response = false;
+  compiled.default_handling_valid = true;
+  compiled.has_profile_part = false;
+  compiled.profile_part_registered = false;
+  compiled.has_trigger = false;
+  compiled.cnf = false;
+  compiled.num_groups = 0;
+
+  xml_node<>* as = ifc->first_node("ApplicationServer");
+  if (as == NULL)
+  {
+    compiled.as_error.set(IfcError::INVALID_NOAS, "iFC missing ApplicationServer element");
+  }
+  else
+  {
+    compiled.server_name = get_first_node_value(as, "ServerName");
+    if (compiled.server_name.empty())
+    {
+      compiled.as_error.set(IfcError::INVALID_NOAS, "iFC has no ServerName");
+    }
+
+    AsInvocation& as_invocation = compiled.as_invocation;
+    as_invocation.server_name = compiled.server_name;
+
+    std::string& default_handling = compiled.default_handling;
+    default_handling = get_first_node_value(as, "DefaultHandling");
+    if (default_handling == "1")
+    {
+      as_invocation.default_handling = SESSION_TERMINATED;
+    }
+    else
+    {
+      // A missing or malformed DefaultHandling is treated as
+      // SESSION_CONTINUED, with a warning whenever the AS is invoked.
+      as_invocation.default_handling = SESSION_CONTINUED;
+      compiled.default_handling_valid = (default_handling == "0");
+    }
+    as_invocation.service_info = get_first_node_value(as, "ServiceInfo");
+
+    xml_node<>* as_ext = as->first_node("Extension");
+    as_invocation.include_register_request = (as_ext) && does_child_node_exist(as_ext, "IncludeRegisterRequest");
+    as_invocation.include_register_response = (as_ext) && does_child_node_exist(as_ext, "IncludeRegisterResponse");
+  }
+
+  xml_node<>* profile_part_indicator = ifc->first_node("ProfilePartIndicator");
+  if (profile_part_indicator)
+  {
+    compiled.has_profile_part = true;
+    try
+    {
+      compiled.profile_part_registered =
+        (parse_integer(profile_part_indicator, "ProfilePartIndicator", 0, 1) == 0);
+    }
+    catch (ifc_error err)
+    {
+      compiled.profile_part_error.set(IfcError::PLAIN, err.what());
+    }
+  }
+
+  xml_node<>* trigger = ifc->first_node("TriggerPoint");
+  if (trigger)
+  {
+    compiled.has_trigger = true;
+    try
+    {
+      compiled.cnf = parse_bool(trigger->first_node("ConditionTypeCNF"), "ConditionTypeCNF");
+    }
+    catch (ifc_error err)
     {
-      invalid_ifc("Missing Header element for SIPHeader service point trigger",
-                  server_name, SASEvent::IFC_INVALID, 0, trail);
+      compiled.cnf_error.set(IfcError::PLAIN, err.what());
     }
 
-    header_regex = boost::regex(get_text_or_cdata(spt_header), boost::regex_constants::no_except);
-    if (header_regex.status())
+    std::vector<int32_t> group_ids;
+    for (xml_node<>* spt = trigger->first_node("SPT");
+         spt;
+         spt = spt->next_sibling("SPT"))
     {
-      invalid_ifc("Invalid regular expression in Header element for SIPHeader service point trigger",
-                  server_name, SASEvent::IFC_INVALID, 0, trail);
+      compiled.spts.push_back(CompiledSpt());
+      compile_spt(spt, group_ids, compiled.spts.back());
     }
 
-    for (header = msg->hdr.next; header != &msg->hdr; header = header->next)
+    // The groups are combined in order of their IDs, so renumber them in
+    // that order.
+    std::vector<int32_t> sorted_ids(group_ids);
+    std::sort(sorted_ids.begin(), sorted_ids.end());
+    for (std::vector<CompiledSpt>::iterator spt = compiled.spts.begin();
+         spt != compiled.spts.end();
+         ++spt)
     {
-      if (boost::regex_search(PJUtils::pj_str_to_string(&(header->name)), header_regex))
+      for (size_t ii = 0; ii < spt->groups.size(); ++ii)
       {
-        if (!spt_content)
+        spt->groups[ii] = std::lower_bound(sorted_ids.begin(),
+                                           sorted_ids.end(),
+                                           group_ids[spt->groups[ii]]) - sorted_ids.begin();
+      }
+    }
+    compiled.num_groups = group_ids.size();
+  }
+}
+
+
+/// Test if a compiled SPT matches, ignoring grouping and negation.
+// @throw ifc_error if there is a problem evaluating the trigger.
+static bool compiled_spt_matches(const CompiledSpt& spt,
+                                 const SessionCase& session_case,
+                                 bool is_registered,
+                                 bool is_initial_registration,
+                                 pjsip_msg* msg,
+                                 const std::string& server_name,
+                                 SAS::TrailId trail)
+{
+  if (spt.error.present())
+  {
+    spt.error.raise(server_name, trail);
+  }
+
+  bool ret = false;
+
+  switch (spt.spt_class)
+  {
+  case CompiledSpt::METHOD:
+    if ((spt.is_register) &&
+        (pj_strcmp2(&msg->line.req.method.name, "REGISTER") == 0))
+    {
+      // If we have a REGISTER we may need to match on RegistrationType.
+      ret = true;
+      bool found = false;
+
+      if (!spt.reg_types.empty())
+      {
+        // Find expiry value from SIP message if it is present to determine
+        // whether we have a de-registration.  Set an arbitrary default value
+        // of an hour.
+        int expiry = PJUtils::max_expires(msg, 3600);
+
+        for (std::vector<int>::const_iterator reg_type = spt.reg_types.begin();
+             reg_type != spt.reg_types.end();
+             ++reg_type)
+        {
+          switch (*reg_type)
+          {
+          case INITIAL_REGISTRATION:
+            ret = (is_initial_registration && (expiry > 0));
+            break;
+          case REREGISTRATION:
+            ret = (!is_initial_registration && (expiry > 0));
+            break;
+          case DEREGISTRATION:
+            ret = (expiry == 0);
+            break;
+          default:
+            // LCOV_EXCL_START Unreachable
+            ret = false;
+            break;
+            // LCOV_EXCL_STOP
+          }
+
+          if (ret)
+          {
+            found = true;
+            break;
+          }
+        }
+      }
+
+      if ((!found) && (spt.reg_type_error.present()))
+      {
+        spt.reg_type_error.raise(server_name, trail);
+      }
+    }
+    else
+    {
+      ret = (pj_strcmp2(&msg->line.req.method.name, spt.method.c_str()) == 0);
+    }
+    break;
+
+  case CompiledSpt::SIP_HEADER:
+    for (pjsip_hdr* header = msg->hdr.next; header != &msg->hdr; header = header->next)
+    {
+      if (spt.regex.search(PJUtils::pj_str_to_string(&(header->name))))
+      {
+        if (!spt.has_content)
         {
           // We've found a matching header, and don't have to match on content
           ret = true;
         }
         else
         {
-          std::string header_value = PJUtils::get_header_value(header);
-          // status() is nonzero for an uninitialised regex, so we check this in order to only compile it once
-          if (content_regex.status())
+          if (spt.content_error.present())
           {
-            content_regex = boost::regex(get_text_or_cdata(spt_content), boost::regex_constants::no_except);
-            if (content_regex.status())
-            {
-              invalid_ifc("Invalid regular expression in Content element for SIPHeader service point trigger",
-                          server_name, SASEvent::IFC_INVALID, 0, trail);
-            }
+            spt.content_error.raise(server_name, trail);
           }
 
-          if (boost::regex_search(header_value, content_regex))
-          {
-            // We've found a matching header, and have matching content in one field
-            ret = true;
-          }
+          // We've found a matching header, and have matching content in one
+          // field
+          ret = spt.content.search(PJUtils::get_header_value(header));
         }
       }
+
       if (ret)
       {
         // Stop processing other headers once we have a match
         break;
       }
     }
-  }
-  else if (strcmp("SessionCase", name) == 0)
-  {
-    int direction = parse_integer(node, "session case", 0, 4);
-    switch (direction)
-    {
-    case ORIGINATING_REGISTERED:
-      ret = (session_case == SessionCase::Originating) && is_registered;
-      break;
-    case TERMINATING_REGISTERED:
-      ret = (session_case == SessionCase::Terminating) && is_registered;
-      break;
-    case TERMINATING_UNREGISTERED:
-      ret = (session_case == SessionCase::Terminating) && !is_registered;
-      break;
-    case ORIGINATING_UNREGISTERED:
-      ret = (session_case == SessionCase::Originating) && !is_registered;
-      break;
-    case ORIGINATING_CDIV:
-      ret = (session_case == SessionCase::OriginatingCdiv);
-      break;
-    default:
-      // LCOV_EXCL_START Unreachable
-      LOG_WARNING("Impossible case %d", direction);
-      ret = false;
-      break;
-    // LCOV_EXCL_STOP
-    }
-  }
-  else if (strcmp("RequestURI", name) == 0)
-  {
-    boost::regex req_uri_regex;
-    std::string test_string;
+    break;
+
+  case CompiledSpt::SESSION_CASE:
+    ret = ((spt.session_cases & session_case_bit(session_case, is_registered)) != 0);
+    break;
 
+  case CompiledSpt::REQUEST_URI:
     if (PJSIP_URI_SCHEME_IS_TEL(msg->line.req.uri))
     {
-      pjsip_tel_uri* req_uri =  (pjsip_tel_uri*)pjsip_uri_get_uri(msg->line.req.uri);
-
-      // Match against the telephone-subscriber part of the Req URI, as per Table F.1
-      // of 3GPP TS 29.228.
-      test_string = PJUtils::pj_str_to_string(&req_uri->number);
+      // Match against the telephone-subscriber part of the Req URI, as per
+      // Table F.1 of 3GPP TS 29.228.
+      pjsip_tel_uri* req_uri = (pjsip_tel_uri*)pjsip_uri_get_uri(msg->line.req.uri);
+      ret = spt.regex.search(PJUtils::pj_str_to_string(&req_uri->number));
     }
     else
     {
-      pjsip_sip_uri* req_uri = (pjsip_sip_uri*)pjsip_uri_get_uri(msg->line.req.uri);
-
       // Compare against the hostport part of the Req URI, as per Table F.1
       // of 3GPP TS 29.228.
+      pjsip_sip_uri* req_uri = (pjsip_sip_uri*)pjsip_uri_get_uri(msg->line.req.uri);
       std::string hostport = PJUtils::pj_str_to_string(&req_uri->host);
 
       if (req_uri->port != 0)
@@ -338,106 +748,77 @@ bool Ifc::spt_matches(const SessionCase& session_case,  //< The session case
         hostport += ":" + std::to_string(req_uri->port);
       }
 
-      test_string = hostport;
-    }
-
-    req_uri_regex = boost::regex(get_text_or_cdata(node), boost::regex_constants::no_except);
-    if (req_uri_regex.status())
-    {
-      invalid_ifc("Invalid regular expression in Request URI service point trigger",
-                  server_name, SASEvent::IFC_INVALID, 0, trail);
-    }
-    ret = boost::regex_search(test_string, req_uri_regex);
-  }
-  else if (strcmp("SessionDescription", name) == 0)
-  {
-    xml_node<>* spt_line = node->first_node("Line");
-    xml_node<>* spt_content = node->first_node("Content");
-    boost::regex line_regex;
-    boost::regex content_regex;
-    char newline = '\n';
-
-    if (!spt_line)
-    {
-      invalid_ifc("Missing Line element for SessionDescription service point trigger",
-                  server_name, SASEvent::IFC_INVALID, 0, trail);
-    }
-
-    line_regex = boost::regex(get_text_or_cdata(spt_line), boost::regex_constants::no_except);
-    if (line_regex.status())
-    {
-      invalid_ifc("Invalid regular expression in Line element for Session Description service point trigger",
-                  server_name, SASEvent::IFC_INVALID, 0, trail);
+      ret = spt.regex.search(hostport);
     }
+    break;
 
+  case CompiledSpt::SESSION_DESCRIPTION:
     // Check if the message body is SDP.
-    if (msg->body &&
+    if ((msg->body) &&
         (!pj_stricmp2(&msg->body->content_type.type, "application")) &&
-        (!pj_stricmp2(&msg->body->content_type.subtype, "sdp")))
+        (!pj_stricmp2(&msg->body->content_type.subtype, "sdp")) &&
+        (msg->body->data != NULL))
     {
-      if (msg->body->data != NULL)
+      // Split the message body into each SDP line.
+      std::stringstream sdp((char *)msg->body->data);
+      std::string sdp_line;
+      while ((std::getline(sdp, sdp_line, '\n')) && (ret == false))
       {
-        // Split the message body into each SDP line.
-        std::stringstream sdp((char *)msg->body->data);
-        std::string sdp_line;
-        while((std::getline(sdp, sdp_line, newline)) && (ret == false))
+        // Match the line regex on the first character of the SDP line.
+        if (spt.regex.search(std::string(1, sdp_line[0])))
         {
-          // Match the line regex on the first character of the SDP line.
-          std::string sdp_identifier(1, sdp_line[0]);
-          if (boost::regex_search(sdp_identifier, line_regex))
+          if (!spt.has_content)
           {
-            if (!spt_content)
+            // We've found a matching line type, and don't have to match on
+            // content.
+            ret = true;
+          }
+          else
+          {
+            if (spt.content_error.present())
+            {
+              spt.content_error.raise(server_name, trail);
+            }
+
+            // Check the second character of the line is an equals sign, and
+            // then consider the content of the SDP line.
+            if (sdp_line.find_first_of("=") == 1)
             {
-              // We've found a matching line type, and don't have to match on content.
-              ret = true;
+              ret = spt.content.search(sdp_line.substr(2));
             }
             else
             {
-              // status() is nonzero for an uninitialised regex, so we check this in order to only compile it once.
-              if (content_regex.status())
-              {
-                content_regex = boost::regex(get_text_or_cdata(spt_content), boost::regex_constants::no_except);
-                if (content_regex.status())
-                {
-                  invalid_ifc("Invalid regular expression in Content element for Session Description service point trigger",
-                              server_name, SASEvent::IFC_INVALID, 0, trail);
-                }
-              }
-
-              // Check the second character of the line is an equals sign, and then
-              // consider the content of the SDP line.
-              if (sdp_line.find_first_of("=") == 1)
-              {
-                sdp_line.erase(0,2);
-                if (boost::regex_search(sdp_line, content_regex))
-                {
-                  // We've found a matching line.
-                  ret = true;
-                }
-              }
-              else
-              {
-                LOG_WARNING("Found badly formatted SDP line: %s", sdp_line.c_str());
-              }
+              LOG_WARNING("Found badly formatted SDP line: %s", sdp_line.c_str());
             }
           }
         }
       }
     }
-  }
-  else
-  {
-    LOG_WARNING("Unimplemented iFC service point trigger class: %s", name);
-    ret = false;
+    break;
+
+  default:
+    LOG_WARNING("Unimplemented iFC service point trigger class: %s", spt.class_name.c_str());
+    break;
   }
 
-  LOG_DEBUG("SPT class %s: result %s", name, ret ? "true" : "false");
+  LOG_DEBUG("SPT class %s: result %s", spt.class_name.c_str(), ret ? "true" : "false");
   return ret;
 }
 
-/// Check whether the message matches the specified criterion.
-// Refer to CxData_Type_Rel11.xsd in 3GPP TS 29.228, and also Annexes
-// B, C, and F in that document for details.
+
+/// Construct an iFC, compiling it.
+Ifc::Ifc(xml_node<>* ifc) :
+  _ifc(ifc)
+{
+  CompiledIfc* program = new CompiledIfc();
+  compile_ifc(ifc, *program);
+  _program.reset(program);
+}
+
+
+/// Check whether the message matches the specified criterion, using the
+// compiled iFC.  The UTs check that this gives the same results as walking
+// the XML.
 //
 // @return true if the message matches, false if not.
 bool Ifc::filter_matches(const SessionCase& session_case,
@@ -446,129 +827,108 @@ bool Ifc::filter_matches(const SessionCase& session_case,
                          pjsip_msg* msg,
                          SAS::TrailId trail) const
 {
-  std::string ifc_str;
-  rapidxml::print(std::back_inserter(ifc_str), *_ifc, 0);
+  const CompiledIfc& program = *_program;
 
   SAS::Event event(trail, SASEvent::IFC_TESTING, 0);
-  event.add_var_param(ifc_str);
+  event.add_var_param(program.ifc_str);
   SAS::report_event(event);
-  std::string server_name;
 
   try
   {
-    xml_node<>* as = _ifc->first_node("ApplicationServer");
-    if (as == NULL)
+    if (program.as_error.present())
     {
-      std::string error_msg = "iFC missing ApplicationServer element";
-
-      SAS::Event event(trail, SASEvent::IFC_INVALID_NOAS, 0);
-      SAS::report_event(event);
-
-      throw ifc_error(error_msg);
+      program.as_error.raise(program.server_name, trail);
     }
 
-    server_name = get_first_node_value(as, "ServerName");
-    if (server_name.empty())
+    if (program.has_profile_part)
     {
-      std::string error_msg = "iFC has no ServerName";
-
-      SAS::Event event(trail, SASEvent::IFC_INVALID_NOAS, 0);
-      SAS::report_event(event);
-
-      throw ifc_error(error_msg);
-    }
+      if (program.profile_part_error.present())
+      {
+        program.profile_part_error.raise(program.server_name, trail);
+      }
 
-    xml_node<>* profile_part_indicator = _ifc->first_node("ProfilePartIndicator");
-    if (profile_part_indicator)
-    {
-      bool reg = parse_integer(profile_part_indicator, "ProfilePartIndicator", 0, 1) == 0;
-      if (reg != is_registered)
+      if (program.profile_part_registered != is_registered)
       {
-        std::string reg_state = reg ? "reg" : "unreg";
-        std::string reason = "iFC ProfilePartIndicator " + reg_state + " doesn't match";
-        LOG_DEBUG(reason.c_str());
+        LOG_DEBUG("iFC ProfilePartIndicator %s doesn't match",
+                  program.profile_part_registered ? "reg" : "unreg");
 
         SAS::Event event(trail, SASEvent::IFC_NOT_MATCHED_PPI, 0);
-        event.add_var_param(server_name);
+        event.add_var_param(program.server_name);
         SAS::report_event(event);
 
         return false;
       }
     }
 
-    // @@@ KSW Parse the URI and ensure it is parsable and a SIP URI
-    // here. If it's invalid, ignore it (seems the only sensible
-    // option).
-    //
-    // That means each AsInvocation would have to belong to a pool,
-    // though, and that's not easy in the current architecture.
-
-    xml_node<>* trigger = _ifc->first_node("TriggerPoint");
-    if (!trigger)
+    if (!program.has_trigger)
     {
       LOG_DEBUG("iFC has no trigger point - unconditional match");  // 3GPP TS 29.228 sB.2.2
 
       SAS::Event event(trail, SASEvent::IFC_MATCHED, 0);
-      event.add_var_param(server_name);
+      event.add_var_param(program.server_name);
       SAS::report_event(event);
 
       return true;
     }
 
-    bool cnf = parse_bool(trigger->first_node("ConditionTypeCNF"), "ConditionTypeCNF");
+    if (program.cnf_error.present())
+    {
+      program.cnf_error.raise(program.server_name, trail);
+    }
 
     // In CNF (conjunct-of-disjuncts, i.e., big-AND of ORs), as we
     // work through each SPT we OR it into its group(s). At the end,
     // we AND all the groups together. In DNF we do the converse.
-    std::map<int32_t, bool> groups;
+    bool cnf = program.cnf;
+    std::vector<bool> groups(program.num_groups);
+    std::vector<bool> group_set(program.num_groups);
 
-    for (xml_node<>* spt = trigger->first_node("SPT");
-         spt;
-         spt = spt->next_sibling("SPT"))
+    for (std::vector<CompiledSpt>::const_iterator spt = program.spts.begin();
+         spt != program.spts.end();
+         ++spt)
     {
-      xml_node<>* neg_node = spt->first_node("ConditionNegated");
-      bool neg = neg_node && parse_bool(neg_node, "ConditionNegated");
-      bool val = spt_matches(session_case, is_registered, is_initial_registration, msg, spt, ifc_str, server_name, trail) != neg;
+      bool val = compiled_spt_matches(*spt,
+                                      session_case,
+                                      is_registered,
+                                      is_initial_registration,
+                                      msg,
+                                      program.server_name,
+                                      trail) != spt->negated;
+
+      for (std::vector<size_t>::const_iterator group = spt->groups.begin();
+           group != spt->groups.end();
+           ++group)
+      {
+        groups[*group] = (!group_set[*group]) ? val :
+                         (cnf) ? (groups[*group] || val) : (groups[*group] && val);
+        group_set[*group] = true;
+      }
 
-      for (xml_node<>* group_node = spt->first_node("Group");
-           group_node;
-           group_node = group_node->next_sibling("Group"))
+      if (spt->group_error.present())
       {
-        int32_t group = parse_integer(group_node, "Group ID", 0, std::numeric_limits<int32_t>::max());
-        LOG_DEBUG("Add to group %d val %s", (int)group, val ? "true" : "false");
-        if (groups.find(group) == groups.end())
-        {
-          groups[group] = val;
-        }
-        else
-        {
-          groups[group] = cnf ? (groups[group] || val) : (groups[group] && val);
-        }
+        spt->group_error.raise(program.server_name, trail);
       }
     }
 
     bool ret = cnf;
 
-    for (std::map<int32_t, bool>::iterator it = groups.begin();
-         it != groups.end();
-         ++it)
+    for (size_t ii = 0; ii < groups.size(); ++ii)
     {
-      LOG_DEBUG("Result group %d val %s", (int)it->first, it->second ? "true" : "false");
-      ret = cnf ? (ret && it->second) : (ret || it->second);
+      ret = cnf ? (ret && groups[ii]) : (ret || groups[ii]);
     }
 
     if (ret)
     {
       LOG_DEBUG("iFC matches");
       SAS::Event event(trail, SASEvent::IFC_MATCHED, 0);
-      event.add_var_param(server_name);
+      event.add_var_param(program.server_name);
       SAS::report_event(event);
     }
     else
     {
       LOG_DEBUG("iFC does not match");
       SAS::Event event(trail, SASEvent::IFC_NOT_MATCHED, 0);
-      event.add_var_param(server_name);
+      event.add_var_param(program.server_name);
       SAS::report_event(event);
     }
 
@@ -632,51 +992,25 @@ static bool does_child_node_exist(xml_node<>* parent_node, std::string child_nod
 // the iFC).
 AsInvocation Ifc::as_invocation() const
 {
-  xml_node<>* as = _ifc->first_node("ApplicationServer");
-  pj_assert(as != NULL);
-
-  AsInvocation as_invocation;
-  as_invocation.server_name = get_first_node_value(as, "ServerName");
+  pj_assert(_ifc->first_node("ApplicationServer") != NULL);
 
+  // The AsInvocation was built when the iFC was compiled.
+  //
   // @@@ KSW Parse the URI and ensure it is parsable and a SIP URI
   // here. If it's invalid, ignore it (seems the only sensible
   // option).
   //
   // That means each AsInvocation would have to belong to a pool,
   // though, and that's not easy in the current architecture.
+  const AsInvocation& as_invocation = _program->as_invocation;
 
-  std::string default_handling = get_first_node_value(as, "DefaultHandling");
-  if (default_handling == "0")
-  {
-    // DefaultHandling is present and set to 0, which is SESSION_CONTINUED.
-    as_invocation.default_handling = SESSION_CONTINUED;
-  }
-  else if (default_handling == "1")
+  if (!_program->default_handling_valid)
   {
-    // DefaultHandling is present and set to 1, which is SESSION_TERMINATED.
-    as_invocation.default_handling = SESSION_TERMINATED;
-  }
-  else
-  {
-    // If the DefaultHandling attribute isn't present, or is malformed, default
-    // to SESSION_CONTINUED.
+    // If the DefaultHandling attribute isn't present, or is malformed, it
+    // defaults to SESSION_CONTINUED.
     LOG_WARNING("Badly formed DefaultHandling element in IFC (%s), defaulting to SESSION_CONTINUED",
-                default_handling.c_str());
-    as_invocation.default_handling = SESSION_CONTINUED;
-  }
-  as_invocation.service_info = get_first_node_value(as, "ServiceInfo");
-
-  xml_node<>* as_ext = as->first_node("Extension");
-  if (as_ext)
-  {
-    as_invocation.include_register_request = does_child_node_exist(as_ext, "IncludeRegisterRequest");
-    as_invocation.include_register_response = does_child_node_exist(as_ext, "IncludeRegisterResponse");
+                _program->default_handling.c_str());
   }
-  else
-  {
-    as_invocation.include_register_request = false;
-    as_invocation.include_register_response = false;
-  };
 
   LOG_INFO("Found (triggered) server %s", as_invocation.server_name.c_str());
   return as_invocation;
@@ -0,0 +1,160 @@
+/**
+ * @file latency_histogram.cpp  LatencyHistogram class implementation.
+ *
+ * Project Clearwater - IMS in the Cloud
+ * Copyright (C) 2014  Metaswitch Networks Ltd
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or (at your
+ * option) any later version, along with the "Special Exception" for use of
+ * the program along with SSL, set forth below. This program is distributed
+ * in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+ * without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details. You should have received a copy of the GNU General Public
+ * License along with this program.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ *
+ * The author can be reached by email at clearwater@metaswitch.com or by
+ * post at Metaswitch Networks Ltd, 100 Church St, Enfield EN2 6BQ, UK
+ *
+ * Special Exception
+ * Metaswitch Networks Ltd  grants you permission to copy, modify,
+ * propagate, and distribute a work formed by combining OpenSSL with The
+ * Software, or a work derivative of such a combination, even if such
+ * copying, modification, propagation, or distribution would otherwise
+ * violate the terms of the GPL. You must comply with the GPL in all
+ * respects for all of the code used other than OpenSSL.
+ * "OpenSSL" means OpenSSL toolkit software distributed by the OpenSSL
+ * Project and licensed under the OpenSSL Licenses, or a work based on such
+ * software and licensed under the OpenSSL Licenses.
+ * "OpenSSL Licenses" means the OpenSSL License and Original SSLeay License
+ * under which the OpenSSL Project distributes the OpenSSL toolkit software,
+ * as those licenses appear in the file LICENSE-OPENSSL.
+ */
+
+#include "latency_histogram.h"
+
+// Samples below this value each have their own bucket.
+static const unsigned long LINEAR_LIMIT = 16;
+
+LatencyHistogram::LatencyHistogram()
+{
+  for (int ii = 0; ii < NUM_BUCKETS; ++ii)
+  {
+    _buckets[ii] = 0;
+  }
+}
+
+
+LatencyHistogram::~LatencyHistogram()
+{
+}
+
+
+void LatencyHistogram::record(unsigned long latency_us)
+{
+  ++_buckets[bucket(latency_us)];
+}
+
+
+void LatencyHistogram::snapshot(std::vector<uint_fast64_t>& counts)
+{
+  counts.resize(NUM_BUCKETS);
+  for (int ii = 0; ii < NUM_BUCKETS; ++ii)
+  {
+    counts[ii] = _buckets[ii].exchange(0);
+  }
+}
+
+
+uint_fast64_t LatencyHistogram::total(const std::vector<uint_fast64_t>& counts)
+{
+  uint_fast64_t total = 0;
+  for (size_t ii = 0; ii < counts.size(); ++ii)
+  {
+    total += counts[ii];
+  }
+  return total;
+}
+
+
+unsigned long LatencyHistogram::percentile(const std::vector<uint_fast64_t>& counts,
+                                           double p)
+{
+  uint_fast64_t n = total(counts);
+
+  if (n == 0)
+  {
+    return 0;
+  }
+
+  // Work out the rank of the sample at the percentile (counting from 1), then
+  // find the bucket it falls in.
+  uint_fast64_t rank = (uint_fast64_t)(p * n);
+  if ((double)rank < p * n)
+  {
+    ++rank;
+  }
+  if (rank == 0)
+  {
+    rank = 1;
+  }
+
+  uint_fast64_t seen = 0;
+  for (size_t ii = 0; ii < counts.size(); ++ii)
+  {
+    seen += counts[ii];
+    if (seen >= rank)
+    {
+      return bucket_upper_bound(ii);
+    }
+  }
+
+  return bucket_upper_bound(counts.size() - 1);
+}
+
+
+void LatencyHistogram::report(std::vector<std::string>& values)
+{
+  std::vector<uint_fast64_t> counts;
+  snapshot(counts);
+
+  values.push_back(std::to_string(total(counts)));
+  values.push_back(std::to_string(percentile(counts, 0.5)));
+  values.push_back(std::to_string(percentile(counts, 0.9)));
+  values.push_back(std::to_string(percentile(counts, 0.99)));
+  values.push_back(std::to_string(percentile(counts, 0.999)));
+}
+
+
+/// Buckets below LINEAR_LIMIT hold a single value.  Above that, each power of
+/// two is split in to four buckets.
+int LatencyHistogram::bucket(unsigned long latency_us)
+{
+  if (latency_us < LINEAR_LIMIT)
+  {
+    return (int)latency_us;
+  }
+
+  int exponent = 63 - __builtin_clzl(latency_us);
+  int sub_bucket = (latency_us >> (exponent - 2)) & 3;
+  int bucket = LINEAR_LIMIT + (exponent - 4) * 4 + sub_bucket;
+
+  return (bucket < NUM_BUCKETS) ? bucket : NUM_BUCKETS - 1;
+}
+
+
+unsigned long LatencyHistogram::bucket_upper_bound(int bucket)
+{
+  if (bucket < (int)LINEAR_LIMIT)
+  {
+    return bucket;
+  }
+
+  int exponent = (bucket - LINEAR_LIMIT) / 4 + 4;
+  int sub_bucket = (bucket - LINEAR_LIMIT) % 4;
+
+  return ((4ul + sub_bucket + 1) << (exponent - 2)) - 1;
+}
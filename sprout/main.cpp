@@ -63,6 +63,10 @@ extern "C" {
 #include "sasevent.h"
 #include "analyticslogger.h"
 #include "regstore.h"
+#include "aor_cache.h"
+#include "aor_write_coalescer.h"
+#include "aor_replicator.h"
+#include "chronos_timer_batcher.h"
 #include "stack.h"
 #include "hssconnection.h"
 #include "xdmconnection.h"
@@ -74,6 +78,8 @@ extern "C" {
 #include "authentication.h"
 #include "options.h"
 #include "enumservice.h"
+#include "regex_cache.h"
+#include "scscf_assignment_cache.h"
 #include "bgcfservice.h"
 #include "pjutils.h"
 #include "log.h"
@@ -89,6 +95,7 @@ extern "C" {
 #include "sproutlet.h"
 #include "sproutletappserver.h"
 #include "sproutletproxy.h"
+#include "thread_affinity.h"
 #include "scscfsproutlet.h"
 #include "icscfsproutlet.h"
 #include "bgcfsproutlet.h"
@@ -106,7 +113,31 @@ enum OptionTypes
   OPT_MEMENTO_THREADS,
   OPT_CALL_LIST_TTL,
   OPT_MEMENTO_ENABLED,
-  OPT_GEMINI_ENABLED
+  OPT_GEMINI_ENABLED,
+  OPT_WORKER_QUEUES,
+  OPT_MAX_QUEUE_DEPTHS,
+  OPT_ASYNC_HTTP_THREADS,
+  OPT_PJSIP_CPUS,
+  OPT_WORKER_CPUS,
+  OPT_SERVICE_CPUS,
+  OPT_NUMA_LOCAL,
+  OPT_WORKER_BATCH_SIZE,
+  OPT_MAX_WORKER_THREADS,
+  OPT_TARGET_LATENCIES,
+  OPT_BINARY_AOR_FORMAT,
+  OPT_PER_BINDING_STORAGE,
+  OPT_AOR_CACHE_SIZE,
+  OPT_AOR_CACHE_STALENESS,
+  OPT_COALESCE_AOR_WRITES,
+  OPT_REMOTE_REPLICATION_THREADS,
+  OPT_REMOTE_REPLICATION_QUEUE,
+  OPT_CHRONOS_BATCH_WINDOW,
+  OPT_HSS_PROFILE_CACHE_SIZE,
+  OPT_HSS_PROFILE_CACHE_TTL,
+  OPT_HSS_PROFILE_CACHE_MAX_TTL,
+  OPT_REGEX_CACHE_SIZE,
+  OPT_SCSCF_ASSIGNMENT_CACHE_SIZE,
+  OPT_SCSCF_ASSIGNMENT_CACHE_TTL
 };
 
 struct options
@@ -166,6 +197,30 @@ struct options
   pj_bool_t              memento_enabled;
   pj_bool_t              gemini_enabled;
   int                    worker_threads;
+  int                    worker_queues;
+  std::vector<unsigned int> max_queue_depths;
+  std::vector<int>       target_latencies;
+  int                    worker_batch_size;
+  int                    max_worker_threads;
+  int                    async_http_threads;
+  std::string            pjsip_cpus;
+  std::string            worker_cpus;
+  std::string            service_cpus;
+  pj_bool_t              numa_local;
+  pj_bool_t              binary_aor_format;
+  pj_bool_t              per_binding_storage;
+  int                    aor_cache_size;
+  int                    aor_cache_staleness;
+  pj_bool_t              coalesce_aor_writes;
+  int                    remote_replication_threads;
+  int                    remote_replication_queue;
+  int                    chronos_batch_window;
+  int                    hss_profile_cache_size;
+  int                    hss_profile_cache_ttl;
+  int                    hss_profile_cache_max_ttl;
+  int                    regex_cache_size;
+  int                    scscf_assignment_cache_size;
+  int                    scscf_assignment_cache_ttl;
   pj_bool_t              log_to_file;
   std::string            log_directory;
   int                    log_level;
@@ -207,6 +262,30 @@ const static struct pj_getopt_option long_opt[] =
   { "sub-max-expires",   required_argument, 0, OPT_SUB_MAX_EXPIRES},
   { "pjsip-threads",     required_argument, 0, 'P'},
   { "worker-threads",    required_argument, 0, 'W'},
+  { "worker-queues",     required_argument, 0, OPT_WORKER_QUEUES},
+  { "max-queue-depths",  required_argument, 0, OPT_MAX_QUEUE_DEPTHS},
+  { "async-http-threads", required_argument, 0, OPT_ASYNC_HTTP_THREADS},
+  { "pjsip-cpus",        required_argument, 0, OPT_PJSIP_CPUS},
+  { "worker-cpus",       required_argument, 0, OPT_WORKER_CPUS},
+  { "service-cpus",      required_argument, 0, OPT_SERVICE_CPUS},
+  { "numa-local",        no_argument,       0, OPT_NUMA_LOCAL},
+  { "binary-aor-format", no_argument,       0, OPT_BINARY_AOR_FORMAT},
+  { "per-binding-storage", no_argument,     0, OPT_PER_BINDING_STORAGE},
+  { "aor-cache-size",    required_argument, 0, OPT_AOR_CACHE_SIZE},
+  { "aor-cache-staleness", required_argument, 0, OPT_AOR_CACHE_STALENESS},
+  { "coalesce-aor-writes", no_argument,     0, OPT_COALESCE_AOR_WRITES},
+  { "remote-replication-threads", required_argument, 0, OPT_REMOTE_REPLICATION_THREADS},
+  { "remote-replication-queue", required_argument, 0, OPT_REMOTE_REPLICATION_QUEUE},
+  { "chronos-batch-window", required_argument, 0, OPT_CHRONOS_BATCH_WINDOW},
+  { "hss-profile-cache-size", required_argument, 0, OPT_HSS_PROFILE_CACHE_SIZE},
+  { "hss-profile-cache-ttl", required_argument, 0, OPT_HSS_PROFILE_CACHE_TTL},
+  { "hss-profile-cache-max-ttl", required_argument, 0, OPT_HSS_PROFILE_CACHE_MAX_TTL},
+  { "regex-cache-size", required_argument, 0, OPT_REGEX_CACHE_SIZE},
+  { "scscf-assignment-cache-size", required_argument, 0, OPT_SCSCF_ASSIGNMENT_CACHE_SIZE},
+  { "scscf-assignment-cache-ttl", required_argument, 0, OPT_SCSCF_ASSIGNMENT_CACHE_TTL},
+  { "worker-batch-size", required_argument, 0, OPT_WORKER_BATCH_SIZE},
+  { "max-worker-threads", required_argument, 0, OPT_MAX_WORKER_THREADS},
+  { "target-latencies",  required_argument, 0, OPT_TARGET_LATENCIES},
   { "analytics",         required_argument, 0, 'a'},
   { "authentication",    no_argument,       0, 'A'},
   { "log-file",          required_argument, 0, 'F'},
@@ -325,6 +404,103 @@ static void usage(void)
        " -P, --pjsip_threads N      Number of PJSIP threads (default: 1)\n"
        " -B, --billing-cdf <server> Billing CDF server\n"
        " -W, --worker_threads N     Number of worker threads (default: 1)\n"
+       "     --max-worker-threads N Maximum number of worker threads.  If this is more than\n"
+       "                            --worker_threads, extra threads are added when messages are\n"
+       "                            queuing while the worker threads are blocked on I/O, and\n"
+       "                            removed again when they are idle (default: the same as\n"
+       "                            --worker_threads)\n"
+       "     --worker-queues N      Number of independent worker queues.  Received messages are\n"
+       "                            distributed across the queues by Call-ID and the worker\n"
+       "                            threads are shared evenly between them.  All messages\n"
+       "                            with the same Call-ID use the same queue, so a single busy\n"
+       "                            dialog or UA is not spread across queues (default: 1)\n"
+       "     --max-queue-depths <in-dialog>,<new session>,<registration>\n"
+       "                            Maximum number of queued messages of each priority class\n"
+       "                            per worker queue.  Requests arriving when their class is\n"
+       "                            full are rejected with a 503.  Zero means unlimited\n"
+       "                            (default: 0,0,0)\n"
+       "     --target-latencies <in-dialog>,<new session>,<registration>\n"
+       "                            Target latency (in microseconds) for requests of each priority\n"
+       "                            class.  If set, each class is also throttled separately under\n"
+       "                            overload to keep its latency near its target, within the\n"
+       "                            overall limit set by the load monitor.  A zero or missing\n"
+       "                            value uses the default of 200000 for in-dialog requests and\n"
+       "                            100000 for the others.  If not set, all requests are throttled\n"
+       "                            together by the load monitor\n"
+       "     --worker-batch-size N  Maximum number of messages a worker thread takes from its\n"
+       "                            queue at a time.  Fewer are taken when the queue is short\n"
+       "                            and other worker threads are idle.  Larger batches reduce\n"
+       "                            contention on the queue, but higher priority messages that\n"
+       "                            arrive wait for the rest of the current batch (default: 1)\n"
+       "     --async-http-threads N Number of threads used to make HSS and Ralf requests without\n"
+       "                            blocking the worker threads, and to read batches of\n"
+       "                            registration records concurrently.  If zero, requests are\n"
+       "                            made on the worker threads (default: 0)\n"
+       "     --pjsip-cpus <cpus>[;<cpus>...]\n"
+       "                            CPUs to pin the PJSIP threads to, as CPU lists (for example\n"
+       "                            0-3,8).  If several groups are given the threads are shared\n"
+       "                            between them\n"
+       "     --worker-cpus <cpus>[;<cpus>...]\n"
+       "                            CPUs to pin the worker threads to.  If several groups are\n"
+       "                            given, the workers for each worker queue use one group\n"
+       "     --service-cpus <cpus>  CPUs to pin all other threads to (including the HTTP stack,\n"
+       "                            WebSockets and connection recycling threads)\n"
+       "     --numa-local           Make pinned threads prefer memory from the NUMA node of\n"
+       "                            their CPUs\n"
+       "     --binary-aor-format    Write registration data in the binary format, which is\n"
+       "                            faster to read and write but can't be read by older\n"
+       "                            releases.  Only set this once every node has been upgraded.\n"
+       "                            Data in either format is always read\n"
+       "     --per-binding-storage  Store each binding and subscription of an AoR as a separate\n"
+       "                            record, so updating a binding doesn't rewrite the whole\n"
+       "                            AoR.  This uses the binary format, so is ignored unless\n"
+       "                            --binary-aor-format is set\n"
+       "     --aor-cache-size N     Maximum number of AoRs cached for terminating lookups\n"
+       "                            (default: 0, which disables the cache)\n"
+       "     --aor-cache-staleness <milliseconds>\n"
+       "                            How long a cached AoR can be used for after it was read.\n"
+       "                            Updates made by other nodes may not be seen for this long\n"
+       "                            (default: 500)\n"
+       "     --coalesce-aor-writes  Combine updates to an AoR that arrive while it is being\n"
+       "                            written into a single update, rather than each having to\n"
+       "                            retry\n"
+       "     --remote-replication-threads N\n"
+       "                            Number of threads used to replicate registration data to\n"
+       "                            the remote store in the background.  If zero, the remote\n"
+       "                            store is written before responding to each request\n"
+       "                            (default: 0)\n"
+       "     --remote-replication-queue N\n"
+       "                            Maximum number of AoRs with changes waiting to be\n"
+       "                            replicated to the remote store (default: 10000)\n"
+       "     --chronos-batch-window <milliseconds>\n"
+       "                            How long updates and deletions of Chronos timers are held\n"
+       "                            so they can be combined and sent in batches in the\n"
+       "                            background (default: 0, which sends each one while\n"
+       "                            handling the request)\n"
+       "     --hss-profile-cache-size N\n"
+       "                            Maximum number of subscriber profiles read from the HSS\n"
+       "                            cached for use by later requests (default: 0, which\n"
+       "                            disables the cache)\n"
+       "     --hss-profile-cache-ttl <milliseconds>\n"
+       "                            How long a cached subscriber profile can be used for after\n"
+       "                            it was read.  Changes not made through this node may not\n"
+       "                            be seen for this long (default: 30000)\n"
+       "     --hss-profile-cache-max-ttl <milliseconds>\n"
+       "                            How long the subscriber profile read when a subscriber\n"
+       "                            registers can be used for, if the registration lasts that\n"
+       "                            long.  Changes not made through this node may not be seen\n"
+       "                            for this long (default: 300000)\n"
+       "     --regex-cache-size N\n"
+       "                            Maximum number of compiled regular expressions (from iFCs\n"
+       "                            and ENUM rules) cached for reuse (default: 1000)\n"
+       "     --scscf-assignment-cache-size N\n"
+       "                            Maximum number of S-CSCF assignments (and unknown\n"
+       "                            subscribers) read from the HSS by the I-CSCF cached for\n"
+       "                            use by later requests (default: 0, which disables the\n"
+       "                            cache)\n"
+       "     --scscf-assignment-cache-ttl <milliseconds>\n"
+       "                            How long a cached S-CSCF assignment can be used for after\n"
+       "                            it was read (default: 5000)\n"
        " -a, --analytics <directory>\n"
        "                            Generate analytics logs in specified directory\n"
        " -A, --authentication       Enable authentication\n"
@@ -713,6 +889,151 @@ static pj_status_t init_options(int argc, char* argv[], struct options* options)
       LOG_INFO("Use %d worker threads", options->worker_threads);
       break;
 
+    case OPT_WORKER_QUEUES:
+      options->worker_queues = atoi(pj_optarg);
+      LOG_INFO("Use %d worker queues", options->worker_queues);
+      break;
+
+    case OPT_MAX_WORKER_THREADS:
+      options->max_worker_threads = atoi(pj_optarg);
+      LOG_INFO("Use up to %d worker threads", options->max_worker_threads);
+      break;
+
+    case OPT_WORKER_BATCH_SIZE:
+      options->worker_batch_size = atoi(pj_optarg);
+      LOG_INFO("Worker threads take up to %d messages at a time", options->worker_batch_size);
+      break;
+
+    case OPT_ASYNC_HTTP_THREADS:
+      options->async_http_threads = atoi(pj_optarg);
+      LOG_INFO("Use %d asynchronous HTTP threads", options->async_http_threads);
+      break;
+
+    case OPT_PJSIP_CPUS:
+      options->pjsip_cpus = std::string(pj_optarg);
+      LOG_INFO("PJSIP threads pinned to CPUs %s", pj_optarg);
+      break;
+
+    case OPT_WORKER_CPUS:
+      options->worker_cpus = std::string(pj_optarg);
+      LOG_INFO("Worker threads pinned to CPUs %s", pj_optarg);
+      break;
+
+    case OPT_SERVICE_CPUS:
+      options->service_cpus = std::string(pj_optarg);
+      LOG_INFO("Other threads pinned to CPUs %s", pj_optarg);
+      break;
+
+    case OPT_BINARY_AOR_FORMAT:
+      options->binary_aor_format = PJ_TRUE;
+      LOG_INFO("Registration data written in the binary format");
+      break;
+
+    case OPT_PER_BINDING_STORAGE:
+      options->per_binding_storage = PJ_TRUE;
+      LOG_INFO("Registration data stored per binding");
+      break;
+
+    case OPT_AOR_CACHE_SIZE:
+      options->aor_cache_size = atoi(pj_optarg);
+      LOG_INFO("Cache up to %d AoRs for lookups", options->aor_cache_size);
+      break;
+
+    case OPT_AOR_CACHE_STALENESS:
+      options->aor_cache_staleness = atoi(pj_optarg);
+      LOG_INFO("Cached AoRs used for up to %dms", options->aor_cache_staleness);
+      break;
+
+    case OPT_COALESCE_AOR_WRITES:
+      options->coalesce_aor_writes = PJ_TRUE;
+      LOG_INFO("Concurrent updates to AoRs are combined");
+      break;
+
+    case OPT_REMOTE_REPLICATION_THREADS:
+      options->remote_replication_threads = atoi(pj_optarg);
+      LOG_INFO("Use %d threads to replicate to the remote store",
+               options->remote_replication_threads);
+      break;
+
+    case OPT_REMOTE_REPLICATION_QUEUE:
+      options->remote_replication_queue = atoi(pj_optarg);
+      LOG_INFO("Up to %d AoRs waiting to be replicated",
+               options->remote_replication_queue);
+      break;
+
+    case OPT_CHRONOS_BATCH_WINDOW:
+      options->chronos_batch_window = atoi(pj_optarg);
+      LOG_INFO("Chronos timer batching window set to %dms",
+               options->chronos_batch_window);
+      break;
+
+    case OPT_HSS_PROFILE_CACHE_SIZE:
+      options->hss_profile_cache_size = atoi(pj_optarg);
+      LOG_INFO("Cache up to %d subscriber profiles",
+               options->hss_profile_cache_size);
+      break;
+
+    case OPT_HSS_PROFILE_CACHE_TTL:
+      options->hss_profile_cache_ttl = atoi(pj_optarg);
+      LOG_INFO("Cached subscriber profiles used for up to %dms",
+               options->hss_profile_cache_ttl);
+      break;
+
+    case OPT_HSS_PROFILE_CACHE_MAX_TTL:
+      options->hss_profile_cache_max_ttl = atoi(pj_optarg);
+      LOG_INFO("Subscriber profiles cached at registration used for up to %dms",
+               options->hss_profile_cache_max_ttl);
+      break;
+
+    case OPT_REGEX_CACHE_SIZE:
+      options->regex_cache_size = atoi(pj_optarg);
+      LOG_INFO("Cache up to %d compiled regular expressions",
+               options->regex_cache_size);
+      break;
+
+    case OPT_SCSCF_ASSIGNMENT_CACHE_SIZE:
+      options->scscf_assignment_cache_size = atoi(pj_optarg);
+      LOG_INFO("Cache up to %d S-CSCF assignments",
+               options->scscf_assignment_cache_size);
+      break;
+
+    case OPT_SCSCF_ASSIGNMENT_CACHE_TTL:
+      options->scscf_assignment_cache_ttl = atoi(pj_optarg);
+      LOG_INFO("Cached S-CSCF assignments used for up to %dms",
+               options->scscf_assignment_cache_ttl);
+      break;
+
+    case OPT_NUMA_LOCAL:
+      options->numa_local = PJ_TRUE;
+      LOG_INFO("Pinned threads use NUMA local memory");
+      break;
+
+    case OPT_MAX_QUEUE_DEPTHS:
+      {
+        std::vector<std::string> depths;
+        Utils::split_string(std::string(pj_optarg), ',', depths, 0, false);
+        options->max_queue_depths.clear();
+        for (size_t ii = 0; ii < depths.size(); ++ii)
+        {
+          options->max_queue_depths.push_back(atoi(depths[ii].c_str()));
+        }
+        LOG_INFO("Maximum queue depths set to %s", pj_optarg);
+      }
+      break;
+
+    case OPT_TARGET_LATENCIES:
+      {
+        std::vector<std::string> latencies;
+        Utils::split_string(std::string(pj_optarg), ',', latencies, 0, false);
+        options->target_latencies.clear();
+        for (size_t ii = 0; ii < latencies.size(); ++ii)
+        {
+          options->target_latencies.push_back(atoi(latencies[ii].c_str()));
+        }
+        LOG_INFO("Target latencies set to %s", pj_optarg);
+      }
+      break;
+
     case 'a':
       options->analytics_enabled = PJ_TRUE;
       options->analytics_directory = std::string(pj_optarg);
@@ -1011,10 +1332,17 @@ int main(int argc, char* argv[])
   Store* remote_data_store = NULL;
   RegStore* local_reg_store = NULL;
   RegStore* remote_reg_store = NULL;
+  AoRCache* aor_cache = NULL;
+  AoRWriteCoalescer* aor_write_coalescer = NULL;
+  AoRReplicator* aor_replicator = NULL;
+  ChronosTimerBatcher* chronos_timer_batcher = NULL;
   AvStore* av_store = NULL;
   SCSCFSelector* scscf_selector = NULL;
+  SCSCFAssignmentCache* scscf_assignment_cache = NULL;
   ChronosConnection* chronos_connection = NULL;
   HttpConnection* ralf_connection = NULL;
+  AsyncDispatcher* async_dispatcher = NULL;
+  RegexCache* regex_cache = NULL;
   ACRFactory* scscf_acr_factory = NULL;
   ACRFactory* bgcf_acr_factory = NULL;
   ACRFactory* icscf_acr_factory = NULL;
@@ -1071,6 +1399,25 @@ int main(int argc, char* argv[])
   opt.record_routing_model = 1;
   opt.default_session_expires = 10 * 60;
   opt.worker_threads = 1;
+  opt.worker_queues = 1;
+  opt.worker_batch_size = 1;
+  opt.max_worker_threads = 0;
+  opt.async_http_threads = 0;
+  opt.numa_local = PJ_FALSE;
+  opt.binary_aor_format = PJ_FALSE;
+  opt.per_binding_storage = PJ_FALSE;
+  opt.aor_cache_size = 0;
+  opt.aor_cache_staleness = 500;
+  opt.coalesce_aor_writes = PJ_FALSE;
+  opt.remote_replication_threads = 0;
+  opt.remote_replication_queue = 10000;
+  opt.chronos_batch_window = 0;
+  opt.hss_profile_cache_size = 0;
+  opt.hss_profile_cache_ttl = 30000;
+  opt.hss_profile_cache_max_ttl = 300000;
+  opt.regex_cache_size = 1000;
+  opt.scscf_assignment_cache_size = 0;
+  opt.scscf_assignment_cache_ttl = 5000;
   opt.analytics_enabled = PJ_FALSE;
   opt.http_address = "0.0.0.0";
   opt.http_port = 9888;
@@ -1146,6 +1493,31 @@ int main(int argc, char* argv[])
     return 1;
   }
 
+  // Save the original CPU affinity, so that PJSIP and worker threads with no
+  // configured CPUs can go back to it.
+  ThreadAffinity::save_process_cpus();
+
+  if (!opt.service_cpus.empty())
+  {
+    // Pin this thread before any other threads are created - threads
+    // inherit the CPU affinity of the thread that creates them, so this
+    // covers all the threads that aren't explicitly pinned elsewhere.  The
+    // PJSIP and worker threads also inherit it, but set their own affinity
+    // (to their configured CPUs, or back to the original affinity) when
+    // they start.
+    cpu_set_t service_cpus;
+    if (!ThreadAffinity::parse_cpu_list(opt.service_cpus, service_cpus))
+    {
+      LOG_ERROR("Invalid service CPU list %s", opt.service_cpus.c_str());
+      return 1;
+    }
+    ThreadAffinity::pin_thread("main", service_cpus, opt.numa_local);
+  }
+  else
+  {
+    ThreadAffinity::record_placement("main");
+  }
+
   if (opt.analytics_enabled)
   {
     analytics_logger_logger = new Logger(opt.analytics_directory, std::string("log"));
@@ -1277,10 +1649,15 @@ int main(int argc, char* argv[])
                       sip_resolver,
                       opt.pjsip_threads,
                       opt.worker_threads,
+                      opt.max_worker_threads,
+                      opt.worker_queues,
+                      opt.max_queue_depths,
+                      opt.worker_batch_size,
                       opt.record_routing_model,
                       opt.default_session_expires,
                       quiescing_mgr,
                       load_monitor,
+                      opt.target_latencies,
                       opt.billing_cdf);
 
   if (status != PJ_SUCCESS)
@@ -1289,6 +1666,15 @@ int main(int argc, char* argv[])
     return 1;
   }
 
+  status = set_stack_thread_affinity(opt.pjsip_cpus,
+                                     opt.worker_cpus,
+                                     opt.numa_local);
+  if (status != PJ_SUCCESS)
+  {
+    LOG_ERROR("Invalid PJSIP or worker thread CPU lists");
+    return 1;
+  }
+
   // Now that we know the address family, create an HttpResolver too.
   http_resolver = new HttpResolver(dns_resolver, stack_data.addr_family);
 
@@ -1304,9 +1690,22 @@ int main(int argc, char* argv[])
                                          SASEvent::HttpLogLevel::PROTOCOL);
   }
 
+  if (opt.async_http_threads > 0)
+  {
+    // Create the thread pool used to make HTTP requests without blocking the
+    // worker threads.
+    async_dispatcher = new AsyncDispatcher(opt.async_http_threads);
+  }
+
   // Initialise the OPTIONS handling module.
   status = init_options();
 
+  // Create the cache of compiled regular expressions used when evaluating
+  // iFCs and ENUM rules.
+  regex_cache = new RegexCache(opt.regex_cache_size,
+                               stack_data.stats_aggregator);
+  RegexCache::set_instance(regex_cache);
+
   if (opt.hss_server != "")
   {
     // Create a connection to the HSS.
@@ -1314,7 +1713,10 @@ int main(int argc, char* argv[])
     hss_connection = new HSSConnection(opt.hss_server,
                                        http_resolver,
                                        load_monitor,
-                                       stack_data.stats_aggregator);
+                                       stack_data.stats_aggregator,
+                                       opt.hss_profile_cache_size,
+                                       opt.hss_profile_cache_ttl,
+                                       opt.hss_profile_cache_max_ttl);
   }
 
   if (ralf_connection != NULL)
@@ -1323,18 +1725,26 @@ int main(int argc, char* argv[])
     if (opt.scscf_enabled)
     {
       // Create ACRFactory instances for the S-CSCF and BGCF.
-      scscf_acr_factory = (ACRFactory*)new RalfACRFactory(ralf_connection, SCSCF);
-      bgcf_acr_factory = (ACRFactory*)new RalfACRFactory(ralf_connection, BGCF);
+      scscf_acr_factory = (ACRFactory*)new RalfACRFactory(ralf_connection,
+                                                          SCSCF,
+                                                          async_dispatcher);
+      bgcf_acr_factory = (ACRFactory*)new RalfACRFactory(ralf_connection,
+                                                         BGCF,
+                                                         async_dispatcher);
     }
     if (opt.icscf_enabled)
     {
       // Create ACRFactory instance for the I-CSCF.
-      icscf_acr_factory = (ACRFactory*)new RalfACRFactory(ralf_connection, ICSCF);
+      icscf_acr_factory = (ACRFactory*)new RalfACRFactory(ralf_connection,
+                                                          ICSCF,
+                                                          async_dispatcher);
     }
     if (opt.pcscf_enabled)
     {
       // Create ACRFactory instance for the P-CSCF.
-      pcscf_acr_factory = (ACRFactory*)new RalfACRFactory(ralf_connection, PCSCF);
+      pcscf_acr_factory = (ACRFactory*)new RalfACRFactory(ralf_connection,
+                                                          PCSCF,
+                                                          async_dispatcher);
     }
   }
   else
@@ -1365,6 +1775,18 @@ int main(int argc, char* argv[])
     chronos_connection = new ChronosConnection(opt.chronos_service,
                                                chronos_callback_host,
                                                http_resolver);
+
+    if (opt.chronos_batch_window > 0)
+    {
+      // Send batches of up to 100 operations from 2 threads, with up to
+      // 10000 operations waiting before they are sent directly.
+      chronos_timer_batcher = new ChronosTimerBatcher(chronos_connection,
+                                                      opt.chronos_batch_window,
+                                                      100,
+                                                      2,
+                                                      10000,
+                                                      stack_data.stats_aggregator);
+    }
   }
 
   if (opt.pcscf_enabled)
@@ -1444,8 +1866,51 @@ int main(int argc, char* argv[])
     }
 
     // Create local and optionally remote registration data stores.
-    local_reg_store = new RegStore(local_data_store, chronos_connection);
-    remote_reg_store = (remote_data_store != NULL) ? new RegStore(remote_data_store, chronos_connection) : NULL;
+    RegStore::SerializerFormat aor_format = (opt.binary_aor_format) ?
+                                              RegStore::FORMAT_BINARY :
+                                              RegStore::FORMAT_LEGACY;
+    RegStore::StorageLayout aor_layout = RegStore::LAYOUT_AOR;
+    if (opt.per_binding_storage)
+    {
+      if (opt.binary_aor_format)
+      {
+        aor_layout = RegStore::LAYOUT_PER_BINDING;
+      }
+      else
+      {
+        LOG_WARNING("Per-binding storage needs the binary AoR format, so is disabled");
+      }
+    }
+
+    // Only lookups in the local store are cached.  The remote store is only
+    // used when the local store has no bindings.
+    if (opt.aor_cache_size > 0)
+    {
+      aor_cache = new AoRCache(opt.aor_cache_size,
+                               opt.aor_cache_staleness,
+                               stack_data.stats_aggregator);
+    }
+
+    // Only updates to the local store are combined, as they are the ones
+    // that hold up the response.
+    if (opt.coalesce_aor_writes)
+    {
+      aor_write_coalescer = new AoRWriteCoalescer(stack_data.stats_aggregator);
+    }
+
+    remote_reg_store = (remote_data_store != NULL) ? new RegStore(remote_data_store, chronos_connection, aor_format, aor_layout, NULL, async_dispatcher, NULL, NULL, chronos_timer_batcher) : NULL;
+
+    // Replicate updates to the remote store in the background if required,
+    // so the round trip to the remote site doesn't delay the responses.
+    if ((remote_reg_store != NULL) && (opt.remote_replication_threads > 0))
+    {
+      aor_replicator = new AoRReplicator(remote_reg_store,
+                                         opt.remote_replication_threads,
+                                         opt.remote_replication_queue,
+                                         stack_data.stats_aggregator);
+    }
+
+    local_reg_store = new RegStore(local_data_store, chronos_connection, aor_format, aor_layout, aor_cache, async_dispatcher, aor_write_coalescer, aor_replicator, chronos_timer_batcher);
 
     if (opt.xdm_server != "")
     {
@@ -1581,6 +2046,15 @@ int main(int argc, char* argv[])
       return 1;
     }
 
+    if (opt.scscf_assignment_cache_size > 0)
+    {
+      // Create the cache of S-CSCF assignments read from the HSS.
+      scscf_assignment_cache =
+        new SCSCFAssignmentCache(opt.scscf_assignment_cache_size,
+                                 opt.scscf_assignment_cache_ttl,
+                                 stack_data.stats_aggregator);
+    }
+
     // Create the I-CSCF sproutlet.
     ICSCFSproutlet* icscf_sproutlet = new ICSCFSproutlet(opt.icscf_port,
                                                          hss_connection,
@@ -1588,7 +2062,8 @@ int main(int argc, char* argv[])
                                                          scscf_selector,
                                                          enum_service,
                                                          opt.enforce_global_only_lookups,
-                                                         opt.enforce_user_phone);
+                                                         opt.enforce_user_phone,
+                                                         scscf_assignment_cache);
     if (icscf_sproutlet == NULL)
     {
       LOG_ERROR("Failed to create I-CSCF Sproutlet");
@@ -1672,7 +2147,8 @@ int main(int argc, char* argv[])
                                          std::string(stack_data.scscf_uri.ptr,
                                                      stack_data.scscf_uri.slen),
                                          host_aliases,
-                                         sproutlets);
+                                         sproutlets,
+                                         async_dispatcher);
     if (sproutlet_proxy == NULL)
     {
       LOG_ERROR("Failed to create SproutletProxy");
@@ -1736,7 +2212,26 @@ int main(int argc, char* argv[])
     }
   }
 
+  if (async_dispatcher != NULL)
+  {
+    // Stop the asynchronous HTTP threads while the worker threads are still
+    // running, so every transaction waiting for an operation is resumed
+    // (with the operation failed if it hadn't started) on a worker thread.
+    async_dispatcher->stop();
+  }
+
   stop_stack();
+  delete async_dispatcher;
+
+  // Send any Chronos timer operations still waiting.  This must be done
+  // while the registration stores can still be written, as Chronos may
+  // change timers' IDs.
+  delete chronos_timer_batcher;
+
+  // Stop replicating registration data.  Any changes not yet replicated are
+  // lost.
+  delete aor_replicator;
+
   // We must unregister stack modules here because this terminates the
   // transaction layer, which can otherwise generate work for other modules
   // after they have unregistered.
@@ -1779,9 +2274,13 @@ int main(int argc, char* argv[])
   if (opt.icscf_enabled)
   {
     delete scscf_selector;
+    delete scscf_assignment_cache;
     delete icscf_acr_factory;
   }
 
+  RegexCache::set_instance(NULL);
+  delete regex_cache;
+
   destroy_options();
   destroy_stack();
 
@@ -1789,6 +2288,8 @@ int main(int argc, char* argv[])
   delete load_monitor;
   delete local_reg_store;
   delete remote_reg_store;
+  delete aor_cache;
+  delete aor_write_coalescer;
   delete av_store;
   delete local_data_store;
   delete remote_data_store;
@@ -0,0 +1,154 @@
+/**
+ * @file regex_cache.cpp  Process-wide cache of compiled regular expressions.
+ *
+ * Project Clearwater - IMS in the Cloud
+ * Copyright (C) 2014  Metaswitch Networks Ltd
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or (at your
+ * option) any later version, along with the "Special Exception" for use of
+ * the program along with SSL, set forth below. This program is distributed
+ * in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+ * without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details. You should have received a copy of the GNU General Public
+ * License along with this program.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ *
+ * The author can be reached by email at clearwater@metaswitch.com or by
+ * post at Metaswitch Networks Ltd, 100 Church St, Enfield EN2 6BQ, UK
+ *
+ * Special Exception
+ * Metaswitch Networks Ltd  grants you permission to copy, modify,
+ * propagate, and distribute a work formed by combining OpenSSL with The
+ * Software, or a work derivative of such a combination, even if such
+ * copying, modification, propagation, or distribution would otherwise
+ * violate the terms of the GPL. You must comply with the GPL in all
+ * respects for all of the code used other than OpenSSL.
+ * "OpenSSL" means OpenSSL toolkit software distributed by the OpenSSL
+ * Project and licensed under the OpenSSL Licenses, or a work based on such
+ * software and licensed under the OpenSSL Licenses.
+ * "OpenSSL Licenses" means the OpenSSL License and Original SSLeay License
+ * under which the OpenSSL Project distributes the OpenSSL toolkit software,
+ * as those licenses appear in the file LICENSE-OPENSSL.
+ */
+
+#include <time.h>
+
+#include <vector>
+
+#include "regex_cache.h"
+#include "stack.h"
+#include "log.h"
+
+RegexCache* RegexCache::_instance = NULL;
+
+RegexCache::RegexCache(int max_entries,
+                       LastValueCache* stats_aggregator) :
+  _cache(max_entries, 0),
+  _compile_us(0),
+  _invalid(0),
+  _statistic("regex_cache", stats_aggregator)
+{
+  add_stats_reporter(this, [this]() { report_stats(); });
+}
+
+
+RegexCache::~RegexCache()
+{
+  remove_stats_reporter(this);
+}
+
+
+RegexCache::Regex RegexCache::get(const std::string& pattern,
+                                  boost::regex::flag_type flags)
+{
+  std::string key = std::to_string(flags) + ":" + pattern;
+  Regex regex;
+  uint64_t generation;
+
+  if (!_cache.get(key, regex, generation))
+  {
+    // Compile the expression without holding a lock, as this can be slow.
+    // If another thread compiles the same expression at the same time, both
+    // compiled forms are equivalent, so it doesn't matter which is cached.
+    uint64_t start_us = now_us();
+    regex = compile_uncached(pattern, flags);
+    _compile_us += now_us() - start_us;
+
+    if (!regex)
+    {
+      LOG_DEBUG("Invalid regular expression %s", pattern.c_str());
+      _invalid++;
+    }
+
+    _cache.put(key, regex);
+  }
+
+  return regex;
+}
+
+
+/// Reports the number of hits, misses (that is, compilations), the hit rate
+/// (as a percentage), the average compile time (in microseconds), the number
+/// of invalid expressions compiled, evictions and the number of entries.
+void RegexCache::report_stats()
+{
+  ShardedLRUCache<Regex>::Stats stats;
+  _cache.get_stats(stats);
+  uint_fast64_t compile_us = _compile_us.exchange(0);
+
+  std::vector<std::string> values;
+  values.push_back(std::to_string(stats.hits));
+  values.push_back(std::to_string(stats.misses));
+  values.push_back(std::to_string(((stats.hits + stats.misses) > 0) ?
+                                    (stats.hits * 100) / (stats.hits + stats.misses) : 0));
+  values.push_back(std::to_string((stats.misses > 0) ? compile_us / stats.misses : 0));
+  values.push_back(std::to_string(_invalid.exchange(0)));
+  values.push_back(std::to_string(stats.evictions));
+  values.push_back(std::to_string(stats.entries));
+  _statistic.report_change(values);
+}
+
+
+void RegexCache::set_instance(RegexCache* instance)
+{
+  _instance = instance;
+}
+
+
+RegexCache::Regex RegexCache::compile(const std::string& pattern,
+                                      boost::regex::flag_type flags)
+{
+  return (_instance != NULL) ? _instance->get(pattern, flags) :
+                               compile_uncached(pattern, flags);
+}
+
+
+RegexCache::Regex RegexCache::compile_uncached(const std::string& pattern,
+                                               boost::regex::flag_type flags)
+{
+  Regex regex;
+  boost::regex* compiled = new boost::regex(pattern,
+                                            flags | boost::regex_constants::no_except);
+
+  if (compiled->status() == 0)
+  {
+    regex.reset(compiled);
+  }
+  else
+  {
+    delete compiled;
+  }
+
+  return regex;
+}
+
+
+uint64_t RegexCache::now_us()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
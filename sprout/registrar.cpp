@@ -49,6 +49,7 @@ extern "C" {
 #include <list>
 #include <queue>
 #include <string>
+#include <algorithm>
 
 #include "utils.h"
 #include "sproutsasevent.h"
@@ -224,32 +225,19 @@ RegStore::AoR* write_to_store(RegStore* primary_store,       ///<store to write
   pjsip_expires_hdr* expires = (pjsip_expires_hdr*)pjsip_msg_find_hdr(msg, PJSIP_H_EXPIRES, NULL);
 
   // The registration service uses optimistic locking to avoid concurrent
-  // updates to the same AoR conflicting.  This means we have to loop
-  // reading, updating and writing the AoR until the write is successful.
-  RegStore::AoR* aor_data = NULL;
+  // updates to the same AoR conflicting, so the changes are made in a
+  // mutation that is applied to the AoR each time it is read.  It may also
+  // be combined with concurrent updates to the AoR from other requests.
   bool backup_aor_alloced = false;
   bool is_initial_registration = true;
   std::map<std::string, RegStore::AoR::Binding> bindings_for_notify;
+  int notify_cseq = 0;
   bool all_bindings_expired = false;
+  int cas_retries = 0;
 
-  do
+  RegStore::Mutation mutation = [&](RegStore::AoR* aor_data)
   {
-    // delete NULL is safe, so we can do this on every iteration.
-    delete aor_data;
-
-    // Find the current bindings for the AoR.
-    aor_data = primary_store->get_aor_data(aor, trail);
-    LOG_DEBUG("Retrieved AoR data %p", aor_data);
-
-    if (aor_data == NULL)
-    {
-      // Failed to get data for the AoR because there is no connection
-      // to the store.
-      // LCOV_EXCL_START - local store (used in testing) never fails
-      LOG_ERROR("Failed to get AoR binding for %s from store", aor.c_str());
-      break;
-      // LCOV_EXCL_STOP
-    }
+    bindings_for_notify.clear();
 
     // If we don't have any bindings, try the backup AoR and/or store.
     if (aor_data->bindings().empty())
@@ -428,8 +416,29 @@ RegStore::AoR* write_to_store(RegStore* primary_store,       ///<store to write
 
     // Finally, update the cseq
     aor_data->_notify_cseq++;
+    notify_cseq = aor_data->_notify_cseq;
+  };
+
+  RegStore::AoR* aor_data = primary_store->update_aor_data(aor,
+                                                           mutation,
+                                                           send_notify,
+                                                           trail,
+                                                           all_bindings_expired,
+                                                           cas_retries);
+  LOG_DEBUG("Updated AoR data %p", aor_data);
+
+  if (aor_data != NULL)
+  {
+    RegStore::record_cas_retries(RegStore::OP_REGISTER, cas_retries);
+  }
+  else
+  {
+    // Failed to get data for the AoR because there is no connection
+    // to the store.
+    // LCOV_EXCL_START - local store (used in testing) never fails
+    LOG_ERROR("Failed to get AoR binding for %s from store", aor.c_str());
+    // LCOV_EXCL_STOP
   }
-  while (!primary_store->set_aor_data(aor, aor_data, send_notify, trail, all_bindings_expired));
 
   // If we allocated the backup AoR, tidy up.
   if (backup_aor_alloced)
@@ -438,7 +447,7 @@ RegStore::AoR* write_to_store(RegStore* primary_store,       ///<store to write
   }
 
   // Finally, send out SIP NOTIFYs for any subscriptions
-  if (send_notify)
+  if ((send_notify) && (aor_data != NULL))
   {
     for (RegStore::AoR::Subscriptions::const_iterator i = aor_data->subscriptions().begin();
          i != aor_data->subscriptions().end();
@@ -450,7 +459,7 @@ RegStore::AoR* write_to_store(RegStore* primary_store,       ///<store to write
         pjsip_tx_data* tdata_notify;
 
         pj_status_t status = NotifyUtils::create_notify(&tdata_notify, subscription, aor,
-                                                        aor_data->_notify_cseq, bindings_for_notify,
+                                                        notify_cseq, bindings_for_notify,
                                                         NotifyUtils::DocState::PARTIAL,
                                                         NotifyUtils::RegistrationState::ACTIVE,
                                                         NotifyUtils::ContactState::ACTIVE, contact_event,
@@ -571,6 +580,7 @@ void process_register_request(pjsip_rx_data* rdata)
   std::string regstate;
   std::deque<std::string> ccfs;
   std::deque<std::string> ecfs;
+  uint64_t profile_generation;
   HTTPCode http_code = hss->update_registration_state(public_id,
                                                       private_id,
                                                       HSSConnection::REG,
@@ -579,6 +589,7 @@ void process_register_request(pjsip_rx_data* rdata)
                                                       uris,
                                                       ccfs,
                                                       ecfs,
+                                                      profile_generation,
                                                       trail);
   if ((http_code != HTTP_OK) || (regstate != HSSConnection::STATE_REGISTERED))
   {
@@ -709,9 +720,28 @@ void process_register_request(pjsip_rx_data* rdata)
     // Log the bindings.
     log_bindings(aor, aor_data);
 
-    // If we have a remote store, try to store this there too.  We don't worry
-    // about failures in this case.
-    if (remote_store != NULL)
+    // The subscriber's profile was cached for the implicit registration set
+    // when it was read from the HSS above.  Keep it for as long as the
+    // registration lasts (up to the configured maximum), so calls to and from
+    // the subscriber don't need to query the HSS again.  Profile changes that
+    // don't go through this node aren't seen until the entry expires.
+    int max_expiry = 0;
+    for (RegStore::AoR::Bindings::const_iterator i = aor_data->bindings().begin();
+         i != aor_data->bindings().end();
+         ++i)
+    {
+      max_expiry = std::max(max_expiry, i->second->_expires - now);
+    }
+
+    if (max_expiry > 0)
+    {
+      hss->extend_cached_profile(uris, max_expiry * 1000, profile_generation);
+    }
+
+    // If we have a remote store, try to store this there too (unless the
+    // local store replicates the update itself).  We don't worry about
+    // failures in this case.
+    if ((remote_store != NULL) && (!store->replicates()))
     {
       int tmp_expiry = 0;
       bool ignored;
@@ -1002,6 +1032,7 @@ pj_bool_t registrar_on_rx_request(pjsip_rx_data *rdata)
       (PJUtils::check_route_headers(rdata)))
   {
     // REGISTER request targeted at the home domain or specifically at this node.
+    set_rx_msg_handler("registrar");
     process_register_request(rdata);
     return PJ_TRUE;
   }
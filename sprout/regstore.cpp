@@ -53,11 +53,19 @@ extern "C" {
 #include <fstream>
 #include <iomanip>
 #include <algorithm>
+#include <atomic>
+#include <memory>
 #include <time.h>
+#include <string.h>
 
 #include "log.h"
 #include "utils.h"
 #include "regstore.h"
+#include "aor_cache.h"
+#include "async_dispatcher.h"
+#include "aor_write_coalescer.h"
+#include "aor_replicator.h"
+#include "chronos_timer_batcher.h"
 #include "notify_utils.h"
 #include "stack.h"
 #include "pjutils.h"
@@ -65,12 +73,26 @@ extern "C" {
 #include "sproutsasevent.h"
 #include "constants.h"
 
+static bool is_index_record(const std::string& data);
+
 RegStore::RegStore(Store* data_store,
-                   ChronosConnection* chronos_connection) :
+                   ChronosConnection* chronos_connection,
+                   SerializerFormat write_format,
+                   StorageLayout layout,
+                   AoRCache* cache,
+                   AsyncDispatcher* dispatcher,
+                   AoRWriteCoalescer* coalescer,
+                   AoRReplicator* replicator,
+                   ChronosTimerBatcher* timer_batcher) :
   _chronos(chronos_connection),
-  _connector(NULL)
+  _connector(NULL),
+  _cache(cache),
+  _dispatcher(dispatcher),
+  _coalescer(coalescer),
+  _replicator(replicator),
+  _timer_batcher(timer_batcher)
 {
-  _connector = new Connector(data_store);
+  _connector = new Connector(data_store, write_format, layout, dispatcher);
 }
 
 
@@ -98,6 +120,152 @@ RegStore::AoR* RegStore::get_aor_data(const std::string& aor_id, SAS::TrailId tr
   return aor_data;
 }
 
+
+/// Retrieve the registration data for a given SIP Address of Record for a
+/// lookup that won't update it.  If this store has a cache, the data may
+/// have been read from the store up to the cache's staleness limit ago.
+/// Bindings that have expired since the data was read are omitted, but are
+/// left for an update or Chronos to tidy up.
+///
+/// @param aor_id       The SIP Address of Record for the registration
+RegStore::AoR* RegStore::lookup_aor_data(const std::string& aor_id, SAS::TrailId trail)
+{
+  if (_cache == NULL)
+  {
+    return get_aor_data(aor_id, trail);
+  }
+
+  uint64_t generation;
+  AoR* aor_data = _cache->get(aor_id, generation);
+
+  if (aor_data != NULL)
+  {
+    LOG_DEBUG("Found cached AoR data for %s", aor_id.c_str());
+    int now = time(NULL);
+    for (AoR::Bindings::iterator i = aor_data->_bindings.begin();
+         i != aor_data->_bindings.end();
+        )
+    {
+      if (i->second->_expires <= now)
+      {
+        delete i->second;
+        aor_data->_bindings.erase(i++);
+      }
+      else
+      {
+        ++i;
+      }
+    }
+  }
+  else
+  {
+    aor_data = get_aor_data(aor_id, trail);
+
+    if (aor_data != NULL)
+    {
+      _cache->put(aor_id, aor_data, generation);
+    }
+  }
+
+  return aor_data;
+}
+
+/// State shared by the threads reading a batch of AoRs.  Each thread reads
+/// the next unclaimed AoR until there are none left, so if the dispatcher
+/// threads are busy the caller just reads the AoRs itself.
+struct RegStore::BatchRead
+{
+  BatchRead(const std::vector<std::string>& ids, SAS::TrailId trail_id) :
+    aor_ids(ids),
+    aor_data(ids.size(), NULL),
+    trail(trail_id),
+    next(0),
+    done(0)
+  {
+    pthread_mutex_init(&lock, NULL);
+    pthread_cond_init(&cond, NULL);
+  }
+
+  ~BatchRead()
+  {
+    pthread_cond_destroy(&cond);
+    pthread_mutex_destroy(&lock);
+  }
+
+  const std::vector<std::string> aor_ids;
+  std::vector<AoR*> aor_data;
+  SAS::TrailId trail;
+  std::atomic<size_t> next;
+  size_t done;
+  pthread_mutex_t lock;
+  pthread_cond_t cond;
+};
+
+
+/// Reads AoRs from a batch until they have all been claimed.  This only
+/// reads from the store, so is safe to run on the dispatcher threads.
+void RegStore::read_batch(BatchRead* batch)
+{
+  size_t ii;
+  while ((ii = batch->next++) < batch->aor_ids.size())
+  {
+    AoR* aor_data = _connector->get_aor_data(batch->aor_ids[ii], batch->trail);
+
+    pthread_mutex_lock(&batch->lock);
+    batch->aor_data[ii] = aor_data;
+    ++batch->done;
+    pthread_cond_signal(&batch->cond);
+    pthread_mutex_unlock(&batch->lock);
+  }
+}
+
+
+void RegStore::get_aor_data_batch(const std::vector<std::string>& aor_ids,
+                                  std::vector<AoR*>& aor_data,
+                                  SAS::TrailId trail)
+{
+  LOG_DEBUG("Get AoR data for batch of %d AoRs", (int)aor_ids.size());
+
+  // The state is shared with the dispatched reads, which may not run until
+  // after this has returned.
+  std::shared_ptr<BatchRead> batch(new BatchRead(aor_ids, trail));
+
+  if (_dispatcher != NULL)
+  {
+    for (size_t ii = 1; ii < aor_ids.size(); ++ii)
+    {
+      _dispatcher->dispatch([this, batch]() { read_batch(batch.get()); });
+    }
+  }
+
+  read_batch(batch.get());
+
+  // Wait for any reads still being made by the dispatcher threads.
+  worker_blocked(true);
+  pthread_mutex_lock(&batch->lock);
+  while (batch->done < aor_ids.size())
+  {
+    pthread_cond_wait(&batch->cond, &batch->lock);
+  }
+  aor_data = batch->aor_data;
+  pthread_mutex_unlock(&batch->lock);
+  worker_blocked(false);
+
+  // Expire old bindings and subscriptions here rather than on the
+  // dispatcher threads, as expiring bindings may send NOTIFYs.
+  int now = time(NULL);
+  for (std::vector<AoR*>::iterator i = aor_data.begin();
+       i != aor_data.end();
+       ++i)
+  {
+    if (*i != NULL)
+    {
+      expire_bindings(*i, now, trail);
+      expire_subscriptions(*i, now);
+    }
+  }
+}
+
 RegStore::AoR* RegStore::Connector::get_aor_data(const std::string& aor_id, SAS::TrailId trail)
 {
   LOG_DEBUG("Get AoR data for %s", aor_id.c_str());
@@ -105,18 +273,33 @@ RegStore::AoR* RegStore::Connector::get_aor_data(const std::string& aor_id, SAS:
 
   std::string data;
   uint64_t cas;
+  worker_blocked(true);
   Store::Status status = _data_store->get_data("reg", aor_id, data, cas, trail);
+  worker_blocked(false);
 
   if (status == Store::Status::OK)
   {
-    // Retrieved the data, so deserialize it.
-    aor_data = deserialize_aor(aor_id, data);
-    aor_data->_cas = cas;
-    LOG_DEBUG("Data store returned a record, CAS = %ld", aor_data->_cas);
+    // Retrieved the data, so deserialize it.  This may be an index record, in
+    // which case the bindings and subscriptions must be read separately.
+    aor_data = is_index_record(data) ?
+                 get_indexed_aor_data(aor_id, data, trail) :
+                 deserialize_aor(aor_id, data);
 
-    SAS::Event event(trail, SASEvent::REGSTORE_GET_FOUND, 0);
-    event.add_var_param(aor_id);
-    SAS::report_event(event);
+    if (aor_data != NULL)
+    {
+      aor_data->_cas = cas;
+      LOG_DEBUG("Data store returned a record, CAS = %ld", aor_data->_cas);
+
+      SAS::Event event(trail, SASEvent::REGSTORE_GET_FOUND, 0);
+      event.add_var_param(aor_id);
+      SAS::report_event(event);
+    }
+    else
+    {
+      SAS::Event event(trail, SASEvent::REGSTORE_GET_FAILURE, 0);
+      event.add_var_param(aor_id);
+      SAS::report_event(event);
+    }
   }
   else if (status == Store::Status::NOT_FOUND)
   {
@@ -219,7 +402,25 @@ bool RegStore::set_aor_data(const std::string& aor_id,
       int now = time(NULL);
       int expiry = b->_expires - now;
 
+      if ((_timer_batcher != NULL) && (b->_timer_id != ""))
+      {
+        // Queue the update to the existing timer.  If Chronos changes the
+        // timer's ID, it's written to the store once the update is sent.
+        std::string old_timer_id = b->_timer_id;
+        _timer_batcher->set_timer(old_timer_id,
+                                  b->_expires,
+                                  callback_uri,
+                                  opaque,
+                                  [this, aor_id, b_id, old_timer_id](const std::string& new_timer_id)
+                                  {
+                                    set_timer_id(aor_id, b_id, old_timer_id, new_timer_id);
+                                  },
+                                  trail);
+        continue;
+      }
+
       // If a timer has been previously set for this binding, send a PUT. Otherwise sent a POST.
+      worker_blocked(true);
       if (b->_timer_id == "")
       {
         status = _chronos->send_post(timer_id, expiry, callback_uri, opaque, 0);
@@ -229,6 +430,7 @@ bool RegStore::set_aor_data(const std::string& aor_id,
         timer_id = b->_timer_id;
         status = _chronos->send_put(timer_id, expiry, callback_uri, opaque, 0);
       }
+      worker_blocked(false);
 
       // Update the timer id. If the update to Chronos failed, that's OK, don't reject the register
       // or update the stored timer id.
@@ -239,7 +441,217 @@ bool RegStore::set_aor_data(const std::string& aor_id,
     }
   }
 
-  return _connector->set_aor_data(aor_id, aor_data, max_expires - now, trail);
+  bool success = _connector->set_aor_data(aor_id, aor_data, max_expires - now, trail);
+
+  if (_cache != NULL)
+  {
+    // Invalidate the cached AoR whether or not the write succeeded, as a
+    // failed write may mean the AoR has been changed by someone else.
+    _cache->invalidate(aor_id);
+  }
+
+  return success;
+}
+
+RegStore::AoR* RegStore::update_aor_data(const std::string& aor_id,
+                                         const Mutation& mutation,
+                                         bool update_timers,
+                                         SAS::TrailId trail,
+                                         bool& all_bindings_expired,
+                                         int& cas_retries)
+{
+  Update update = {&mutation, update_timers, trail, NULL, false, 0};
+
+  if (_coalescer != NULL)
+  {
+    _coalescer->update(aor_id,
+                       update,
+                       [this, &aor_id, trail](std::vector<Update*>& batch)
+                       {
+                         write_updates(aor_id, batch, trail);
+                       });
+  }
+  else
+  {
+    std::vector<Update*> batch(1, &update);
+    write_updates(aor_id, batch, trail);
+  }
+
+  all_bindings_expired = update.all_bindings_expired;
+  cas_retries = update.cas_retries;
+  return update.aor_data;
+}
+
+
+void RegStore::replicate(const std::string& aor_id,
+                         const AoR* original,
+                         const AoR* updated)
+{
+  if (_replicator != NULL)
+  {
+    _replicator->replicate(aor_id, original, updated);
+  }
+}
+
+
+/// Makes a batch of updates to an AoR with one read-modify-write loop.  The
+/// first update gets the written data and the others get copies of it.  If
+/// no bindings remain, all_bindings_expired is set on the update whose
+/// change removed the last of them (or the first update, if none did), so
+/// that only one of them deregisters the AoR.  The store is accessed on the
+/// given trail, and the result of the write is also logged on the trail of
+/// each of the other updates.
+void RegStore::write_updates(const std::string& aor_id,
+                             std::vector<Update*>& batch,
+                             SAS::TrailId trail)
+{
+  bool update_timers = false;
+  for (std::vector<Update*>::iterator i = batch.begin(); i != batch.end(); ++i)
+  {
+    update_timers = update_timers || (*i)->update_timers;
+  }
+
+  AoR* aor_data = NULL;
+  AoR* original = NULL;
+  bool all_bindings_expired = false;
+  size_t emptied_by = 0;
+  int cas_retries = -1;
+
+  do
+  {
+    ++cas_retries;
+
+    // delete NULL is safe, so we can do this on every iteration.
+    delete aor_data;
+    delete original;
+    original = NULL;
+
+    aor_data = get_aor_data(aor_id, trail);
+    if (aor_data == NULL)
+    {
+      // LCOV_EXCL_START - local store (used in testing) never fails
+      break;
+      // LCOV_EXCL_STOP
+    }
+
+    if (_replicator != NULL)
+    {
+      // Keep the AoR as read, to find the changes to replicate.
+      original = new AoR(*aor_data);
+    }
+
+    // Apply the updates in order, noting the last one that left the AoR with
+    // no unexpired bindings when it had some before.
+    int now = time(NULL);
+    bool had_bindings = has_bindings(aor_data, now);
+    emptied_by = 0;
+
+    for (size_t ii = 0; ii < batch.size(); ++ii)
+    {
+      (*batch[ii]->mutation)(aor_data);
+
+      bool has = has_bindings(aor_data, now);
+      if ((had_bindings) && (!has))
+      {
+        emptied_by = ii;
+      }
+      had_bindings = has;
+    }
+  }
+  while (!set_aor_data(aor_id, aor_data, update_timers, trail, all_bindings_expired));
+
+  if (aor_data != NULL)
+  {
+    replicate(aor_id, original, aor_data);
+  }
+  delete original;
+
+  for (size_t ii = 0; ii < batch.size(); ++ii)
+  {
+    Update* update = batch[ii];
+    update->aor_data = ((ii == 0) || (aor_data == NULL)) ?
+                         aor_data : new AoR(*aor_data);
+    update->all_bindings_expired = (ii == emptied_by) && all_bindings_expired;
+    update->cas_retries = cas_retries;
+
+    if (update->trail != trail)
+    {
+      // The store was accessed on another request's trail, so record the
+      // outcome of the write on this one too.
+      if (aor_data != NULL)
+      {
+        SAS::Event event(update->trail, SASEvent::REGSTORE_SET_START, 0);
+        event.add_var_param(aor_id);
+        SAS::report_event(event);
+
+        SAS::Event event2(update->trail, SASEvent::REGSTORE_SET_SUCCESS, 0);
+        event2.add_var_param(aor_id);
+        SAS::report_event(event2);
+      }
+      else
+      {
+        // LCOV_EXCL_START - local store (used in testing) never fails
+        SAS::Event event(update->trail, SASEvent::REGSTORE_GET_FAILURE, 0);
+        event.add_var_param(aor_id);
+        SAS::report_event(event);
+        // LCOV_EXCL_STOP
+      }
+    }
+  }
+}
+
+/// Returns true if the AoR has any bindings that haven't expired.
+bool RegStore::has_bindings(const AoR* aor_data, int now)
+{
+  for (AoR::Bindings::const_iterator i = aor_data->_bindings.begin();
+       i != aor_data->_bindings.end();
+       ++i)
+  {
+    if (i->second->_expires > now)
+    {
+      return true;
+    }
+  }
+
+  return false;
+}
+
+/// Records the new ID Chronos gave a binding's timer when it was updated
+/// through the timer batcher.  Nothing is written if the binding has gone,
+/// or its timer has been changed since.
+void RegStore::set_timer_id(const std::string& aor_id,
+                            const std::string& binding_id,
+                            const std::string& old_timer_id,
+                            const std::string& new_timer_id)
+{
+  LOG_DEBUG("Timer for binding %s of %s changed from %s to %s",
+            binding_id.c_str(), aor_id.c_str(),
+            old_timer_id.c_str(), new_timer_id.c_str());
+
+  bool success = false;
+
+  while (!success)
+  {
+    AoR* aor_data = get_aor_data(aor_id, 0);
+    if (aor_data == NULL)
+    {
+      // LCOV_EXCL_START
+      break;
+      // LCOV_EXCL_STOP
+    }
+
+    AoR::Bindings::const_iterator i = aor_data->bindings().find(binding_id);
+    if ((i == aor_data->bindings().end()) ||
+        (i->second->_timer_id != old_timer_id))
+    {
+      delete aor_data;
+      break;
+    }
+
+    i->second->_timer_id = new_timer_id;
+    success = set_aor_data(aor_id, aor_data, false, 0);
+    delete aor_data;
+  }
 }
 
 bool RegStore::Connector::set_aor_data(const std::string& aor_id,
@@ -247,18 +659,25 @@ bool RegStore::Connector::set_aor_data(const std::string& aor_id,
                                        int expiry,
                                        SAS::TrailId trail)
 {
-  std::string data = serialize_aor(aor_data);
+  if (_layout == LAYOUT_PER_BINDING)
+  {
+    return set_indexed_aor_data(aor_id, aor_data, expiry, trail);
+  }
+
+  std::string data = serialize_aor(aor_data, _write_format);
 
   SAS::Event event(trail, SASEvent::REGSTORE_SET_START, 0);
   event.add_var_param(aor_id);
   SAS::report_event(event);
 
+  worker_blocked(true);
   Store::Status status = _data_store->set_data("reg",
                                                aor_id,
                                                data,
                                                aor_data->_cas,
                                                expiry,
                                                trail);
+  worker_blocked(false);
 
   LOG_DEBUG("Data store set_data returned %d", status);
 
@@ -319,9 +738,15 @@ int RegStore::expire_bindings(AoR* aor_data,
 
       // If a timer id is present, then delete it. If the timer id is empty (because a
       // previous post/put failed) then don't.
-      if (b->_timer_id != "")
+      if ((b->_timer_id != "") && (_timer_batcher != NULL))
+      {
+        _timer_batcher->delete_timer(b->_timer_id, trail);
+      }
+      else if (b->_timer_id != "")
       {
+        worker_blocked(true);
         _chronos->send_delete(b->_timer_id, trail);
+        worker_blocked(false);
       }
 
       delete i->second;
@@ -366,8 +791,8 @@ void RegStore::expire_subscriptions(AoR* aor_data,
 }
 
 
-/// Serialize the contents of an AoR.
-std::string RegStore::Connector::serialize_aor(AoR* aor_data)
+/// Serializes an AoR in the original format.
+static std::string serialize_aor_legacy(RegStore::AoR* aor_data)
 {
   std::ostringstream oss(std::ostringstream::out|std::ostringstream::binary);
 
@@ -375,14 +800,14 @@ std::string RegStore::Connector::serialize_aor(AoR* aor_data)
   LOG_DEBUG("Serialize %d bindings", num_bindings);
   oss.write((const char *)&num_bindings, sizeof(int));
 
-  for (AoR::Bindings::const_iterator i = aor_data->bindings().begin();
+  for (RegStore::AoR::Bindings::const_iterator i = aor_data->bindings().begin();
        i != aor_data->bindings().end();
        ++i)
   {
     LOG_DEBUG("  Binding %s", i->first.c_str());
     oss << i->first << '\0';
 
-    AoR::Binding* b = i->second;
+    RegStore::AoR::Binding* b = i->second;
     oss << b->_uri << '\0';
     oss << b->_cid << '\0';
     oss.write((const char *)&b->_cseq, sizeof(int));
@@ -413,14 +838,14 @@ std::string RegStore::Connector::serialize_aor(AoR* aor_data)
   LOG_DEBUG("Serialize %d subscriptions", num_subscriptions);
   oss.write((const char *)&num_subscriptions, sizeof(int));
 
-  for (AoR::Subscriptions::const_iterator i = aor_data->subscriptions().begin();
+  for (RegStore::AoR::Subscriptions::const_iterator i = aor_data->subscriptions().begin();
        i != aor_data->subscriptions().end();
        ++i)
   {
     LOG_DEBUG("  Subscription %s", i->first.c_str());
     oss << i->first << '\0';
 
-    AoR::Subscription* s = i->second;
+    RegStore::AoR::Subscription* s = i->second;
     oss << s->_req_uri << '\0';
     oss << s->_from_uri << '\0';
     oss << s->_from_tag << '\0';
@@ -445,8 +870,8 @@ std::string RegStore::Connector::serialize_aor(AoR* aor_data)
 }
 
 
-/// Deserialize the contents of an AoR
-RegStore::AoR* RegStore::Connector::deserialize_aor(const std::string& aor_id, const std::string& s)
+/// Deserializes an AoR in the original format.
+RegStore::AoR* RegStore::deserialize_aor_legacy(const std::string& aor_id, const std::string& s)
 {
   std::istringstream iss(s, std::istringstream::in|std::istringstream::binary);
 
@@ -542,12 +967,941 @@ RegStore::AoR* RegStore::Connector::deserialize_aor(const std::string& aor_id, c
   return aor_data;
 }
 
+
+// Records in the binary format start with this marker, followed by the format
+// version.  Records in the original format start with the number of bindings
+// as a native int instead.  Read as an int, the marker is over a billion
+// (0x526f41ff on little-endian hosts), which is far more bindings than an AoR
+// can hold, so the two formats can't be confused.
+static const char BINARY_FORMAT_MARKER[4] = {'\xff', 'A', 'o', 'R'};
+
+// Version of the binary format written.  Each binding and subscription is
+// written as a length-prefixed record, so later versions can add fields to
+// the end of the records and still be read by this version.  Version 0 is
+// never written, so marks a corrupt record.
+static const uint32_t BINARY_FORMAT_VERSION = 1;
+
+/// Appends an unsigned 32-bit value (in little-endian byte order).
+static inline void put_u32(std::string& s, uint32_t v)
+{
+  char b[4] = {(char)(v & 0xff),
+               (char)((v >> 8) & 0xff),
+               (char)((v >> 16) & 0xff),
+               (char)((v >> 24) & 0xff)};
+  s.append(b, 4);
+}
+
+/// Appends a length-prefixed string.
+static inline void put_str(std::string& s, const std::string& v)
+{
+  put_u32(s, v.size());
+  s.append(v);
+}
+
+/// Overwrites the length prefix written at the specified offset with the
+/// length of everything that has been appended since.
+static inline void end_record(std::string& s, size_t offset)
+{
+  uint32_t len = s.size() - offset - 4;
+  s[offset] = (char)(len & 0xff);
+  s[offset + 1] = (char)((len >> 8) & 0xff);
+  s[offset + 2] = (char)((len >> 16) & 0xff);
+  s[offset + 3] = (char)((len >> 24) & 0xff);
+}
+
+/// Appends a binding as a length-prefixed record.
+static void put_binding_record(std::string& out,
+                               const std::string& binding_id,
+                               const RegStore::AoR::Binding* b)
+{
+  size_t record = out.size();
+  put_u32(out, 0);
+  put_str(out, binding_id);
+  put_str(out, b->_uri);
+  put_str(out, b->_cid);
+  put_u32(out, b->_cseq);
+  put_u32(out, b->_expires);
+  put_u32(out, b->_priority);
+  put_u32(out, b->_params.size());
+  for (std::map<std::string, std::string>::const_iterator j = b->_params.begin();
+       j != b->_params.end();
+       ++j)
+  {
+    put_str(out, j->first);
+    put_str(out, j->second);
+  }
+  put_u32(out, b->_path_headers.size());
+  for (std::list<std::string>::const_iterator j = b->_path_headers.begin();
+       j != b->_path_headers.end();
+       ++j)
+  {
+    put_str(out, *j);
+  }
+  put_str(out, b->_timer_id);
+  put_str(out, b->_private_id);
+  put_u32(out, b->_emergency_registration ? 1 : 0);
+  end_record(out, record);
+}
+
+/// Appends a subscription as a length-prefixed record.
+static void put_subscription_record(std::string& out,
+                                    const std::string& to_tag,
+                                    const RegStore::AoR::Subscription* s)
+{
+  size_t record = out.size();
+  put_u32(out, 0);
+  put_str(out, to_tag);
+  put_str(out, s->_req_uri);
+  put_str(out, s->_from_uri);
+  put_str(out, s->_from_tag);
+  put_str(out, s->_to_uri);
+  put_str(out, s->_to_tag);
+  put_str(out, s->_cid);
+  put_u32(out, s->_route_uris.size());
+  for (std::list<std::string>::const_iterator j = s->_route_uris.begin();
+       j != s->_route_uris.end();
+       ++j)
+  {
+    put_str(out, *j);
+  }
+  put_u32(out, s->_expires);
+  end_record(out, record);
+}
+
+/// Serializes an AoR in the binary format.  The output is built in a single
+/// string, sized up front, rather than through a stream.
+static std::string serialize_aor_binary(RegStore::AoR* aor_data)
+{
+  std::string out;
+
+  size_t size = 32;
+  for (RegStore::AoR::Bindings::const_iterator i = aor_data->bindings().begin();
+       i != aor_data->bindings().end();
+       ++i)
+  {
+    RegStore::AoR::Binding* b = i->second;
+    size += 64 + i->first.size() + b->_uri.size() + b->_cid.size() +
+            b->_timer_id.size() + b->_private_id.size();
+    for (std::map<std::string, std::string>::const_iterator j = b->_params.begin();
+         j != b->_params.end();
+         ++j)
+    {
+      size += 8 + j->first.size() + j->second.size();
+    }
+    for (std::list<std::string>::const_iterator j = b->_path_headers.begin();
+         j != b->_path_headers.end();
+         ++j)
+    {
+      size += 4 + j->size();
+    }
+  }
+  size += aor_data->subscriptions().size() * 256;
+  out.reserve(size);
+
+  out.append(BINARY_FORMAT_MARKER, sizeof(BINARY_FORMAT_MARKER));
+  put_u32(out, BINARY_FORMAT_VERSION);
+  put_u32(out, aor_data->_notify_cseq);
+
+  put_u32(out, aor_data->bindings().size());
+  for (RegStore::AoR::Bindings::const_iterator i = aor_data->bindings().begin();
+       i != aor_data->bindings().end();
+       ++i)
+  {
+    put_binding_record(out, i->first, i->second);
+  }
+
+  put_u32(out, aor_data->subscriptions().size());
+  for (RegStore::AoR::Subscriptions::const_iterator i = aor_data->subscriptions().begin();
+       i != aor_data->subscriptions().end();
+       ++i)
+  {
+    put_subscription_record(out, i->first, i->second);
+  }
+
+  return out;
+}
+
+/// Reads the fields of a record in the binary format in place.  Every read
+/// is checked against the end of the data, and once a read has failed all
+/// later reads fail too, so the caller need only check at the end.
+class RecordReader
+{
+public:
+  RecordReader(const char* start, const char* end) :
+    _p(start), _end(end), _ok(true)
+  {
+  }
+
+  bool ok() const { return _ok; }
+  void fail() { _ok = false; }
+  const char* pos() const { return _p; }
+
+  uint32_t get_u32()
+  {
+    uint32_t v = 0;
+    if (check(4))
+    {
+      const unsigned char* p = (const unsigned char*)_p;
+      v = p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t)p[3] << 24);
+      _p += 4;
+    }
+    return v;
+  }
+
+  int get_int()
+  {
+    return (int)get_u32();
+  }
+
+  void get_str(std::string& v)
+  {
+    uint32_t len = get_u32();
+    if (check(len))
+    {
+      v.assign(_p, len);
+      _p += len;
+    }
+  }
+
+  /// Reads the length prefix of a record, returning the end of the record.
+  const char* get_record()
+  {
+    uint32_t len = get_u32();
+    return check(len) ? _p + len : _p;
+  }
+
+  /// Moves to the end of a record, skipping any fields added by later
+  /// versions of the format.
+  void end_record(const char* end)
+  {
+    if (_p > end)
+    {
+      _ok = false;
+    }
+    _p = end;
+  }
+
+private:
+  bool check(size_t len)
+  {
+    _ok = _ok && ((size_t)(_end - _p) >= len);
+    return _ok;
+  }
+
+  const char* _p;
+  const char* _end;
+  bool _ok;
+};
+
+/// Reads a binding record, returning the new binding.  The caller must check
+/// the reader is still OK before using the binding.
+static RegStore::AoR::Binding* get_binding_record(RecordReader& reader,
+                                                  std::string* address_of_record,
+                                                  std::string& binding_id)
+{
+  const char* end = reader.get_record();
+
+  reader.get_str(binding_id);
+  RegStore::AoR::Binding* b = new RegStore::AoR::Binding(address_of_record);
+  reader.get_str(b->_uri);
+  reader.get_str(b->_cid);
+  b->_cseq = reader.get_int();
+  b->_expires = reader.get_int();
+  b->_priority = reader.get_int();
+
+  uint32_t num_params = reader.get_u32();
+  for (uint32_t jj = 0; (jj < num_params) && (reader.ok()); ++jj)
+  {
+    std::pair<std::string, std::string> param;
+    reader.get_str(param.first);
+    reader.get_str(param.second);
+    b->_params.insert(b->_params.end(), param);
+  }
+
+  uint32_t num_paths = reader.get_u32();
+  for (uint32_t jj = 0; (jj < num_paths) && (reader.ok()); ++jj)
+  {
+    b->_path_headers.push_back(std::string());
+    reader.get_str(b->_path_headers.back());
+  }
+
+  reader.get_str(b->_timer_id);
+  reader.get_str(b->_private_id);
+  b->_emergency_registration = (reader.get_u32() != 0);
+  reader.end_record(end);
+
+  return b;
+}
+
+/// Reads a subscription record, returning the new subscription.  The caller
+/// must check the reader is still OK before using the subscription.
+static RegStore::AoR::Subscription* get_subscription_record(RecordReader& reader,
+                                                            std::string& to_tag)
+{
+  const char* end = reader.get_record();
+
+  reader.get_str(to_tag);
+  RegStore::AoR::Subscription* s = new RegStore::AoR::Subscription;
+  reader.get_str(s->_req_uri);
+  reader.get_str(s->_from_uri);
+  reader.get_str(s->_from_tag);
+  reader.get_str(s->_to_uri);
+  reader.get_str(s->_to_tag);
+  reader.get_str(s->_cid);
+
+  uint32_t num_routes = reader.get_u32();
+  for (uint32_t jj = 0; (jj < num_routes) && (reader.ok()); ++jj)
+  {
+    s->_route_uris.push_back(std::string());
+    reader.get_str(s->_route_uris.back());
+  }
+
+  s->_expires = reader.get_int();
+  reader.end_record(end);
+
+  return s;
+}
+
+/// Deserializes an AoR in the binary format.  Returns NULL if the data is
+/// corrupt.
+RegStore::AoR* RegStore::deserialize_aor_binary(const std::string& aor_id, const std::string& s)
+{
+  RecordReader reader(s.data() + sizeof(BINARY_FORMAT_MARKER),
+                      s.data() + s.size());
+
+  uint32_t version = reader.get_u32();
+  if (version == 0)
+  {
+    LOG_ERROR("Invalid AoR format version for %s", aor_id.c_str());
+    return NULL;
+  }
+
+  AoR* aor_data = new AoR(aor_id);
+  aor_data->_notify_cseq = reader.get_int();
+
+  // The bindings and subscriptions were written in key order, so each can be
+  // added at the end of its map without a search.
+  uint32_t num_bindings = reader.get_u32();
+  LOG_DEBUG("Deserialize %u bindings", num_bindings);
+  for (uint32_t ii = 0; (ii < num_bindings) && (reader.ok()); ++ii)
+  {
+    std::string binding_id;
+    AoR::Binding* b = get_binding_record(reader, &aor_data->_uri, binding_id);
+
+    if (aor_data->_bindings.insert(aor_data->_bindings.end(),
+                                   std::make_pair(binding_id, b))->second != b)
+    {
+      // Duplicate binding ID.
+      LOG_WARNING("Duplicate binding %s in AoR record for %s",
+                  binding_id.c_str(), aor_id.c_str());
+      delete b;
+    }
+  }
+
+  uint32_t num_subscriptions = reader.get_u32();
+  LOG_DEBUG("Deserialize %u subscriptions", num_subscriptions);
+  for (uint32_t ii = 0; (ii < num_subscriptions) && (reader.ok()); ++ii)
+  {
+    std::string to_tag;
+    AoR::Subscription* s = get_subscription_record(reader, to_tag);
+
+    if (aor_data->_subscriptions.insert(aor_data->_subscriptions.end(),
+                                        std::make_pair(to_tag, s))->second != s)
+    {
+      // Duplicate To tag.
+      LOG_WARNING("Duplicate subscription %s in AoR record for %s",
+                  to_tag.c_str(), aor_id.c_str());
+      delete s;
+    }
+  }
+
+  if (!reader.ok())
+  {
+    LOG_ERROR("Failed to deserialize corrupt AoR record for %s", aor_id.c_str());
+    delete aor_data;
+    aor_data = NULL;
+  }
+
+  return aor_data;
+}
+
+
+std::string RegStore::serialize_aor(AoR* aor_data, SerializerFormat format)
+{
+  return (format == FORMAT_LEGACY) ?
+           serialize_aor_legacy(aor_data) :
+           serialize_aor_binary(aor_data);
+}
+
+
+RegStore::AoR* RegStore::deserialize_aor(const std::string& aor_id, const std::string& s)
+{
+  if ((s.size() >= sizeof(BINARY_FORMAT_MARKER)) &&
+      (memcmp(s.data(), BINARY_FORMAT_MARKER, sizeof(BINARY_FORMAT_MARKER)) == 0))
+  {
+    return deserialize_aor_binary(aor_id, s);
+  }
+
+  return deserialize_aor_legacy(aor_id, s);
+}
+
+
+// In the per-binding layout the AoR record is an index starting with this
+// marker, followed by the format version, the notify CSeq, the time the index
+// expires and the IDs of the bindings and subscriptions.  The bindings and
+// subscriptions are stored in their own tables, keyed by the AoR and the
+// binding ID or To tag, each in the binary format.
+static const char INDEX_RECORD_MARKER[4] = {'\xff', 'A', 'o', 'I'};
+static const std::string BINDING_TABLE = "reg_binding";
+static const std::string SUBSCRIPTION_TABLE = "reg_subscription";
+
+// Bindings are kept in the store for a short while after they expire, for
+// the same reason as the AoR record (see RegStore::set_aor_data).
+static const int BINDING_EXPIRY_GRACE = 10;
+
+static bool is_index_record(const std::string& data)
+{
+  return ((data.size() >= sizeof(INDEX_RECORD_MARKER)) &&
+          (memcmp(data.data(), INDEX_RECORD_MARKER, sizeof(INDEX_RECORD_MARKER)) == 0));
+}
+
+static inline std::string element_key(const std::string& aor_id,
+                                       const std::string& id)
+{
+  return aor_id + '\\' + id;
+}
+
+/// Serializes the index record for an AoR stored in the per-binding layout.
+static std::string serialize_index(RegStore::AoR* aor_data, int expires)
+{
+  std::string out;
+  out.append(INDEX_RECORD_MARKER, sizeof(INDEX_RECORD_MARKER));
+  put_u32(out, BINARY_FORMAT_VERSION);
+  put_u32(out, aor_data->_notify_cseq);
+  put_u32(out, expires);
+
+  put_u32(out, aor_data->bindings().size());
+  for (RegStore::AoR::Bindings::const_iterator i = aor_data->bindings().begin();
+       i != aor_data->bindings().end();
+       ++i)
+  {
+    put_str(out, i->first);
+  }
+
+  put_u32(out, aor_data->subscriptions().size());
+  for (RegStore::AoR::Subscriptions::const_iterator i = aor_data->subscriptions().begin();
+       i != aor_data->subscriptions().end();
+       ++i)
+  {
+    put_str(out, i->first);
+  }
+
+  return out;
+}
+
+/// Serializes a separately stored binding.
+static std::string serialize_binding(const std::string& binding_id,
+                                     const RegStore::AoR::Binding* b)
+{
+  std::string out;
+  out.append(BINARY_FORMAT_MARKER, sizeof(BINARY_FORMAT_MARKER));
+  put_u32(out, BINARY_FORMAT_VERSION);
+  put_binding_record(out, binding_id, b);
+  return out;
+}
+
+/// Serializes a separately stored subscription.
+static std::string serialize_subscription(const std::string& to_tag,
+                                          const RegStore::AoR::Subscription* s)
+{
+  std::string out;
+  out.append(BINARY_FORMAT_MARKER, sizeof(BINARY_FORMAT_MARKER));
+  put_u32(out, BINARY_FORMAT_VERSION);
+  put_subscription_record(out, to_tag, s);
+  return out;
+}
+
+/// Returns a reader positioned at the record in a separately stored binding
+/// or subscription, or a failed reader if the record is invalid.
+static RecordReader element_reader(const std::string& data)
+{
+  RecordReader reader(data.data(), data.data() + data.size());
+  if ((data.size() < sizeof(BINARY_FORMAT_MARKER)) ||
+      (memcmp(data.data(), BINARY_FORMAT_MARKER, sizeof(BINARY_FORMAT_MARKER)) != 0))
+  {
+    reader.fail();
+  }
+  else
+  {
+    reader = RecordReader(data.data() + sizeof(BINARY_FORMAT_MARKER),
+                          data.data() + data.size());
+    if (reader.get_u32() == 0)
+    {
+      reader.fail();
+    }
+  }
+  return reader;
+}
+
+/// State shared by the threads reading the bindings and subscriptions of an
+/// AoR in the per-binding layout.  As for a batch of AoRs, each thread reads
+/// the next unclaimed record until there are none left, so if the dispatcher
+/// threads are busy the caller just reads the records itself.
+struct RegStore::Connector::RecordRead
+{
+  struct Record
+  {
+    Record(const std::string& t, const std::string& k) :
+      table(t),
+      key(k),
+      status(Store::Status::NOT_FOUND),
+      cas(0)
+    {
+    }
+
+    std::string table;
+    std::string key;
+    Store::Status status;
+    std::string data;
+    uint64_t cas;
+  };
+
+  RecordRead(SAS::TrailId trail_id) :
+    trail(trail_id),
+    next(0),
+    done(0)
+  {
+    pthread_mutex_init(&lock, NULL);
+    pthread_cond_init(&cond, NULL);
+  }
+
+  ~RecordRead()
+  {
+    pthread_cond_destroy(&cond);
+    pthread_mutex_destroy(&lock);
+  }
+
+  std::vector<Record> records;
+  SAS::TrailId trail;
+  std::atomic<size_t> next;
+  size_t done;
+  pthread_mutex_t lock;
+  pthread_cond_t cond;
+};
+
+
+/// Reads records until they have all been claimed.
+void RegStore::Connector::read_records(RecordRead* reads)
+{
+  size_t ii;
+  while ((ii = reads->next++) < reads->records.size())
+  {
+    RecordRead::Record& record = reads->records[ii];
+    worker_blocked(true);
+    record.status = _data_store->get_data(record.table,
+                                          record.key,
+                                          record.data,
+                                          record.cas,
+                                          reads->trail);
+    worker_blocked(false);
+
+    pthread_mutex_lock(&reads->lock);
+    ++reads->done;
+    pthread_cond_signal(&reads->cond);
+    pthread_mutex_unlock(&reads->lock);
+  }
+}
+
+
+/// Reads the index record for an AoR in the per-binding layout, then each of
+/// its bindings and subscriptions.  These are read concurrently on the
+/// dispatcher threads if there is a dispatcher, so reading an AoR with many
+/// bindings takes roughly one store round trip after the index rather than
+/// one per binding.  Bindings and subscriptions that are listed in the index
+/// but are missing have expired (or have not been written yet), so are
+/// skipped.  Returns NULL if the index is corrupt or the store fails.
+RegStore::AoR* RegStore::Connector::get_indexed_aor_data(const std::string& aor_id,
+                                                         const std::string& index,
+                                                         SAS::TrailId trail)
+{
+  RecordReader reader(index.data() + sizeof(INDEX_RECORD_MARKER),
+                      index.data() + index.size());
+
+  uint32_t version = reader.get_u32();
+  if (version == 0)
+  {
+    LOG_ERROR("Invalid AoR index version for %s", aor_id.c_str());
+    return NULL;
+  }
+
+  AoR* aor_data = new AoR(aor_id);
+  aor_data->_indexed = true;
+  aor_data->_stored_index = index;
+  aor_data->_notify_cseq = reader.get_int();
+  aor_data->_index_expires = reader.get_int();
+
+  // The state is shared with the dispatched reads, which may not run until
+  // after this has returned.
+  std::shared_ptr<RecordRead> reads(new RecordRead(trail));
+
+  std::vector<std::string> binding_ids;
+  uint32_t num_bindings = reader.get_u32();
+  for (uint32_t ii = 0; (ii < num_bindings) && (reader.ok()); ++ii)
+  {
+    binding_ids.push_back(std::string());
+    reader.get_str(binding_ids.back());
+    reads->records.push_back(RecordRead::Record(BINDING_TABLE,
+                                                element_key(aor_id, binding_ids.back())));
+  }
+
+  std::vector<std::string> to_tags;
+  uint32_t num_subscriptions = reader.get_u32();
+  for (uint32_t ii = 0; (ii < num_subscriptions) && (reader.ok()); ++ii)
+  {
+    to_tags.push_back(std::string());
+    reader.get_str(to_tags.back());
+    reads->records.push_back(RecordRead::Record(SUBSCRIPTION_TABLE,
+                                                element_key(aor_id, to_tags.back())));
+  }
+
+  if (!reader.ok())
+  {
+    LOG_ERROR("Failed to deserialize corrupt AoR index for %s", aor_id.c_str());
+    delete aor_data;
+    return NULL;
+  }
+
+  LOG_DEBUG("Read index of %d bindings and %d subscriptions for %s",
+            (int)binding_ids.size(), (int)to_tags.size(), aor_id.c_str());
+
+  if (_dispatcher != NULL)
+  {
+    for (size_t ii = 1; ii < reads->records.size(); ++ii)
+    {
+      _dispatcher->dispatch([this, reads]() { read_records(reads.get()); });
+    }
+  }
+
+  read_records(reads.get());
+
+  // Wait for any reads still being made by the dispatcher threads.
+  worker_blocked(true);
+  pthread_mutex_lock(&reads->lock);
+  while (reads->done < reads->records.size())
+  {
+    pthread_cond_wait(&reads->cond, &reads->lock);
+  }
+  pthread_mutex_unlock(&reads->lock);
+  worker_blocked(false);
+
+  bool ok = true;
+  std::vector<RecordRead::Record>::const_iterator record = reads->records.begin();
+
+  for (std::vector<std::string>::const_iterator i = binding_ids.begin();
+       i != binding_ids.end();
+       ++i, ++record)
+  {
+    if (record->status == Store::Status::OK)
+    {
+      // Remember the record as read, even if it has been removed, so it can
+      // be updated with the right CAS.
+      AoR::StoredRecord& stored = aor_data->_stored_bindings[*i];
+      stored._data = record->data;
+      stored._cas = record->cas;
+
+      if (!record->data.empty())
+      {
+        RecordReader binding_reader = element_reader(record->data);
+        std::string binding_id;
+        AoR::Binding* b = get_binding_record(binding_reader, &aor_data->_uri, binding_id);
+
+        if ((binding_reader.ok()) && (binding_id == *i))
+        {
+          aor_data->_bindings.insert(aor_data->_bindings.end(),
+                                     std::make_pair(binding_id, b));
+        }
+        else
+        {
+          LOG_WARNING("Ignoring corrupt binding %s for %s",
+                      i->c_str(), aor_id.c_str());
+          delete b;
+        }
+      }
+    }
+    else if (record->status != Store::Status::NOT_FOUND)
+    {
+      // LCOV_EXCL_START
+      ok = false;
+      // LCOV_EXCL_STOP
+    }
+  }
+
+  for (std::vector<std::string>::const_iterator i = to_tags.begin();
+       i != to_tags.end();
+       ++i, ++record)
+  {
+    if (record->status == Store::Status::OK)
+    {
+      AoR::StoredRecord& stored = aor_data->_stored_subscriptions[*i];
+      stored._data = record->data;
+      stored._cas = record->cas;
+
+      if (!record->data.empty())
+      {
+        RecordReader subscription_reader = element_reader(record->data);
+        std::string to_tag;
+        AoR::Subscription* s = get_subscription_record(subscription_reader, to_tag);
+
+        if ((subscription_reader.ok()) && (to_tag == *i))
+        {
+          aor_data->_subscriptions.insert(aor_data->_subscriptions.end(),
+                                          std::make_pair(to_tag, s));
+        }
+        else
+        {
+          LOG_WARNING("Ignoring corrupt subscription %s for %s",
+                      i->c_str(), aor_id.c_str());
+          delete s;
+        }
+      }
+    }
+    else if (record->status != Store::Status::NOT_FOUND)
+    {
+      // LCOV_EXCL_START
+      ok = false;
+      // LCOV_EXCL_STOP
+    }
+  }
+
+  if (!ok)
+  {
+    // LCOV_EXCL_START
+    LOG_ERROR("Failed to read bindings and subscriptions for %s", aor_id.c_str());
+    delete aor_data;
+    aor_data = NULL;
+    // LCOV_EXCL_STOP
+  }
+
+  return aor_data;
+}
+
+/// Writes an AoR in the per-binding layout.  Only the records that have
+/// changed since the AoR was read are written, each with its own CAS.
+///
+/// The index is written first if the set of bindings or subscriptions (or
+/// the notify CSeq) has changed, so that concurrent structural changes
+/// conflict on the index.  When the index is unchanged, it is read again
+/// after the bindings have been written to check that nobody has changed it
+/// in the meantime (for example by removing a binding that has just been
+/// refreshed).  This is much cheaper than rewriting the whole AoR.
+bool RegStore::Connector::set_indexed_aor_data(const std::string& aor_id,
+                                               AoR* aor_data,
+                                               int expiry,
+                                               SAS::TrailId trail)
+{
+  int now = time(NULL);
+
+  // The index needs rewriting if it has changed or would expire before the
+  // AoR.  When it is written it is given twice the lifetime it needs, so it
+  // isn't rewritten on every refresh of the bindings.
+  std::string index = serialize_index(aor_data, aor_data->_index_expires);
+  bool write_index = ((!aor_data->_indexed) ||
+                      (index != aor_data->_stored_index) ||
+                      (aor_data->_index_expires < now + expiry));
+  bool written = false;
+  bool ok = true;
+
+  SAS::Event event(trail, SASEvent::REGSTORE_SET_START, 0);
+  event.add_var_param(aor_id);
+  SAS::report_event(event);
+
+  if (write_index)
+  {
+    index = serialize_index(aor_data, now + 2 * expiry);
+    worker_blocked(true);
+    Store::Status status = _data_store->set_data("reg",
+                                                 aor_id,
+                                                 index,
+                                                 aor_data->_cas,
+                                                 2 * expiry,
+                                                 trail);
+    worker_blocked(false);
+    LOG_DEBUG("Data store set_data for index returned %d", status);
+    ok = (status == Store::Status::OK);
+    written = true;
+  }
+
+  for (AoR::Bindings::const_iterator i = aor_data->_bindings.begin();
+       (i != aor_data->_bindings.end()) && (ok);
+       ++i)
+  {
+    std::string data = serialize_binding(i->first, i->second);
+    AoR::StoredRecords::const_iterator stored = aor_data->_stored_bindings.find(i->first);
+
+    if ((stored == aor_data->_stored_bindings.end()) ||
+        (stored->second._data != data))
+    {
+      int binding_expiry = i->second->_expires - now + BINDING_EXPIRY_GRACE;
+      worker_blocked(true);
+      Store::Status status = _data_store->set_data(BINDING_TABLE,
+                                                   element_key(aor_id, i->first),
+                                                   data,
+                                                   (stored != aor_data->_stored_bindings.end()) ?
+                                                     stored->second._cas : 0,
+                                                   (binding_expiry > 0) ? binding_expiry : 1,
+                                                   trail);
+      worker_blocked(false);
+      LOG_DEBUG("Data store set_data for binding %s returned %d",
+                i->first.c_str(), status);
+      ok = (status == Store::Status::OK);
+      written = true;
+    }
+  }
+
+  for (AoR::Subscriptions::const_iterator i = aor_data->_subscriptions.begin();
+       (i != aor_data->_subscriptions.end()) && (ok);
+       ++i)
+  {
+    std::string data = serialize_subscription(i->first, i->second);
+    AoR::StoredRecords::const_iterator stored = aor_data->_stored_subscriptions.find(i->first);
+
+    if ((stored == aor_data->_stored_subscriptions.end()) ||
+        (stored->second._data != data))
+    {
+      // Subscriptions expire with the last binding, so have the AoR expiry.
+      worker_blocked(true);
+      Store::Status status = _data_store->set_data(SUBSCRIPTION_TABLE,
+                                                   element_key(aor_id, i->first),
+                                                   data,
+                                                   (stored != aor_data->_stored_subscriptions.end()) ?
+                                                     stored->second._cas : 0,
+                                                   expiry,
+                                                   trail);
+      worker_blocked(false);
+      LOG_DEBUG("Data store set_data for subscription %s returned %d",
+                i->first.c_str(), status);
+      ok = (status == Store::Status::OK);
+      written = true;
+    }
+  }
+
+  if (ok)
+  {
+    // Blank out any bindings and subscriptions that have been removed, so
+    // they don't reappear if the same ID is used again before they expire.
+    // These records are no longer in the index, so a failure here doesn't
+    // matter.
+    for (AoR::StoredRecords::const_iterator i = aor_data->_stored_bindings.begin();
+         i != aor_data->_stored_bindings.end();
+         ++i)
+    {
+      if ((!i->second._data.empty()) &&
+          (aor_data->_bindings.find(i->first) == aor_data->_bindings.end()))
+      {
+        worker_blocked(true);
+        _data_store->set_data(BINDING_TABLE,
+                              element_key(aor_id, i->first),
+                              "",
+                              i->second._cas,
+                              BINDING_EXPIRY_GRACE,
+                              trail);
+        worker_blocked(false);
+      }
+    }
+
+    for (AoR::StoredRecords::const_iterator i = aor_data->_stored_subscriptions.begin();
+         i != aor_data->_stored_subscriptions.end();
+         ++i)
+    {
+      if ((!i->second._data.empty()) &&
+          (aor_data->_subscriptions.find(i->first) == aor_data->_subscriptions.end()))
+      {
+        worker_blocked(true);
+        _data_store->set_data(SUBSCRIPTION_TABLE,
+                              element_key(aor_id, i->first),
+                              "",
+                              i->second._cas,
+                              BINDING_EXPIRY_GRACE,
+                              trail);
+        worker_blocked(false);
+      }
+    }
+  }
+
+  if ((ok) && (written) && (!write_index))
+  {
+    // Check the index hasn't changed since it was read.
+    std::string data;
+    uint64_t cas;
+    worker_blocked(true);
+    Store::Status status = _data_store->get_data("reg", aor_id, data, cas, trail);
+    worker_blocked(false);
+    ok = ((status == Store::Status::OK) && (cas == aor_data->_cas));
+  }
+
+  if (ok)
+  {
+    SAS::Event event2(trail, SASEvent::REGSTORE_SET_SUCCESS, 0);
+    event2.add_var_param(aor_id);
+    SAS::report_event(event2);
+  }
+  else
+  {
+    SAS::Event event2(trail, SASEvent::REGSTORE_SET_FAILURE, 0);
+    event2.add_var_param(aor_id);
+    SAS::report_event(event2);
+  }
+
+  return ok;
+}
+
+
+// CAS retry counts for each operation since they were last reported.
+static std::atomic<uint_fast64_t> cas_updates[RegStore::NUM_OPERATIONS];
+static std::atomic<uint_fast64_t> cas_retries[RegStore::NUM_OPERATIONS];
+static std::atomic<int> cas_max_retries[RegStore::NUM_OPERATIONS];
+
+void RegStore::record_cas_retries(Operation op, int retries)
+{
+  if (retries > 0)
+  {
+    LOG_DEBUG("AoR update %d needed %d CAS retries", op, retries);
+  }
+
+  cas_updates[op]++;
+  cas_retries[op] += retries;
+
+  int max_retries = cas_max_retries[op];
+  while ((retries > max_retries) &&
+         (!cas_max_retries[op].compare_exchange_weak(max_retries, retries)))
+  {
+  }
+}
+
+/// Gets the number of updates, the total number of CAS retries and the
+/// maximum retries for a single update for each operation since this was
+/// last called, and resets them.
+void RegStore::get_cas_retry_stats(std::vector<std::string>& stats)
+{
+  for (int ii = 0; ii < NUM_OPERATIONS; ++ii)
+  {
+    stats.push_back(std::to_string(cas_updates[ii].exchange(0)));
+    stats.push_back(std::to_string(cas_retries[ii].exchange(0)));
+    stats.push_back(std::to_string(cas_max_retries[ii].exchange(0)));
+  }
+}
+
 /// Default constructor.
 RegStore::AoR::AoR(std::string sip_uri) :
   _notify_cseq(1),
   _bindings(),
   _subscriptions(),
   _cas(0),
+  _indexed(false),
+  _stored_index(),
+  _index_expires(0),
+  _stored_bindings(),
+  _stored_subscriptions(),
   _uri(sip_uri)
 {
 }
@@ -580,11 +1934,16 @@ RegStore::AoR& RegStore::AoR::operator= (AoR const& other)
 
 void RegStore::AoR::common_constructor(const AoR& other)
 {
+  _uri = other._uri;
+
   for (Bindings::const_iterator i = other._bindings.begin();
        i != other._bindings.end();
        ++i)
   {
+    // The copied binding must refer to this AoR's URI, not the original's,
+    // as the original may be deleted first.
     Binding* bb = new Binding(*i->second);
+    bb->_address_of_record = &_uri;
     _bindings.insert(std::make_pair(i->first, bb));
   }
 
@@ -598,6 +1957,11 @@ void RegStore::AoR::common_constructor(const AoR& other)
 
   _notify_cseq = other._notify_cseq;
   _cas = other._cas;
+  _indexed = other._indexed;
+  _stored_index = other._stored_index;
+  _index_expires = other._index_expires;
+  _stored_bindings = other._stored_bindings;
+  _stored_subscriptions = other._stored_subscriptions;
 }
 
 
@@ -723,8 +2087,14 @@ void RegStore::send_notify(AoR::Subscription* s, int cseq,
   }
 }
 
-RegStore::Connector::Connector(Store* data_store) :
-  _data_store(data_store)
+RegStore::Connector::Connector(Store* data_store,
+                               SerializerFormat write_format,
+                               StorageLayout layout,
+                               AsyncDispatcher* dispatcher) :
+  _data_store(data_store),
+  _write_format(write_format),
+  _layout(layout),
+  _dispatcher(dispatcher)
 {
 }
 
@@ -0,0 +1,179 @@
+/**
+ * @file request_coalescer.cpp  Shares the responses to identical concurrent requests.
+ *
+ * Project Clearwater - IMS in the Cloud
+ * Copyright (C) 2014  Metaswitch Networks Ltd
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or (at your
+ * option) any later version, along with the "Special Exception" for use of
+ * the program along with SSL, set forth below. This program is distributed
+ * in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+ * without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details. You should have received a copy of the GNU General Public
+ * License along with this program.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ *
+ * The author can be reached by email at clearwater@metaswitch.com or by
+ * post at Metaswitch Networks Ltd, 100 Church St, Enfield EN2 6BQ, UK
+ *
+ * Special Exception
+ * Metaswitch Networks Ltd  grants you permission to copy, modify,
+ * propagate, and distribute a work formed by combining OpenSSL with The
+ * Software, or a work derivative of such a combination, even if such
+ * copying, modification, propagation, or distribution would otherwise
+ * violate the terms of the GPL. You must comply with the GPL in all
+ * respects for all of the code used other than OpenSSL.
+ * "OpenSSL" means OpenSSL toolkit software distributed by the OpenSSL
+ * Project and licensed under the OpenSSL Licenses, or a work based on such
+ * software and licensed under the OpenSSL Licenses.
+ * "OpenSSL Licenses" means the OpenSSL License and Original SSLeay License
+ * under which the OpenSSL Project distributes the OpenSSL toolkit software,
+ * as those licenses appear in the file LICENSE-OPENSSL.
+ */
+
+#include <vector>
+
+#include "request_coalescer.h"
+#include "stack.h"
+#include "log.h"
+#include "sproutsasevent.h"
+
+RequestCoalescer::Call::Call() :
+  complete(false),
+  waiters(0),
+  trail(0),
+  shared(false),
+  http_code(0)
+{
+  pthread_cond_init(&cond, NULL);
+}
+
+
+RequestCoalescer::Call::~Call()
+{
+  pthread_cond_destroy(&cond);
+}
+
+
+RequestCoalescer::RequestCoalescer(const std::string& stat_name,
+                                   LastValueCache* stats_aggregator) :
+  _requests(0),
+  _coalesced(0),
+  _unshared(0),
+  _statistic(stat_name, stats_aggregator)
+{
+  pthread_mutex_init(&_lock, NULL);
+  add_stats_reporter(this, [this]() { report_stats(); });
+}
+
+
+RequestCoalescer::~RequestCoalescer()
+{
+  remove_stats_reporter(this);
+  pthread_mutex_destroy(&_lock);
+}
+
+
+long RequestCoalescer::send(const std::string& key,
+                            SAS::TrailId trail,
+                            std::string& response,
+                            const Request& request,
+                            const Shareable& shareable)
+{
+  long http_code;
+
+  pthread_mutex_lock(&_lock);
+
+  std::unordered_map<std::string, std::shared_ptr<Call> >::iterator i = _calls.find(key);
+  if (i != _calls.end())
+  {
+    // The same request is in progress, so wait for it to complete.
+    std::shared_ptr<Call> call = i->second;
+    call->waiters++;
+    while (!call->complete)
+    {
+      pthread_cond_wait(&call->cond, &_lock);
+    }
+    bool shared = call->shared;
+    SAS::TrailId sent_on = call->trail;
+    http_code = call->http_code;
+    if (shared)
+    {
+      response = call->response;
+    }
+    pthread_mutex_unlock(&_lock);
+
+    if (shared)
+    {
+      LOG_DEBUG("Shared response to in-progress request %s", key.c_str());
+      _coalesced++;
+
+      // The request and response are logged on the trail of the caller that
+      // sent it, so record on this trail which request we shared, the result
+      // and the response we were given.
+      SAS::Event event(trail, SASEvent::HTTP_HOMESTEAD_COALESCED, 0);
+      event.add_static_param(http_code);
+      event.add_var_param(key);
+      event.add_var_param(std::to_string(sent_on));
+      event.add_var_param(response);
+      SAS::report_event(event);
+    }
+    else
+    {
+      // The response can't be shared (for example because it is only valid
+      // for one use), so send our own request.
+      LOG_DEBUG("Response to %s can't be shared, so resend", key.c_str());
+      _unshared++;
+      _requests++;
+      http_code = request(response);
+    }
+  }
+  else
+  {
+    std::shared_ptr<Call> call(new Call());
+    call->trail = trail;
+    _calls[key] = call;
+    pthread_mutex_unlock(&_lock);
+
+    http_code = request(response);
+    _requests++;
+
+    bool shared = ((!shareable) || (shareable(http_code, response)));
+
+    pthread_mutex_lock(&_lock);
+    call->complete = true;
+    call->shared = shared;
+    call->http_code = http_code;
+    if ((shared) && (call->waiters > 0))
+    {
+      call->response = response;
+    }
+    _calls.erase(key);
+    pthread_cond_broadcast(&call->cond);
+    pthread_mutex_unlock(&_lock);
+  }
+
+  return http_code;
+}
+
+
+/// Reports the number of requests sent, the number of requests that shared
+/// the response to an identical request, the percentage of requests that
+/// were coalesced, and the number of requests resent because the response
+/// couldn't be shared.
+void RequestCoalescer::report_stats()
+{
+  uint_fast64_t requests = _requests.exchange(0);
+  uint_fast64_t coalesced = _coalesced.exchange(0);
+
+  std::vector<std::string> values;
+  values.push_back(std::to_string(requests));
+  values.push_back(std::to_string(coalesced));
+  values.push_back(std::to_string(((requests + coalesced) > 0) ?
+                                    (coalesced * 100) / (requests + coalesced) : 0));
+  values.push_back(std::to_string(_unshared.exchange(0)));
+  _statistic.report_change(values);
+}
@@ -0,0 +1,123 @@
+/**
+ * @file scscf_assignment_cache.cpp  Cache of the S-CSCF assignments read by the I-CSCF.
+ *
+ * Project Clearwater - IMS in the Cloud
+ * Copyright (C) 2014  Metaswitch Networks Ltd
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or (at your
+ * option) any later version, along with the "Special Exception" for use of
+ * the program along with SSL, set forth below. This program is distributed
+ * in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+ * without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details. You should have received a copy of the GNU General Public
+ * License along with this program.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ *
+ * The author can be reached by email at clearwater@metaswitch.com or by
+ * post at Metaswitch Networks Ltd, 100 Church St, Enfield EN2 6BQ, UK
+ *
+ * Special Exception
+ * Metaswitch Networks Ltd  grants you permission to copy, modify,
+ * propagate, and distribute a work formed by combining OpenSSL with The
+ * Software, or a work derivative of such a combination, even if such
+ * copying, modification, propagation, or distribution would otherwise
+ * violate the terms of the GPL. You must comply with the GPL in all
+ * respects for all of the code used other than OpenSSL.
+ * "OpenSSL" means OpenSSL toolkit software distributed by the OpenSSL
+ * Project and licensed under the OpenSSL Licenses, or a work based on such
+ * software and licensed under the OpenSSL Licenses.
+ * "OpenSSL Licenses" means the OpenSSL License and Original SSLeay License
+ * under which the OpenSSL Project distributes the OpenSSL toolkit software,
+ * as those licenses appear in the file LICENSE-OPENSSL.
+ */
+
+extern "C" {
+#include <pjsip.h>
+}
+
+#include <algorithm>
+#include <vector>
+
+#include "scscf_assignment_cache.h"
+#include "stack.h"
+#include "log.h"
+
+SCSCFAssignmentCache::SCSCFAssignmentCache(int max_entries,
+                                           int ttl_ms,
+                                           LastValueCache* stats_aggregator) :
+  _cache(max_entries, ttl_ms),
+  _negative_hits(0),
+  _statistic("scscf_assignment_cache", stats_aggregator)
+{
+  add_stats_reporter(this, [this]() { report_stats(); });
+}
+
+
+SCSCFAssignmentCache::~SCSCFAssignmentCache()
+{
+  remove_stats_reporter(this);
+}
+
+
+bool SCSCFAssignmentCache::get(const std::string& key,
+                               Assignment& assignment,
+                               uint64_t& generation)
+{
+  bool found = _cache.get(key, assignment, generation);
+
+  if ((found) && (assignment.status_code != PJSIP_SC_OK))
+  {
+    _negative_hits++;
+  }
+
+  return found;
+}
+
+
+void SCSCFAssignmentCache::put(const std::string& key,
+                               const Assignment& assignment,
+                               uint64_t generation)
+{
+  _cache.put(key, assignment, generation);
+}
+
+
+uint64_t SCSCFAssignmentCache::invalidate(const std::string& key)
+{
+  if (_cache.invalidate(key))
+  {
+    LOG_DEBUG("Invalidated cached S-CSCF assignment for %s", key.c_str());
+  }
+
+  return _cache.generation();
+}
+
+
+/// Reports the number of hits (excluding negative hits), negative hits,
+/// misses, the hit rate (as a percentage, including negative hits),
+/// evictions, invalidations and the number of entries.
+void SCSCFAssignmentCache::report_stats()
+{
+  ShardedLRUCache<Assignment>::Stats stats;
+  _cache.get_stats(stats);
+
+  // A lookup made while this is running may have its negative hit counted
+  // in this period but its hit in the next, so cap the negative hits.
+  uint_fast64_t negative_hits = std::min(_negative_hits.exchange(0),
+                                         stats.hits);
+  uint_fast64_t lookups = stats.hits + stats.misses;
+
+  std::vector<std::string> values;
+  values.push_back(std::to_string(stats.hits - negative_hits));
+  values.push_back(std::to_string(negative_hits));
+  values.push_back(std::to_string(stats.misses));
+  values.push_back(std::to_string((lookups > 0) ?
+                                    (stats.hits * 100) / lookups : 0));
+  values.push_back(std::to_string(stats.evictions));
+  values.push_back(std::to_string(stats.invalidations));
+  values.push_back(std::to_string(stats.entries));
+  _statistic.report_change(values);
+}
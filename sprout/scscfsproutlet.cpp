@@ -158,7 +158,7 @@ void SCSCFSproutlet::get_bindings(const std::string& aor,
 {
   // Look up the target in the registration data store.
   LOG_INFO("Look up targets in registration store: %s", aor.c_str());
-  *aor_data = _store->get_aor_data(aor, trail);
+  *aor_data = _store->lookup_aor_data(aor, trail);
 
   // If we didn't get bindings from the local store and we have a remote
   // store, try the remote.
@@ -167,7 +167,7 @@ void SCSCFSproutlet::get_bindings(const std::string& aor,
        ((*aor_data)->bindings().empty())))
   {
     delete *aor_data;
-    *aor_data = _remote_store->get_aor_data(aor, trail);
+    *aor_data = _remote_store->lookup_aor_data(aor, trail);
   }
 
   // TODO - Log bindings to SAS
@@ -271,6 +271,8 @@ SCSCFSproutletTsx::SCSCFSproutletTsx(SproutletTsxHelper* helper,
   _cancelled(false),
   _session_case(NULL),
   _as_chain_link(),
+  _new_chain_served_user(),
+  _parked_req(NULL),
   _hss_data_cached(false),
   _registered(false),
   _uris(),
@@ -313,15 +315,100 @@ void SCSCFSproutletTsx::on_rx_initial_request(pjsip_msg* req)
 {
   LOG_INFO("S-CSCF received initial request");
 
-  pjsip_status_code status_code = PJSIP_SC_OK;
-
   // Add a Session-Expires header if required.
   add_session_expires(req);
 
   // Determine the session case and the served user.  This will link to
-  // an AsChain object (creating it if necessary), if we need to provide
-  // services.
-  status_code = determine_served_user(req);
+  // an existing AsChain object if there is one.
+  pjsip_status_code status_code = determine_served_user(req);
+
+  if ((status_code == PJSIP_SC_OK) &&
+      (!_new_chain_served_user.empty()) &&
+      (!_hss_data_cached))
+  {
+    // We need the served user's data from the HSS to create the AS chain.
+    // Read it asynchronously so the worker thread isn't blocked waiting for
+    // the HSS - processing continues in on_async_complete.  The read runs
+    // on another thread without the transaction's lock, so it must only
+    // write to the result, which is applied to this transaction when the
+    // read completes.
+    LOG_DEBUG("Read HSS data for %s before creating AS chain",
+              _new_chain_served_user.c_str());
+    _parked_req = req;
+    HSSReadResult* result = new HSSReadResult();
+    SCSCFSproutlet* scscf = _scscf;
+    std::string public_id = _new_chain_served_user;
+    SAS::TrailId trail_id = trail();
+    run_async([scscf, public_id, trail_id, result]()
+              {
+                result->success = scscf->read_hss_data(public_id,
+                                                       result->registered,
+                                                       result->uris,
+                                                       result->ifcs,
+                                                       result->ccfs,
+                                                       result->ecfs,
+                                                       trail_id);
+              },
+              result);
+  }
+  else
+  {
+    process_initial_request(req, status_code);
+  }
+}
+
+
+/// Handles completion of the HSS read started by on_rx_initial_request.
+void SCSCFSproutletTsx::on_async_complete(void* context)
+{
+  pjsip_msg* req = _parked_req;
+  _parked_req = NULL;
+
+  // Apply the result of the read.  If the read wasn't run (because we are
+  // shutting down) it is treated as a failure.
+  HSSReadResult* result = (HSSReadResult*)context;
+  if (result->success)
+  {
+    _registered = result->registered;
+    _uris.swap(result->uris);
+    _ifcs = result->ifcs;
+    _ccfs.swap(result->ccfs);
+    _ecfs.swap(result->ecfs);
+    _hss_data_cached = true;
+  }
+  delete result;
+
+  if (_cancelled)
+  {
+    // The request was cancelled while we were waiting for the HSS.
+    LOG_INFO("Request cancelled while reading HSS data");
+    pjsip_msg* rsp = create_response(req, PJSIP_SC_REQUEST_TERMINATED);
+    send_response(rsp);
+    free_msg(req);
+  }
+  else if (!_hss_data_cached)
+  {
+    LOG_DEBUG("Failed to retrieve ServiceProfile for %s",
+              _new_chain_served_user.c_str());
+    process_initial_request(req, PJSIP_SC_NOT_FOUND);
+  }
+  else
+  {
+    process_initial_request(req, PJSIP_SC_OK);
+  }
+}
+
+
+/// Continues processing of an initial request once the served user has been
+/// determined.
+void SCSCFSproutletTsx::process_initial_request(pjsip_msg* req,
+                                                pjsip_status_code status_code)
+{
+  if (status_code == PJSIP_SC_OK)
+  {
+    // Create a new AsChain if the served user needs one.
+    status_code = create_served_user_as_chain(req);
+  }
 
   if (_acr == NULL)
   {
@@ -609,25 +696,9 @@ pjsip_status_code SCSCFSproutletTsx::determine_served_user(pjsip_msg* req)
         pcv->term_ioi = pj_str("");
       }
 
-
-      Ifcs ifcs;
-      if (lookup_ifcs(served_user, ifcs))
-      {
-        LOG_DEBUG("Creating originating CDIV AS chain");
-        _as_chain_link.release();
-        _as_chain_link = create_as_chain(ifcs, served_user);
-
-        if (stack_data.record_route_on_diversion)
-        {
-          LOG_DEBUG("Add service to dialog - originating Cdiv");
-          add_record_route(req, "charge-orig");
-        }
-      }
-      else
-      {
-        LOG_DEBUG("Failed to retrieve ServiceProfile for %s", served_user.c_str());
-        status_code = PJSIP_SC_NOT_FOUND;
-      }
+      // The originating CDIV AS chain is created by
+      // create_served_user_as_chain.
+      _new_chain_served_user = served_user;
     }
     else
     {
@@ -656,18 +727,8 @@ pjsip_status_code SCSCFSproutletTsx::determine_served_user(pjsip_msg* req)
 
     if (!served_user.empty())
     {
-      LOG_DEBUG("Looking up iFCs for %s for new AS chain", served_user.c_str());
-      Ifcs ifcs;
-      if (lookup_ifcs(served_user, ifcs))
-      {
-        LOG_DEBUG("Successfully looked up iFCs");
-        _as_chain_link = create_as_chain(ifcs, served_user);
-      }
-      else
-      {
-        LOG_DEBUG("Failed to retrieve ServiceProfile for %s", served_user.c_str());
-        status_code = PJSIP_SC_NOT_FOUND;
-      }
+      // The AS chain is created by create_served_user_as_chain.
+      _new_chain_served_user = served_user;
 
       if (_session_case->is_terminating())
       {
@@ -692,6 +753,50 @@ pjsip_status_code SCSCFSproutletTsx::determine_served_user(pjsip_msg* req)
 }
 
 
+/// Creates a new AS chain for the served user found by determine_served_user
+/// (if a new chain is needed), looking up the served user's iFCs.
+pjsip_status_code SCSCFSproutletTsx::create_served_user_as_chain(pjsip_msg* req)
+{
+  pjsip_status_code status_code = PJSIP_SC_OK;
+
+  if (!_new_chain_served_user.empty())
+  {
+    LOG_DEBUG("Looking up iFCs for %s for new AS chain",
+              _new_chain_served_user.c_str());
+    Ifcs ifcs;
+    if (lookup_ifcs(_new_chain_served_user, ifcs))
+    {
+      if (_as_chain_link.is_set())
+      {
+        // The AS retargeted the request, so replace the existing chain.
+        LOG_DEBUG("Creating originating CDIV AS chain");
+        _as_chain_link.release();
+        _as_chain_link = create_as_chain(ifcs, _new_chain_served_user);
+
+        if (stack_data.record_route_on_diversion)
+        {
+          LOG_DEBUG("Add service to dialog - originating Cdiv");
+          add_record_route(req, "charge-orig");
+        }
+      }
+      else
+      {
+        LOG_DEBUG("Successfully looked up iFCs");
+        _as_chain_link = create_as_chain(ifcs, _new_chain_served_user);
+      }
+    }
+    else
+    {
+      LOG_DEBUG("Failed to retrieve ServiceProfile for %s",
+                _new_chain_served_user.c_str());
+      status_code = PJSIP_SC_NOT_FOUND;
+    }
+  }
+
+  return status_code;
+}
+
+
 std::string SCSCFSproutletTsx::served_user_from_msg(pjsip_msg* msg)
 {
   // For originating:
@@ -0,0 +1,341 @@
+/**
+ * @file slab_cache.cpp  Per-thread cache of small fixed size allocations.
+ *
+ * Project Clearwater - IMS in the Cloud
+ * Copyright (C) 2014  Metaswitch Networks Ltd
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or (at your
+ * option) any later version, along with the "Special Exception" for use of
+ * the program along with SSL, set forth below. This program is distributed
+ * in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+ * without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details. You should have received a copy of the GNU General Public
+ * License along with this program.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ *
+ * The author can be reached by email at clearwater@metaswitch.com or by
+ * post at Metaswitch Networks Ltd, 100 Church St, Enfield EN2 6BQ, UK
+ *
+ * Special Exception
+ * Metaswitch Networks Ltd  grants you permission to copy, modify,
+ * propagate, and distribute a work formed by combining OpenSSL with The
+ * Software, or a work derivative of such a combination, even if such
+ * copying, modification, propagation, or distribution would otherwise
+ * violate the terms of the GPL. You must comply with the GPL in all
+ * respects for all of the code used other than OpenSSL.
+ * "OpenSSL" means OpenSSL toolkit software distributed by the OpenSSL
+ * Project and licensed under the OpenSSL Licenses, or a work based on such
+ * software and licensed under the OpenSSL Licenses.
+ * "OpenSSL Licenses" means the OpenSSL License and Original SSLeay License
+ * under which the OpenSSL Project distributes the OpenSSL toolkit software,
+ * as those licenses appear in the file LICENSE-OPENSSL.
+ */
+
+#include <pthread.h>
+#include <stdlib.h>
+
+#include <atomic>
+#include <new>
+
+#include "slab_cache.h"
+
+struct ThreadFreeLists;
+
+// Every cached block starts with a header recording the thread that
+// allocated it and its size class.  Free blocks are chained through the
+// word after the header.
+struct BlockHeader
+{
+  ThreadFreeLists* owner;
+  int cls;
+};
+
+struct FreeBlock
+{
+  union
+  {
+    BlockHeader header;
+    char pad[SlabCache::HEADER_SIZE];
+  };
+  FreeBlock* next;
+};
+
+static_assert(sizeof(BlockHeader) <= SlabCache::HEADER_SIZE,
+              "Slab cache block header is too large");
+static_assert(sizeof(FreeBlock) <= SlabCache::MIN_BLOCK_SIZE,
+              "Slab cache minimum block size is too small");
+
+// The free lists for a single thread, plus the list of blocks that other
+// threads have freed and returned to this thread.
+//
+// Blocks point at the lists of the thread that allocated them, so the lists
+// outlive the thread until all its blocks have been freed.  The thread
+// counts the blocks it allocates and frees itself without atomics, and
+// other threads count the blocks they free in outstanding, which is
+// therefore never positive while the thread is running.  When the thread
+// exits it adds its own count to outstanding, which then holds the number
+// of its blocks still in use, and whichever thread takes it to zero deletes
+// the lists.
+struct ThreadFreeLists
+{
+  ThreadFreeLists() : returned(NULL), allocated(0), outstanding(0)
+  {
+    for (int ii = 0; ii < SlabCache::NUM_SIZE_CLASSES; ++ii)
+    {
+      head[ii] = NULL;
+      count[ii] = 0;
+    }
+  }
+
+  FreeBlock* head[SlabCache::NUM_SIZE_CLASSES];
+  int count[SlabCache::NUM_SIZE_CLASSES];
+  std::atomic<FreeBlock*> returned;
+  int_fast64_t allocated;
+  std::atomic<int_fast64_t> outstanding;
+};
+
+// Marker placed on a thread's returned list once the thread has exited, so
+// other threads free its blocks to the heap instead.
+static FreeBlock returns_closed;
+
+static __thread ThreadFreeLists* thread_free_lists = NULL;
+
+// Key used to free a thread's lists when it exits.
+static pthread_key_t free_lists_key;
+static pthread_once_t free_lists_key_once = PTHREAD_ONCE_INIT;
+
+static std::atomic<uint_fast64_t> cache_hits(0);
+static std::atomic<uint_fast64_t> cache_misses(0);
+static std::atomic<uint_fast64_t> cache_remote_frees(0);
+static std::atomic<int> live_free_lists(0);
+
+static void free_block_list(FreeBlock* block)
+{
+  while (block != NULL)
+  {
+    FreeBlock* next = block->next;
+    ::free(block);
+    block = next;
+  }
+}
+
+// Deletes a thread's lists once the thread has exited and none of its blocks
+// are in use.
+static void delete_free_lists(ThreadFreeLists* lists)
+{
+  delete lists;
+  live_free_lists.fetch_sub(1, std::memory_order_relaxed);
+}
+
+static void destroy_free_lists(void* p)
+{
+  ThreadFreeLists* lists = (ThreadFreeLists*)p;
+
+  for (int ii = 0; ii < SlabCache::NUM_SIZE_CLASSES; ++ii)
+  {
+    free_block_list(lists->head[ii]);
+    lists->head[ii] = NULL;
+    lists->count[ii] = 0;
+  }
+
+  // Stop other threads returning blocks to this thread.  Blocks this thread
+  // allocated may still be in use elsewhere and point at these lists, so
+  // they are only deleted once the last of them is freed.
+  free_block_list(lists->returned.exchange(&returns_closed,
+                                           std::memory_order_acquire));
+  thread_free_lists = NULL;
+
+  if (lists->outstanding.fetch_add(lists->allocated,
+                                   std::memory_order_acq_rel) +
+      lists->allocated == 0)
+  {
+    delete_free_lists(lists);
+  }
+}
+
+static void create_free_lists_key()
+{
+  pthread_key_create(&free_lists_key, destroy_free_lists);
+}
+
+static ThreadFreeLists* get_free_lists()
+{
+  if (thread_free_lists == NULL)
+  {
+    pthread_once(&free_lists_key_once, create_free_lists_key);
+    thread_free_lists = new ThreadFreeLists();
+    live_free_lists.fetch_add(1, std::memory_order_relaxed);
+    pthread_setspecific(free_lists_key, thread_free_lists);
+  }
+
+  return thread_free_lists;
+}
+
+// Adds a block to the free lists of the calling thread, or frees it to the
+// heap if the list for its size class is full.
+static void push_local(ThreadFreeLists* lists, FreeBlock* block)
+{
+  int cls = block->header.cls;
+
+  if (lists->count[cls] < SlabCache::MAX_FREE_BLOCKS)
+  {
+    block->next = lists->head[cls];
+    lists->head[cls] = block;
+    ++lists->count[cls];
+  }
+  else
+  {
+    ::free(block);
+  }
+}
+
+// Moves the blocks that other threads have returned to the calling thread
+// onto its free lists.
+static void collect_returned(ThreadFreeLists* lists)
+{
+  FreeBlock* block = lists->returned.exchange(NULL, std::memory_order_acquire);
+
+  while (block != NULL)
+  {
+    FreeBlock* next = block->next;
+    push_local(lists, block);
+    block = next;
+  }
+}
+
+// Returns a block to the thread that allocated it, or frees it to the heap
+// if that thread has exited (deleting the thread's lists if this was its
+// last block in use).
+static void push_remote(ThreadFreeLists* owner, FreeBlock* block)
+{
+  FreeBlock* head = owner->returned.load(std::memory_order_relaxed);
+  bool returned = true;
+
+  do
+  {
+    if (head == &returns_closed)
+    {
+      ::free(block);
+      returned = false;
+      break;
+    }
+    block->next = head;
+  }
+  while (!owner->returned.compare_exchange_weak(head,
+                                                block,
+                                                std::memory_order_release,
+                                                std::memory_order_relaxed));
+
+  if (returned)
+  {
+    cache_remote_frees.fetch_add(1, std::memory_order_relaxed);
+  }
+
+  // This must be the last access to the owner's lists, as they can be
+  // deleted as soon as the count reaches zero.
+  if (owner->outstanding.fetch_sub(1, std::memory_order_acq_rel) == 1)
+  {
+    delete_free_lists(owner);
+  }
+}
+
+int SlabCache::size_class(size_t size)
+{
+  int cls = 0;
+  size_t block_size = MIN_BLOCK_SIZE;
+
+  while (block_size < size)
+  {
+    block_size <<= 1;
+    ++cls;
+  }
+
+  return cls;
+}
+
+void* SlabCache::alloc(size_t size)
+{
+  if (size > MAX_BLOCK_SIZE - HEADER_SIZE)
+  {
+    void* block = ::malloc(size);
+    if (block == NULL)
+    {
+      throw std::bad_alloc();
+    }
+    return block;
+  }
+
+  int cls = size_class(size + HEADER_SIZE);
+  ThreadFreeLists* lists = get_free_lists();
+
+  if ((lists->head[cls] == NULL) &&
+      (lists->returned.load(std::memory_order_relaxed) != NULL))
+  {
+    collect_returned(lists);
+  }
+
+  ++lists->allocated;
+
+  FreeBlock* block = lists->head[cls];
+  if (block != NULL)
+  {
+    lists->head[cls] = block->next;
+    --lists->count[cls];
+    cache_hits.fetch_add(1, std::memory_order_relaxed);
+    return (char*)block + HEADER_SIZE;
+  }
+
+  cache_misses.fetch_add(1, std::memory_order_relaxed);
+  block = (FreeBlock*)::malloc(MIN_BLOCK_SIZE << cls);
+  if (block == NULL)
+  {
+    throw std::bad_alloc();
+  }
+  block->header.owner = lists;
+  block->header.cls = cls;
+  return (char*)block + HEADER_SIZE;
+}
+
+void SlabCache::free(void* block, size_t size)
+{
+  if (block == NULL)
+  {
+    return;
+  }
+
+  if (size > MAX_BLOCK_SIZE - HEADER_SIZE)
+  {
+    ::free(block);
+    return;
+  }
+
+  FreeBlock* free_block = (FreeBlock*)((char*)block - HEADER_SIZE);
+  ThreadFreeLists* lists = get_free_lists();
+
+  if (free_block->header.owner == lists)
+  {
+    --lists->allocated;
+    push_local(lists, free_block);
+  }
+  else
+  {
+    push_remote(free_block->header.owner, free_block);
+  }
+}
+
+void SlabCache::get_stats(uint_fast64_t& hits,
+                          uint_fast64_t& misses,
+                          uint_fast64_t& remote_frees)
+{
+  hits = cache_hits.exchange(0);
+  misses = cache_misses.exchange(0);
+  remote_frees = cache_remote_frees.exchange(0);
+}
+
+int SlabCache::live_thread_lists()
+{
+  return live_free_lists.load(std::memory_order_relaxed);
+}
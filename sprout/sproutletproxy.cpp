@@ -64,11 +64,13 @@ SproutletProxy::SproutletProxy(pjsip_endpoint* endpt,
                                int priority,
                                const std::string& root_uri,
                                const std::unordered_set<std::string>& host_aliases,
-                               const std::list<Sproutlet*>& sproutlets) :
+                               const std::list<Sproutlet*>& sproutlets,
+                               AsyncDispatcher* async_dispatcher) :
   BasicProxy(endpt, "mod-sproutlet-controller", priority, false),
   _root_uri(NULL),
   _host_aliases(host_aliases),
-  _sproutlets(sproutlets)
+  _sproutlets(sproutlets),
+  _async_dispatcher(async_dispatcher)
 {
   /// Store the URI of this SproutletProxy - this is used for Record-Routing.
   LOG_DEBUG("Root Record-Route URI = %s", root_uri.c_str());
@@ -90,7 +92,7 @@ void SproutletProxy::on_timer_pop(pj_timer_heap_t* th,
   tdata->proxy->on_timer_pop(tdata->uas_tsx,
                              tdata->sproutlet_wrapper,
                              tdata->context);
-  delete tentry;
+  SlabCache::free(tentry, sizeof(pj_timer_entry));
   delete tdata;
 }
 
@@ -390,7 +392,8 @@ bool SproutletProxy::schedule_timer(SproutletProxy::UASTsx* uas_tsx,
                                     TimerID& id,
                                     int duration)
 {
-  pj_timer_entry* tentry = new pj_timer_entry();
+  pj_timer_entry* tentry =
+                 (pj_timer_entry*)SlabCache::alloc(sizeof(pj_timer_entry));
   memset(tentry, 0, sizeof(*tentry));
 
   SproutletTimerCallbackData* tdata = new SproutletTimerCallbackData;
@@ -421,7 +424,7 @@ void SproutletProxy::cancel_timer(TimerID id)
   pjsip_endpt_cancel_timer(_endpt, tentry);
   SproutletTimerCallbackData* tdata = (SproutletTimerCallbackData*)tentry->user_data;
   delete tdata;
-  delete tentry;
+  SlabCache::free(tentry, sizeof(pj_timer_entry));
   LOG_DEBUG("Cancelled Sproutlet timer, id = %ld", id);
 }
 
@@ -441,6 +444,21 @@ void SproutletProxy::on_timer_pop(SproutletProxy::UASTsx* uas_tsx,
                              context);
 }
 
+
+void SproutletProxy::run_async(SproutletProxy::UASTsx* uas_tsx,
+                               SproutletWrapper* sproutlet_wrapper,
+                               const std::function<void()>& operation,
+                               void* context)
+{
+  // Run the operation on the dispatcher, then resume the transaction on a
+  // worker thread.
+  _async_dispatcher->dispatch(operation,
+                              std::bind(&SproutletProxy::UASTsx::process_async_complete,
+                                        uas_tsx,
+                                        sproutlet_wrapper,
+                                        context));
+}
+
 SproutletProxy::UASTsx::UASTsx(SproutletProxy* proxy) :
   BasicProxy::UASTsx(proxy),
   _root(NULL),
@@ -448,6 +466,7 @@ SproutletProxy::UASTsx::UASTsx(SproutletProxy* proxy) :
   _dmap_uac(),
   _umap(),
   _pending_req_q(),
+  _pending_async(0),
   _sproutlet_proxy(proxy)
 {
   LOG_VERBOSE("Sproutlet Proxy transaction (%p) created", this);
@@ -502,6 +521,12 @@ pj_status_t SproutletProxy::UASTsx::init(pjsip_rx_data* rdata)
 
     if (status == PJ_SUCCESS)
     {
+      if (sproutlet != NULL)
+      {
+        // Attribute the processing of this request to the Sproutlet.
+        set_rx_msg_handler(sproutlet->service_name());
+      }
+
       _root = new SproutletWrapper(_sproutlet_proxy,
                                    this,
                                    sproutlet,
@@ -564,6 +589,21 @@ void SproutletProxy::UASTsx::process_timer_pop(SproutletWrapper* sproutlet_wrapp
 }
 
 
+/// Handle completion of an asynchronous operation.
+void SproutletProxy::UASTsx::process_async_complete(SproutletWrapper* sproutlet_wrapper,
+                                                    void* context)
+{
+  enter_context();
+  --_pending_async;
+  sproutlet_wrapper->on_async_complete(context);
+  schedule_requests();
+
+  // Check to see if we can destroy the UASTsx now the operation is complete.
+  check_destroy();
+  exit_context();
+}
+
+
 /// Handles a response to an associated UACTsx.
 void SproutletProxy::UASTsx::on_new_client_response(UACTsx* uac_tsx,
                                                     pjsip_tx_data *rsp)
@@ -809,6 +849,25 @@ bool SproutletProxy::UASTsx::timer_running(TimerID id)
 }
 
 
+void SproutletProxy::UASTsx::run_async(SproutletWrapper* tsx,
+                                       const std::function<void()>& operation,
+                                       void* context)
+{
+  if (_sproutlet_proxy->_async_dispatcher != NULL)
+  {
+    ++_pending_async;
+    _sproutlet_proxy->run_async(this, tsx, operation, context);
+  }
+  else
+  {
+    // Asynchronous operations are not enabled, so just run the operation on
+    // this thread.  We are already in the transaction's context.
+    operation();
+    tsx->on_async_complete(context);
+  }
+}
+
+
 void SproutletProxy::UASTsx::tx_response(SproutletWrapper* downstream,
                                          pjsip_tx_data* rsp)
 {
@@ -916,6 +975,7 @@ void SproutletProxy::UASTsx::check_destroy()
   if ((_dmap_uac.empty()) &&
       (_dmap_sproutlet.empty()) &&
       (_umap.empty()) &&
+      (_pending_async == 0) &&
       (_tsx == NULL))
   {
     // UAS transaction has been destroyed and all Sproutlets are complete.
@@ -945,6 +1005,7 @@ SproutletWrapper::SproutletWrapper(SproutletProxy* proxy,
   _send_responses(),
   _pending_sends(0),
   _pending_responses(0),
+  _pending_async(0),
   _best_rsp(NULL),
   _complete(false),
   _forks(),
@@ -1298,6 +1359,13 @@ bool SproutletWrapper::timer_running(TimerID id)
   return _proxy_tsx->timer_running(id);
 }
 
+void SproutletWrapper::run_async(const std::function<void()>& operation,
+                                 void* context)
+{
+  ++_pending_async;
+  _proxy_tsx->run_async(this, operation, context);
+}
+
 SAS::TrailId SproutletWrapper::trail() const
 {
   return _trail_id;
@@ -1457,6 +1525,21 @@ void SproutletWrapper::on_timer_pop(void* context)
   process_actions(false);
 }
 
+void SproutletWrapper::on_async_complete(void* context)
+{
+  LOG_DEBUG("Asynchronous operation complete");
+  --_pending_async;
+  _sproutlet_tsx->on_async_complete(context);
+
+  if (_proxy->_async_dispatcher != NULL)
+  {
+    // The operation completed after the Sproutlet returned control, so
+    // process any actions it has taken.  (If the operation ran inline the
+    // actions are processed when the Sproutlet returns.)
+    process_actions(false);
+  }
+}
+
 void SproutletWrapper::register_tdata(pjsip_tx_data* tdata)
 {
   LOG_DEBUG("Adding message %p => txdata %p mapping",
@@ -1538,10 +1621,12 @@ void SproutletWrapper::process_actions(bool complete_after_actions)
   }
 
   if ((_complete) &&
-      (_pending_responses == 0))
+      (_pending_responses == 0) &&
+      (_pending_async == 0))
   {
     // Sproutlet has sent a final response and has no downstream forks
-    // waiting a response, so should destroy itself.
+    // waiting a response or asynchronous operations outstanding, so should
+    // destroy itself.
     LOG_VERBOSE("%s suiciding", _id.c_str());
     delete this;
   }
@@ -49,15 +49,18 @@ extern "C" {
 
 // Common STL includes.
 #include <cassert>
+#include <algorithm>
 #include <vector>
 #include <map>
 #include <set>
 #include <list>
 #include <queue>
 #include <string>
+#include <atomic>
+#include <functional>
 
 #include "constants.h"
-#include "eventq.h"
+#include "classified_eventq.h"
 #include "pjutils.h"
 #include "log.h"
 #include "sas.h"
@@ -73,23 +76,212 @@ extern "C" {
 #include "connection_tracker.h"
 #include "quiescing_manager.h"
 #include "load_monitor.h"
+#include "admission_controller.h"
 #include "counter.h"
+#include "latency_histogram.h"
+#include "slab_cache.h"
+#include "thread_affinity.h"
+#include "worker_pool_policy.h"
+#include "regstore.h"
 
 class StackQuiesceHandler;
 
 struct stack_data_struct stack_data;
 
 static std::vector<pj_thread_t*> pjsip_threads;
-static std::vector<pj_thread_t*> worker_threads;
-static volatile pj_bool_t quit_flag;
 
-// Queue for incoming messages.
+// Worker threads, and the pool each was created from.  Each worker thread
+// has a pool of its own, so a thread that retires from an elastic pool can be
+// freed completely once it has been joined.
+static std::map<pj_thread_t*, pj_pool_t*> worker_threads;
+
+// Worker threads that have retired from their pool and are waiting to be
+// joined by the reaper thread.  Retired threads stay in worker_threads until
+// they have been joined.  Both are protected by worker_threads_lock, and
+// worker_threads_cond is signalled when a thread retires (or the reaper
+// thread is stopped).
+static std::vector<pj_thread_t*> retired_worker_threads;
+static pthread_mutex_t worker_threads_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t worker_threads_cond = PTHREAD_COND_INITIALIZER;
+static pj_thread_t* reaper_thread = NULL;
+static bool reaper_stopping = false;
+static volatile pj_bool_t quit_flag;
+static std::atomic<bool> workers_running(false);
+
+// CPU sets that the PJSIP and worker threads are pinned to.  Each is a list of
+// groups - PJSIP threads are assigned to the groups in turn, and worker
+// threads use the group for their queue.  If empty, the threads are not
+// pinned.
+static std::vector<cpu_set_t> pjsip_cpu_sets;
+static std::vector<cpu_set_t> worker_cpu_sets;
+static bool numa_local_threads = false;
+static std::atomic<int> num_started_workers(0);
+
+// Maximum number of messages a worker thread takes from its queue at a time.
+// The actual number adapts to the depth of the queue.
+static int worker_batch_size = 1;
+
+// The queue serviced by the current thread, or NULL if this is not a worker
+// thread.
+static __thread rx_msg_queue* worker_rxq = NULL;
+
+// The batch of messages the current worker thread is processing, and the
+// index of the next message in the batch, so the rest of the batch can be
+// put back on the queue if the worker blocks.
+static __thread std::vector<struct rx_msg_qe>* worker_batch = NULL;
+static __thread size_t worker_batch_next = 0;
+
+// Queue entry for incoming messages.  Entries with no message carry a
+// callback posted by post_to_worker instead.
 struct rx_msg_qe
 {
   pjsip_rx_data* rdata;    // received message
   Utils::StopWatch stop_watch;    // stop watch for tracking message latency
+  std::function<void()> callback;    // callback to run (if rdata is NULL)
+  bool retire;    // tells the worker thread to exit (if rdata is NULL)
+  int admitted_cls;    // admission class of the request, or -1 if the
+                       // message didn't go through admission control
+  int cls;    // queue class the entry was pushed to
+  size_t order_key;    // hash of the Call-ID, so messages for the same
+                       // Call-ID are popped in order, or zero
 };
-eventq<struct rx_msg_qe> rx_msg_q;
+
+// Priority classes for received messages.  Messages relating to existing
+// transactions and dialogs are processed first, so that calls already in
+// progress are not starved by new work, and registration traffic is
+// processed last.
+enum
+{
+  RX_MSG_CLASS_IN_DIALOG = 0,
+  RX_MSG_CLASS_NEW_SESSION,
+  RX_MSG_CLASS_REGISTRATION,
+  NUM_RX_MSG_CLASSES
+};
+
+// Number of consecutive messages a class with messages waiting can be passed
+// over for before it is served ahead of the higher priority classes.  This
+// guarantees each class at least one message in every
+// RX_MSG_STARVATION_LIMIT + 1, so registration traffic is slowed rather
+// than starved completely while calls are saturating the workers.
+static const unsigned int RX_MSG_STARVATION_LIMIT = 8;
+
+// Incoming messages are distributed across one or more queues, each serviced
+// by its own group of worker threads.  Messages are assigned to a queue by
+// hashing the Call-ID (or the transport if there is no Call-ID), so related
+// messages are always processed by the same group of threads.  Each queue
+// keeps its own latency and queue size statistics and does its own deadlock
+// detection.
+//
+// Hashing by Call-ID puts the messages for a dialog (and the refreshes of a
+// registration, which reuse the Call-ID) on the same queue.  The Call-ID is
+// also the ordering key within the queue, so these messages are dequeued in
+// the order they arrived even when they are in different priority classes -
+// a CANCEL never overtakes its INVITE.  However, it means the load
+// is only spread evenly when it comes from many Call-IDs.  A single very busy
+// dialog, or a storm of REGISTERs from one UA, is handled by one queue and
+// can back it up while the other queues are idle.  The transaction key isn't
+// used instead because that would let requests within a dialog (for example
+// a re-INVITE and a BYE) be processed out of order.
+//
+// The pool of worker threads servicing each queue can grow and shrink between
+// a minimum and maximum size - see adjust_worker_pool.
+struct rx_msg_queue
+{
+  rx_msg_queue(const std::vector<unsigned int>& max_depths) :
+    q(max_depths, RX_MSG_STARVATION_LIMIT)
+  {
+    pthread_mutex_init(&pool_lock, NULL);
+  }
+
+  ~rx_msg_queue()
+  {
+    pthread_mutex_destroy(&pool_lock);
+  }
+
+  int index;
+  classified_eventq<struct rx_msg_qe> q;
+
+  // Worker pool limits, the current number of workers (excluding any that
+  // have been asked to retire) and the number currently blocked waiting for
+  // I/O.
+  int min_workers;
+  int max_workers;
+  std::atomic<int> num_workers;
+  std::atomic<int> num_blocked;
+
+  // Queue wait samples accumulated since the worker pool size was last
+  // reviewed, and the lock and timer controlling the reviews.
+  std::atomic<uint_fast64_t> pool_wait_sum_us;
+  std::atomic<uint_fast64_t> pool_wait_samples;
+  pthread_mutex_t pool_lock;
+  Utils::StopWatch pool_stop_watch;
+
+  // Latency and queue size samples accumulated since the statistics were
+  // last reported.
+  std::atomic<uint_fast64_t> latency_sum_us;
+  std::atomic<uint_fast64_t> latency_samples;
+  std::atomic<uint_fast64_t> queue_size_sum;
+  std::atomic<uint_fast64_t> queue_size_samples;
+  std::atomic<uint_fast64_t> batch_size_sum;
+  std::atomic<uint_fast64_t> batch_samples;
+};
+static std::vector<rx_msg_queue*> rx_msg_queues;
+
+
+// Default target latencies (in microseconds) for admission control of any
+// classes that haven't been given one.  In-dialog traffic completes calls
+// that have already used resources, so it is allowed twice the latency of
+// the other classes before it is throttled, and is shed last.
+static const int DEFAULT_TARGET_LATENCY = 100000;
+static const int DEFAULT_IN_DIALOG_TARGET_LATENCY = 2 * DEFAULT_TARGET_LATENCY;
+
+// Retry-After value (in seconds) sent on requests rejected because their
+// queue class is full.
+static const int QUEUE_FULL_RETRY_AFTER = 1;
+
+// Every received message is cloned (by pjsip_rx_data_clone) into a pool of
+// its own, which is released once a worker thread has processed it.  The
+// caching pool factory keeps released pools for reuse as long as the total
+// capacity it holds is below this limit, so the clone doesn't have to
+// allocate a fresh pool from the system for every message.  This allows
+// several thousand rx_data pools (of PJSIP_POOL_RDATA_LEN bytes) to be kept.
+static const pj_size_t POOL_CACHE_MAX_CAPACITY = 32 * 1024 * 1024;
+
+// Method categories used to break down the queue wait and service time
+// statistics.
+enum
+{
+  RX_MSG_METHOD_INVITE = 0,
+  RX_MSG_METHOD_REGISTER,
+  RX_MSG_METHOD_SUBSCRIBE,
+  RX_MSG_METHOD_IN_DIALOG,
+  RX_MSG_METHOD_OTHER,
+  NUM_RX_MSG_METHODS
+};
+static const char* RX_MSG_METHOD_NAMES[] =
+{
+  "INVITE",
+  "REGISTER",
+  "SUBSCRIBE",
+  "in-dialog",
+  "other"
+};
+
+// Queue wait and service time histograms for each method category, and
+// service time histograms for each handler (keyed by handler name and
+// created on demand).
+static LatencyHistogram queue_wait_histograms[NUM_RX_MSG_METHODS];
+static LatencyHistogram service_time_histograms[NUM_RX_MSG_METHODS];
+static std::map<std::string, LatencyHistogram*> handler_histograms;
+static pthread_rwlock_t handler_histograms_lock = PTHREAD_RWLOCK_INITIALIZER;
+
+// Name of the handler for the message currently being processed by this
+// worker thread.
+static const int MAX_HANDLER_NAME_LEN = 32;
+static __thread char rx_msg_handler[MAX_HANDLER_NAME_LEN];
+
+// Handler name used for messages that aren't claimed by any handler.
+static const char* DEFAULT_HANDLER_NAME = "core";
 
 // Deadlock detection threshold for the message queue (in milliseconds).  This
 // is set to roughly twice the expected maximum service time for each message
@@ -97,12 +289,38 @@ eventq<struct rx_msg_qe> rx_msg_q;
 // from a single request, each with a possible 500ms timeout).
 static const int MSG_Q_DEADLOCK_TIME = 4000;
 
+// Period over which the per-queue statistics are accumulated before being
+// reported (in milliseconds).
+static const int QUEUE_STATS_PERIOD = 5000;
+
 static Accumulator* latency_accumulator;
 static Accumulator* queue_size_accumulator;
 static Counter* requests_counter;
 static Counter* overload_counter;
+static Counter* queue_full_counter;
+static Statistic* queue_latency_statistic;
+static Statistic* queue_size_statistic;
+static Statistic* queue_wait_statistic;
+static Statistic* service_time_statistic;
+static Statistic* handler_service_time_statistic;
+static Statistic* slab_cache_statistic;
+static Statistic* thread_placement_statistic;
+static Statistic* queue_batch_size_statistic;
+static Statistic* worker_pool_size_statistic;
+static Counter* worker_pool_grown_counter;
+static Counter* worker_pool_shrunk_counter;
+static Statistic* admission_rate_statistic;
+static Statistic* rejected_overload_by_class_statistic;
+static Statistic* regstore_cas_retries_statistic;
+static pthread_mutex_t queue_stats_lock = PTHREAD_MUTEX_INITIALIZER;
+static Utils::StopWatch queue_stats_stop_watch;
+
+// Functions that report the statistics of other components, keyed by owner.
+static std::map<const void*, std::function<void()> > stats_reporters;
+static pthread_mutex_t stats_reporters_lock = PTHREAD_MUTEX_INITIALIZER;
 
 static LoadMonitor *load_monitor = NULL;
+static AdmissionController *admission_controller = NULL;
 static QuiescingManager *quiescing_mgr = NULL;
 static StackQuiesceHandler *stack_quiesce_handler = NULL;
 static ConnectionTracker *connection_tracker = NULL;
@@ -145,6 +363,29 @@ const static std::string _known_statnames[] = {
   "hss_user_auth_latency_us",
   "hss_location_latency_us",
   "connected_ralfs",
+  "worker_queue_latency_us",
+  "worker_queue_size",
+  "rejected_queue_full",
+  "queue_wait_latency_us",
+  "service_latency_us",
+  "handler_service_latency_us",
+  "slab_cache_stats",
+  "thread_placement",
+  "worker_queue_batch_size",
+  "worker_pool_size",
+  "worker_pool_grown",
+  "worker_pool_shrunk",
+  "admission_rate_limits",
+  "rejected_overload_by_class",
+  "regstore_cas_retries",
+  "aor_cache_stats",
+  "aor_write_coalescing",
+  "remote_replication",
+  "chronos_timer_batching",
+  "hss_profile_cache",
+  "hss_coalesced_requests",
+  "regex_cache",
+  "scscf_assignment_cache",
 };
 
 const static std::string SPROUT_ZMQ_PORT = "6666";
@@ -153,13 +394,72 @@ const static std::string BONO_ZMQ_PORT = "6669";
 const std::string* known_statnames = _known_statnames;
 const int num_known_stats = sizeof(_known_statnames) / sizeof(std::string);
 
+/// Pins a PJSIP or worker thread to the CPUs for its group (if configured),
+/// and records its placement.  Threads with no configured CPUs are reset to
+/// the process's original affinity, rather than keeping the service CPUs
+/// they inherit from the main thread.
+static void place_stack_thread(const std::string& name,
+                               const std::vector<cpu_set_t>& cpu_sets,
+                               int group)
+{
+  if (cpu_sets.empty())
+  {
+    ThreadAffinity::unpin_thread(name);
+  }
+  else
+  {
+    ThreadAffinity::pin_thread(name,
+                               cpu_sets[group % cpu_sets.size()],
+                               numa_local_threads);
+  }
+}
+
+
+/// Parses a list of CPU lists separated by semi-colons.
+static bool parse_cpu_groups(const std::string& groups,
+                             std::vector<cpu_set_t>& cpu_sets)
+{
+  std::vector<std::string> lists;
+  Utils::split_string(groups, ';', lists, 0, true);
+  cpu_sets.clear();
+
+  for (size_t ii = 0; ii < lists.size(); ++ii)
+  {
+    cpu_set_t cpus;
+    if (!ThreadAffinity::parse_cpu_list(lists[ii], cpus))
+    {
+      return false;
+    }
+    cpu_sets.push_back(cpus);
+  }
+
+  return true;
+}
+
+
+pj_status_t set_stack_thread_affinity(const std::string& pjsip_cpus,
+                                      const std::string& worker_cpus,
+                                      bool numa_local)
+{
+  if ((!parse_cpu_groups(pjsip_cpus, pjsip_cpu_sets)) ||
+      (!parse_cpu_groups(worker_cpus, worker_cpu_sets)))
+  {
+    return PJ_EINVAL;
+  }
+  numa_local_threads = numa_local;
+
+  return PJ_SUCCESS;
+}
+
+
 /// PJSIP threads are donated to PJSIP to handle receiving at transport level
 /// and timers.
 static int pjsip_thread(void *p)
 {
   pj_time_val delay = {0, 10};
+  int index = (int)(intptr_t)p;
 
-  PJ_UNUSED_ARG(p);
+  place_stack_thread("pjsip-" + std::to_string(index), pjsip_cpu_sets, index);
 
   LOG_DEBUG("PJSIP thread started");
 
@@ -174,9 +474,335 @@ static int pjsip_thread(void *p)
 }
 
 
-/// Worker threads handle most SIP message processing.
+/// Returns the method category of a received message.
+static int rx_msg_method(pjsip_rx_data* rdata)
+{
+  pjsip_msg* msg = rdata->msg_info.msg;
+
+  if ((msg->type == PJSIP_RESPONSE_MSG) ||
+      ((rdata->msg_info.to != NULL) &&
+       (rdata->msg_info.to->tag.slen > 0)))
+  {
+    return RX_MSG_METHOD_IN_DIALOG;
+  }
+  else if (msg->line.req.method.id == PJSIP_INVITE_METHOD)
+  {
+    return RX_MSG_METHOD_INVITE;
+  }
+  else if (msg->line.req.method.id == PJSIP_REGISTER_METHOD)
+  {
+    return RX_MSG_METHOD_REGISTER;
+  }
+  else if (pjsip_method_cmp(&msg->line.req.method,
+                            pjsip_get_subscribe_method()) == 0)
+  {
+    return RX_MSG_METHOD_SUBSCRIBE;
+  }
+
+  return RX_MSG_METHOD_OTHER;
+}
+
+
+void set_rx_msg_handler(const std::string& handler)
+{
+  strncpy(rx_msg_handler, handler.c_str(), MAX_HANDLER_NAME_LEN - 1);
+  rx_msg_handler[MAX_HANDLER_NAME_LEN - 1] = '\0';
+}
+
+
+/// Records the service time for a message against the handler that
+/// processed it.
+static void record_handler_service_time(const std::string& handler,
+                                        unsigned long service_us)
+{
+  LatencyHistogram* histogram = NULL;
+
+  pthread_rwlock_rdlock(&handler_histograms_lock);
+  std::map<std::string, LatencyHistogram*>::iterator i =
+                                                handler_histograms.find(handler);
+  if (i != handler_histograms.end())
+  {
+    histogram = i->second;
+  }
+  pthread_rwlock_unlock(&handler_histograms_lock);
+
+  if (histogram == NULL)
+  {
+    // First message for this handler, so create its histogram (checking
+    // again under the write lock in case another thread got there first).
+    pthread_rwlock_wrlock(&handler_histograms_lock);
+    LatencyHistogram*& entry = handler_histograms[handler];
+    if (entry == NULL)
+    {
+      entry = new LatencyHistogram();
+    }
+    histogram = entry;
+    pthread_rwlock_unlock(&handler_histograms_lock);
+  }
+
+  histogram->record(service_us);
+}
+
+
+/// Reports the latency histograms.  Each statistic is a list of groups of
+/// values, one group per method category or handler, with each group
+/// holding the name, sample count and 50th, 90th, 99th and 99.9th percentile
+/// latencies.
+static void report_latency_histograms()
+{
+  std::vector<std::string> queue_wait_values;
+  std::vector<std::string> service_time_values;
+  std::vector<std::string> handler_values;
+
+  for (int ii = 0; ii < NUM_RX_MSG_METHODS; ++ii)
+  {
+    queue_wait_values.push_back(RX_MSG_METHOD_NAMES[ii]);
+    queue_wait_histograms[ii].report(queue_wait_values);
+    service_time_values.push_back(RX_MSG_METHOD_NAMES[ii]);
+    service_time_histograms[ii].report(service_time_values);
+  }
+
+  pthread_rwlock_rdlock(&handler_histograms_lock);
+  for (std::map<std::string, LatencyHistogram*>::iterator i = handler_histograms.begin();
+       i != handler_histograms.end();
+       ++i)
+  {
+    handler_values.push_back(i->first);
+    i->second->report(handler_values);
+  }
+  pthread_rwlock_unlock(&handler_histograms_lock);
+
+  queue_wait_statistic->report_change(queue_wait_values);
+  service_time_statistic->report_change(service_time_values);
+  handler_service_time_statistic->report_change(handler_values);
+}
+
+
+/// Reports the per-queue statistics and latency histograms if the reporting
+/// period has elapsed.  The per-queue statistics are reported as lists with
+/// one entry per queue, giving the mean latency and mean queue size seen by
+/// each queue over the period.
+static void report_queue_stats()
+{
+  if (pthread_mutex_trylock(&queue_stats_lock) != 0)
+  {
+    // Another thread is already reporting.
+    return;
+  }
+
+  unsigned long elapsed_us;
+  if ((queue_stats_stop_watch.read(elapsed_us)) &&
+      (elapsed_us >= QUEUE_STATS_PERIOD * 1000))
+  {
+    std::vector<std::string> latencies;
+    std::vector<std::string> queue_sizes;
+    std::vector<std::string> batch_sizes;
+    std::vector<std::string> pool_sizes;
+
+    for (size_t ii = 0; ii < rx_msg_queues.size(); ++ii)
+    {
+      rx_msg_queue* rxq = rx_msg_queues[ii];
+      uint_fast64_t latency_samples = rxq->latency_samples.exchange(0);
+      uint_fast64_t latency_sum_us = rxq->latency_sum_us.exchange(0);
+      uint_fast64_t queue_size_samples = rxq->queue_size_samples.exchange(0);
+      uint_fast64_t queue_size_sum = rxq->queue_size_sum.exchange(0);
+      uint_fast64_t batch_samples = rxq->batch_samples.exchange(0);
+      uint_fast64_t batch_size_sum = rxq->batch_size_sum.exchange(0);
+
+      latencies.push_back(std::to_string((latency_samples > 0) ?
+                                         latency_sum_us / latency_samples : 0));
+      queue_sizes.push_back(std::to_string((queue_size_samples > 0) ?
+                                           queue_size_sum / queue_size_samples : 0));
+      batch_sizes.push_back(std::to_string((batch_samples > 0) ?
+                                           batch_size_sum / batch_samples : 0));
+      pool_sizes.push_back(std::to_string(rxq->num_workers));
+    }
+
+    queue_latency_statistic->report_change(latencies);
+    queue_size_statistic->report_change(queue_sizes);
+    queue_batch_size_statistic->report_change(batch_sizes);
+    worker_pool_size_statistic->report_change(pool_sizes);
+
+    report_latency_histograms();
+
+    // Report the slab cache hits and misses over the period, and how many
+    // blocks were returned to the thread that allocated them.
+    uint_fast64_t slab_hits;
+    uint_fast64_t slab_misses;
+    uint_fast64_t slab_remote_frees;
+    SlabCache::get_stats(slab_hits, slab_misses, slab_remote_frees);
+    std::vector<std::string> slab_stats;
+    slab_stats.push_back(std::to_string(slab_hits));
+    slab_stats.push_back(std::to_string(slab_misses));
+    slab_stats.push_back(std::to_string(slab_remote_frees));
+    slab_cache_statistic->report_change(slab_stats);
+
+    // Report the admission rate limit and overload rejections for each
+    // message class, if requests are admitted per class.
+    if (admission_controller != NULL)
+    {
+      std::vector<std::string> rate_limits;
+      std::vector<std::string> rejections;
+      for (int ii = 0; ii < NUM_RX_MSG_CLASSES; ++ii)
+      {
+        rate_limits.push_back(std::to_string(admission_controller->get_rate_limit(ii)));
+        rejections.push_back(std::to_string(admission_controller->get_rejected(ii)));
+      }
+      admission_rate_statistic->report_change(rate_limits);
+      rejected_overload_by_class_statistic->report_change(rejections);
+    }
+
+    // Report the CAS retries needed to update registration data, for each
+    // type of update.
+    std::vector<std::string> cas_retries;
+    RegStore::get_cas_retry_stats(cas_retries);
+    regstore_cas_retries_statistic->report_change(cas_retries);
+
+    std::vector<std::string> placements;
+    ThreadAffinity::get_placements(placements);
+    thread_placement_statistic->report_change(placements);
+
+    pthread_mutex_lock(&stats_reporters_lock);
+    for (std::map<const void*, std::function<void()> >::const_iterator i =
+           stats_reporters.begin();
+         i != stats_reporters.end();
+         ++i)
+    {
+      i->second();
+    }
+    pthread_mutex_unlock(&stats_reporters_lock);
+
+    queue_stats_stop_watch.start();
+  }
+
+  pthread_mutex_unlock(&queue_stats_lock);
+}
+
+
+/// Selects the queue for a received message.  Messages with the same Call-ID
+/// always map to the same queue, however many of them there are (see the
+/// comment on rx_msg_queue).  Messages with no Call-ID (which can only
+/// happen if the message is malformed) are queued by transport.
+/// Returns the key used to keep received messages with the same Call-ID in
+/// order on their queue, or zero if the message has no Call-ID.
+static size_t rx_msg_order_key(pjsip_rx_data* rdata)
+{
+  if (rdata->msg_info.cid == NULL)
+  {
+    return 0;
+  }
+
+  // Add one so the key is never zero.
+  return (size_t)pj_hash_calc(0,
+                              rdata->msg_info.cid->id.ptr,
+                              rdata->msg_info.cid->id.slen) + 1;
+}
+
+
+static rx_msg_queue* select_rx_msg_queue(pjsip_rx_data* rdata)
+{
+  if (rx_msg_queues.size() == 1)
+  {
+    return rx_msg_queues[0];
+  }
+
+  size_t hash = rx_msg_order_key(rdata);
+  if (hash == 0)
+  {
+    pjsip_transport* tp = rdata->tp_info.transport;
+    hash = pj_hash_calc(0, &tp, sizeof(tp));
+  }
+
+  return rx_msg_queues[hash % rx_msg_queues.size()];
+}
+
+
+/// Processes a single entry taken from a worker queue - either a received
+/// message or a posted callback.
+static void process_rx_msg_qe(rx_msg_queue* rxq,
+                              struct rx_msg_qe& qe,
+                              pjsip_process_rdata_param* rp)
+{
+  pjsip_rx_data* rdata = qe.rdata;
+  if (rdata)
+  {
+    LOG_DEBUG("Worker thread dequeue message %p", rdata);
+
+    // Record how long the message waited on the queue, then time how long
+    // it takes to process.  The handler name is set by whichever module
+    // handles the message.
+    int method = rx_msg_method(rdata);
+    unsigned long queue_wait_us;
+    if (qe.stop_watch.read(queue_wait_us))
+    {
+      queue_wait_histograms[method].record(queue_wait_us);
+      rxq->pool_wait_sum_us += queue_wait_us;
+      ++rxq->pool_wait_samples;
+    }
+    strcpy(rx_msg_handler, DEFAULT_HANDLER_NAME);
+    Utils::StopWatch service_stop_watch;
+    service_stop_watch.start();
+
+    pjsip_endpt_process_rx_data(stack_data.endpt, rdata, rp, NULL);
+    LOG_DEBUG("Worker thread completed processing message %p", rdata);
+    pjsip_rx_data_free_cloned(rdata);
+
+    unsigned long service_us = 0;
+    if (service_stop_watch.read(service_us))
+    {
+      LOG_DEBUG("Service time = %ldus (%s)", service_us, rx_msg_handler);
+      service_time_histograms[method].record(service_us);
+      record_handler_service_time(rx_msg_handler, service_us);
+    }
+
+    unsigned long latency_us;
+    if (qe.stop_watch.read(latency_us))
+    {
+      LOG_DEBUG("Request latency = %ldus", latency_us);
+      latency_accumulator->accumulate(latency_us);
+
+      // Feed the latency back to the load monitor, and to the class's own
+      // throttle if it went through one.
+      load_monitor->request_complete(latency_us);
+      if ((admission_controller != NULL) && (qe.admitted_cls >= 0))
+      {
+        admission_controller->request_complete(qe.admitted_cls,
+                                               latency_us,
+                                               service_us);
+      }
+      rxq->latency_sum_us += latency_us;
+      ++rxq->latency_samples;
+      report_queue_stats();
+    }
+    else
+    {
+      LOG_ERROR("Failed to get done timestamp: %s", strerror(errno));
+    }
+  }
+  else if (qe.callback)
+  {
+    // Work posted back to the worker threads, typically the completion of
+    // an asynchronous operation.
+    LOG_DEBUG("Worker thread running posted callback");
+    strcpy(rx_msg_handler, DEFAULT_HANDLER_NAME);
+    qe.callback();
+    qe.callback = nullptr;
+  }
+}
+
+
+/// Worker threads handle most SIP message processing.  Each worker thread
+/// services a single queue, passed in as the thread parameter.
 static int worker_thread(void* p)
 {
+  rx_msg_queue* rxq = (rx_msg_queue*)p;
+
+  // Worker threads servicing the same queue share a CPU group, so the
+  // transaction state for a call stays in one place.
+  std::string name = "worker-" + std::to_string(rxq->index) + "-" +
+                     std::to_string(num_started_workers++);
+  place_stack_thread(name, worker_cpu_sets, rxq->index);
+
   // Set up data to always process incoming messages at the first PJSIP
   // module after our module.
   pjsip_process_rdata_param rp;
@@ -184,40 +810,334 @@ static int worker_thread(void* p)
   rp.start_mod = &mod_stack;
   rp.idx_after_start = 1;
 
-  LOG_DEBUG("Worker thread started");
+  worker_rxq = rxq;
 
-  struct rx_msg_qe qe = {0};
+  LOG_DEBUG("Worker thread started on queue %d", rxq->index);
 
-  while (rx_msg_q.pop(qe))
+  // Take a batch of messages from the queue at a time, so the queue lock is
+  // taken once per batch rather than once per message, and then process them
+  // back-to-back.  Each message's queue wait is measured when processing of
+  // that message starts, so time spent waiting behind earlier messages in the
+  // same batch is still counted.
+  //
+  // The batch is taken in priority order, but a higher priority message that
+  // arrives while the batch is being processed waits for the rest of the
+  // batch, so larger batches trade priority (and latency for in-dialog
+  // messages) for less queue lock contention.  If processing a message
+  // blocks, the rest of the batch is put back on the queue (see
+  // worker_blocked) so other workers can process it.
+  std::vector<struct rx_msg_qe> batch;
+  batch.reserve(worker_batch_size);
+  worker_batch = &batch;
+  bool retire = false;
+
+  while ((!retire) && (rxq->q.pop_batch(batch, worker_batch_size) > 0))
   {
-    pjsip_rx_data* rdata = qe.rdata;
-    if (rdata)
+    rxq->batch_size_sum += batch.size();
+    ++rxq->batch_samples;
+
+    for (size_t ii = 0; ii < batch.size(); ++ii)
     {
-      LOG_DEBUG("Worker thread dequeue message %p", rdata);
-      pjsip_endpt_process_rx_data(stack_data.endpt, rdata, &rp, NULL);
-      LOG_DEBUG("Worker thread completed processing message %p", rdata);
-      pjsip_rx_data_free_cloned(rdata);
+      worker_batch_next = ii + 1;
 
-      unsigned long latency_us;
-      if (qe.stop_watch.read(latency_us))
+      if ((batch[ii].rdata == NULL) && (batch[ii].retire))
       {
-        LOG_DEBUG("Request latency = %ldus", latency_us);
-        latency_accumulator->accumulate(latency_us);
-        load_monitor->request_complete(latency_us);
+        // The pool is shrinking.  Finish the rest of the batch, then exit.
+        retire = true;
       }
       else
       {
-        LOG_ERROR("Failed to get done timestamp: %s", strerror(errno));
+        process_rx_msg_qe(rxq, batch[ii], &rp);
       }
     }
+    batch.clear();
   }
 
+  if (retire)
+  {
+    // Forget this thread's placement (retired threads' names aren't reused),
+    // and add it to the retired list so the reaper thread joins it.
+    ThreadAffinity::remove_placement(name);
+    pthread_mutex_lock(&worker_threads_lock);
+    retired_worker_threads.push_back(pj_thread_this());
+    pthread_cond_signal(&worker_threads_cond);
+    pthread_mutex_unlock(&worker_threads_lock);
+    LOG_INFO("Worker thread retired from queue %d", rxq->index);
+  }
+
+  worker_rxq = NULL;
+  worker_batch = NULL;
+
   LOG_DEBUG("Worker thread ended");
 
   return 0;
 }
 
 
+/// Creates a worker thread servicing the specified queue.
+static pj_status_t create_worker_thread(rx_msg_queue* rxq)
+{
+  pj_pool_t* pool = pj_pool_create(&stack_data.cp.factory,
+                                   "worker%p",
+                                   1024,
+                                   1024,
+                                   NULL);
+  if (pool == NULL)
+  {
+    // LCOV_EXCL_START
+    LOG_ERROR("Failed to create pool for worker thread");
+    return PJ_ENOMEM;
+    // LCOV_EXCL_STOP
+  }
+
+  // Hold the lock while the thread is created, so it can't retire before it
+  // has been added to the list.
+  pthread_mutex_lock(&worker_threads_lock);
+  pj_thread_t* thread;
+  pj_status_t status = pj_thread_create(pool, "worker", &worker_thread,
+                                        (void*)rxq, 0, 0, &thread);
+  if (status == PJ_SUCCESS)
+  {
+    worker_threads[thread] = pool;
+    ++rxq->num_workers;
+  }
+  pthread_mutex_unlock(&worker_threads_lock);
+
+  if (status != PJ_SUCCESS)
+  {
+    LOG_ERROR("Error creating worker thread, %s",
+              PJUtils::pj_status_to_string(status).c_str());
+    pj_pool_release(pool);
+  }
+
+  return status;
+}
+
+
+/// The reaper thread joins worker threads as they retire from their pools,
+/// and frees them.  This is done on a thread of its own so that nothing on
+/// the message path waits for a retiring thread to exit.
+static int reaper_thread_func(void* p)
+{
+  pthread_mutex_lock(&worker_threads_lock);
+
+  while (!reaper_stopping)
+  {
+    if (retired_worker_threads.empty())
+    {
+      pthread_cond_wait(&worker_threads_cond, &worker_threads_lock);
+      continue;
+    }
+
+    pj_thread_t* thread = retired_worker_threads.back();
+    retired_worker_threads.pop_back();
+    pthread_mutex_unlock(&worker_threads_lock);
+
+    pj_thread_join(thread);
+    pj_thread_destroy(thread);
+
+    pthread_mutex_lock(&worker_threads_lock);
+    std::map<pj_thread_t*, pj_pool_t*>::iterator i = worker_threads.find(thread);
+    if (i != worker_threads.end())
+    {
+      pj_pool_release(i->second);
+      worker_threads.erase(i);
+    }
+  }
+
+  pthread_mutex_unlock(&worker_threads_lock);
+  return 0;
+}
+
+
+/// Adds a worker thread to the queue's pool if it is below its maximum size.
+/// Must be called with the pool lock held.
+static bool grow_worker_pool(rx_msg_queue* rxq, const char* reason)
+{
+  if ((!workers_running) || (rxq->num_workers >= rxq->max_workers))
+  {
+    return false;
+  }
+
+  if (create_worker_thread(rxq) != PJ_SUCCESS)
+  {
+    return false;
+  }
+
+  LOG_INFO("Added worker thread to queue %d (%s), now %d threads",
+           rxq->index, reason, (int)rxq->num_workers);
+  worker_pool_grown_counter->increment();
+  return true;
+}
+
+
+/// Asks one of the queue's worker threads to exit if the pool is above its
+/// minimum size.  Must be called with the pool lock held.
+static bool shrink_worker_pool(rx_msg_queue* rxq, const char* reason)
+{
+  if ((!workers_running) || (rxq->num_workers <= rxq->min_workers))
+  {
+    return false;
+  }
+
+  // Queue a retire request behind any work already queued.  The first
+  // worker to pick it up exits.
+  struct rx_msg_qe qe = {0};
+  qe.retire = true;
+  qe.cls = RX_MSG_CLASS_REGISTRATION;
+  if (!rxq->q.push(qe, qe.cls, true))
+  {
+    return false;
+  }
+
+  --rxq->num_workers;
+  LOG_INFO("Removing worker thread from queue %d (%s), now %d threads",
+           rxq->index, reason, (int)rxq->num_workers);
+  worker_pool_shrunk_counter->increment();
+  return true;
+}
+
+
+/// Reviews the size of a queue's worker pool once every review period,
+/// based on the queue wait over the period and how many of the workers are
+/// blocked on I/O or idle.  This is called as messages arrive, rather than
+/// from the worker threads, so it still runs when all the workers are
+/// blocked.
+static void adjust_worker_pool(rx_msg_queue* rxq)
+{
+  if ((rxq->max_workers <= rxq->min_workers) ||
+      (pthread_mutex_trylock(&rxq->pool_lock) != 0))
+  {
+    // Fixed size pool, or another thread is already reviewing it.
+    return;
+  }
+
+  unsigned long elapsed_us;
+  if ((rxq->pool_stop_watch.read(elapsed_us)) &&
+      (elapsed_us >= WorkerPoolPolicy::REVIEW_PERIOD_MS * 1000))
+  {
+    uint_fast64_t samples = rxq->pool_wait_samples.exchange(0);
+    uint_fast64_t sum_us = rxq->pool_wait_sum_us.exchange(0);
+    unsigned long mean_wait_us = (samples > 0) ? sum_us / samples : 0;
+
+    if ((samples == 0) && (rxq->q.size() > 0))
+    {
+      // Nothing has been taken off the queue over the whole period.
+      mean_wait_us = elapsed_us;
+    }
+
+    int workers = rxq->num_workers;
+    int blocked = rxq->num_blocked;
+    int idle = rxq->q.num_waiters();
+
+    LOG_DEBUG("Queue %d: mean wait %luus, %d workers, %d blocked, %d idle",
+              rxq->index, mean_wait_us, workers, blocked, idle);
+
+    switch (WorkerPoolPolicy::review(mean_wait_us,
+                                     workers,
+                                     blocked,
+                                     idle,
+                                     rxq->min_workers,
+                                     rxq->max_workers))
+    {
+      case WorkerPoolPolicy::GROW:
+        grow_worker_pool(rxq, "queue wait high and workers blocked");
+        break;
+
+      case WorkerPoolPolicy::SHRINK:
+        shrink_worker_pool(rxq, "workers idle");
+        break;
+
+      default:
+        break;
+    }
+
+    rxq->pool_stop_watch.start();
+  }
+
+  pthread_mutex_unlock(&rxq->pool_lock);
+}
+
+
+void worker_blocked(bool blocked)
+{
+  if (worker_rxq != NULL)
+  {
+    if (blocked)
+    {
+      ++worker_rxq->num_blocked;
+
+      // Put the rest of this worker's batch back on the front of the queue
+      // (last first, so the original order is kept) rather than holding it
+      // while this worker waits.
+      if (worker_batch != NULL)
+      {
+        while (worker_batch->size() > worker_batch_next)
+        {
+          struct rx_msg_qe& qe = worker_batch->back();
+          if (!worker_rxq->q.push_front(qe, qe.cls, qe.order_key))
+          {
+            // The queue has been terminated, so keep the rest of the batch.
+            break;
+          }
+          worker_batch->pop_back();
+        }
+      }
+    }
+    else
+    {
+      --worker_rxq->num_blocked;
+    }
+  }
+}
+
+
+void add_stats_reporter(const void* owner,
+                        const std::function<void()>& reporter)
+{
+  pthread_mutex_lock(&stats_reporters_lock);
+  stats_reporters[owner] = reporter;
+  pthread_mutex_unlock(&stats_reporters_lock);
+}
+
+
+void remove_stats_reporter(const void* owner)
+{
+  pthread_mutex_lock(&stats_reporters_lock);
+  stats_reporters.erase(owner);
+  pthread_mutex_unlock(&stats_reporters_lock);
+}
+
+
+void post_to_worker(const std::function<void()>& callback)
+{
+  if (!workers_running)
+  {
+    // No worker threads to pass the callback to (for example because the
+    // stack is shutting down), so just run it now.
+    callback();
+    return;
+  }
+
+  // Posted work belongs to transactions that are already in progress, so
+  // queue it with the highest priority and never reject it.  It doesn't
+  // matter which worker runs it, so share it out across the queues.
+  static std::atomic<unsigned int> next_queue(0);
+  rx_msg_queue* rxq = rx_msg_queues[next_queue++ % rx_msg_queues.size()];
+
+  struct rx_msg_qe qe = {0};
+  qe.stop_watch.start();
+  qe.callback = callback;
+  qe.cls = RX_MSG_CLASS_IN_DIALOG;
+
+  if (!rxq->q.push(qe, qe.cls, true))
+  {
+    // The queue has been terminated, so run the callback now.
+    callback();
+  }
+}
+
+
 static void local_log_rx_msg(pjsip_rx_data* rdata)
 {
   LOG_VERBOSE("RX %d bytes %s from %s %s:%d:\n"
@@ -350,6 +1270,92 @@ static void sas_log_tx_msg(pjsip_tx_data *tdata)
 }
 
 
+/// Classifies a received message in to one of the queue priority classes.
+static int classify_rx_msg(pjsip_rx_data* rdata)
+{
+  pjsip_msg* msg = rdata->msg_info.msg;
+
+  if (msg->type == PJSIP_RESPONSE_MSG)
+  {
+    // Responses always relate to transactions already in progress.
+    return RX_MSG_CLASS_IN_DIALOG;
+  }
+
+  pjsip_method* method = &msg->line.req.method;
+
+  if ((rdata->msg_info.to != NULL) &&
+      (rdata->msg_info.to->tag.slen > 0))
+  {
+    // In-dialog requests, including SUBSCRIBE refreshes, keep existing
+    // dialogs alive so are treated as dialog traffic.
+    return RX_MSG_CLASS_IN_DIALOG;
+  }
+
+  if ((method->id == PJSIP_REGISTER_METHOD) ||
+      (pjsip_method_cmp(method, pjsip_get_subscribe_method()) == 0))
+  {
+    return RX_MSG_CLASS_REGISTRATION;
+  }
+
+  if ((method->id == PJSIP_ACK_METHOD) ||
+      (method->id == PJSIP_BYE_METHOD) ||
+      (method->id == PJSIP_CANCEL_METHOD))
+  {
+    // These requests complete or modify existing transactions and dialogs.
+    // They can overtake new work, but are queued with their Call-ID as the
+    // ordering key so, for example, a CANCEL is never processed before the
+    // INVITE it cancels.
+    return RX_MSG_CLASS_IN_DIALOG;
+  }
+
+  return RX_MSG_CLASS_NEW_SESSION;
+}
+
+
+/// Rejects a received request statelessly with a 503 Service Unavailable,
+/// logging the supplied event to SAS to explain why.
+static void reject_rx_request(pjsip_rx_data* rdata,
+                              SAS::Event& event,
+                              int retry_after_secs)
+{
+  pjsip_cid_hdr* cid = (pjsip_cid_hdr*)rdata->msg_info.cid;
+
+  SAS::TrailId trail = get_trail(rdata);
+
+  SAS::Marker start_marker(trail, MARKER_ID_START, 1u);
+  SAS::report_marker(start_marker);
+
+  SAS::report_event(event);
+
+  PJUtils::report_sas_to_from_markers(trail, rdata->msg_info.msg);
+
+  if ((rdata->msg_info.msg->line.req.method.id == PJSIP_REGISTER_METHOD) ||
+      ((pjsip_method_cmp(&rdata->msg_info.msg->line.req.method, pjsip_get_subscribe_method())) == 0) ||
+      ((pjsip_method_cmp(&rdata->msg_info.msg->line.req.method, pjsip_get_notify_method())) == 0))
+  {
+    // Omit the Call-ID for these requests, as the same Call-ID can be
+    // reused over a long period of time and produce huge SAS trails.
+    PJUtils::mark_sas_call_branch_ids(trail, NULL, rdata->msg_info.msg);
+  }
+  else
+  {
+    PJUtils::mark_sas_call_branch_ids(trail, cid, rdata->msg_info.msg);
+  }
+
+  SAS::Marker end_marker(trail, MARKER_ID_END, 1u);
+  SAS::report_marker(end_marker);
+
+  pjsip_retry_after_hdr* retry_after =
+                pjsip_retry_after_hdr_create(rdata->tp_info.pool, retry_after_secs);
+  PJUtils::respond_stateless(stack_data.endpt,
+                             rdata,
+                             PJSIP_SC_SERVICE_UNAVAILABLE,
+                             NULL,
+                             (pjsip_hdr*)retry_after,
+                             NULL);
+}
+
+
 static pj_bool_t on_rx_msg(pjsip_rx_data* rdata)
 {
   // Do logging.
@@ -358,54 +1364,53 @@ static pj_bool_t on_rx_msg(pjsip_rx_data* rdata)
 
   requests_counter->increment();
 
-  // Check whether the request should be processed
-  if (!(load_monitor->admit_request()) &&
-      (rdata->msg_info.msg->type == PJSIP_REQUEST_MSG) &&
-      (rdata->msg_info.msg->line.req.method.id != PJSIP_ACK_METHOD))
+  // Work out the priority class of the message.  This is used both for
+  // admission control and to queue the message.
+  int cls = classify_rx_msg(rdata);
+
+  // Check whether the request should be processed.  ACKs and responses
+  // can't be rejected so they aren't subject to admission control.
+  bool admission_controlled =
+    ((rdata->msg_info.msg->type == PJSIP_REQUEST_MSG) &&
+     (rdata->msg_info.msg->line.req.method.id != PJSIP_ACK_METHOD));
+
+  // The load monitor takes a token for every message and sees the latency
+  // of every message, and is also penalized when downstream servers (such as
+  // Homestead) report overload, so it is always the overall gate.  If target
+  // latencies have been configured for the message classes, requests it
+  // admits must also get a token from their class's own bucket, which only
+  // sees the requests it admits.
+  bool admitted = (load_monitor->admit_request()) || (!admission_controlled);
+  bool class_rejected = false;
+  if ((admitted) &&
+      (admission_controlled) &&
+      (admission_controller != NULL))
   {
-    // Discard non-ACK requests if there are no available tokens.
-    // Respond statelessly with a 503 Service Unavailable, including a
-    // Retry-After header with a zero length timeout.
-    LOG_DEBUG("Rejected request due to overload");
-
-    pjsip_cid_hdr* cid = (pjsip_cid_hdr*)rdata->msg_info.cid;
-
-    SAS::TrailId trail = get_trail(rdata);
-
-    SAS::Marker start_marker(trail, MARKER_ID_START, 1u);
-    SAS::report_marker(start_marker);
-
-    SAS::Event event(trail, SASEvent::SIP_OVERLOAD, 0);
-    event.add_static_param(load_monitor->get_target_latency());
-    event.add_static_param(load_monitor->get_current_latency());
-    event.add_static_param(load_monitor->get_rate_limit());
-    SAS::report_event(event);
+    class_rejected = !admission_controller->admit_request(cls);
+    admitted = !class_rejected;
+  }
 
-    PJUtils::report_sas_to_from_markers(trail, rdata->msg_info.msg);
+  if (!admitted)
+  {
+    // Discard non-ACK requests if there are no available tokens, either
+    // overall or for their class.  Respond statelessly with a 503 Service
+    // Unavailable, including a Retry-After header with a zero length timeout.
+    LOG_DEBUG("Rejected class %d request due to overload", cls);
 
-    if ((rdata->msg_info.msg->line.req.method.id == PJSIP_REGISTER_METHOD) ||
-        ((pjsip_method_cmp(&rdata->msg_info.msg->line.req.method, pjsip_get_subscribe_method())) == 0) ||
-        ((pjsip_method_cmp(&rdata->msg_info.msg->line.req.method, pjsip_get_notify_method())) == 0))
+    SAS::Event event(get_trail(rdata), SASEvent::SIP_OVERLOAD, 0);
+    if (!class_rejected)
     {
-      // Omit the Call-ID for these requests, as the same Call-ID can be
-      // reused over a long period of time and produce huge SAS trails.
-      PJUtils::mark_sas_call_branch_ids(trail, NULL, rdata->msg_info.msg);
+      event.add_static_param(load_monitor->get_target_latency());
+      event.add_static_param(load_monitor->get_current_latency());
+      event.add_static_param(load_monitor->get_rate_limit());
     }
     else
     {
-      PJUtils::mark_sas_call_branch_ids(trail, cid, rdata->msg_info.msg);
+      event.add_static_param(admission_controller->get_target_latency(cls));
+      event.add_static_param(admission_controller->get_current_latency(cls));
+      event.add_static_param(admission_controller->get_rate_limit(cls));
     }
-
-    SAS::Marker end_marker(trail, MARKER_ID_END, 1u);
-    SAS::report_marker(end_marker);
-
-    pjsip_retry_after_hdr* retry_after = pjsip_retry_after_hdr_create(rdata->tp_info.pool, 0);
-    PJUtils::respond_stateless(stack_data.endpt,
-                               rdata,
-                               PJSIP_SC_SERVICE_UNAVAILABLE,
-                               NULL,
-                               (pjsip_hdr*)retry_after,
-                               NULL);
+    reject_rx_request(rdata, event, 0);
 
     // We no longer terminate TCP connections on overload as the shutdown has
     // to wait for existing transactions to end and therefore it takes too
@@ -416,20 +1421,45 @@ static pj_bool_t on_rx_msg(pjsip_rx_data* rdata)
     return PJ_TRUE;
   }
 
-  // Check that the worker threads are not all deadlocked.
-  if (rx_msg_q.is_deadlocked())
+  // Check that the worker threads servicing the queue for this message are
+  // not all deadlocked.
+  rx_msg_queue* rxq = select_rx_msg_queue(rdata);
+  adjust_worker_pool(rxq);
+
+  if (rxq->q.is_deadlocked())
   {
     // The queue has not been serviced for sufficiently long to imply that
-    // all the worker threads are deadlock, so exit the process so it will be
+    // all the worker threads are deadlock.  If they are all just blocked
+    // waiting for I/O and the pool can grow, add another worker and give it
+    // time to service the queue.  Otherwise exit the process so it will be
     // restarted.
-    LOG_ERROR("Detected worker thread deadlock - exiting");
-    abort();
+    bool grown = false;
+    if (rxq->num_blocked >= rxq->num_workers)
+    {
+      pthread_mutex_lock(&rxq->pool_lock);
+      grown = grow_worker_pool(rxq, "all workers blocked");
+      pthread_mutex_unlock(&rxq->pool_lock);
+    }
+
+    if (grown)
+    {
+      LOG_WARNING("Worker threads on queue %d all blocked on I/O", rxq->index);
+      rxq->q.reset_deadlock_detection();
+    }
+    else
+    {
+      LOG_ERROR("Detected worker thread deadlock on queue %d - exiting",
+                rxq->index);
+      abort();
+    }
   }
 
   // Before we start, get a timestamp.  This will track the time from
   // receiving a message to forwarding it on (or rejecting it).
   struct rx_msg_qe qe;
   qe.stop_watch.start();
+  qe.retire = false;
+  qe.admitted_cls = (admission_controlled) ? cls : -1;
 
   // Notify the connection tracker that the transport is active.
   connection_tracker->connection_active(rdata->tp_info.transport);
@@ -448,18 +1478,44 @@ static pj_bool_t on_rx_msg(pjsip_rx_data* rdata)
   // Make sure the trail identifier is passed across.
   set_trail(clone_rdata, get_trail(rdata));
 
-  // @TODO - need to think about back-pressure mechanisms.  For example,
-  // should we have a maximum depth of queue and drop messages after that?
-  // May be better to hold on to the message until the queue has space - this
-  // will force back pressure on the particular TCP connection.  Or should we
-  // have a queue per transport and round-robin them?
+  // Queue the message in its priority class.  If the class is already at its
+  // maximum depth, reject it now rather than letting it wait behind a queue
+  // it will probably time out in anyway.
 
-  LOG_DEBUG("Queuing cloned received message %p for worker threads", clone_rdata);
+  LOG_DEBUG("Queuing cloned received message %p for worker threads on queue %d class %d",
+            clone_rdata, rxq->index, cls);
   qe.rdata = clone_rdata;
+  qe.cls = cls;
+  qe.order_key = rx_msg_order_key(rdata);
 
   // Track the current queue size
-  queue_size_accumulator->accumulate(rx_msg_q.size());
-  rx_msg_q.push(qe);
+  int queue_size = rxq->q.size();
+  queue_size_accumulator->accumulate(queue_size);
+  rxq->queue_size_sum += queue_size;
+  ++rxq->queue_size_samples;
+
+  if (!rxq->q.push(qe, cls, false, qe.order_key))
+  {
+    pjsip_rx_data_free_cloned(clone_rdata);
+
+    if ((rdata->msg_info.msg->type == PJSIP_REQUEST_MSG) &&
+        (rdata->msg_info.msg->line.req.method.id != PJSIP_ACK_METHOD))
+    {
+      LOG_DEBUG("Rejected request as queue %d class %d is full", rxq->index, cls);
+      SAS::Event event(get_trail(rdata), SASEvent::SIP_QUEUE_FULL, 0);
+      event.add_static_param(cls);
+      event.add_static_param(rxq->q.max_depth(cls));
+      reject_rx_request(rdata, event, QUEUE_FULL_RETRY_AFTER);
+    }
+    else
+    {
+      // Can't reject ACKs or responses, so just discard them and rely on
+      // retransmissions.
+      LOG_WARNING("Discarded message as queue %d class %d is full", rxq->index, cls);
+    }
+
+    queue_full_counter->increment();
+  }
 
   // return TRUE to flag that we have absorbed the incoming message.
   return PJ_TRUE;
@@ -795,7 +1851,9 @@ pj_status_t init_pjsip()
   PJ_ASSERT_RETURN(status == PJ_SUCCESS, status);
 
   // Must create a pool factory before we can allocate any memory.
-  pj_caching_pool_init(&stack_data.cp, &pj_pool_factory_default_policy, 0);
+  pj_caching_pool_init(&stack_data.cp,
+                       &pj_pool_factory_default_policy,
+                       POOL_CACHE_MAX_CAPACITY);
   // Create the endpoint.
   status = pjsip_endpt_create(&stack_data.cp.factory, NULL, &stack_data.endpt);
   PJ_ASSERT_RETURN(status == PJ_SUCCESS, status);
@@ -814,9 +1872,6 @@ pj_status_t init_pjsip()
   status = register_custom_headers();
   PJ_ASSERT_RETURN(status == PJ_SUCCESS, status);
 
-  // Enable deadlock detection on the message queue.
-  rx_msg_q.set_deadlock_threshold(MSG_Q_DEADLOCK_TIME);
-
   return PJ_SUCCESS;
 }
 
@@ -836,10 +1891,15 @@ pj_status_t init_stack(const std::string& system_name,
                        SIPResolver* sipresolver,
                        int num_pjsip_threads,
                        int num_worker_threads,
+                       int max_worker_threads,
+                       int num_worker_queues,
+                       const std::vector<unsigned int>& max_queue_depths,
+                       int max_worker_batch_size,
                        int record_routing_model,
                        const int default_session_expires,
                        QuiescingManager *quiescing_mgr_arg,
                        LoadMonitor *load_monitor_arg,
+                       const std::vector<int>& target_latencies,
                        const std::string& cdf_domain)
 {
   pj_status_t status;
@@ -851,7 +1911,79 @@ pj_status_t init_stack(const std::string& system_name,
   // Set up the vectors of threads.  The threads don't get created until
   // start_stack is called.
   pjsip_threads.resize(num_pjsip_threads);
-  worker_threads.resize(num_worker_threads);
+
+  // Set up the message queues.  Every queue needs at least one worker thread,
+  // so there can't be more queues than worker threads.
+  if (num_worker_queues > num_worker_threads)
+  {
+    LOG_WARNING("Cannot have more worker queues (%d) than worker threads (%d), using %d queues",
+                num_worker_queues, num_worker_threads, num_worker_threads);
+    num_worker_queues = num_worker_threads;
+  }
+  if (num_worker_queues < 1)
+  {
+    num_worker_queues = 1;
+  }
+
+  // Each queue has a maximum depth for each of the message classes.  Any
+  // classes that haven't been given a maximum depth are unbounded.
+  std::vector<unsigned int> class_depths(NUM_RX_MSG_CLASSES, 0);
+  for (size_t ii = 0;
+       (ii < max_queue_depths.size()) && (ii < class_depths.size());
+       ++ii)
+  {
+    class_depths[ii] = max_queue_depths[ii];
+  }
+  LOG_STATUS("Maximum queue depths: in-dialog %u, new session %u, registration %u",
+             class_depths[RX_MSG_CLASS_IN_DIALOG],
+             class_depths[RX_MSG_CLASS_NEW_SESSION],
+             class_depths[RX_MSG_CLASS_REGISTRATION]);
+
+  worker_batch_size = (max_worker_batch_size > 1) ? max_worker_batch_size : 1;
+  LOG_STATUS("Worker threads take up to %d messages at a time", worker_batch_size);
+
+  for (int ii = 0; ii < num_worker_queues; ++ii)
+  {
+    rx_msg_queue* rxq = new rx_msg_queue(class_depths);
+    rxq->index = ii;
+    rxq->latency_sum_us = 0;
+    rxq->latency_samples = 0;
+    rxq->queue_size_sum = 0;
+    rxq->queue_size_samples = 0;
+    rxq->batch_size_sum = 0;
+    rxq->batch_samples = 0;
+
+    // The worker threads are shared out evenly between the queues, as is the
+    // maximum number of threads if the pools are elastic.
+    rxq->min_workers = WorkerPoolPolicy::queue_share(num_worker_threads,
+                                                     num_worker_queues,
+                                                     ii);
+    rxq->max_workers = WorkerPoolPolicy::queue_share(max_worker_threads,
+                                                     num_worker_queues,
+                                                     ii);
+    if (rxq->max_workers < rxq->min_workers)
+    {
+      rxq->max_workers = rxq->min_workers;
+    }
+    rxq->num_workers = 0;
+    rxq->num_blocked = 0;
+    rxq->pool_wait_sum_us = 0;
+    rxq->pool_wait_samples = 0;
+    rxq->pool_stop_watch.start();
+
+    // Enable deadlock detection on the message queue.  A worker pops a
+    // whole batch at once, so allow for it taking a batch's worth of
+    // messages to come back to the queue.
+    rxq->q.set_deadlock_threshold(MSG_Q_DEADLOCK_TIME * worker_batch_size);
+    rx_msg_queues.push_back(rxq);
+  }
+  LOG_STATUS("Using %d worker queues", num_worker_queues);
+  if (max_worker_threads > num_worker_threads)
+  {
+    LOG_STATUS("Worker thread pools can grow from %d to %d threads",
+               num_worker_threads, max_worker_threads);
+  }
+
 
   // Get ports and host names specified on options.  If local host was not
   // specified, use the host name returned by pj_gethostname.
@@ -1107,12 +2239,66 @@ pj_status_t init_stack(const std::string& system_name,
                                           stack_data.stats_aggregator);
   overload_counter = new StatisticCounter("rejected_overload",
                                           stack_data.stats_aggregator);
+  queue_full_counter = new StatisticCounter("rejected_queue_full",
+                                            stack_data.stats_aggregator);
+  queue_latency_statistic = new Statistic("worker_queue_latency_us",
+                                          stack_data.stats_aggregator);
+  queue_size_statistic = new Statistic("worker_queue_size",
+                                       stack_data.stats_aggregator);
+  queue_wait_statistic = new Statistic("queue_wait_latency_us",
+                                       stack_data.stats_aggregator);
+  service_time_statistic = new Statistic("service_latency_us",
+                                         stack_data.stats_aggregator);
+  handler_service_time_statistic = new Statistic("handler_service_latency_us",
+                                                 stack_data.stats_aggregator);
+  slab_cache_statistic = new Statistic("slab_cache_stats",
+                                       stack_data.stats_aggregator);
+  thread_placement_statistic = new Statistic("thread_placement",
+                                             stack_data.stats_aggregator);
+  queue_batch_size_statistic = new Statistic("worker_queue_batch_size",
+                                             stack_data.stats_aggregator);
+  worker_pool_size_statistic = new Statistic("worker_pool_size",
+                                             stack_data.stats_aggregator);
+  worker_pool_grown_counter = new StatisticCounter("worker_pool_grown",
+                                                   stack_data.stats_aggregator);
+  worker_pool_shrunk_counter = new StatisticCounter("worker_pool_shrunk",
+                                                    stack_data.stats_aggregator);
+  admission_rate_statistic = new Statistic("admission_rate_limits",
+                                           stack_data.stats_aggregator);
+  rejected_overload_by_class_statistic = new Statistic("rejected_overload_by_class",
+                                                       stack_data.stats_aggregator);
+  regstore_cas_retries_statistic = new Statistic("regstore_cas_retries",
+                                                 stack_data.stats_aggregator);
+  queue_stats_stop_watch.start();
 
   if (load_monitor_arg != NULL)
   {
     load_monitor = load_monitor_arg;
   }
 
+  // If target latencies have been configured, also throttle each of the
+  // message classes with its own token bucket.  Any classes that haven't
+  // been given a target use the default.
+  if (!target_latencies.empty())
+  {
+    std::vector<int> class_targets(NUM_RX_MSG_CLASSES, DEFAULT_TARGET_LATENCY);
+    class_targets[RX_MSG_CLASS_IN_DIALOG] = DEFAULT_IN_DIALOG_TARGET_LATENCY;
+    for (size_t ii = 0;
+         (ii < target_latencies.size()) && (ii < class_targets.size());
+         ++ii)
+    {
+      if (target_latencies[ii] > 0)
+      {
+        class_targets[ii] = target_latencies[ii];
+      }
+    }
+    LOG_STATUS("Target latencies: in-dialog %dus, new session %dus, registration %dus",
+               class_targets[RX_MSG_CLASS_IN_DIALOG],
+               class_targets[RX_MSG_CLASS_NEW_SESSION],
+               class_targets[RX_MSG_CLASS_REGISTRATION]);
+    admission_controller = new AdmissionController(class_targets);
+  }
+
   if (quiescing_mgr_arg != NULL)
   {
     quiescing_mgr = quiescing_mgr_arg;
@@ -1142,19 +2328,35 @@ pj_status_t start_stack()
   quit_flag = PJ_FALSE;
 
   // Create worker threads first as they take work from the PJSIP threads so
-  // need to be ready.
-  for (size_t ii = 0; ii < worker_threads.size(); ++ii)
+  // need to be ready.  Each queue starts with its minimum number of workers.
+  bool elastic = false;
+  for (size_t ii = 0; ii < rx_msg_queues.size(); ++ii)
   {
-    pj_thread_t* thread;
-    status = pj_thread_create(stack_data.pool, "worker", &worker_thread,
-                              NULL, 0, 0, &thread);
+    rx_msg_queue* rxq = rx_msg_queues[ii];
+    for (int jj = 0; jj < rxq->min_workers; ++jj)
+    {
+      status = create_worker_thread(rxq);
+      if (status != PJ_SUCCESS)
+      {
+        return 1;
+      }
+    }
+    elastic = elastic || (rxq->max_workers > rxq->min_workers);
+  }
+  workers_running = true;
+
+  if (elastic)
+  {
+    // The pools can shrink, so start the thread that reaps retired workers.
+    reaper_stopping = false;
+    status = pj_thread_create(stack_data.pool, "reaper", &reaper_thread_func,
+                              NULL, 0, 0, &reaper_thread);
     if (status != PJ_SUCCESS)
     {
-      LOG_ERROR("Error creating worker thread, %s",
+      LOG_ERROR("Error creating worker reaper thread, %s",
                 PJUtils::pj_status_to_string(status).c_str());
       return 1;
     }
-    worker_threads[ii] = thread;
   }
 
   // Now create the PJSIP threads.
@@ -1162,7 +2364,7 @@ pj_status_t start_stack()
   {
     pj_thread_t* thread;
     status = pj_thread_create(stack_data.pool, "pjsip", &pjsip_thread,
-                              NULL, 0, 0, &thread);
+                              (void*)(intptr_t)ii, 0, 0, &thread);
     if (status != PJ_SUCCESS)
     {
       LOG_ERROR("Error creating PJSIP thread, %s",
@@ -1179,7 +2381,7 @@ void stop_stack()
 {
   // Terminate the PJSIP threads and the worker threads to exit.  We kill
   // the PJSIP threads first - if we killed the worker threads first the
-  // rx_msg_q will stop getting serviced so could fill up blocking
+  // rx_msg_queues will stop getting serviced so could fill up blocking
   // PJSIP threads, causing a deadlock.
 
   // Set the quit flag to signal the PJSIP threads to exit, then wait
@@ -1193,14 +2395,41 @@ void stop_stack()
     pj_thread_join(*i);
   }
 
-  // Now it is safe to signal the worker threads to exit via the queue and to
+  // Now it is safe to signal the worker threads to exit via the queues and to
   // wait for them to terminate.
-  rx_msg_q.terminate();
-  for (std::vector<pj_thread_t*>::iterator i = worker_threads.begin();
-       i != worker_threads.end();
+  workers_running = false;
+  for (std::vector<rx_msg_queue*>::iterator i = rx_msg_queues.begin();
+       i != rx_msg_queues.end();
        ++i)
   {
-    pj_thread_join(*i);
+    (*i)->q.terminate();
+  }
+
+  // Stop the reaper thread.  Any retired threads it hasn't joined yet are
+  // still in the list of worker threads, and are joined below.
+  if (reaper_thread != NULL)
+  {
+    pthread_mutex_lock(&worker_threads_lock);
+    reaper_stopping = true;
+    pthread_cond_signal(&worker_threads_cond);
+    pthread_mutex_unlock(&worker_threads_lock);
+    pj_thread_join(reaper_thread);
+    pj_thread_destroy(reaper_thread);
+    reaper_thread = NULL;
+  }
+
+  // The pools are only grown on the PJSIP threads, which have exited, so the
+  // list of worker threads can't change.
+  pthread_mutex_lock(&worker_threads_lock);
+  std::map<pj_thread_t*, pj_pool_t*> threads = worker_threads;
+  retired_worker_threads.clear();
+  pthread_mutex_unlock(&worker_threads_lock);
+
+  for (std::map<pj_thread_t*, pj_pool_t*>::iterator i = threads.begin();
+       i != threads.end();
+       ++i)
+  {
+    pj_thread_join(i->first);
   }
 }
 
@@ -1228,6 +2457,8 @@ void term_pjsip()
 void destroy_stack(void)
 {
   // Tear down the stack.
+  delete admission_controller;
+  admission_controller = NULL;
   delete latency_accumulator;
   latency_accumulator = NULL;
   delete queue_size_accumulator;
@@ -1236,6 +2467,44 @@ void destroy_stack(void)
   requests_counter = NULL;
   delete overload_counter;
   overload_counter = NULL;
+  delete queue_full_counter;
+  queue_full_counter = NULL;
+  delete queue_latency_statistic;
+  queue_latency_statistic = NULL;
+  delete queue_size_statistic;
+  queue_size_statistic = NULL;
+  delete queue_wait_statistic;
+  queue_wait_statistic = NULL;
+  delete service_time_statistic;
+  service_time_statistic = NULL;
+  delete handler_service_time_statistic;
+  handler_service_time_statistic = NULL;
+  delete slab_cache_statistic;
+  slab_cache_statistic = NULL;
+  delete thread_placement_statistic;
+  thread_placement_statistic = NULL;
+  delete queue_batch_size_statistic;
+  queue_batch_size_statistic = NULL;
+  delete worker_pool_size_statistic;
+  worker_pool_size_statistic = NULL;
+  delete worker_pool_grown_counter;
+  worker_pool_grown_counter = NULL;
+  delete worker_pool_shrunk_counter;
+  worker_pool_shrunk_counter = NULL;
+  delete admission_rate_statistic;
+  admission_rate_statistic = NULL;
+  delete rejected_overload_by_class_statistic;
+  rejected_overload_by_class_statistic = NULL;
+  delete regstore_cas_retries_statistic;
+  regstore_cas_retries_statistic = NULL;
+
+  for (std::map<std::string, LatencyHistogram*>::iterator i = handler_histograms.begin();
+       i != handler_histograms.end();
+       ++i)
+  {
+    delete i->second;
+  }
+  handler_histograms.clear();
   delete stack_data.stats_aggregator;
 
   delete stack_quiesce_handler;
@@ -1245,7 +2514,20 @@ void destroy_stack(void)
   connection_tracker = NULL;
 
   pjsip_threads.clear();
+  for (std::map<pj_thread_t*, pj_pool_t*>::iterator i = worker_threads.begin();
+       i != worker_threads.end();
+       ++i)
+  {
+    pj_pool_release(i->second);
+  }
   worker_threads.clear();
+  retired_worker_threads.clear();
+
+  while (!rx_msg_queues.empty())
+  {
+    delete rx_msg_queues.back();
+    rx_msg_queues.pop_back();
+  }
 
   SAS::term();
 
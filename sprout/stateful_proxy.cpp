@@ -1723,6 +1723,15 @@ void UASTransaction::cancel_trying_timer()
 
 // The info parameter is only filled in correctly if this function
 // returns true,
+//
+// This (like the XDM reads made by the MMTEL call services) blocks the
+// worker thread, rather than parking the transaction on the asynchronous
+// dispatcher as the S-CSCF sproutlet does.  Sprout only starts the stateful
+// proxy as the P-CSCF access proxy, which has no HSS connection or call
+// services, so these lookups are only made by the routing proxy UTs.  Parking
+// them would mean splitting routing_proxy_handle_initial_non_cancel into
+// resumable steps, as each lookup is made part way through building the AS
+// chain, after ACRs, Record-Routes and the request itself have been updated.
 bool UASTransaction::get_data_from_hss(std::string public_id, HSSCallInformation& info, SAS::TrailId trail)
 {
   std::map<std::string, HSSCallInformation>::iterator data = cached_hss_data.find(public_id);
@@ -1998,7 +2007,7 @@ void UASTransaction::get_all_bindings(const std::string& aor,
 {
   // Look up the target in the registration data store.
   LOG_INFO("Look up targets in registration store: %s", aor.c_str());
-  *aor_data = store->get_aor_data(aor, trail);
+  *aor_data = store->lookup_aor_data(aor, trail);
 
   // If we didn't get bindings from the local store and we have a remote
   // store, try the remote.
@@ -2007,7 +2016,7 @@ void UASTransaction::get_all_bindings(const std::string& aor,
        ((*aor_data)->bindings().empty())))
   {
     delete *aor_data;
-    *aor_data = remote_store->get_aor_data(aor, trail);
+    *aor_data = remote_store->lookup_aor_data(aor, trail);
   }
 
   // TODO - Log bindings to SAS
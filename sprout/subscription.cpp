@@ -141,34 +141,34 @@ pj_status_t write_subscriptions_to_store(RegStore* primary_store,      ///<store
   pjsip_fromto_hdr* to = (pjsip_fromto_hdr*)pjsip_msg_find_hdr(msg, PJSIP_H_TO, NULL);
 
   // The registration store uses optimistic locking to avoid concurrent
-  // updates to the same AoR conflicting.  This means we have to loop
-  // reading, updating and writing the AoR until the write is successful.
+  // updates to the same AoR conflicting, so the changes are made in a
+  // mutation that is applied to the AoR each time it is read.  It may also
+  // be combined with concurrent updates to the AoR from other requests.
   bool backup_aor_alloced = false;
   int expiry = 0;
   pj_status_t status = PJ_FALSE;
-  (*aor_data) = NULL;
+  int notify_cseq = 0;
+  RegStore::AoR::Subscription notify_subscription;
+  std::map<std::string, RegStore::AoR::Binding> bindings;
+  bool all_bindings_expired = false;
+  int cas_retries = 0;
 
-  do
+  subscription_id = PJUtils::pj_str_to_string(&to->tag);
+
+  if (subscription_id == "")
   {
-    // delete NULL is safe, so we can do this on every iteration.
-    delete (*aor_data);
+    // If there's no to tag, generate an unique one
+    subscription_id = std::to_string(Utils::generate_unique_integer(id_deployment, id_instance));
+  }
 
-    // Find the current subscriptions for the AoR.
-    (*aor_data) = primary_store->get_aor_data(aor, trail);
-    LOG_DEBUG("Retrieved AoR data %p", (*aor_data));
+  LOG_DEBUG("Subscription identifier = %s", subscription_id.c_str());
 
-    if ((*aor_data) == NULL)
-    {
-      // Failed to get data for the AoR because there is no connection
-      // to the store.
-      // LCOV_EXCL_START - local store (used in testing) never fails
-      LOG_ERROR("Failed to get AoR subscriptions for %s from store", aor.c_str());
-      break;
-      // LCOV_EXCL_STOP
-    }
+  pjsip_contact_hdr* contact = (pjsip_contact_hdr*)pjsip_msg_find_hdr(msg, PJSIP_H_CONTACT, NULL);
 
+  RegStore::Mutation mutation = [&](RegStore::AoR* aor_data)
+  {
     // If we don't have any subscriptions, try the backup AoR and/or store.
-    if ((*aor_data)->subscriptions().empty())
+    if (aor_data->subscriptions().empty())
     {
       if ((backup_aor == NULL) &&
           (backup_store != NULL))
@@ -185,13 +185,12 @@ pj_status_t write_subscriptions_to_store(RegStore* primary_store,      ///<store
              ++i)
         {
           RegStore::AoR::Subscription* src = i->second;
-          RegStore::AoR::Subscription* dst = (*aor_data)->get_subscription(i->first);
+          RegStore::AoR::Subscription* dst = aor_data->get_subscription(i->first);
           *dst = *src;
         }
       }
     }
 
-    pjsip_contact_hdr* contact = (pjsip_contact_hdr*)pjsip_msg_find_hdr(msg, PJSIP_H_CONTACT, NULL);
     if (contact != NULL)
     {
       std::string contact_uri;
@@ -205,19 +204,9 @@ pj_status_t write_subscriptions_to_store(RegStore* primary_store,      ///<store
         contact_uri = PJUtils::uri_to_string(PJSIP_URI_IN_CONTACT_HDR, uri);
       }
 
-      subscription_id = PJUtils::pj_str_to_string(&to->tag);
-
-      if (subscription_id == "")
-      {
-        // If there's no to tag, generate an unique one
-        subscription_id = std::to_string(Utils::generate_unique_integer(id_deployment, id_instance));
-      }
-
-      LOG_DEBUG("Subscription identifier = %s", subscription_id.c_str());
-
       // Find the appropriate subscription in the subscription list for this AoR. If it can't
       // be found a new empty subscription is created.
-      RegStore::AoR::Subscription* subscription = (*aor_data)->get_subscription(subscription_id);
+      RegStore::AoR::Subscription* subscription = aor_data->get_subscription(subscription_id);
 
       // Update/create the subscription.
       subscription->_req_uri = contact_uri;
@@ -251,10 +240,10 @@ pj_status_t write_subscriptions_to_store(RegStore* primary_store,      ///<store
       }
 
       subscription->_expires = now + expiry;
-      std::map<std::string, RegStore::AoR::Binding> bindings;
+      bindings.clear();
 
-      for (RegStore::AoR::Bindings::const_iterator i = (*aor_data)->bindings().begin();
-           i != (*aor_data)->bindings().end();
+      for (RegStore::AoR::Bindings::const_iterator i = aor_data->bindings().begin();
+           i != aor_data->bindings().end();
            ++i)
       {
         std::string id = i->first;
@@ -268,23 +257,11 @@ pj_status_t write_subscriptions_to_store(RegStore* primary_store,      ///<store
 
       if (update_notify)
       {
-        NotifyUtils::SubscriptionState state = NotifyUtils::SubscriptionState::ACTIVE;
-
-        if (expiry == 0)
-        {
-          state = NotifyUtils::SubscriptionState::TERMINATED;
-        }
-
-        // Increment the CSeq before creating a NOTIFY
-        (*aor_data)->_notify_cseq++;
-
-        status = NotifyUtils::create_notify(tdata_notify, subscription, aor,
-                                            (*aor_data)->_notify_cseq, bindings,
-                                            NotifyUtils::DocState::FULL,
-                                            NotifyUtils::RegistrationState::ACTIVE,
-                                            NotifyUtils::ContactState::ACTIVE,
-                                            NotifyUtils::ContactEvent::REGISTERED,
-                                            state, expiry);
+        // Increment the CSeq for the NOTIFY, which is built once the
+        // subscription has been written.
+        aor_data->_notify_cseq++;
+        notify_cseq = aor_data->_notify_cseq;
+        notify_subscription = *subscription;
       }
 
       if (analytics != NULL)
@@ -293,8 +270,46 @@ pj_status_t write_subscriptions_to_store(RegStore* primary_store,      ///<store
         analytics->subscription(aor, subscription_id, contact_uri, expiry);
       }
     }
+  };
+
+  (*aor_data) = primary_store->update_aor_data(aor,
+                                               mutation,
+                                               false,
+                                               trail,
+                                               all_bindings_expired,
+                                               cas_retries);
+  LOG_DEBUG("Updated AoR data %p", (*aor_data));
+
+  if ((*aor_data) != NULL)
+  {
+    RegStore::record_cas_retries(RegStore::OP_SUBSCRIBE, cas_retries);
+
+    if ((update_notify) && (contact != NULL))
+    {
+      NotifyUtils::SubscriptionState state = NotifyUtils::SubscriptionState::ACTIVE;
+
+      if (expiry == 0)
+      {
+        state = NotifyUtils::SubscriptionState::TERMINATED;
+      }
+
+      status = NotifyUtils::create_notify(tdata_notify, &notify_subscription, aor,
+                                          notify_cseq, bindings,
+                                          NotifyUtils::DocState::FULL,
+                                          NotifyUtils::RegistrationState::ACTIVE,
+                                          NotifyUtils::ContactState::ACTIVE,
+                                          NotifyUtils::ContactEvent::REGISTERED,
+                                          state, expiry);
+    }
+  }
+  else
+  {
+    // Failed to get data for the AoR because there is no connection
+    // to the store.
+    // LCOV_EXCL_START - local store (used in testing) never fails
+    LOG_ERROR("Failed to get AoR subscriptions for %s from store", aor.c_str());
+    // LCOV_EXCL_STOP
   }
-  while (!primary_store->set_aor_data(aor, (*aor_data), false, trail));
 
   // If we allocated the backup AoR, tidy up.
   if (backup_aor_alloced)
@@ -482,9 +497,10 @@ void process_subscription_request(pjsip_rx_data* rdata)
     // Log the subscriptions.
     log_subscriptions(aor, aor_data);
 
-    // If we have a remote store, try to store this there too.  We don't worry
-    // about failures in this case.
-    if (remote_store != NULL)
+    // If we have a remote store, try to store this there too (unless the
+    // local store replicates the update itself).  We don't worry about
+    // failures in this case.
+    if ((remote_store != NULL) && (!store->replicates()))
     {
       RegStore::AoR* remote_aor_data = NULL;
       std::string ignore;
@@ -675,6 +691,7 @@ pj_bool_t subscription_on_rx_request(pjsip_rx_data *rdata)
     }
   }
 
+  set_rx_msg_handler("subscription");
   process_subscription_request(rdata);
   return PJ_TRUE;
 }
@@ -0,0 +1,306 @@
+/**
+ * @file thread_affinity.cpp  Pinning of threads to CPUs and NUMA nodes.
+ *
+ * Project Clearwater - IMS in the Cloud
+ * Copyright (C) 2014  Metaswitch Networks Ltd
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or (at your
+ * option) any later version, along with the "Special Exception" for use of
+ * the program along with SSL, set forth below. This program is distributed
+ * in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+ * without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details. You should have received a copy of the GNU General Public
+ * License along with this program.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ *
+ * The author can be reached by email at clearwater@metaswitch.com or by
+ * post at Metaswitch Networks Ltd, 100 Church St, Enfield EN2 6BQ, UK
+ *
+ * Special Exception
+ * Metaswitch Networks Ltd  grants you permission to copy, modify,
+ * propagate, and distribute a work formed by combining OpenSSL with The
+ * Software, or a work derivative of such a combination, even if such
+ * copying, modification, propagation, or distribution would otherwise
+ * violate the terms of the GPL. You must comply with the GPL in all
+ * respects for all of the code used other than OpenSSL.
+ * "OpenSSL" means OpenSSL toolkit software distributed by the OpenSSL
+ * Project and licensed under the OpenSSL Licenses, or a work based on such
+ * software and licensed under the OpenSSL Licenses.
+ * "OpenSSL Licenses" means the OpenSSL License and Original SSLeay License
+ * under which the OpenSSL Project distributes the OpenSSL toolkit software,
+ * as those licenses appear in the file LICENSE-OPENSSL.
+ */
+
+#include <pthread.h>
+#include <dirent.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <linux/mempolicy.h>
+
+#include <map>
+#include <sstream>
+
+#include "thread_affinity.h"
+#include "log.h"
+
+// Placements recorded so far, keyed on thread name.
+static std::map<std::string, std::string> placements;
+static pthread_mutex_t placements_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// The CPU affinity of the process before any threads were pinned.
+static cpu_set_t process_cpus;
+static bool process_cpus_saved = false;
+
+/// Returns the NUMA node of a CPU, or -1 if it is not known (for example
+/// because the kernel doesn't support NUMA).
+static int numa_node_of_cpu(int cpu)
+{
+  int node = -1;
+  std::string path = "/sys/devices/system/cpu/cpu" + std::to_string(cpu);
+  DIR* dir = opendir(path.c_str());
+
+  if (dir != NULL)
+  {
+    struct dirent* entry;
+    while ((entry = readdir(dir)) != NULL)
+    {
+      if ((strncmp(entry->d_name, "node", 4) == 0) &&
+          (entry->d_name[4] >= '0') &&
+          (entry->d_name[4] <= '9'))
+      {
+        node = atoi(entry->d_name + 4);
+        break;
+      }
+    }
+    closedir(dir);
+  }
+
+  return node;
+}
+
+
+bool ThreadAffinity::parse_cpu_list(const std::string& list, cpu_set_t& cpus)
+{
+  CPU_ZERO(&cpus);
+
+  std::stringstream ss(list);
+  std::string range;
+
+  while (std::getline(ss, range, ','))
+  {
+    if (range.empty())
+    {
+      continue;
+    }
+
+    char* end;
+    long first = strtol(range.c_str(), &end, 10);
+    long last = first;
+
+    if (*end == '-')
+    {
+      last = strtol(end + 1, &end, 10);
+    }
+
+    if ((*end != '\0') ||
+        (first < 0) ||
+        (last < first) ||
+        (last >= CPU_SETSIZE))
+    {
+      LOG_ERROR("Invalid CPU range %s in CPU list %s", range.c_str(), list.c_str());
+      return false;
+    }
+
+    for (long cpu = first; cpu <= last; ++cpu)
+    {
+      CPU_SET(cpu, &cpus);
+    }
+  }
+
+  return (CPU_COUNT(&cpus) > 0);
+}
+
+
+std::string ThreadAffinity::cpu_list(const cpu_set_t& cpus)
+{
+  std::string list;
+  int cpu = 0;
+
+  while (cpu < CPU_SETSIZE)
+  {
+    if (!CPU_ISSET(cpu, &cpus))
+    {
+      ++cpu;
+      continue;
+    }
+
+    // Find the end of this range of CPUs.
+    int last = cpu;
+    while ((last + 1 < CPU_SETSIZE) && (CPU_ISSET(last + 1, &cpus)))
+    {
+      ++last;
+    }
+
+    if (!list.empty())
+    {
+      list += ",";
+    }
+    list += std::to_string(cpu);
+    if (last > cpu)
+    {
+      list += "-" + std::to_string(last);
+    }
+
+    cpu = last + 1;
+  }
+
+  return list;
+}
+
+
+int ThreadAffinity::numa_node(const cpu_set_t& cpus)
+{
+  int node = -1;
+
+  for (int cpu = 0; cpu < CPU_SETSIZE; ++cpu)
+  {
+    if (CPU_ISSET(cpu, &cpus))
+    {
+      int cpu_node = numa_node_of_cpu(cpu);
+      if ((cpu_node == -1) ||
+          ((node != -1) && (cpu_node != node)))
+      {
+        // Either the node isn't known or the CPUs span nodes.
+        return -1;
+      }
+      node = cpu_node;
+    }
+  }
+
+  return node;
+}
+
+
+bool ThreadAffinity::pin_thread(const std::string& name,
+                                const cpu_set_t& cpus,
+                                bool numa_local)
+{
+  int rc = pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus);
+  if (rc != 0)
+  {
+    LOG_ERROR("Failed to pin thread %s to CPUs %s (%d)",
+              name.c_str(), cpu_list(cpus).c_str(), rc);
+    record_placement(name);
+    return false;
+  }
+
+  if (numa_local)
+  {
+    int node = numa_node(cpus);
+    if (node >= 0)
+    {
+      // Prefer memory from the local node.  Memory is allocated on first
+      // touch, so this keeps the pools and objects the thread creates local
+      // to the CPUs it runs on.
+      unsigned long nodemask = 1UL << node;
+      if (syscall(SYS_set_mempolicy,
+                  MPOL_PREFERRED,
+                  &nodemask,
+                  sizeof(nodemask) * 8) != 0)
+      {
+        LOG_WARNING("Failed to set NUMA memory policy for thread %s: %s",
+                    name.c_str(), strerror(errno));
+      }
+    }
+    else
+    {
+      LOG_WARNING("CPUs %s for thread %s are not on a single NUMA node",
+                  cpu_list(cpus).c_str(), name.c_str());
+    }
+  }
+
+  record_placement(name);
+  return true;
+}
+
+
+void ThreadAffinity::save_process_cpus()
+{
+  CPU_ZERO(&process_cpus);
+  if (pthread_getaffinity_np(pthread_self(),
+                             sizeof(process_cpus),
+                             &process_cpus) == 0)
+  {
+    process_cpus_saved = true;
+  }
+}
+
+
+void ThreadAffinity::unpin_thread(const std::string& name)
+{
+  if (process_cpus_saved)
+  {
+    int rc = pthread_setaffinity_np(pthread_self(),
+                                    sizeof(process_cpus),
+                                    &process_cpus);
+    if (rc != 0)
+    {
+      LOG_ERROR("Failed to reset CPU affinity of thread %s (%d)",
+                name.c_str(), rc);
+    }
+
+    // The memory policy is also inherited, so reset it in case the creating
+    // thread preferred its local NUMA node.
+    if (syscall(SYS_set_mempolicy, MPOL_DEFAULT, NULL, 0) != 0)
+    {
+      LOG_WARNING("Failed to reset NUMA memory policy for thread %s: %s",
+                  name.c_str(), strerror(errno));
+    }
+  }
+
+  record_placement(name);
+}
+
+
+void ThreadAffinity::record_placement(const std::string& name)
+{
+  cpu_set_t cpus;
+  CPU_ZERO(&cpus);
+  pthread_getaffinity_np(pthread_self(), sizeof(cpus), &cpus);
+
+  std::string placement = name +
+                          " cpus=" + cpu_list(cpus) +
+                          " node=" + std::to_string(numa_node(cpus));
+  LOG_STATUS("Thread placement: %s", placement.c_str());
+
+  pthread_mutex_lock(&placements_lock);
+  placements[name] = placement;
+  pthread_mutex_unlock(&placements_lock);
+}
+
+
+void ThreadAffinity::remove_placement(const std::string& name)
+{
+  pthread_mutex_lock(&placements_lock);
+  placements.erase(name);
+  pthread_mutex_unlock(&placements_lock);
+}
+
+
+void ThreadAffinity::get_placements(std::vector<std::string>& placement_list)
+{
+  pthread_mutex_lock(&placements_lock);
+  for (std::map<std::string, std::string>::const_iterator i = placements.begin();
+       i != placements.end();
+       ++i)
+  {
+    placement_list.push_back(i->second);
+  }
+  pthread_mutex_unlock(&placements_lock);
+}
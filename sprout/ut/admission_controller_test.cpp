@@ -0,0 +1,148 @@
+/**
+ * @file admission_controller_test.cpp UT for per-class admission control.
+ *
+ * Project Clearwater - IMS in the Cloud
+ * Copyright (C) 2014  Metaswitch Networks Ltd
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or (at your
+ * option) any later version, along with the "Special Exception" for use of
+ * the program along with SSL, set forth below. This program is distributed
+ * in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+ * without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details. You should have received a copy of the GNU General Public
+ * License along with this program.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ *
+ * The author can be reached by email at clearwater@metaswitch.com or by
+ * post at Metaswitch Networks Ltd, 100 Church St, Enfield EN2 6BQ, UK
+ *
+ * Special Exception
+ * Metaswitch Networks Ltd  grants you permission to copy, modify,
+ * propagate, and distribute a work formed by combining OpenSSL with The
+ * Software, or a work derivative of such a combination, even if such
+ * copying, modification, propagation, or distribution would otherwise
+ * violate the terms of the GPL. You must comply with the GPL in all
+ * respects for all of the code used other than OpenSSL.
+ * "OpenSSL" means OpenSSL toolkit software distributed by the OpenSSL
+ * Project and licensed under the OpenSSL Licenses, or a work based on such
+ * software and licensed under the OpenSSL Licenses.
+ * "OpenSSL Licenses" means the OpenSSL License and Original SSLeay License
+ * under which the OpenSSL Project distributes the OpenSSL toolkit software,
+ * as those licenses appear in the file LICENSE-OPENSSL.
+ */
+
+///
+///----------------------------------------------------------------------------
+#include "gtest/gtest.h"
+
+#include "basetest.hpp"
+#include "test_interposer.hpp"
+#include "admission_controller.h"
+
+using namespace std;
+
+/// Fixture for AdmissionControllerTest.  Time is frozen so the token buckets
+/// only refill when the test advances time.
+class AdmissionControllerTest : public BaseTest
+{
+  AdmissionController* _ac;
+
+  AdmissionControllerTest()
+  {
+    cwtest_completely_control_time();
+    std::vector<int> targets;
+    targets.push_back(100000);
+    targets.push_back(100000);
+    targets.push_back(50000);
+    _ac = new AdmissionController(targets);
+  }
+
+  virtual ~AdmissionControllerTest()
+  {
+    delete _ac; _ac = NULL;
+    cwtest_reset_time();
+  }
+};
+
+TEST_F(AdmissionControllerTest, BurstThenReject)
+{
+  // Each class initially admits a burst of requests, then rejects them.
+  int admitted = 0;
+  for (int ii = 0; ii < 30; ++ii)
+  {
+    admitted += _ac->admit_request(2) ? 1 : 0;
+  }
+  EXPECT_EQ(AdmissionController::MAX_BURST, admitted);
+  EXPECT_EQ(30u - AdmissionController::MAX_BURST, _ac->get_rejected(2));
+  EXPECT_EQ(0u, _ac->get_rejected(2));
+
+  // The bucket refills over time.
+  cwtest_advance_time_ms(1000);
+  EXPECT_TRUE(_ac->admit_request(2));
+}
+
+TEST_F(AdmissionControllerTest, ClassesAreIndependent)
+{
+  // Use up the tokens for the registration class.
+  for (int ii = 0; ii < 30; ++ii)
+  {
+    _ac->admit_request(2);
+  }
+  EXPECT_FALSE(_ac->admit_request(2));
+
+  // New sessions are still admitted.
+  EXPECT_TRUE(_ac->admit_request(1));
+}
+
+TEST_F(AdmissionControllerTest, RateAdapts)
+{
+  EXPECT_EQ(50000, _ac->get_target_latency(2));
+  int initial_rate = _ac->get_rate_limit(2);
+  EXPECT_EQ(AdmissionController::INITIAL_RATE, initial_rate);
+
+  // Use the whole burst over a second with latency well below target.  The
+  // rate goes up.
+  for (int ii = 0; ii < AdmissionController::MAX_BURST; ++ii)
+  {
+    _ac->admit_request(2);
+  }
+  cwtest_advance_time_ms(1000);
+  for (int ii = 0; ii < AdmissionController::ADJUST_REQUESTS; ++ii)
+  {
+    _ac->request_complete(2, 10000, AdmissionController::INITIAL_COST_US);
+  }
+  EXPECT_EQ(10000, _ac->get_current_latency(2));
+  int raised_rate = _ac->get_rate_limit(2);
+  EXPECT_LT(initial_rate, raised_rate);
+
+  // Latency well above target cuts the rate again, but not below the
+  // minimum.
+  for (int ii = 0; ii < AdmissionController::ADJUST_REQUESTS; ++ii)
+  {
+    _ac->request_complete(2, 200000, AdmissionController::INITIAL_COST_US);
+  }
+  EXPECT_LT(50000, _ac->get_current_latency(2));
+  EXPECT_GT(raised_rate, _ac->get_rate_limit(2));
+  EXPECT_LE(AdmissionController::MIN_RATE, _ac->get_rate_limit(2));
+}
+
+TEST_F(AdmissionControllerTest, CostWeighting)
+{
+  // Make new session requests look ten times as expensive as they were.
+  for (int ii = 0; ii < 100; ++ii)
+  {
+    _ac->request_complete(1, 1000, 10 * AdmissionController::INITIAL_COST_US);
+  }
+
+  // The bucket still holds the same amount of work, so fewer of the
+  // expensive requests are admitted.
+  int admitted = 0;
+  for (int ii = 0; ii < 30; ++ii)
+  {
+    admitted += _ac->admit_request(1) ? 1 : 0;
+  }
+  EXPECT_GT(AdmissionController::MAX_BURST, admitted);
+}
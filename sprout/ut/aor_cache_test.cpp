@@ -0,0 +1,165 @@
+/**
+ * @file aor_cache_test.cpp UT for the AoR cache.
+ *
+ * Project Clearwater - IMS in the Cloud
+ * Copyright (C) 2014  Metaswitch Networks Ltd
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or (at your
+ * option) any later version, along with the "Special Exception" for use of
+ * the program along with SSL, set forth below. This program is distributed
+ * in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+ * without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details. You should have received a copy of the GNU General Public
+ * License along with this program.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ *
+ * The author can be reached by email at clearwater@metaswitch.com or by
+ * post at Metaswitch Networks Ltd, 100 Church St, Enfield EN2 6BQ, UK
+ *
+ * Special Exception
+ * Metaswitch Networks Ltd  grants you permission to copy, modify,
+ * propagate, and distribute a work formed by combining OpenSSL with The
+ * Software, or a work derivative of such a combination, even if such
+ * copying, modification, propagation, or distribution would otherwise
+ * violate the terms of the GPL. You must comply with the GPL in all
+ * respects for all of the code used other than OpenSSL.
+ * "OpenSSL" means OpenSSL toolkit software distributed by the OpenSSL
+ * Project and licensed under the OpenSSL Licenses, or a work based on such
+ * software and licensed under the OpenSSL Licenses.
+ * "OpenSSL Licenses" means the OpenSSL License and Original SSLeay License
+ * under which the OpenSSL Project distributes the OpenSSL toolkit software,
+ * as those licenses appear in the file LICENSE-OPENSSL.
+ */
+
+///
+///----------------------------------------------------------------------------
+#include "gtest/gtest.h"
+
+#include "basetest.hpp"
+#include "test_interposer.hpp"
+#include "localstore.h"
+#include "fakechronosconnection.hpp"
+#include "regstore.h"
+#include "aor_cache.h"
+
+using namespace std;
+
+/// Fixture for AoRCacheTest.  Time is frozen so entries only become stale
+/// when the test advances time.  The behaviour common to all the caches is
+/// tested by ShardedLRUCacheTest.
+class AoRCacheTest : public BaseTest
+{
+  AoRCache* _cache;
+
+  AoRCacheTest()
+  {
+    cwtest_completely_control_time();
+    _cache = new AoRCache(100, 500, NULL);
+  }
+
+  virtual ~AoRCacheTest()
+  {
+    delete _cache; _cache = NULL;
+    cwtest_reset_time();
+  }
+
+  /// Builds an AoR with a single binding.
+  RegStore::AoR* build_aor(const std::string& aor_id, int cseq)
+  {
+    RegStore::AoR* aor_data = new RegStore::AoR(aor_id);
+    RegStore::AoR::Binding* b = aor_data->get_binding("binding1");
+    b->_uri = "<sip:6505550231@192.91.191.29:59934;transport=tcp;ob>";
+    b->_cid = "gfYHoZGaFaRNxhlV0WIwoS-f91NoJ2gq";
+    b->_cseq = cseq;
+    b->_expires = time(NULL) + 300;
+    b->_priority = 0;
+    b->_emergency_registration = false;
+    return aor_data;
+  }
+};
+
+TEST_F(AoRCacheTest, HitAndStale)
+{
+  uint64_t generation;
+  EXPECT_TRUE(_cache->get("sip:6505550231@homedomain", generation) == NULL);
+
+  RegStore::AoR* aor_data = build_aor("sip:6505550231@homedomain", 1);
+  _cache->put("sip:6505550231@homedomain", aor_data, generation);
+  delete aor_data; aor_data = NULL;
+
+  // The cached copy is independent of the AoR that was cached.
+  aor_data = _cache->get("sip:6505550231@homedomain", generation);
+  ASSERT_TRUE(aor_data != NULL);
+  EXPECT_EQ(1, aor_data->get_binding("binding1")->_cseq);
+  EXPECT_EQ("sip:6505550231@homedomain",
+            *aor_data->get_binding("binding1")->_address_of_record);
+  delete aor_data; aor_data = NULL;
+
+  // The entry can't be used once it is older than the staleness limit.
+  cwtest_advance_time_ms(501);
+  EXPECT_TRUE(_cache->get("sip:6505550231@homedomain", generation) == NULL);
+}
+
+TEST_F(AoRCacheTest, RegStoreLookups)
+{
+  // Lookups through a RegStore use the cache, and updates through the
+  // RegStore invalidate it.  This uses its own cache with a longer staleness
+  // limit than the bindings' lifetime.
+  AoRCache cache(100, 5000, NULL);
+  ChronosConnection* chronos_connection = new FakeChronosConnection();
+  LocalStore* datastore = new LocalStore();
+  RegStore* store = new RegStore(datastore,
+                                 chronos_connection,
+                                 RegStore::FORMAT_BINARY,
+                                 RegStore::LAYOUT_AOR,
+                                 &cache);
+
+  RegStore::AoR* aor_data = build_aor("sip:6505550231@homedomain", 1);
+  EXPECT_TRUE(store->set_aor_data("sip:6505550231@homedomain", aor_data, false, 0));
+  delete aor_data; aor_data = NULL;
+
+  aor_data = store->lookup_aor_data("sip:6505550231@homedomain", 0);
+  ASSERT_TRUE(aor_data != NULL);
+  EXPECT_EQ(1, aor_data->get_binding("binding1")->_cseq);
+  delete aor_data; aor_data = NULL;
+
+  // Change the data behind the cache's back, so the lookup still returns
+  // the cached data.
+  RegStore* uncached_store = new RegStore(datastore, chronos_connection);
+  aor_data = uncached_store->get_aor_data("sip:6505550231@homedomain", 0);
+  aor_data->get_binding("binding1")->_cseq = 2;
+  EXPECT_TRUE(uncached_store->set_aor_data("sip:6505550231@homedomain", aor_data, false, 0));
+  delete aor_data; aor_data = NULL;
+
+  aor_data = store->lookup_aor_data("sip:6505550231@homedomain", 0);
+  ASSERT_TRUE(aor_data != NULL);
+  EXPECT_EQ(1, aor_data->get_binding("binding1")->_cseq);
+  delete aor_data; aor_data = NULL;
+
+  // An update through the caching store invalidates the cache.
+  aor_data = store->get_aor_data("sip:6505550231@homedomain", 0);
+  aor_data->get_binding("binding1")->_cseq = 3;
+  aor_data->get_binding("binding1")->_expires = time(NULL) + 2;
+  EXPECT_TRUE(store->set_aor_data("sip:6505550231@homedomain", aor_data, false, 0));
+  delete aor_data; aor_data = NULL;
+
+  aor_data = store->lookup_aor_data("sip:6505550231@homedomain", 0);
+  ASSERT_TRUE(aor_data != NULL);
+  EXPECT_EQ(3, aor_data->get_binding("binding1")->_cseq);
+  delete aor_data; aor_data = NULL;
+
+  // Bindings that expire while cached are omitted.
+  cwtest_advance_time_ms(3000);
+  aor_data = store->lookup_aor_data("sip:6505550231@homedomain", 0);
+  ASSERT_TRUE(aor_data != NULL);
+  EXPECT_EQ(0u, aor_data->bindings().size());
+  delete aor_data; aor_data = NULL;
+
+  delete uncached_store; uncached_store = NULL;
+  delete store; store = NULL;
+  delete datastore; datastore = NULL;
+  delete chronos_connection; chronos_connection = NULL;
+}
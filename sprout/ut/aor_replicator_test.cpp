@@ -0,0 +1,235 @@
+/**
+ * @file aor_replicator_test.cpp UT for asynchronous replication to the remote store.
+ *
+ * Project Clearwater - IMS in the Cloud
+ * Copyright (C) 2014  Metaswitch Networks Ltd
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or (at your
+ * option) any later version, along with the "Special Exception" for use of
+ * the program along with SSL, set forth below. This program is distributed
+ * in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+ * without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details. You should have received a copy of the GNU General Public
+ * License along with this program.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ *
+ * The author can be reached by email at clearwater@metaswitch.com or by
+ * post at Metaswitch Networks Ltd, 100 Church St, Enfield EN2 6BQ, UK
+ *
+ * Special Exception
+ * Metaswitch Networks Ltd  grants you permission to copy, modify,
+ * propagate, and distribute a work formed by combining OpenSSL with The
+ * Software, or a work derivative of such a combination, even if such
+ * copying, modification, propagation, or distribution would otherwise
+ * violate the terms of the GPL. You must comply with the GPL in all
+ * respects for all of the code used other than OpenSSL.
+ * "OpenSSL" means OpenSSL toolkit software distributed by the OpenSSL
+ * Project and licensed under the OpenSSL Licenses, or a work based on such
+ * software and licensed under the OpenSSL Licenses.
+ * "OpenSSL Licenses" means the OpenSSL License and Original SSLeay License
+ * under which the OpenSSL Project distributes the OpenSSL toolkit software,
+ * as those licenses appear in the file LICENSE-OPENSSL.
+ */
+
+///
+///----------------------------------------------------------------------------
+
+#include <unistd.h>
+
+#include "gtest/gtest.h"
+
+#include "siptest.hpp"
+#include "localstore.h"
+#include "fakechronosconnection.hpp"
+#include "regstore.h"
+#include "aor_replicator.h"
+
+using namespace std;
+
+/// Fixture for AoRReplicatorTest.  This uses a SipTest as the replication
+/// threads are registered with PJSIP.
+class AoRReplicatorTest : public SipTest
+{
+  static void SetUpTestCase()
+  {
+    SipTest::SetUpTestCase();
+  }
+
+  static void TearDownTestCase()
+  {
+    SipTest::TearDownTestCase();
+  }
+
+  AoRReplicatorTest()
+  {
+    _chronos_connection = new FakeChronosConnection();
+    _local_data_store = new LocalStore();
+    _remote_data_store = new LocalStore();
+    _remote_store = new RegStore(_remote_data_store, _chronos_connection);
+  }
+
+  virtual ~AoRReplicatorTest()
+  {
+    delete _remote_store; _remote_store = NULL;
+    delete _remote_data_store; _remote_data_store = NULL;
+    delete _local_data_store; _local_data_store = NULL;
+    delete _chronos_connection; _chronos_connection = NULL;
+  }
+
+  /// Adds or refreshes a binding through a store.
+  static void add_binding(RegStore* store,
+                          const std::string& aor_id,
+                          const std::string& binding_id,
+                          int cseq)
+  {
+    RegStore::Mutation mutation = [binding_id, cseq](RegStore::AoR* aor_data)
+    {
+      RegStore::AoR::Binding* b = aor_data->get_binding(binding_id);
+      b->_uri = "<sip:6505550231@192.91.191.29:59934;transport=tcp;ob>";
+      b->_cid = "gfYHoZGaFaRNxhlV0WIwoS-f91NoJ2gq";
+      b->_cseq = cseq;
+      b->_expires = time(NULL) + 300;
+      b->_priority = 0;
+      b->_emergency_registration = false;
+    };
+    bool all_bindings_expired;
+    int cas_retries;
+    RegStore::AoR* aor_data = store->update_aor_data(aor_id,
+                                                     mutation,
+                                                     false,
+                                                     0,
+                                                     all_bindings_expired,
+                                                     cas_retries);
+    EXPECT_TRUE(aor_data != NULL);
+    delete aor_data;
+  }
+
+  /// Waits for a binding in the remote store to reach the given CSeq (or to
+  /// be removed, if the CSeq is zero).  Returns false if it doesn't in time.
+  bool wait_for_remote_binding(const std::string& aor_id,
+                               const std::string& binding_id,
+                               int cseq)
+  {
+    for (int ii = 0; ii < 500; ++ii)
+    {
+      RegStore::AoR* aor_data = _remote_store->get_aor_data(aor_id, 0);
+      RegStore::AoR::Bindings::const_iterator i = aor_data->bindings().find(binding_id);
+      bool done = (cseq == 0) ?
+                    (i == aor_data->bindings().end()) :
+                    ((i != aor_data->bindings().end()) && (i->second->_cseq == cseq));
+      delete aor_data;
+
+      if (done)
+      {
+        return true;
+      }
+      usleep(10000);
+    }
+    return false;
+  }
+
+  ChronosConnection* _chronos_connection;
+  LocalStore* _local_data_store;
+  LocalStore* _remote_data_store;
+  RegStore* _remote_store;
+};
+
+TEST_F(AoRReplicatorTest, ReplicatesChanges)
+{
+  // Changes made through the local store reach the remote store, and
+  // bindings added directly to the remote store are kept.
+  AoRReplicator replicator(_remote_store, 2, 100, NULL);
+  RegStore local_store(_local_data_store,
+                       _chronos_connection,
+                       RegStore::FORMAT_BINARY,
+                       RegStore::LAYOUT_AOR,
+                       NULL,
+                       NULL,
+                       NULL,
+                       &replicator);
+  EXPECT_TRUE(local_store.replicates());
+
+  add_binding(_remote_store, "sip:6505550231@homedomain", "remote", 1);
+  add_binding(&local_store, "sip:6505550231@homedomain", "local", 1);
+  EXPECT_TRUE(wait_for_remote_binding("sip:6505550231@homedomain", "local", 1));
+
+  add_binding(&local_store, "sip:6505550231@homedomain", "local", 2);
+  EXPECT_TRUE(wait_for_remote_binding("sip:6505550231@homedomain", "local", 2));
+  EXPECT_TRUE(wait_for_remote_binding("sip:6505550231@homedomain", "remote", 1));
+
+  // Removing the binding locally removes it remotely.
+  RegStore::AoR* original = local_store.get_aor_data("sip:6505550231@homedomain", 0);
+  RegStore::AoR* updated = new RegStore::AoR(*original);
+  updated->remove_binding("local");
+  EXPECT_TRUE(local_store.set_aor_data("sip:6505550231@homedomain", updated, false, 0));
+  local_store.replicate("sip:6505550231@homedomain", original, updated);
+  EXPECT_TRUE(wait_for_remote_binding("sip:6505550231@homedomain", "local", 0));
+  EXPECT_TRUE(wait_for_remote_binding("sip:6505550231@homedomain", "remote", 1));
+  delete original;
+  delete updated;
+}
+
+TEST_F(AoRReplicatorTest, CombinesAndBoundsChanges)
+{
+  // With no threads to write the changes they stay queued.  Changes to an
+  // AoR are combined, and changes to new AoRs are dropped once the limit is
+  // reached.
+  AoRReplicator replicator(_remote_store, 0, 2, NULL);
+  RegStore local_store(_local_data_store,
+                       _chronos_connection,
+                       RegStore::FORMAT_BINARY,
+                       RegStore::LAYOUT_AOR,
+                       NULL,
+                       NULL,
+                       NULL,
+                       &replicator);
+
+  add_binding(&local_store, "sip:6505550231@homedomain", "binding1", 1);
+  add_binding(&local_store, "sip:6505550231@homedomain", "binding1", 2);
+  add_binding(&local_store, "sip:6505550231@homedomain", "binding2", 1);
+  EXPECT_EQ(1, replicator.pending());
+
+  add_binding(&local_store, "sip:6505550232@homedomain", "binding1", 1);
+  EXPECT_EQ(2, replicator.pending());
+
+  add_binding(&local_store, "sip:6505550233@homedomain", "binding1", 1);
+  EXPECT_EQ(2, replicator.pending());
+
+  // An update that changes nothing isn't queued.
+  RegStore::AoR* aor_data = local_store.get_aor_data("sip:6505550233@homedomain", 0);
+  local_store.replicate("sip:6505550233@homedomain", aor_data, aor_data);
+  EXPECT_EQ(2, replicator.pending());
+  delete aor_data;
+}
+
+TEST_F(AoRReplicatorTest, ResyncsAfterDroppedChanges)
+{
+  // Changes that are dropped because too many AoRs are waiting aren't lost
+  // for good: the next change to the AoR replicates the whole local AoR,
+  // which also removes bindings the local AoR doesn't have.
+  AoRReplicator replicator(_remote_store, 1, 0, NULL);
+  RegStore local_store(_local_data_store,
+                       _chronos_connection,
+                       RegStore::FORMAT_BINARY,
+                       RegStore::LAYOUT_AOR,
+                       NULL,
+                       NULL,
+                       NULL,
+                       &replicator);
+
+  add_binding(_remote_store, "sip:6505550231@homedomain", "stale", 1);
+  add_binding(&local_store, "sip:6505550231@homedomain", "binding1", 1);
+  EXPECT_EQ(0, replicator.pending());
+  EXPECT_EQ(1u, replicator._dirty.size());
+
+  // Make room, and change a different binding.
+  replicator._max_pending = 100;
+  add_binding(&local_store, "sip:6505550231@homedomain", "binding2", 1);
+  EXPECT_TRUE(wait_for_remote_binding("sip:6505550231@homedomain", "binding2", 1));
+  EXPECT_TRUE(wait_for_remote_binding("sip:6505550231@homedomain", "binding1", 1));
+  EXPECT_TRUE(wait_for_remote_binding("sip:6505550231@homedomain", "stale", 0));
+  EXPECT_EQ(0u, replicator._dirty.size());
+}
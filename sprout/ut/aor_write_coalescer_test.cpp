@@ -0,0 +1,325 @@
+/**
+ * @file aor_write_coalescer_test.cpp UT for the AoR write coalescer.
+ *
+ * Project Clearwater - IMS in the Cloud
+ * Copyright (C) 2014  Metaswitch Networks Ltd
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or (at your
+ * option) any later version, along with the "Special Exception" for use of
+ * the program along with SSL, set forth below. This program is distributed
+ * in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+ * without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details. You should have received a copy of the GNU General Public
+ * License along with this program.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ *
+ * The author can be reached by email at clearwater@metaswitch.com or by
+ * post at Metaswitch Networks Ltd, 100 Church St, Enfield EN2 6BQ, UK
+ *
+ * Special Exception
+ * Metaswitch Networks Ltd  grants you permission to copy, modify,
+ * propagate, and distribute a work formed by combining OpenSSL with The
+ * Software, or a work derivative of such a combination, even if such
+ * copying, modification, propagation, or distribution would otherwise
+ * violate the terms of the GPL. You must comply with the GPL in all
+ * respects for all of the code used other than OpenSSL.
+ * "OpenSSL" means OpenSSL toolkit software distributed by the OpenSSL
+ * Project and licensed under the OpenSSL Licenses, or a work based on such
+ * software and licensed under the OpenSSL Licenses.
+ * "OpenSSL Licenses" means the OpenSSL License and Original SSLeay License
+ * under which the OpenSSL Project distributes the OpenSSL toolkit software,
+ * as those licenses appear in the file LICENSE-OPENSSL.
+ */
+
+///
+///----------------------------------------------------------------------------
+
+#include <pthread.h>
+#include <unistd.h>
+
+#include "gtest/gtest.h"
+
+#include "basetest.hpp"
+#include "localstore.h"
+#include "fakechronosconnection.hpp"
+#include "regstore.h"
+#include "aor_write_coalescer.h"
+
+using namespace std;
+
+/// Fixture for AoRWriteCoalescerTest.
+class AoRWriteCoalescerTest : public BaseTest
+{
+  AoRWriteCoalescer* _coalescer;
+
+  AoRWriteCoalescerTest()
+  {
+    _coalescer = new AoRWriteCoalescer(NULL);
+  }
+
+  virtual ~AoRWriteCoalescerTest()
+  {
+    delete _coalescer; _coalescer = NULL;
+  }
+};
+
+/// Writer that records the size of each batch, and can be held up so that
+/// updates queue behind the batch being written.
+struct BatchRecorder
+{
+  BatchRecorder() : hold(false)
+  {
+    pthread_mutex_init(&lock, NULL);
+    pthread_cond_init(&cond, NULL);
+  }
+
+  ~BatchRecorder()
+  {
+    pthread_cond_destroy(&cond);
+    pthread_mutex_destroy(&lock);
+  }
+
+  void write(std::vector<RegStore::Update*>& batch)
+  {
+    pthread_mutex_lock(&lock);
+    batch_sizes.push_back(batch.size());
+    while (hold)
+    {
+      pthread_cond_wait(&cond, &lock);
+    }
+    pthread_mutex_unlock(&lock);
+
+    for (size_t ii = 0; ii < batch.size(); ++ii)
+    {
+      batch[ii]->cas_retries = ii;
+    }
+  }
+
+  void release()
+  {
+    pthread_mutex_lock(&lock);
+    hold = false;
+    pthread_cond_broadcast(&cond);
+    pthread_mutex_unlock(&lock);
+  }
+
+  std::vector<size_t> batch_sizes;
+  bool hold;
+  pthread_mutex_t lock;
+  pthread_cond_t cond;
+};
+
+struct UpdateThread
+{
+  AoRWriteCoalescer* coalescer;
+  BatchRecorder* recorder;
+  RegStore::Update update;
+  pthread_t thread;
+};
+
+static void* make_update(void* p)
+{
+  UpdateThread* t = (UpdateThread*)p;
+  BatchRecorder* recorder = t->recorder;
+  t->coalescer->update("sip:6505550231@homedomain",
+                       t->update,
+                       [recorder](std::vector<RegStore::Update*>& batch)
+                       {
+                         recorder->write(batch);
+                       });
+  return NULL;
+}
+
+TEST_F(AoRWriteCoalescerTest, SingleUpdate)
+{
+  // An update to an AoR that isn't being written is made on its own.
+  BatchRecorder recorder;
+  RegStore::Update update = {NULL, false, 0, NULL, false, -1};
+  _coalescer->update("sip:6505550231@homedomain",
+                     update,
+                     [&recorder](std::vector<RegStore::Update*>& batch)
+                     {
+                       recorder.write(batch);
+                     });
+  ASSERT_EQ(1u, recorder.batch_sizes.size());
+  EXPECT_EQ(1u, recorder.batch_sizes[0]);
+  EXPECT_EQ(0, update.cas_retries);
+}
+
+TEST_F(AoRWriteCoalescerTest, ConcurrentUpdatesCombined)
+{
+  // Updates that arrive while the AoR is being written are made together
+  // once the write finishes.
+  BatchRecorder recorder;
+  recorder.hold = true;
+  UpdateThread threads[4];
+
+  for (int ii = 0; ii < 4; ++ii)
+  {
+    threads[ii].coalescer = _coalescer;
+    threads[ii].recorder = &recorder;
+    threads[ii].update.cas_retries = -1;
+    pthread_create(&threads[ii].thread, NULL, make_update, &threads[ii]);
+
+    // Give the first update time to start writing, and the others time to
+    // queue behind it.
+    usleep(50000);
+  }
+
+  recorder.release();
+
+  for (int ii = 0; ii < 4; ++ii)
+  {
+    pthread_join(threads[ii].thread, NULL);
+  }
+
+  ASSERT_EQ(2u, recorder.batch_sizes.size());
+  EXPECT_EQ(1u, recorder.batch_sizes[0]);
+  EXPECT_EQ(3u, recorder.batch_sizes[1]);
+
+  // The later updates are made in the order they arrived.
+  EXPECT_EQ(0, threads[0].update.cas_retries);
+  EXPECT_EQ(0, threads[1].update.cas_retries);
+  EXPECT_EQ(1, threads[2].update.cas_retries);
+  EXPECT_EQ(2, threads[3].update.cas_retries);
+}
+
+struct RegisterThread
+{
+  RegStore* store;
+  std::string binding_id;
+  RegStore::AoR* aor_data;
+  pthread_t thread;
+};
+
+static void* add_binding(void* p)
+{
+  RegisterThread* t = (RegisterThread*)p;
+  std::string binding_id = t->binding_id;
+  RegStore::Mutation mutation = [binding_id](RegStore::AoR* aor_data)
+  {
+    RegStore::AoR::Binding* b = aor_data->get_binding(binding_id);
+    b->_uri = "<sip:6505550231@192.91.191.29:59934;transport=tcp;ob>";
+    b->_cid = binding_id;
+    b->_cseq = 1;
+    b->_expires = time(NULL) + 300;
+    b->_priority = 0;
+    b->_emergency_registration = false;
+  };
+  bool all_bindings_expired;
+  int cas_retries;
+  t->aor_data = t->store->update_aor_data("sip:6505550231@homedomain",
+                                          mutation,
+                                          false,
+                                          0,
+                                          all_bindings_expired,
+                                          cas_retries);
+  return NULL;
+}
+
+TEST_F(AoRWriteCoalescerTest, RegStoreUpdates)
+{
+  // Concurrent updates through a RegStore with a coalescer all take effect,
+  // and each gets the AoR as written.
+  ChronosConnection* chronos_connection = new FakeChronosConnection();
+  LocalStore* datastore = new LocalStore();
+  RegStore* store = new RegStore(datastore,
+                                 chronos_connection,
+                                 RegStore::FORMAT_BINARY,
+                                 RegStore::LAYOUT_AOR,
+                                 NULL,
+                                 NULL,
+                                 _coalescer);
+
+  RegisterThread threads[8];
+  for (int ii = 0; ii < 8; ++ii)
+  {
+    threads[ii].store = store;
+    threads[ii].binding_id = "binding" + std::to_string(ii);
+    threads[ii].aor_data = NULL;
+    pthread_create(&threads[ii].thread, NULL, add_binding, &threads[ii]);
+  }
+
+  for (int ii = 0; ii < 8; ++ii)
+  {
+    pthread_join(threads[ii].thread, NULL);
+    ASSERT_TRUE(threads[ii].aor_data != NULL);
+    EXPECT_TRUE(threads[ii].aor_data->bindings().find(threads[ii].binding_id) !=
+                threads[ii].aor_data->bindings().end());
+    delete threads[ii].aor_data;
+  }
+
+  RegStore::AoR* aor_data = store->get_aor_data("sip:6505550231@homedomain", 0);
+  ASSERT_TRUE(aor_data != NULL);
+  EXPECT_EQ(8u, aor_data->bindings().size());
+  delete aor_data;
+
+  delete store; store = NULL;
+  delete datastore; datastore = NULL;
+  delete chronos_connection; chronos_connection = NULL;
+}
+
+TEST_F(AoRWriteCoalescerTest, DeregistrationReportedOnce)
+{
+  // When a batch of updates leaves an AoR with no bindings, only the update
+  // that removed the last binding is told that all the bindings expired.
+  ChronosConnection* chronos_connection = new FakeChronosConnection();
+  LocalStore* datastore = new LocalStore();
+  RegStore* store = new RegStore(datastore,
+                                 chronos_connection,
+                                 RegStore::FORMAT_BINARY,
+                                 RegStore::LAYOUT_AOR,
+                                 NULL,
+                                 NULL,
+                                 _coalescer);
+
+  RegStore::AoR* aor_data = store->get_aor_data("sip:6505550231@homedomain", 0);
+  ASSERT_TRUE(aor_data != NULL);
+  RegStore::AoR::Binding* b = aor_data->get_binding("binding1");
+  b->_uri = "<sip:6505550231@192.91.191.29:59934;transport=tcp;ob>";
+  b->_cid = "binding1";
+  b->_cseq = 1;
+  b->_expires = time(NULL) + 300;
+  b->_priority = 0;
+  b->_emergency_registration = false;
+  ASSERT_TRUE(store->set_aor_data("sip:6505550231@homedomain", aor_data, false, 0));
+  delete aor_data;
+
+  RegStore::Mutation refresh = [](RegStore::AoR* aor_data)
+  {
+    aor_data->get_binding("binding1")->_cseq++;
+  };
+  RegStore::Mutation deregister = [](RegStore::AoR* aor_data)
+  {
+    aor_data->remove_binding("binding1");
+  };
+
+  // The first update refreshes the binding, the second removes it and the
+  // third finds it already removed.  The updates are on different trails.
+  RegStore::Update updates[3] = {{&refresh, false, 1, NULL, false, -1},
+                                 {&deregister, false, 2, NULL, false, -1},
+                                 {&deregister, false, 3, NULL, false, -1}};
+  std::vector<RegStore::Update*> batch;
+  for (int ii = 0; ii < 3; ++ii)
+  {
+    batch.push_back(&updates[ii]);
+  }
+  store->write_updates("sip:6505550231@homedomain", batch, 1);
+
+  EXPECT_FALSE(updates[0].all_bindings_expired);
+  EXPECT_TRUE(updates[1].all_bindings_expired);
+  EXPECT_FALSE(updates[2].all_bindings_expired);
+  for (int ii = 0; ii < 3; ++ii)
+  {
+    ASSERT_TRUE(updates[ii].aor_data != NULL);
+    EXPECT_EQ(0u, updates[ii].aor_data->bindings().size());
+    delete updates[ii].aor_data;
+  }
+
+  delete store; store = NULL;
+  delete datastore; datastore = NULL;
+  delete chronos_connection; chronos_connection = NULL;
+}
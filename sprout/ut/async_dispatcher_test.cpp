@@ -0,0 +1,171 @@
+/**
+ * @file async_dispatcher_test.cpp UT for AsyncDispatcher.
+ *
+ * Project Clearwater - IMS in the Cloud
+ * Copyright (C) 2014  Metaswitch Networks Ltd
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or (at your
+ * option) any later version, along with the "Special Exception" for use of
+ * the program along with SSL, set forth below. This program is distributed
+ * in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+ * without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details. You should have received a copy of the GNU General Public
+ * License along with this program.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ *
+ * The author can be reached by email at clearwater@metaswitch.com or by
+ * post at Metaswitch Networks Ltd, 100 Church St, Enfield EN2 6BQ, UK
+ *
+ * Special Exception
+ * Metaswitch Networks Ltd  grants you permission to copy, modify,
+ * propagate, and distribute a work formed by combining OpenSSL with The
+ * Software, or a work derivative of such a combination, even if such
+ * copying, modification, propagation, or distribution would otherwise
+ * violate the terms of the GPL. You must comply with the GPL in all
+ * respects for all of the code used other than OpenSSL.
+ * "OpenSSL" means OpenSSL toolkit software distributed by the OpenSSL
+ * Project and licensed under the OpenSSL Licenses, or a work based on such
+ * software and licensed under the OpenSSL Licenses.
+ * "OpenSSL Licenses" means the OpenSSL License and Original SSLeay License
+ * under which the OpenSSL Project distributes the OpenSSL toolkit software,
+ * as those licenses appear in the file LICENSE-OPENSSL.
+ */
+
+///
+///----------------------------------------------------------------------------
+
+#include <semaphore.h>
+#include <unistd.h>
+#include <pthread.h>
+#include "gtest/gtest.h"
+
+#include "basetest.hpp"
+#include "async_dispatcher.h"
+
+using namespace std;
+
+/// Fixture for AsyncDispatcherTest.
+class AsyncDispatcherTest : public BaseTest
+{
+  sem_t _sem;
+
+  AsyncDispatcherTest()
+  {
+    sem_init(&_sem, 0, 0);
+  }
+
+  virtual ~AsyncDispatcherTest()
+  {
+    sem_destroy(&_sem);
+  }
+};
+
+TEST_F(AsyncDispatcherTest, RunsOperationThenCompletion)
+{
+  AsyncDispatcher dispatcher(2);
+  pthread_t caller = pthread_self();
+  pthread_t op_thread = caller;
+  bool op_run = false;
+  bool op_run_before_completion = false;
+
+  // The worker threads aren't running, so the completion runs on the
+  // dispatcher thread straight after the operation.
+  dispatcher.dispatch([&]() { op_thread = pthread_self(); op_run = true; },
+                      [&]() { op_run_before_completion = op_run; sem_post(&_sem); });
+  sem_wait(&_sem);
+
+  EXPECT_TRUE(op_run_before_completion);
+  EXPECT_FALSE(pthread_equal(caller, op_thread));
+}
+
+TEST_F(AsyncDispatcherTest, NoCompletion)
+{
+  AsyncDispatcher dispatcher(1);
+  int count = 0;
+
+  for (int ii = 0; ii < 10; ++ii)
+  {
+    dispatcher.dispatch([&]() { if (++count == 10) { sem_post(&_sem); } });
+  }
+  sem_wait(&_sem);
+
+  EXPECT_EQ(10, count);
+}
+
+TEST_F(AsyncDispatcherTest, NoThreads)
+{
+  // With no threads the operation and completion run inline.
+  AsyncDispatcher dispatcher(0);
+  int order = 0;
+  int op_order = 0;
+  int completion_order = 0;
+
+  dispatcher.dispatch([&]() { op_order = ++order; },
+                      [&]() { completion_order = ++order; });
+
+  EXPECT_EQ(1, op_order);
+  EXPECT_EQ(2, completion_order);
+}
+
+TEST_F(AsyncDispatcherTest, StopCompletesQueuedOperations)
+{
+  AsyncDispatcher dispatcher(1);
+  int ops_run = 0;
+  int completions_run = 0;
+
+  // Block the only thread until the dispatcher has been stopped, so the
+  // other operations are still queued behind it.
+  dispatcher.dispatch([&]()
+                      {
+                        bool stopped = false;
+                        while (!stopped)
+                        {
+                          usleep(1000);
+                          pthread_mutex_lock(&dispatcher._lock);
+                          stopped = dispatcher._stopped;
+                          pthread_mutex_unlock(&dispatcher._lock);
+                        }
+                        ++ops_run;
+                      },
+                      [&]() { ++completions_run; });
+  for (int ii = 0; ii < 5; ++ii)
+  {
+    dispatcher.dispatch([&]() { ++ops_run; },
+                        [&]() { ++completions_run; });
+  }
+
+  // Wait for the thread to pick up the first operation, then stop the
+  // dispatcher.  The operation that was running completes normally, and the
+  // queued ones are skipped but still completed.
+  while (dispatcher.queue_size() > 5)
+  {
+    usleep(1000);
+  }
+  dispatcher.stop();
+
+  EXPECT_EQ(0, dispatcher.queue_size());
+  EXPECT_EQ(1, ops_run);
+  EXPECT_EQ(6, completions_run);
+}
+
+TEST_F(AsyncDispatcherTest, DispatchAfterStop)
+{
+  AsyncDispatcher dispatcher(1);
+  bool op_run = false;
+  bool completion_run = false;
+
+  // Operations dispatched after the dispatcher has stopped are skipped, but
+  // their completions are run straight away.
+  dispatcher.stop();
+  dispatcher.dispatch([&]() { op_run = true; },
+                      [&]() { completion_run = true; });
+
+  EXPECT_FALSE(op_run);
+  EXPECT_TRUE(completion_run);
+
+  // Stopping again is harmless.
+  dispatcher.stop();
+}
@@ -0,0 +1,314 @@
+/**
+ * @file chronos_timer_batcher_test.cpp UT for the Chronos timer batcher.
+ *
+ * Project Clearwater - IMS in the Cloud
+ * Copyright (C) 2014  Metaswitch Networks Ltd
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or (at your
+ * option) any later version, along with the "Special Exception" for use of
+ * the program along with SSL, set forth below. This program is distributed
+ * in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+ * without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details. You should have received a copy of the GNU General Public
+ * License along with this program.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ *
+ * The author can be reached by email at clearwater@metaswitch.com or by
+ * post at Metaswitch Networks Ltd, 100 Church St, Enfield EN2 6BQ, UK
+ *
+ * Special Exception
+ * Metaswitch Networks Ltd  grants you permission to copy, modify,
+ * propagate, and distribute a work formed by combining OpenSSL with The
+ * Software, or a work derivative of such a combination, even if such
+ * copying, modification, propagation, or distribution would otherwise
+ * violate the terms of the GPL. You must comply with the GPL in all
+ * respects for all of the code used other than OpenSSL.
+ * "OpenSSL" means OpenSSL toolkit software distributed by the OpenSSL
+ * Project and licensed under the OpenSSL Licenses, or a work based on such
+ * software and licensed under the OpenSSL Licenses.
+ * "OpenSSL Licenses" means the OpenSSL License and Original SSLeay License
+ * under which the OpenSSL Project distributes the OpenSSL toolkit software,
+ * as those licenses appear in the file LICENSE-OPENSSL.
+ */
+
+///
+///----------------------------------------------------------------------------
+
+#include <unistd.h>
+#include <pthread.h>
+
+#include "gtest/gtest.h"
+
+#include "siptest.hpp"
+#include "localstore.h"
+#include "chronosconnection.h"
+#include "regstore.h"
+#include "chronos_timer_batcher.h"
+
+using namespace std;
+
+/// ChronosConnection that records the operations sent to it.  Updated
+/// timers are given the ID set in _new_timer_id, if any.
+class RecordingChronosConnection : public ChronosConnection
+{
+public:
+  RecordingChronosConnection() :
+    ChronosConnection("localhost", "localhost:9888", NULL)
+  {
+    pthread_mutex_init(&_lock, NULL);
+  }
+
+  ~RecordingChronosConnection()
+  {
+    pthread_mutex_destroy(&_lock);
+  }
+
+  HTTPCode send_delete(const std::string& delete_identity,
+                       SAS::TrailId trail)
+  {
+    record("DELETE " + delete_identity);
+    return HTTP_OK;
+  }
+
+  HTTPCode send_post(std::string& post_identity,
+                     uint32_t timer_interval,
+                     const std::string& callback_uri,
+                     const std::string& opaque_data,
+                     SAS::TrailId trail)
+  {
+    record("POST " + std::to_string(timer_interval));
+    post_identity = "new_timer";
+    return HTTP_OK;
+  }
+
+  HTTPCode send_put(std::string& put_identity,
+                    uint32_t timer_interval,
+                    const std::string& callback_uri,
+                    const std::string& opaque_data,
+                    SAS::TrailId trail)
+  {
+    record("PUT " + put_identity + " " + std::to_string(timer_interval));
+    if (_new_timer_id != "")
+    {
+      put_identity = _new_timer_id;
+    }
+    return HTTP_OK;
+  }
+
+  std::vector<std::string> operations()
+  {
+    pthread_mutex_lock(&_lock);
+    std::vector<std::string> ops = _ops;
+    pthread_mutex_unlock(&_lock);
+    return ops;
+  }
+
+  std::string _new_timer_id;
+
+private:
+  void record(const std::string& op)
+  {
+    pthread_mutex_lock(&_lock);
+    _ops.push_back(op);
+    pthread_mutex_unlock(&_lock);
+  }
+
+  pthread_mutex_t _lock;
+  std::vector<std::string> _ops;
+};
+
+/// Fixture for ChronosTimerBatcherTest.  This uses a SipTest as the
+/// batching threads are registered with PJSIP.
+class ChronosTimerBatcherTest : public SipTest
+{
+  static void SetUpTestCase()
+  {
+    SipTest::SetUpTestCase();
+  }
+
+  static void TearDownTestCase()
+  {
+    SipTest::TearDownTestCase();
+  }
+
+  ChronosTimerBatcherTest()
+  {
+    _chronos_connection = new RecordingChronosConnection();
+  }
+
+  virtual ~ChronosTimerBatcherTest()
+  {
+    delete _chronos_connection; _chronos_connection = NULL;
+  }
+
+  /// Waits for the batcher to send everything waiting.  Returns false if it
+  /// doesn't in time.
+  static bool wait_for_batcher(ChronosTimerBatcher* batcher)
+  {
+    for (int ii = 0; ii < 500; ++ii)
+    {
+      if (batcher->pending() == 0)
+      {
+        // Give the thread time to finish sending the last batch.
+        usleep(20000);
+        return true;
+      }
+      usleep(10000);
+    }
+    return false;
+  }
+
+  /// Checks that an operation is an update of the given timer, with an
+  /// interval at most a second or so shorter than the given one (as time
+  /// passes before the update is sent).
+  static void expect_put(const std::string& op,
+                         const std::string& timer_id,
+                         int interval)
+  {
+    std::string prefix = "PUT " + timer_id + " ";
+    ASSERT_EQ(0u, op.find(prefix)) << op;
+    int sent_interval = std::stoi(op.substr(prefix.size()));
+    EXPECT_LE(sent_interval, interval);
+    EXPECT_GE(sent_interval, interval - 2);
+  }
+
+  RecordingChronosConnection* _chronos_connection;
+};
+
+
+TEST_F(ChronosTimerBatcherTest, CombinesOperations)
+{
+  ChronosTimerBatcher batcher(_chronos_connection, 100, 100, 1, 1000, NULL);
+  int now = time(NULL);
+
+  // Several updates to one timer, and an update to another timer followed
+  // by its deletion.
+  batcher.set_timer("timer1", now + 300, "/timers", "opaque", NULL, 0);
+  batcher.set_timer("timer2", now + 300, "/timers", "opaque", NULL, 0);
+  batcher.set_timer("timer1", now + 600, "/timers", "opaque", NULL, 0);
+  batcher.delete_timer("timer2", 0);
+  batcher.set_timer("timer1", now + 900, "/timers", "opaque", NULL, 0);
+
+  // Nothing is sent until the window has passed.
+  EXPECT_EQ(2, batcher.pending());
+  EXPECT_EQ(0u, _chronos_connection->operations().size());
+
+  // Then only the latest operation on each timer is sent, in the order the
+  // timers were first queued.
+  ASSERT_TRUE(wait_for_batcher(&batcher));
+  std::vector<std::string> ops = _chronos_connection->operations();
+  ASSERT_EQ(2u, ops.size());
+  expect_put(ops[0], "timer1", 900);
+  EXPECT_EQ("DELETE timer2", ops[1]);
+}
+
+
+TEST_F(ChronosTimerBatcherTest, FullQueueAndShutdown)
+{
+  ChronosTimerBatcher* batcher =
+    new ChronosTimerBatcher(_chronos_connection, 60000, 100, 1, 2, NULL);
+  int now = time(NULL);
+
+  // Operations beyond the maximum waiting are sent straight away, unless
+  // they can be combined with one already waiting.
+  batcher->set_timer("timer1", now + 300, "/timers", "opaque", NULL, 0);
+  batcher->set_timer("timer2", now + 300, "/timers", "opaque", NULL, 0);
+  batcher->delete_timer("timer3", 0);
+  batcher->set_timer("timer2", now + 600, "/timers", "opaque", NULL, 0);
+
+  std::vector<std::string> ops = _chronos_connection->operations();
+  ASSERT_EQ(1u, ops.size());
+  EXPECT_EQ("DELETE timer3", ops[0]);
+  EXPECT_EQ(2, batcher->pending());
+
+  // Operations still waiting are sent when the batcher is destroyed.
+  delete batcher;
+  ops = _chronos_connection->operations();
+  ASSERT_EQ(3u, ops.size());
+  expect_put(ops[1], "timer1", 300);
+  expect_put(ops[2], "timer2", 600);
+}
+
+
+TEST_F(ChronosTimerBatcherTest, IntervalWorkedOutWhenSent)
+{
+  // An update waits for the window before being sent, and the interval it
+  // is sent with excludes the time it waited.
+  ChronosTimerBatcher batcher(_chronos_connection, 1500, 100, 1, 1000, NULL);
+  int now = time(NULL);
+  batcher.set_timer("timer1", now + 300, "/timers", "opaque", NULL, 0);
+
+  ASSERT_TRUE(wait_for_batcher(&batcher));
+  std::vector<std::string> ops = _chronos_connection->operations();
+  ASSERT_EQ(1u, ops.size());
+  expect_put(ops[0], "timer1", 299);
+}
+
+TEST_F(ChronosTimerBatcherTest, RegStoreTimers)
+{
+  LocalStore* data_store = new LocalStore();
+  ChronosTimerBatcher* batcher =
+    new ChronosTimerBatcher(_chronos_connection, 10, 100, 1, 1000, NULL);
+  RegStore* store = new RegStore(data_store,
+                                 _chronos_connection,
+                                 RegStore::FORMAT_BINARY,
+                                 RegStore::LAYOUT_AOR,
+                                 NULL,
+                                 NULL,
+                                 NULL,
+                                 NULL,
+                                 batcher);
+  std::string aor_id = "sip:6505550231@homedomain";
+
+  // A new binding's timer is created straight away, as its ID is needed.
+  RegStore::AoR* aor_data = store->get_aor_data(aor_id, 0);
+  RegStore::AoR::Binding* b = aor_data->get_binding("binding1");
+  b->_uri = "<sip:6505550231@192.91.191.29:59934;transport=tcp;ob>";
+  b->_cid = "gfYHoZGaFaRNxhlV0WIwoS-f91NoJ2gq";
+  b->_cseq = 1;
+  b->_expires = time(NULL) + 300;
+  b->_priority = 0;
+  b->_emergency_registration = false;
+  EXPECT_TRUE(store->set_aor_data(aor_id, aor_data, true, 0));
+  delete aor_data;
+
+  std::vector<std::string> ops = _chronos_connection->operations();
+  ASSERT_EQ(1u, ops.size());
+  EXPECT_EQ(0u, ops[0].find("POST "));
+
+  // Refreshing the binding updates the timer in the background.  Chronos
+  // changes the timer's ID, which is written back to the store.
+  _chronos_connection->_new_timer_id = "changed_timer";
+  aor_data = store->get_aor_data(aor_id, 0);
+  EXPECT_EQ("new_timer", aor_data->get_binding("binding1")->_timer_id);
+  aor_data->get_binding("binding1")->_cseq = 2;
+  aor_data->get_binding("binding1")->_expires = time(NULL) + 600;
+  EXPECT_TRUE(store->set_aor_data(aor_id, aor_data, true, 0));
+  delete aor_data;
+
+  ASSERT_TRUE(wait_for_batcher(batcher));
+  ops = _chronos_connection->operations();
+  ASSERT_EQ(2u, ops.size());
+  expect_put(ops[1], "new_timer", 600);
+
+  aor_data = store->get_aor_data(aor_id, 0);
+  EXPECT_EQ("changed_timer", aor_data->get_binding("binding1")->_timer_id);
+  EXPECT_EQ(2, aor_data->get_binding("binding1")->_cseq);
+
+  // When the binding expires its timer is deleted in the background.
+  aor_data->get_binding("binding1")->_expires = time(NULL) - 1;
+  EXPECT_TRUE(store->set_aor_data(aor_id, aor_data, false, 0));
+  delete aor_data;
+
+  ASSERT_TRUE(wait_for_batcher(batcher));
+  ops = _chronos_connection->operations();
+  ASSERT_EQ(3u, ops.size());
+  EXPECT_EQ("DELETE changed_timer", ops[2]);
+
+  delete batcher;
+  delete store;
+  delete data_store;
+}
@@ -0,0 +1,277 @@
+/**
+ * @file classified_eventq_test.cpp UT for the classified event queue.
+ *
+ * Project Clearwater - IMS in the Cloud
+ * Copyright (C) 2013  Metaswitch Networks Ltd
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or (at your
+ * option) any later version, along with the "Special Exception" for use of
+ * the program along with SSL, set forth below. This program is distributed
+ * in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+ * without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details. You should have received a copy of the GNU General Public
+ * License along with this program.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ *
+ * The author can be reached by email at clearwater@metaswitch.com or by
+ * post at Metaswitch Networks Ltd, 100 Church St, Enfield EN2 6BQ, UK
+ *
+ * Special Exception
+ * Metaswitch Networks Ltd  grants you permission to copy, modify,
+ * propagate, and distribute a work formed by combining OpenSSL with The
+ * Software, or a work derivative of such a combination, even if such
+ * copying, modification, propagation, or distribution would otherwise
+ * violate the terms of the GPL. You must comply with the GPL in all
+ * respects for all of the code used other than OpenSSL.
+ * "OpenSSL" means OpenSSL toolkit software distributed by the OpenSSL
+ * Project and licensed under the OpenSSL Licenses, or a work based on such
+ * software and licensed under the OpenSSL Licenses.
+ * "OpenSSL Licenses" means the OpenSSL License and Original SSLeay License
+ * under which the OpenSSL Project distributes the OpenSSL toolkit software,
+ * as those licenses appear in the file LICENSE-OPENSSL.
+ */
+
+///
+///----------------------------------------------------------------------------
+
+#include <string>
+#include <vector>
+#include <unistd.h>
+#include "gtest/gtest.h"
+
+#include "basetest.hpp"
+#include "classified_eventq.h"
+
+using namespace std;
+
+/// Fixture for ClassifiedEventqTest.  The queue has three classes, the first
+/// unbounded and the others with small maximum depths.
+class ClassifiedEventqTest : public BaseTest
+{
+  classified_eventq<int>* _q;
+
+  ClassifiedEventqTest()
+  {
+    std::vector<unsigned int> max_depths;
+    max_depths.push_back(0);
+    max_depths.push_back(2);
+    max_depths.push_back(1);
+    _q = new classified_eventq<int>(max_depths);
+  }
+
+  virtual ~ClassifiedEventqTest()
+  {
+    delete _q; _q = NULL;
+  }
+};
+
+TEST_F(ClassifiedEventqTest, PriorityOrder)
+{
+  EXPECT_EQ(3, _q->num_classes());
+  EXPECT_TRUE(_q->push(1, 2));
+  EXPECT_TRUE(_q->push(2, 1));
+  EXPECT_TRUE(_q->push(3, 0));
+  EXPECT_TRUE(_q->push(4, 1));
+  EXPECT_TRUE(_q->push(5, 0));
+  EXPECT_EQ(5, _q->size());
+  EXPECT_EQ(2, _q->size(1));
+
+  // Items come out highest priority class first, FIFO within each class.
+  int item;
+  EXPECT_TRUE(_q->pop(item)); EXPECT_EQ(3, item);
+  EXPECT_TRUE(_q->pop(item)); EXPECT_EQ(5, item);
+  EXPECT_TRUE(_q->pop(item)); EXPECT_EQ(2, item);
+  EXPECT_TRUE(_q->pop(item)); EXPECT_EQ(4, item);
+  EXPECT_TRUE(_q->pop(item)); EXPECT_EQ(1, item);
+  EXPECT_EQ(0, _q->size());
+}
+
+TEST_F(ClassifiedEventqTest, MaxDepth)
+{
+  EXPECT_TRUE(_q->push(1, 1));
+  EXPECT_TRUE(_q->push(2, 1));
+  EXPECT_FALSE(_q->push(3, 1));
+  EXPECT_TRUE(_q->push(4, 2));
+  EXPECT_FALSE(_q->push(5, 2));
+  EXPECT_EQ(2u, _q->max_depth(1));
+
+  // The unbounded class still accepts items.
+  for (int ii = 0; ii < 100; ++ii)
+  {
+    EXPECT_TRUE(_q->push(ii, 0));
+  }
+  EXPECT_EQ(103, _q->size());
+
+  // Once an item is popped from a full class there is room again.
+  int item;
+  for (int ii = 0; ii < 101; ++ii)
+  {
+    _q->pop(item);
+  }
+  EXPECT_EQ(1, item);
+  EXPECT_TRUE(_q->push(6, 1));
+}
+
+TEST_F(ClassifiedEventqTest, ForcePush)
+{
+  EXPECT_TRUE(_q->push(1, 2));
+  EXPECT_FALSE(_q->push(2, 2));
+
+  // A forced push ignores the depth limit.
+  EXPECT_TRUE(_q->push(3, 2, true));
+  EXPECT_EQ(2, _q->size(2));
+}
+
+TEST_F(ClassifiedEventqTest, PopBatch)
+{
+  EXPECT_TRUE(_q->push(1, 2));
+  EXPECT_TRUE(_q->push(2, 1));
+  EXPECT_TRUE(_q->push(3, 0));
+  EXPECT_TRUE(_q->push(4, 0));
+
+  // A batch is popped in priority order, and limited to the maximum size.
+  std::vector<int> items;
+  EXPECT_EQ(3u, _q->pop_batch(items, 3));
+  ASSERT_EQ(3u, items.size());
+  EXPECT_EQ(3, items[0]);
+  EXPECT_EQ(4, items[1]);
+  EXPECT_EQ(2, items[2]);
+  EXPECT_EQ(1, _q->size());
+
+  // Items are appended to the vector.
+  EXPECT_EQ(1u, _q->pop_batch(items, 3));
+  ASSERT_EQ(4u, items.size());
+  EXPECT_EQ(1, items[3]);
+  EXPECT_EQ(0, _q->size());
+
+  _q->terminate();
+  EXPECT_EQ(0u, _q->pop_batch(items, 3));
+}
+
+TEST_F(ClassifiedEventqTest, PushFront)
+{
+  EXPECT_TRUE(_q->push(1, 1));
+  EXPECT_TRUE(_q->push(2, 1));
+
+  // Pop a batch, then put the unprocessed items back (last first).  They
+  // are popped again in their original order, ahead of later items, and the
+  // depth limit doesn't apply.
+  std::vector<int> items;
+  EXPECT_EQ(2u, _q->pop_batch(items, 2));
+  EXPECT_TRUE(_q->push(3, 1));
+  EXPECT_TRUE(_q->push(4, 1));
+  EXPECT_TRUE(_q->push_front(items[1], 1));
+  EXPECT_TRUE(_q->push_front(items[0], 1));
+  EXPECT_EQ(4, _q->size(1));
+
+  int item;
+  EXPECT_TRUE(_q->pop(item)); EXPECT_EQ(1, item);
+  EXPECT_TRUE(_q->pop(item)); EXPECT_EQ(2, item);
+  EXPECT_TRUE(_q->pop(item)); EXPECT_EQ(3, item);
+  EXPECT_TRUE(_q->pop(item)); EXPECT_EQ(4, item);
+
+  _q->terminate();
+  EXPECT_FALSE(_q->push_front(5, 1));
+}
+
+TEST_F(ClassifiedEventqTest, Terminate)
+{
+  EXPECT_TRUE(_q->push(1, 0));
+  _q->terminate();
+  EXPECT_TRUE(_q->is_terminated());
+
+  int item;
+  EXPECT_FALSE(_q->pop(item));
+  EXPECT_FALSE(_q->push(2, 0));
+}
+
+TEST_F(ClassifiedEventqTest, Deadlock)
+{
+  // Deadlock detection is disabled by default.
+  EXPECT_TRUE(_q->push(1, 0));
+  EXPECT_FALSE(_q->is_deadlocked());
+
+  // With a threshold set, an unserviced queue becomes deadlocked once the
+  // threshold has passed.
+  _q->set_deadlock_threshold(1);
+  usleep(5000);
+  EXPECT_TRUE(_q->is_deadlocked());
+
+  // Servicing the queue clears the deadlock.
+  int item;
+  _q->pop(item);
+  EXPECT_FALSE(_q->is_deadlocked());
+}
+
+TEST_F(ClassifiedEventqTest, DeadlockReset)
+{
+  _q->set_deadlock_threshold(1);
+  EXPECT_TRUE(_q->push(1, 0));
+  usleep(5000);
+  EXPECT_TRUE(_q->is_deadlocked());
+
+  // Restarting the clock gives the queue more time to be serviced.
+  _q->set_deadlock_threshold(1000);
+  _q->reset_deadlock_detection();
+  EXPECT_FALSE(_q->is_deadlocked());
+}
+
+TEST_F(ClassifiedEventqTest, StarvationLimit)
+{
+  // Recreate the queue so that a class is served after being passed over
+  // twice.
+  std::vector<unsigned int> max_depths(3, 0);
+  delete _q;
+  _q = new classified_eventq<int>(max_depths, 2);
+
+  for (int ii = 0; ii < 6; ++ii)
+  {
+    EXPECT_TRUE(_q->push(ii, 0));
+  }
+  EXPECT_TRUE(_q->push(100, 2));
+  EXPECT_TRUE(_q->push(101, 2));
+
+  // The low priority class gets a share of the pops even though the high
+  // priority class never empties.
+  int item;
+  EXPECT_TRUE(_q->pop(item)); EXPECT_EQ(0, item);
+  EXPECT_TRUE(_q->pop(item)); EXPECT_EQ(1, item);
+  EXPECT_TRUE(_q->pop(item)); EXPECT_EQ(100, item);
+  EXPECT_TRUE(_q->pop(item)); EXPECT_EQ(2, item);
+  EXPECT_TRUE(_q->pop(item)); EXPECT_EQ(3, item);
+  EXPECT_TRUE(_q->pop(item)); EXPECT_EQ(101, item);
+  EXPECT_TRUE(_q->pop(item)); EXPECT_EQ(4, item);
+  EXPECT_TRUE(_q->pop(item)); EXPECT_EQ(5, item);
+  EXPECT_EQ(0, _q->size());
+}
+
+TEST_F(ClassifiedEventqTest, KeyOrder)
+{
+  // An INVITE (in a lower priority class) followed by its CANCEL and an
+  // unrelated in-dialog request (in the highest priority class).  Items
+  // with different keys still jump ahead, but the CANCEL isn't popped
+  // before its INVITE.
+  EXPECT_TRUE(_q->push(1, 1, false, 42));
+  EXPECT_TRUE(_q->push(2, 0, false, 42));
+  EXPECT_TRUE(_q->push(3, 0, false, 43));
+
+  int item;
+  EXPECT_TRUE(_q->pop(item)); EXPECT_EQ(3, item);
+  EXPECT_TRUE(_q->pop(item)); EXPECT_EQ(1, item);
+  EXPECT_TRUE(_q->pop(item)); EXPECT_EQ(2, item);
+  EXPECT_EQ(0, _q->size());
+  EXPECT_TRUE(_q->_keys.empty());
+
+  // Items put back at the front of the queue stay ahead of later items with
+  // the same key.
+  EXPECT_TRUE(_q->push(4, 1, false, 42));
+  std::vector<int> items;
+  EXPECT_EQ(1u, _q->pop_batch(items, 1));
+  EXPECT_TRUE(_q->push(5, 0, false, 42));
+  EXPECT_TRUE(_q->push_front(items[0], 1, 42));
+  EXPECT_TRUE(_q->pop(item)); EXPECT_EQ(4, item);
+  EXPECT_TRUE(_q->pop(item)); EXPECT_EQ(5, item);
+}
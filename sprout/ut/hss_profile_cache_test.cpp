@@ -0,0 +1,237 @@
+/**
+ * @file hss_profile_cache_test.cpp UT for the HSS subscriber profile cache.
+ *
+ * Project Clearwater - IMS in the Cloud
+ * Copyright (C) 2014  Metaswitch Networks Ltd
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or (at your
+ * option) any later version, along with the "Special Exception" for use of
+ * the program along with SSL, set forth below. This program is distributed
+ * in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+ * without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details. You should have received a copy of the GNU General Public
+ * License along with this program.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ *
+ * The author can be reached by email at clearwater@metaswitch.com or by
+ * post at Metaswitch Networks Ltd, 100 Church St, Enfield EN2 6BQ, UK
+ *
+ * Special Exception
+ * Metaswitch Networks Ltd  grants you permission to copy, modify,
+ * propagate, and distribute a work formed by combining OpenSSL with The
+ * Software, or a work derivative of such a combination, even if such
+ * copying, modification, propagation, or distribution would otherwise
+ * violate the terms of the GPL. You must comply with the GPL in all
+ * respects for all of the code used other than OpenSSL.
+ * "OpenSSL" means OpenSSL toolkit software distributed by the OpenSSL
+ * Project and licensed under the OpenSSL Licenses, or a work based on such
+ * software and licensed under the OpenSSL Licenses.
+ * "OpenSSL Licenses" means the OpenSSL License and Original SSLeay License
+ * under which the OpenSSL Project distributes the OpenSSL toolkit software,
+ * as those licenses appear in the file LICENSE-OPENSSL.
+ */
+
+///
+///----------------------------------------------------------------------------
+#include "gtest/gtest.h"
+
+#include "basetest.hpp"
+#include "test_interposer.hpp"
+#include "hssconnection.h"
+#include "hss_profile_cache.h"
+
+using namespace std;
+
+/// Fixture for HSSProfileCacheTest.  Time is frozen so entries only become
+/// stale when the test advances time.  Entries can be extended to last up
+/// to 5 minutes.  The behaviour common to all the
+/// caches is tested by ShardedLRUCacheTest.
+class HSSProfileCacheTest : public BaseTest
+{
+  HSSProfileCache* _cache;
+
+  HSSProfileCacheTest()
+  {
+    cwtest_completely_control_time();
+    _cache = new HSSProfileCache(100, 30000, 300000, NULL);
+  }
+
+  virtual ~HSSProfileCacheTest()
+  {
+    delete _cache; _cache = NULL;
+    cwtest_reset_time();
+  }
+
+  /// Builds a profile for an implicit registration set.
+  HSSProfileCache::Profile build_profile(const std::string& regstate,
+                                         const std::vector<std::string>& uris)
+  {
+    HSSProfileCache::Profile profile;
+    profile.regstate = regstate;
+    profile.associated_uris = uris;
+    profile.ccfs.push_back("ccf1");
+    for (std::vector<std::string>::const_iterator i = uris.begin();
+         i != uris.end();
+         ++i)
+    {
+      profile.ifcs_map[*i] = Ifcs();
+    }
+    return profile;
+  }
+};
+
+TEST_F(HSSProfileCacheTest, HitAndStale)
+{
+  HSSProfileCache::Profile profile;
+  uint64_t generation;
+  EXPECT_FALSE(_cache->get("sip:6505550231@homedomain", false, profile, generation));
+
+  _cache->put("sip:6505550231@homedomain",
+              build_profile(HSSConnection::STATE_REGISTERED, {"sip:6505550231@homedomain"}),
+              generation);
+
+  ASSERT_TRUE(_cache->get("sip:6505550231@homedomain", false, profile, generation));
+  EXPECT_EQ(HSSConnection::STATE_REGISTERED, profile.regstate);
+  ASSERT_EQ(1u, profile.associated_uris.size());
+  EXPECT_EQ("sip:6505550231@homedomain", profile.associated_uris[0]);
+  EXPECT_EQ(1u, profile.ifcs_map.size());
+  ASSERT_EQ(1u, profile.ccfs.size());
+  EXPECT_EQ("ccf1", profile.ccfs[0]);
+
+  // The entry can't be used once it is older than the TTL.
+  cwtest_advance_time_ms(30001);
+  EXPECT_FALSE(_cache->get("sip:6505550231@homedomain", false, profile, generation));
+}
+
+TEST_F(HSSProfileCacheTest, RegisteredOnly)
+{
+  HSSProfileCache::Profile profile;
+  uint64_t generation;
+  _cache->get("sip:6505550231@homedomain", false, profile, generation);
+  _cache->put("sip:6505550231@homedomain",
+              build_profile(HSSConnection::STATE_NOT_REGISTERED, {}),
+              generation);
+
+  // Profiles for subscribers that aren't registered are only used if asked.
+  EXPECT_FALSE(_cache->get("sip:6505550231@homedomain", true, profile, generation));
+  ASSERT_TRUE(_cache->get("sip:6505550231@homedomain", false, profile, generation));
+  EXPECT_EQ(HSSConnection::STATE_NOT_REGISTERED, profile.regstate);
+}
+
+TEST_F(HSSProfileCacheTest, Invalidate)
+{
+  HSSProfileCache::Profile profile;
+  HSSProfileCache::Profile profile1 =
+    build_profile(HSSConnection::STATE_REGISTERED,
+                  {"sip:6505550231@homedomain", "tel:6505550231"});
+  HSSProfileCache::Profile profile2 =
+    build_profile(HSSConnection::STATE_REGISTERED, {"sip:6505550232@homedomain"});
+  uint64_t generation;
+
+  _cache->get("sip:6505550231@homedomain", false, profile, generation);
+  _cache->put("sip:6505550231@homedomain", profile1, generation);
+  _cache->get("tel:6505550231", false, profile, generation);
+  _cache->put("tel:6505550231", profile1, generation);
+  _cache->get("sip:6505550232@homedomain", false, profile, generation);
+  _cache->put("sip:6505550232@homedomain", profile2, generation);
+
+  // Invalidating an identity also invalidates the rest of its implicit
+  // registration set, but not other subscribers.
+  generation = _cache->invalidate("sip:6505550231@homedomain");
+  EXPECT_FALSE(_cache->get("sip:6505550231@homedomain", false, profile, generation));
+  EXPECT_FALSE(_cache->get("tel:6505550231", false, profile, generation));
+  EXPECT_TRUE(_cache->get("sip:6505550232@homedomain", false, profile, generation));
+
+  // The new profile can be cached using the generation returned.
+  generation = _cache->invalidate("sip:6505550231@homedomain");
+  _cache->put("sip:6505550231@homedomain", profile1, generation);
+  EXPECT_TRUE(_cache->get("sip:6505550231@homedomain", false, profile, generation));
+
+  // A profile read before an invalidation isn't cached after it.
+  _cache->get("tel:6505550231", false, profile, generation);
+  _cache->invalidate("tel:6505550231");
+  _cache->put("tel:6505550231", profile1, generation);
+  EXPECT_FALSE(_cache->get("tel:6505550231", false, profile, generation));
+}
+
+TEST_F(HSSProfileCacheTest, PutSetAndExtend)
+{
+  std::vector<std::string> impus = {"sip:6505550231@homedomain", "tel:6505550231"};
+  HSSProfileCache::Profile profile;
+  uint64_t generation;
+  uint64_t reg_generation;
+
+  // A profile read at REGISTER time is cached for every identity in the set.
+  reg_generation = _cache->invalidate("sip:6505550231@homedomain");
+  _cache->put_set(impus, build_profile(HSSConnection::STATE_REGISTERED, impus), reg_generation);
+  EXPECT_TRUE(_cache->get("sip:6505550231@homedomain", true, profile, generation));
+  EXPECT_TRUE(_cache->get("tel:6505550231", true, profile, generation));
+
+  // Extending the entries keeps them for as long as the registration lasts.
+  _cache->extend(impus, 60000, reg_generation);
+  cwtest_advance_time_ms(30001);
+  EXPECT_TRUE(_cache->get("sip:6505550231@homedomain", true, profile, generation));
+  EXPECT_TRUE(_cache->get("tel:6505550231", true, profile, generation));
+  cwtest_advance_time_ms(30000);
+  EXPECT_FALSE(_cache->get("sip:6505550231@homedomain", true, profile, generation));
+  EXPECT_FALSE(_cache->get("tel:6505550231", true, profile, generation));
+
+  // Extending doesn't create entries that aren't cached.
+  _cache->extend(impus, 60000, reg_generation);
+  EXPECT_FALSE(_cache->get("sip:6505550231@homedomain", true, profile, generation));
+
+  // A set read before one of its identities was invalidated isn't cached
+  // for that identity after it, but is cached for the others.
+  generation = _cache->invalidate("sip:6505550231@homedomain");
+  _cache->invalidate("tel:6505550231");
+  _cache->put_set(impus, build_profile(HSSConnection::STATE_REGISTERED, impus), generation);
+  EXPECT_FALSE(_cache->get("tel:6505550231", true, profile, generation));
+  EXPECT_TRUE(_cache->get("sip:6505550231@homedomain", true, profile, generation));
+}
+
+TEST_F(HSSProfileCacheTest, ExtendCapped)
+{
+  std::vector<std::string> impus = {"sip:6505550231@homedomain"};
+  HSSProfileCache::Profile profile;
+  uint64_t generation;
+
+  // Profiles are only kept for up to the maximum TTL, however long the
+  // registration lasts, so changes made elsewhere are seen within that time.
+  generation = _cache->invalidate("sip:6505550231@homedomain");
+  _cache->put_set(impus, build_profile(HSSConnection::STATE_REGISTERED, impus), generation);
+  _cache->extend(impus, 3600000, generation);
+  cwtest_advance_time_ms(300000);
+  EXPECT_TRUE(_cache->get("sip:6505550231@homedomain", true, profile, generation));
+  cwtest_advance_time_ms(1);
+  EXPECT_FALSE(_cache->get("sip:6505550231@homedomain", true, profile, generation));
+}
+
+TEST_F(HSSProfileCacheTest, ExtendRacesWithChange)
+{
+  std::vector<std::string> impus = {"sip:6505550231@homedomain", "tel:6505550231"};
+  HSSProfileCache::Profile profile;
+  uint64_t generation;
+  uint64_t reg_generation;
+
+  // A REGISTER caches the profile for the set.
+  reg_generation = _cache->invalidate("sip:6505550231@homedomain");
+  _cache->put_set(impus, build_profile(HSSConnection::STATE_REGISTERED, impus), reg_generation);
+
+  // Before the registrar extends the entries, the subscriber is deregistered
+  // and a lookup caches the new profile for one of the identities.
+  _cache->invalidate("sip:6505550231@homedomain");
+  _cache->get("sip:6505550231@homedomain", false, profile, generation);
+  _cache->put("sip:6505550231@homedomain",
+              build_profile(HSSConnection::STATE_NOT_REGISTERED, impus),
+              generation);
+
+  // The registrar's extension doesn't apply to the new profile, which
+  // expires as normal.
+  _cache->extend(impus, 60000, reg_generation);
+  cwtest_advance_time_ms(30001);
+  EXPECT_FALSE(_cache->get("sip:6505550231@homedomain", false, profile, generation));
+  EXPECT_FALSE(_cache->get("tel:6505550231", false, profile, generation));
+}
@@ -55,10 +55,12 @@ class HssConnectionTest : public BaseTest
 {
   FakeHttpResolver _resolver;
   HSSConnection _hss;
+  HSSConnection _cached_hss;
 
   HssConnectionTest() :
     _resolver("10.42.42.42"),
-    _hss("narcissus", &_resolver, NULL, NULL)
+    _hss("narcissus", &_resolver, NULL, NULL),
+    _cached_hss("narcissus", &_resolver, NULL, NULL, 100, 30000, 300000)
   {
     fakecurl_responses.clear();
     fakecurl_responses_with_body[std::make_pair("http://10.42.42.42:80/impu/pubid42/reg-data", "{\"reqtype\": \"reg\"}")] =
@@ -225,6 +227,65 @@ TEST_F(HssConnectionTest, SimpleNotRegisteredUpdate)
   EXPECT_EQ("NOT_REGISTERED", regstate);
 }
 
+TEST_F(HssConnectionTest, CachedProfile)
+{
+  std::vector<std::string> uris;
+  std::map<std::string, Ifcs> ifcs_map;
+  std::string regstate;
+  EXPECT_EQ(HTTP_OK, _cached_hss.update_registration_state("pubid42", "", HSSConnection::REG, regstate, ifcs_map, uris, 0));
+
+  // Homestead is no longer needed for calls to or lookups of the subscriber.
+  fakecurl_responses_with_body[std::make_pair("http://10.42.42.42:80/impu/pubid42/reg-data", "")] = CURLE_REMOTE_FILE_NOT_FOUND;
+  uris.clear();
+  ifcs_map.clear();
+  regstate = "";
+  EXPECT_EQ(HTTP_OK, _cached_hss.update_registration_state("pubid42", "", HSSConnection::CALL, regstate, ifcs_map, uris, 0));
+  EXPECT_EQ("REGISTERED", regstate);
+  ASSERT_EQ(2u, uris.size());
+  EXPECT_EQ("sip:123@example.com", uris[0]);
+  EXPECT_FALSE(ifcs_map.empty());
+
+  uris.clear();
+  EXPECT_EQ(HTTP_OK, _cached_hss.get_registration_data("pubid42", regstate, ifcs_map, uris, 0));
+  EXPECT_EQ(2u, uris.size());
+
+  // Once the profile is invalidated Homestead is queried again.
+  _cached_hss.invalidate_cached_profile("pubid42");
+  EXPECT_NE(HTTP_OK, _cached_hss.get_registration_data("pubid42", regstate, ifcs_map, uris, 0));
+}
+
+TEST_F(HssConnectionTest, CachedProfileDeregistration)
+{
+  std::vector<std::string> uris;
+  std::map<std::string, Ifcs> ifcs_map;
+  std::string regstate;
+  EXPECT_EQ(HTTP_OK, _cached_hss.get_registration_data("pubid42", regstate, ifcs_map, uris, 0));
+
+  // Deregistering the subscriber invalidates the cached profile, even if the
+  // request fails.
+  fakecurl_responses_with_body[std::make_pair("http://10.42.42.42:80/impu/pubid42/reg-data", "")] = CURLE_REMOTE_FILE_NOT_FOUND;
+  fakecurl_responses_with_body[std::make_pair("http://10.42.42.42:80/impu/pubid42/reg-data", "{\"reqtype\": \"dereg-user\"}")] = CURLE_REMOTE_FILE_NOT_FOUND;
+  _cached_hss.update_registration_state("pubid42", "", HSSConnection::DEREG_USER, 0);
+  EXPECT_NE(HTTP_OK, _cached_hss.get_registration_data("pubid42", regstate, ifcs_map, uris, 0));
+}
+
+TEST_F(HssConnectionTest, CachedProfileUnregistered)
+{
+  std::vector<std::string> uris;
+  std::map<std::string, Ifcs> ifcs_map;
+  std::string regstate;
+  EXPECT_EQ(HTTP_OK, _cached_hss.update_registration_state("pubid50", "", HSSConnection::CALL, regstate, ifcs_map, uris, 0));
+  EXPECT_EQ("UNREGISTERED", regstate);
+
+  // The profile is used for lookups, but calls still go to Homestead as they
+  // may change the registration state.
+  fakecurl_responses_with_body[std::make_pair("http://10.42.42.42:80/impu/pubid50/reg-data", "{\"reqtype\": \"call\"}")] = CURLE_REMOTE_FILE_NOT_FOUND;
+  regstate = "";
+  EXPECT_EQ(HTTP_OK, _cached_hss.get_registration_data("pubid50", regstate, ifcs_map, uris, 0));
+  EXPECT_EQ("UNREGISTERED", regstate);
+  EXPECT_NE(HTTP_OK, _cached_hss.update_registration_state("pubid50", "", HSSConnection::CALL, regstate, ifcs_map, uris, 0));
+}
+
 TEST_F(HssConnectionTest, SimpleIfc)
 {
   std::vector<std::string> uris;
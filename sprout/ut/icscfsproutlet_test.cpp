@@ -45,6 +45,9 @@
 #include "utils.h"
 #include "test_utils.hpp"
 #include "icscfsproutlet.h"
+#include "scscf_assignment_cache.h"
+#include "sproutsasevent.h"
+#include "mock_sas.h"
 #include "fakehssconnection.hpp"
 #include "test_interposer.hpp"
 #include "sproutletproxy.h"
@@ -56,6 +59,49 @@ using testing::MatchesRegex;
 using testing::HasSubstr;
 using testing::Not;
 
+/// ACR that counts the ACRs sent before the request is forwarded, which are
+/// the ACRs generated on completion of a Cx query.
+class CxQueryCountingACR : public ACR
+{
+public:
+  CxQueryCountingACR(int* cx_query_acrs) :
+    _cx_query_acrs(cx_query_acrs),
+    _forwarded(false)
+  {
+  }
+
+  virtual void tx_request(pjsip_msg* req, pj_time_val timestamp=unspec)
+  {
+    _forwarded = true;
+  }
+
+  virtual void send_message(pj_time_val timestamp=unspec)
+  {
+    if (!_forwarded)
+    {
+      (*_cx_query_acrs)++;
+    }
+  }
+
+private:
+  int* _cx_query_acrs;
+  bool _forwarded;
+};
+
+/// Factory for CxQueryCountingACRs.
+class CxQueryCountingACRFactory : public ACRFactory
+{
+public:
+  CxQueryCountingACRFactory() : cx_query_acrs(0) {}
+
+  virtual ACR* get_acr(SAS::TrailId trail, Initiator initiator, NodeRole role)
+  {
+    return new CxQueryCountingACR(&cx_query_acrs);
+  }
+
+  int cx_query_acrs;
+};
+
 /// ABC for fixtures for ICSCFSproutletTest.
 class ICSCFSproutletTestBase : public SipTest
 {
@@ -64,13 +110,15 @@ public:
   /// forked flow has its URI stored in _uris, and its txdata stored
   /// in _tdata against that URI.
 
-  /// Set up test case.  Caller must clear host_mapping.
-  static void SetUpTestCase()
+  /// Set up test case.  Caller must clear host_mapping.  HSS query results
+  /// are cached in scscf_assignment_cache, if set.
+  static void SetUpTestCase(SCSCFAssignmentCache* scscf_assignment_cache = NULL)
   {
     SipTest::SetUpTestCase(false);
 
     _hss_connection = new FakeHSSConnection();
-    _acr_factory = new ACRFactory();
+    _acr_factory = new CxQueryCountingACRFactory();
+    _scscf_assignment_cache = scscf_assignment_cache;
     _scscf_selector = new SCSCFSelector(string(UT_DIR).append("/test_icscf.json"));
     _enum_service = new JSONEnumService(string(UT_DIR).append("/test_enum.json"));
 
@@ -80,7 +128,8 @@ public:
                                           _scscf_selector,
                                           _enum_service,
                                           true,
-                                          false);
+                                          false,
+                                          _scscf_assignment_cache);
     std::list<Sproutlet*> sproutlets;
     sproutlets.push_back(_icscf_sproutlet);
 
@@ -105,6 +154,7 @@ public:
     delete _acr_factory; _acr_factory = NULL;
     delete _hss_connection; _hss_connection = NULL;
     delete _scscf_selector; _scscf_selector = NULL;
+    delete _scscf_assignment_cache; _scscf_assignment_cache = NULL;
     SipTest::TearDownTestCase();
   }
 
@@ -288,18 +338,20 @@ public:
 
 
 protected:
-  static ACRFactory* _acr_factory;
+  static CxQueryCountingACRFactory* _acr_factory;
   static FakeHSSConnection* _hss_connection;
   static SCSCFSelector* _scscf_selector;
+  static SCSCFAssignmentCache* _scscf_assignment_cache;
   static JSONEnumService* _enum_service;
   static Sproutlet* _icscf_sproutlet;
   static SproutletProxy* _icscf_proxy;
 
 };
 
-ACRFactory* ICSCFSproutletTestBase::_acr_factory;
+CxQueryCountingACRFactory* ICSCFSproutletTestBase::_acr_factory;
 FakeHSSConnection* ICSCFSproutletTestBase::_hss_connection;
 SCSCFSelector* ICSCFSproutletTestBase::_scscf_selector;
+SCSCFAssignmentCache* ICSCFSproutletTestBase::_scscf_assignment_cache;
 JSONEnumService* ICSCFSproutletTestBase::_enum_service;
 Sproutlet* ICSCFSproutletTestBase::_icscf_sproutlet;
 SproutletProxy* ICSCFSproutletTestBase::_icscf_proxy;
@@ -2737,3 +2789,326 @@ TEST_F(ICSCFSproutletTest, RouteOrigInviteBadServerName)
 
   delete tp;
 }
+
+
+/// Fixture for I-CSCF tests that cache the results of HSS queries.
+class ICSCFSproutletCacheTest : public ICSCFSproutletTestBase
+{
+public:
+  static void SetUpTestCase()
+  {
+    ICSCFSproutletTestBase::SetUpTestCase(new SCSCFAssignmentCache(100, 30000, NULL));
+
+    // Set up DNS mappings for some S-CSCFs.
+    add_host_mapping("scscf1.homedomain", "10.10.10.1");
+    add_host_mapping("scscf2.homedomain", "10.10.10.2");
+    add_host_mapping("scscf3.homedomain", "10.10.10.3");
+    add_host_mapping("scscf4.homedomain", "10.10.10.4");
+    add_host_mapping("scscf5.homedomain", "10.10.10.5");
+  }
+
+  static void TearDownTestCase()
+  {
+    ICSCFSproutletTestBase::TearDownTestCase();
+  }
+
+  ICSCFSproutletCacheTest()
+  {
+  }
+
+  ~ICSCFSproutletCacheTest()
+  {
+  }
+
+protected:
+  /// Injects a terminating INVITE to 6505551234, and checks that it is
+  /// forwarded to the S-CSCF at scscf_ip.  The INVITE is left in the
+  /// current txdata.
+  void inject_term_invite(TransportFlow* tp, const char* scscf_ip)
+  {
+    Message msg;
+    msg._method = "INVITE";
+    msg._via = tp->to_string(false);
+    msg._extra = "Contact: sip:6505551000@" +
+                 tp->to_string(true) +
+                 ";ob;expires=300;+sip.ice;reg-id=1;+sip.instance=\"<urn:uuid:00000000-0000-0000-0000-b665231f1213>\"\r\n";
+    msg._extra += "P-Served-User: <sip:6505551000@homedomain>";
+    msg._route = "Route: <sip:homedomain>";
+    inject_msg(msg.get_request(), tp);
+
+    // Expecting 100 Trying and forwarded INVITE.
+    ASSERT_EQ(2, txdata_count());
+    pjsip_tx_data* tdata = current_txdata();
+    RespMatcher(100).matches(tdata->msg);
+    tp->expect_target(tdata);
+    free_txdata();
+
+    tdata = current_txdata();
+    expect_target("TCP", scscf_ip, 5058, tdata);
+    ReqMatcher("INVITE").matches(tdata->msg);
+  }
+
+  /// Answers the INVITE in the current txdata, and checks the answer is
+  /// forwarded back to the source.
+  void answer_invite(TransportFlow* tp)
+  {
+    inject_msg(respond_to_current_txdata(200));
+    ASSERT_EQ(1, txdata_count());
+    pjsip_tx_data* tdata = current_txdata();
+    tp->expect_target(tdata);
+    RespMatcher(200).matches(tdata->msg);
+    free_txdata();
+  }
+
+  /// Returns the S-CSCF named by the HSS in the cached result of a query,
+  /// or an empty string if the result isn't cached.
+  std::string cached_scscf(const std::string& key)
+  {
+    SCSCFAssignmentCache::Assignment assignment;
+    uint64_t generation;
+    return (_scscf_assignment_cache->get(key, assignment, generation)) ?
+             assignment.caps.scscf : "";
+  }
+
+  /// Returns the S-CSCF cached as selected using the capabilities in the
+  /// result of a query, or an empty string if there isn't one.
+  std::string cached_selected_scscf(const std::string& key)
+  {
+    SCSCFAssignmentCache::Assignment assignment;
+    uint64_t generation;
+    return (_scscf_assignment_cache->get(key, assignment, generation)) ?
+             assignment.selected_scscf : "";
+  }
+};
+
+
+TEST_F(ICSCFSproutletCacheTest, CacheHitSkipsLIR)
+{
+  // Create a TCP connection to the I-CSCF listening port.
+  TransportFlow* tp = new TransportFlow(TransportFlow::Protocol::TCP,
+                                        stack_data.icscf_port,
+                                        "1.2.3.4",
+                                        49152);
+
+  // Set up the HSS response for the terminating location query.
+  _hss_connection->set_result("/impu/sip%3A6505551234%40homedomain/location",
+                              "{\"result-code\": 2001,"
+                              " \"scscf\": \"sip:scscf1.homedomain:5058;transport=TCP\"}");
+
+  // The first INVITE is routed using an LIR, and an ACR is sent for the Cx
+  // query.
+  int cx_query_acrs = _acr_factory->cx_query_acrs;
+  inject_term_invite(tp, "10.10.10.1");
+  EXPECT_TRUE(_hss_connection->url_was_requested("/impu/sip%3A6505551234%40homedomain/location", ""));
+  EXPECT_EQ(cx_query_acrs + 1, _acr_factory->cx_query_acrs);
+  answer_invite(tp);
+
+  // The second INVITE is routed to the same S-CSCF using the cached result,
+  // without an LIR, so no ACR is sent for a Cx query.
+  _hss_connection->_calls.clear();
+  cx_query_acrs = _acr_factory->cx_query_acrs;
+  inject_term_invite(tp, "10.10.10.1");
+  EXPECT_FALSE(_hss_connection->url_was_requested("/impu/sip%3A6505551234%40homedomain/location", ""));
+  EXPECT_EQ(cx_query_acrs, _acr_factory->cx_query_acrs);
+  answer_invite(tp);
+
+  _hss_connection->delete_result("/impu/sip%3A6505551234%40homedomain/location");
+
+  delete tp;
+}
+
+
+TEST_F(ICSCFSproutletCacheTest, CacheSelectedSCSCF)
+{
+  // Create a TCP connection to the I-CSCF listening port.
+  TransportFlow* tp = new TransportFlow(TransportFlow::Protocol::TCP,
+                                        stack_data.icscf_port,
+                                        "1.2.3.4",
+                                        49152);
+
+  // Set up the HSS response for the terminating location query, which
+  // returns capabilities.
+  _hss_connection->set_result("/impu/sip%3A6505551234%40homedomain/location",
+                              "{\"result-code\": 2001,"
+                              " \"mandatory-capabilities\": [567],"
+                              " \"optional-capabilities\": [789, 567]}");
+
+  // The S-CSCF selected from the capabilities (scscf3) is cached, separately
+  // from the (empty) S-CSCF returned by the HSS.
+  inject_term_invite(tp, "10.10.10.3");
+  answer_invite(tp);
+  EXPECT_EQ("sip:scscf3.homedomain:5058;transport=TCP",
+            cached_selected_scscf("LIR term sip:6505551234@homedomain"));
+  EXPECT_EQ("", cached_scscf("LIR term sip:6505551234@homedomain"));
+
+  // Later INVITEs are routed to the same S-CSCF without an LIR, and SAS
+  // reports it as a cached selection rather than an S-CSCF from the HSS.
+  _hss_connection->_calls.clear();
+  mock_sas_collect_messages(true);
+  inject_term_invite(tp, "10.10.10.3");
+  EXPECT_FALSE(_hss_connection->url_was_requested("/impu/sip%3A6505551234%40homedomain/location", ""));
+  MockSASMessage* event = mock_sas_find_event(SASEvent::SCSCF_SELECTION_CACHED);
+  ASSERT_TRUE(event != NULL);
+  EXPECT_EQ("sip:scscf3.homedomain:5058;transport=TCP", event->var_params[0]);
+  event = mock_sas_find_event(SASEvent::SCSCF_SELECTION_SUCCESS);
+  ASSERT_TRUE(event != NULL);
+  EXPECT_EQ("sip:scscf3.homedomain:5058;transport=TCP", event->var_params[0]);
+  EXPECT_EQ("", event->var_params[1]);
+  mock_sas_collect_messages(false);
+  answer_invite(tp);
+
+  _hss_connection->delete_result("/impu/sip%3A6505551234%40homedomain/location");
+
+  delete tp;
+}
+
+
+TEST_F(ICSCFSproutletCacheTest, CacheInvalidatedOnRetry)
+{
+  pjsip_tx_data* tdata;
+
+  // Create a TCP connection to the I-CSCF listening port.
+  TransportFlow* tp = new TransportFlow(TransportFlow::Protocol::TCP,
+                                        stack_data.icscf_port,
+                                        "1.2.3.4",
+                                        49152);
+
+  // Set up the HSS responses for the terminating location query.
+  _hss_connection->set_result("/impu/sip%3A6505551234%40homedomain/location",
+                              "{\"result-code\": 2001,"
+                              " \"scscf\": \"sip:scscf1.homedomain:5058;transport=TCP\"}");
+  _hss_connection->set_result("/impu/sip%3A6505551234%40homedomain/location?auth-type=CAPAB",
+                              "{\"result-code\": 2001,"
+                              " \"mandatory-capabilities\": [567],"
+                              " \"optional-capabilities\": [789, 567]}");
+
+  // Cache the S-CSCF named by the HSS.
+  inject_term_invite(tp, "10.10.10.1");
+  answer_invite(tp);
+
+  // The next INVITE is routed to the cached S-CSCF without an LIR.
+  _hss_connection->_calls.clear();
+  inject_term_invite(tp, "10.10.10.1");
+  EXPECT_FALSE(_hss_connection->url_was_requested("/impu/sip%3A6505551234%40homedomain/location", ""));
+
+  // Kill the TCP connection to the S-CSCF to force a retry.
+  tdata = current_txdata();
+  terminate_tcp_transport(tdata->tp_info.transport);
+  free_txdata();
+  cwtest_advance_time_ms(6000);
+  poll();
+
+  // The cached result is invalidated, and the I-CSCF queries the HSS for
+  // capabilities.  This time scscf3 is selected.
+  ASSERT_EQ(1, txdata_count());
+  tdata = current_txdata();
+  expect_target("TCP", "10.10.10.3", 5058, tdata);
+  ReqMatcher("INVITE").matches(tdata->msg);
+  EXPECT_TRUE(_hss_connection->url_was_requested("/impu/sip%3A6505551234%40homedomain/location?auth-type=CAPAB", ""));
+  answer_invite(tp);
+
+  // The newly selected S-CSCF is cached in place of the one that failed.
+  EXPECT_EQ("sip:scscf3.homedomain:5058;transport=TCP",
+            cached_selected_scscf("LIR term sip:6505551234@homedomain"));
+  _hss_connection->_calls.clear();
+  inject_term_invite(tp, "10.10.10.3");
+  EXPECT_FALSE(_hss_connection->url_was_requested("/impu/sip%3A6505551234%40homedomain/location", ""));
+  answer_invite(tp);
+
+  _hss_connection->delete_result("/impu/sip%3A6505551234%40homedomain/location");
+  _hss_connection->delete_result("/impu/sip%3A6505551234%40homedomain/location?auth-type=CAPAB");
+
+  delete tp;
+}
+
+
+TEST_F(ICSCFSproutletCacheTest, NegativeHitNotFound)
+{
+  pjsip_tx_data* tdata;
+
+  // Create a TCP connection to the I-CSCF listening port.
+  TransportFlow* tp = new TransportFlow(TransportFlow::Protocol::TCP,
+                                        stack_data.icscf_port,
+                                        "1.2.3.4",
+                                        49152);
+
+  // Don't set up the HSS response, so the originating location query
+  // returns 404.  The second INVITE is rejected using the cached result,
+  // without an LIR.
+  for (int ii = 0; ii < 2; ++ii)
+  {
+    _hss_connection->_calls.clear();
+
+    Message msg;
+    msg._method = "INVITE";
+    msg._via = tp->to_string(false);
+    msg._extra = "Contact: sip:6505551000@" +
+                 tp->to_string(true) +
+                 ";ob;expires=300;+sip.ice;reg-id=1;+sip.instance=\"<urn:uuid:00000000-0000-0000-0000-b665231f1213>\"\r\n";
+    msg._extra += "P-Served-User: <sip:6505551000@homedomain>";
+    msg._route = "Route: <sip:homedomain;orig>";
+    inject_msg(msg.get_request(), tp);
+
+    // Expecting 100 Trying and final 404 responses.
+    ASSERT_EQ(2, txdata_count());
+    tdata = current_txdata();
+    RespMatcher(100).matches(tdata->msg);
+    tp->expect_target(tdata);
+    free_txdata();
+
+    tdata = current_txdata();
+    RespMatcher(404).matches(tdata->msg);
+    tp->expect_target(tdata);
+    free_txdata();
+
+    EXPECT_EQ((ii == 0),
+              _hss_connection->url_was_requested("/impu/sip%3A6505551000%40homedomain/location?originating=true", ""));
+  }
+
+  delete tp;
+}
+
+
+TEST_F(ICSCFSproutletCacheTest, NegativeHitForbidden)
+{
+  pjsip_tx_data* tdata;
+
+  // Create a TCP connection to the I-CSCF listening port.
+  TransportFlow* tp = new TransportFlow(TransportFlow::Protocol::TCP,
+                                        stack_data.icscf_port,
+                                        "1.2.3.4",
+                                        49152);
+
+  // The user registration status query returns 403.
+  _hss_connection->set_rc("/impi/6505551000%40homedomain/registration-status?impu=sip%3A6505551000%40homedomain&visited-network=homedomain&auth-type=REG",
+                          HTTP_FORBIDDEN);
+
+  // The second REGISTER is rejected using the cached result, without a UAR.
+  for (int ii = 0; ii < 2; ++ii)
+  {
+    _hss_connection->_calls.clear();
+
+    Message msg;
+    msg._method = "REGISTER";
+    msg._requri = "sip:homedomain";
+    msg._to = msg._from;        // To header contains AoR in REGISTER requests.
+    msg._via = tp->to_string(false);
+    msg._extra = "Contact: sip:6505551000@" +
+                 tp->to_string(true) +
+                 ";ob;expires=300;+sip.ice;reg-id=1;+sip.instance=\"<urn:uuid:00000000-0000-0000-0000-b665231f1213>\"";
+    inject_msg(msg.get_request(), tp);
+
+    ASSERT_EQ(1, txdata_count());
+    tdata = current_txdata();
+    tp->expect_target(tdata);
+    RespMatcher(403).matches(tdata->msg);
+    free_txdata();
+
+    EXPECT_EQ((ii == 0),
+              _hss_connection->url_was_requested("/impi/6505551000%40homedomain/registration-status?impu=sip%3A6505551000%40homedomain&visited-network=homedomain&auth-type=REG", ""));
+  }
+
+  _hss_connection->delete_rc("/impi/6505551000%40homedomain/registration-status?impu=sip%3A6505551000%40homedomain&visited-network=homedomain&auth-type=REG");
+
+  delete tp;
+}
@@ -46,6 +46,7 @@
 #include "fakechronosconnection.hpp"
 
 #include "ifchandler.h"
+#include "xmlifc.hpp"
 
 using namespace std;
 
@@ -60,6 +61,19 @@ public:
   static IfcHandler* _ifc_handler;
   pjsip_msg* TEST_MSG;
 
+  /// An iFC document evaluated by doBaseTest, and the state of the served
+  /// user it was evaluated for.
+  struct EvaluatedIfc
+  {
+    std::string ifc;
+    const SessionCase* sescase;
+    bool reg;
+    bool initial_registration;
+  };
+
+  /// Every iFC document evaluated by the tests so far.
+  static std::vector<EvaluatedIfc> _evaluated_ifcs;
+
   static void SetUpTestCase()
   {
     SipTest::SetUpTestCase();
@@ -157,6 +171,7 @@ FakeHSSConnection* IfcHandlerTest::_hss_connection;
 LocalStore* IfcHandlerTest::_local_data_store;
 RegStore* IfcHandlerTest::_store;
 IfcHandler* IfcHandlerTest::_ifc_handler;
+std::vector<IfcHandlerTest::EvaluatedIfc> IfcHandlerTest::_evaluated_ifcs;
 
 TEST_F(IfcHandlerTest, ServedUser)
 {
@@ -243,6 +258,16 @@ void IfcHandlerTest::doBaseTest(string description,
                   msg,
                   application_servers,
                   0);
+
+  // The compiled iFCs must give the same results as walking the XML.
+  for (size_t ii = 0; ii < ifcs->size(); ++ii)
+  {
+    EXPECT_EQ(xml_filter_matches((*ifcs)[ii], sescase, reg, initial_registration, msg, 0),
+              (*ifcs)[ii].filter_matches(sescase, reg, initial_registration, msg, 0));
+  }
+  EvaluatedIfc evaluated = {ifc, &sescase, reg, initial_registration};
+  _evaluated_ifcs.push_back(evaluated);
+
   delete ifcs;
   free(cstr_ifc);
   EXPECT_EQ(expected ? 1u : 0u, application_servers.size());
@@ -2271,6 +2296,70 @@ TEST_F(IfcHandlerTest, SDPNoEqualsSign)
   EXPECT_TRUE(log.contains("Found badly formatted SDP line: einvalidline"));
 }
 
+TEST_F(IfcHandlerTest, DISABLED_EvaluationBenchmark)
+{
+  // Times the iFCs the other IfcHandlerTest cases evaluated, walking the XML
+  // and running the compiled form, against this fixture's INVITE.  It needs
+  // those cases to have run first, so is only run on request (with
+  // --gtest_also_run_disabled_tests) and its mean times per iFC are written
+  // to the XML report.
+  ASSERT_FALSE(_evaluated_ifcs.empty()) << "Run with the other IfcHandlerTest cases";
+
+  std::vector<char*> cstrs;
+  std::vector<Ifcs*> ifcs;
+  size_t num_ifcs = 0;
+  for (size_t ii = 0; ii < _evaluated_ifcs.size(); ++ii)
+  {
+    std::shared_ptr<rapidxml::xml_document<> > root(new rapidxml::xml_document<>);
+    char* cstr_ifc = strdup(_evaluated_ifcs[ii].ifc.c_str());
+    root->parse<0>(cstr_ifc);
+    cstrs.push_back(cstr_ifc);
+    ifcs.push_back(new Ifcs(root, root->first_node("ServiceProfile")));
+    num_ifcs += ifcs.back()->size();
+  }
+  ASSERT_LT(0u, num_ifcs);
+
+  int iterations = 100;
+  unsigned long elapsed_us[2];
+  int matches[2];
+
+  for (int compiled = 0; compiled <= 1; ++compiled)
+  {
+    matches[compiled] = 0;
+    Utils::StopWatch stop_watch;
+    stop_watch.start();
+
+    for (int jj = 0; jj < iterations; ++jj)
+    {
+      for (size_t kk = 0; kk < ifcs.size(); ++kk)
+      {
+        const EvaluatedIfc& e = _evaluated_ifcs[kk];
+        for (size_t ll = 0; ll < ifcs[kk]->size(); ++ll)
+        {
+          const Ifc& ifc = (*ifcs[kk])[ll];
+          bool match = (compiled) ?
+            ifc.filter_matches(*e.sescase, e.reg, e.initial_registration, TEST_MSG, 0) :
+            xml_filter_matches(ifc, *e.sescase, e.reg, e.initial_registration, TEST_MSG, 0);
+          matches[compiled] += (match) ? 1 : 0;
+        }
+      }
+    }
+
+    stop_watch.read(elapsed_us[compiled]);
+  }
+
+  for (size_t ii = 0; ii < ifcs.size(); ++ii)
+  {
+    delete ifcs[ii];
+    free(cstrs[ii]);
+  }
+
+  EXPECT_EQ(matches[0], matches[1]);
+  RecordProperty("ifcs", (int)num_ifcs);
+  RecordProperty("xml_ns", (int)(elapsed_us[0] * 1000 / (iterations * num_ifcs)));
+  RecordProperty("compiled_ns", (int)(elapsed_us[1] * 1000 / (iterations * num_ifcs)));
+}
+
 
 // @@@ iFC XML parse error
 // @@@ lookup_ifcs gets no served user
@@ -0,0 +1,140 @@
+/**
+ * @file latency_histogram_test.cpp UT for the latency histogram class.
+ *
+ * Project Clearwater - IMS in the Cloud
+ * Copyright (C) 2014  Metaswitch Networks Ltd
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or (at your
+ * option) any later version, along with the "Special Exception" for use of
+ * the program along with SSL, set forth below. This program is distributed
+ * in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+ * without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details. You should have received a copy of the GNU General Public
+ * License along with this program.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ *
+ * The author can be reached by email at clearwater@metaswitch.com or by
+ * post at Metaswitch Networks Ltd, 100 Church St, Enfield EN2 6BQ, UK
+ *
+ * Special Exception
+ * Metaswitch Networks Ltd  grants you permission to copy, modify,
+ * propagate, and distribute a work formed by combining OpenSSL with The
+ * Software, or a work derivative of such a combination, even if such
+ * copying, modification, propagation, or distribution would otherwise
+ * violate the terms of the GPL. You must comply with the GPL in all
+ * respects for all of the code used other than OpenSSL.
+ * "OpenSSL" means OpenSSL toolkit software distributed by the OpenSSL
+ * Project and licensed under the OpenSSL Licenses, or a work based on such
+ * software and licensed under the OpenSSL Licenses.
+ * "OpenSSL Licenses" means the OpenSSL License and Original SSLeay License
+ * under which the OpenSSL Project distributes the OpenSSL toolkit software,
+ * as those licenses appear in the file LICENSE-OPENSSL.
+ */
+
+///
+///----------------------------------------------------------------------------
+
+#include <string>
+#include <vector>
+#include "gtest/gtest.h"
+
+#include "basetest.hpp"
+#include "latency_histogram.h"
+
+using namespace std;
+
+/// Fixture for LatencyHistogramTest.
+class LatencyHistogramTest : public BaseTest
+{
+  LatencyHistogram _histogram;
+
+  LatencyHistogramTest()
+  {
+  }
+
+  virtual ~LatencyHistogramTest()
+  {
+  }
+};
+
+TEST_F(LatencyHistogramTest, NoSamples)
+{
+  std::vector<uint_fast64_t> counts;
+  _histogram.snapshot(counts);
+  EXPECT_EQ((uint_fast64_t)0, LatencyHistogram::total(counts));
+  EXPECT_EQ(0ul, LatencyHistogram::percentile(counts, 0.5));
+  EXPECT_EQ(0ul, LatencyHistogram::percentile(counts, 0.999));
+}
+
+TEST_F(LatencyHistogramTest, SmallValuesExact)
+{
+  for (unsigned long ii = 0; ii < 10; ++ii)
+  {
+    _histogram.record(ii);
+  }
+
+  std::vector<uint_fast64_t> counts;
+  _histogram.snapshot(counts);
+  EXPECT_EQ((uint_fast64_t)10, LatencyHistogram::total(counts));
+  EXPECT_EQ(4ul, LatencyHistogram::percentile(counts, 0.5));
+  EXPECT_EQ(8ul, LatencyHistogram::percentile(counts, 0.9));
+  EXPECT_EQ(9ul, LatencyHistogram::percentile(counts, 0.99));
+}
+
+TEST_F(LatencyHistogramTest, Accuracy)
+{
+  // Every estimate is at least the true value and within 25% of it.
+  for (unsigned long value = 16; value < 10000000; value = value * 3 / 2)
+  {
+    LatencyHistogram histogram;
+    histogram.record(value);
+    std::vector<uint_fast64_t> counts;
+    histogram.snapshot(counts);
+    unsigned long estimate = LatencyHistogram::percentile(counts, 0.5);
+    EXPECT_LE(value, estimate);
+    EXPECT_GE(value + value / 4, estimate);
+  }
+}
+
+TEST_F(LatencyHistogramTest, Percentiles)
+{
+  for (unsigned long ii = 1; ii <= 1000; ++ii)
+  {
+    _histogram.record(ii * 100);
+  }
+
+  std::vector<uint_fast64_t> counts;
+  _histogram.snapshot(counts);
+  EXPECT_EQ((uint_fast64_t)1000, LatencyHistogram::total(counts));
+  EXPECT_EQ(57343ul, LatencyHistogram::percentile(counts, 0.5));
+  EXPECT_EQ(98303ul, LatencyHistogram::percentile(counts, 0.9));
+  EXPECT_EQ(114687ul, LatencyHistogram::percentile(counts, 0.99));
+}
+
+TEST_F(LatencyHistogramTest, SnapshotResets)
+{
+  _histogram.record(1000);
+  std::vector<uint_fast64_t> counts;
+  _histogram.snapshot(counts);
+  EXPECT_EQ((uint_fast64_t)1, LatencyHistogram::total(counts));
+  _histogram.snapshot(counts);
+  EXPECT_EQ((uint_fast64_t)0, LatencyHistogram::total(counts));
+}
+
+TEST_F(LatencyHistogramTest, Report)
+{
+  _histogram.record(5);
+  _histogram.record(5);
+
+  std::vector<std::string> values;
+  values.push_back("INVITE");
+  _histogram.report(values);
+  ASSERT_EQ(6u, values.size());
+  EXPECT_EQ("INVITE", values[0]);
+  EXPECT_EQ("2", values[1]);
+  EXPECT_EQ("5", values[2]);
+  EXPECT_EQ("5", values[5]);
+}
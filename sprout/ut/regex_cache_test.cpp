@@ -0,0 +1,131 @@
+/**
+ * @file regex_cache_test.cpp UT for the cache of compiled regular expressions.
+ *
+ * Project Clearwater - IMS in the Cloud
+ * Copyright (C) 2014  Metaswitch Networks Ltd
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or (at your
+ * option) any later version, along with the "Special Exception" for use of
+ * the program along with SSL, set forth below. This program is distributed
+ * in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+ * without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details. You should have received a copy of the GNU General Public
+ * License along with this program.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ *
+ * The author can be reached by email at clearwater@metaswitch.com or by
+ * post at Metaswitch Networks Ltd, 100 Church St, Enfield EN2 6BQ, UK
+ *
+ * Special Exception
+ * Metaswitch Networks Ltd  grants you permission to copy, modify,
+ * propagate, and distribute a work formed by combining OpenSSL with The
+ * Software, or a work derivative of such a combination, even if such
+ * copying, modification, propagation, or distribution would otherwise
+ * violate the terms of the GPL. You must comply with the GPL in all
+ * respects for all of the code used other than OpenSSL.
+ * "OpenSSL" means OpenSSL toolkit software distributed by the OpenSSL
+ * Project and licensed under the OpenSSL Licenses, or a work based on such
+ * software and licensed under the OpenSSL Licenses.
+ * "OpenSSL Licenses" means the OpenSSL License and Original SSLeay License
+ * under which the OpenSSL Project distributes the OpenSSL toolkit software,
+ * as those licenses appear in the file LICENSE-OPENSSL.
+ */
+
+///
+///----------------------------------------------------------------------------
+#include "gtest/gtest.h"
+
+#include "basetest.hpp"
+#include "test_interposer.hpp"
+#include "regex_cache.h"
+
+using namespace std;
+
+/// Fixture for RegexCacheTest.  The behaviour common to all the caches is
+/// tested by ShardedLRUCacheTest.
+class RegexCacheTest : public BaseTest
+{
+  RegexCache* _cache;
+
+  RegexCacheTest()
+  {
+    _cache = new RegexCache(100, NULL);
+  }
+
+  virtual ~RegexCacheTest()
+  {
+    RegexCache::set_instance(NULL);
+    delete _cache; _cache = NULL;
+  }
+};
+
+TEST_F(RegexCacheTest, Hit)
+{
+  RegexCache::Regex regex = _cache->get("^sip:[0-9]+@");
+  ASSERT_TRUE(regex != NULL);
+  EXPECT_TRUE(boost::regex_search(std::string("sip:6505550231@homedomain"), *regex));
+  EXPECT_FALSE(boost::regex_search(std::string("sip:alice@homedomain"), *regex));
+
+  // The same expression is returned for the same pattern.
+  EXPECT_EQ(regex, _cache->get("^sip:[0-9]+@"));
+  EXPECT_EQ(1u, _cache->_cache._hits);
+  EXPECT_EQ(1u, _cache->_cache._misses);
+
+  // Different flags give a different expression.
+  RegexCache::Regex icase = _cache->get("^SIP:[0-9]+@", boost::regex::icase);
+  ASSERT_TRUE(icase != NULL);
+  EXPECT_NE(regex, icase);
+  EXPECT_TRUE(boost::regex_search(std::string("sip:6505550231@homedomain"), *icase));
+  EXPECT_EQ(2u, _cache->_cache._misses);
+}
+
+TEST_F(RegexCacheTest, Invalid)
+{
+  // Invalid expressions aren't compiled again.
+  EXPECT_TRUE(_cache->get("[") == NULL);
+  EXPECT_TRUE(_cache->get("[") == NULL);
+  EXPECT_EQ(1u, _cache->_cache._hits);
+  EXPECT_EQ(1u, _cache->_cache._misses);
+  EXPECT_EQ(1u, _cache->_invalid);
+}
+
+TEST_F(RegexCacheTest, EvictedExpressionsUsable)
+{
+  // Expressions can still be used after they have been evicted.
+  RegexCache cache(1, NULL);
+  RegexCache::Regex first = cache.get("^0");
+
+  for (int ii = 1; ii < 100; ++ii)
+  {
+    cache.get("^" + std::to_string(ii));
+  }
+
+  EXPECT_NE(first, cache.get("^0"));
+  EXPECT_TRUE(boost::regex_search(std::string("0123"), *first));
+}
+
+TEST_F(RegexCacheTest, Disabled)
+{
+  RegexCache cache(0, NULL);
+  RegexCache::Regex regex = cache.get("^sip:");
+  ASSERT_TRUE(regex != NULL);
+  EXPECT_NE(regex, cache.get("^sip:"));
+  EXPECT_EQ(2u, cache._cache._misses);
+}
+
+TEST_F(RegexCacheTest, Instance)
+{
+  // With no process-wide cache, each expression is compiled separately.
+  RegexCache::Regex regex = RegexCache::compile("^sip:");
+  ASSERT_TRUE(regex != NULL);
+  EXPECT_NE(regex, RegexCache::compile("^sip:"));
+  EXPECT_TRUE(RegexCache::compile("(") == NULL);
+
+  RegexCache::set_instance(_cache);
+  regex = RegexCache::compile("^sip:");
+  EXPECT_EQ(regex, RegexCache::compile("^sip:"));
+  EXPECT_TRUE(RegexCache::compile("(") == NULL);
+}
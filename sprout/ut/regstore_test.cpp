@@ -36,6 +36,8 @@
 
 
 #include <string>
+#include <atomic>
+#include <unistd.h>
 #include "gmock/gmock.h"
 #include "gtest/gtest.h"
 #include <json/reader.h>
@@ -47,6 +49,7 @@
 #include "sas.h"
 #include "localstore.h"
 #include "regstore.h"
+#include "async_dispatcher.h"
 #include "test_utils.hpp"
 #include "test_interposer.hpp"
 #include "fakechronosconnection.hpp"
@@ -460,3 +463,499 @@ TEST_F(RegStoreTest, ExpiryTests)
 }
 
 
+
+/// Builds an AoR with the specified number of bindings and one subscription,
+/// for testing serialization.
+static RegStore::AoR* build_aor(int num_bindings)
+{
+  RegStore::AoR* aor_data = new RegStore::AoR("sip:5102175698@cw-ngv.com");
+
+  for (int ii = 0; ii < num_bindings; ++ii)
+  {
+    RegStore::AoR::Binding* b =
+      aor_data->get_binding("urn:uuid:00000000-0000-0000-0000-b4dd32817622:" +
+                            std::to_string(ii));
+    b->_uri = std::string("<sip:5102175698@192.91.191.29:59934;transport=tcp;ob>");
+    b->_cid = std::string("gfYHoZGaFaRNxhlV0WIwoS-f91NoJ2gq");
+    b->_cseq = 17038 + ii;
+    b->_expires = 1000 + ii;
+    b->_timer_id = "00000000000";
+    b->_priority = ii;
+    b->_path_headers.push_back(std::string("<sip:abcdefgh@bono1.homedomain;lr>"));
+    b->_params["+sip.instance"] = "\"<urn:uuid:00000000-0000-0000-0000-b4dd32817622>\"";
+    b->_params["reg-id"] = std::to_string(ii);
+    b->_params["+sip.ice"] = "";
+    b->_private_id = "5102175698@cw-ngv.com";
+    b->_emergency_registration = ((ii % 2) == 1);
+  }
+
+  RegStore::AoR::Subscription* s = aor_data->get_subscription("1234");
+  s->_req_uri = std::string("sip:5102175698@192.91.191.29:59934;transport=tcp");
+  s->_from_uri = std::string("<sip:5102175698@cw-ngv.com>");
+  s->_from_tag = std::string("4321");
+  s->_to_uri = std::string("<sip:5102175698@cw-ngv.com>");
+  s->_to_tag = std::string("1234");
+  s->_cid = std::string("xyzabc@192.91.191.29");
+  s->_route_uris.push_back(std::string("<sip:abcdefgh@bono1.homedomain;lr>"));
+  s->_expires = 2000;
+
+  aor_data->_notify_cseq = 7;
+
+  return aor_data;
+}
+
+TEST_F(RegStoreTest, SerializationFormats)
+{
+  RegStore::AoR* aor_data = build_aor(3);
+
+  // Both formats can be read back, whichever is being written.
+  std::string legacy = RegStore::serialize_aor(aor_data, RegStore::FORMAT_LEGACY);
+  std::string binary = RegStore::serialize_aor(aor_data, RegStore::FORMAT_BINARY);
+  EXPECT_NE(legacy, binary);
+
+  RegStore::AoR* from_legacy = RegStore::deserialize_aor("sip:5102175698@cw-ngv.com", legacy);
+  RegStore::AoR* from_binary = RegStore::deserialize_aor("sip:5102175698@cw-ngv.com", binary);
+  ASSERT_TRUE(from_legacy != NULL);
+  ASSERT_TRUE(from_binary != NULL);
+
+  // The records read back are identical to the original.
+  EXPECT_EQ(legacy, RegStore::serialize_aor(from_binary, RegStore::FORMAT_LEGACY));
+  EXPECT_EQ(binary, RegStore::serialize_aor(from_legacy, RegStore::FORMAT_BINARY));
+
+  EXPECT_EQ(3u, from_binary->bindings().size());
+  EXPECT_EQ(1u, from_binary->subscriptions().size());
+  EXPECT_EQ(7, from_binary->_notify_cseq);
+  RegStore::AoR::Binding* b = from_binary->get_binding("urn:uuid:00000000-0000-0000-0000-b4dd32817622:1");
+  EXPECT_EQ(17039, b->_cseq);
+  EXPECT_EQ(1001, b->_expires);
+  EXPECT_EQ("1", b->_params["reg-id"]);
+  EXPECT_EQ(1u, b->_path_headers.size());
+  EXPECT_TRUE(b->_emergency_registration);
+  EXPECT_EQ("sip:5102175698@cw-ngv.com", *b->_address_of_record);
+
+  delete from_legacy; from_legacy = NULL;
+  delete from_binary; from_binary = NULL;
+
+  // Truncated binary records are rejected.
+  EXPECT_TRUE(RegStore::deserialize_aor("sip:5102175698@cw-ngv.com",
+                                        binary.substr(0, binary.size() / 2)) == NULL);
+
+  delete aor_data; aor_data = NULL;
+}
+
+TEST_F(RegStoreTest, StoreFormats)
+{
+  // A store writing the original format and a store writing the binary
+  // format can share a data store.
+  ChronosConnection* chronos_connection = new FakeChronosConnection();
+  LocalStore* datastore = new LocalStore();
+  RegStore* legacy_store = new RegStore(datastore, chronos_connection, RegStore::FORMAT_LEGACY);
+  RegStore* store = new RegStore(datastore, chronos_connection);
+
+  int now = time(NULL);
+  RegStore::AoR* aor_data = legacy_store->get_aor_data("5102175698@cw-ngv.com", 0);
+  RegStore::AoR::Binding* b = aor_data->get_binding("binding1");
+  b->_uri = "<sip:5102175698@192.91.191.29:59934;transport=tcp;ob>";
+  b->_expires = now + 300;
+  b->_cseq = 1;
+  b->_priority = 0;
+  b->_emergency_registration = false;
+  EXPECT_TRUE(legacy_store->set_aor_data("5102175698@cw-ngv.com", aor_data, false, 0));
+  delete aor_data; aor_data = NULL;
+
+  aor_data = store->get_aor_data("5102175698@cw-ngv.com", 0);
+  ASSERT_TRUE(aor_data != NULL);
+  EXPECT_EQ(1u, aor_data->bindings().size());
+  aor_data->get_binding("binding1")->_cseq = 2;
+  EXPECT_TRUE(store->set_aor_data("5102175698@cw-ngv.com", aor_data, false, 0));
+  delete aor_data; aor_data = NULL;
+
+  aor_data = legacy_store->get_aor_data("5102175698@cw-ngv.com", 0);
+  ASSERT_TRUE(aor_data != NULL);
+  EXPECT_EQ(2, aor_data->get_binding("binding1")->_cseq);
+  delete aor_data; aor_data = NULL;
+
+  delete store; store = NULL;
+  delete legacy_store; legacy_store = NULL;
+  delete datastore; datastore = NULL;
+  delete chronos_connection; chronos_connection = NULL;
+}
+
+TEST_F(RegStoreTest, PerBindingLayout)
+{
+  // A store using the per-binding layout can read AoRs written as a single
+  // record, and AoRs it writes can be read by a store using either layout.
+  ChronosConnection* chronos_connection = new FakeChronosConnection();
+  LocalStore* datastore = new LocalStore();
+  RegStore* aor_store = new RegStore(datastore, chronos_connection);
+  RegStore* store = new RegStore(datastore,
+                                 chronos_connection,
+                                 RegStore::FORMAT_BINARY,
+                                 RegStore::LAYOUT_PER_BINDING);
+
+  int now = time(NULL);
+  RegStore::AoR* aor_data = aor_store->get_aor_data("sip:5102175698@cw-ngv.com", 0);
+  ASSERT_TRUE(aor_data != NULL);
+  for (int ii = 1; ii <= 3; ++ii)
+  {
+    RegStore::AoR::Binding* b = aor_data->get_binding("binding" + std::to_string(ii));
+    b->_uri = "<sip:5102175698@192.91.191.29:59934;transport=tcp;ob>";
+    b->_cid = "gfYHoZGaFaRNxhlV0WIwoS-f91NoJ2gq";
+    b->_cseq = ii;
+    b->_expires = now + 300;
+    b->_priority = 0;
+    b->_emergency_registration = false;
+  }
+  RegStore::AoR::Subscription* s = aor_data->get_subscription("1234");
+  s->_req_uri = "sip:5102175698@192.91.191.29:59934;transport=tcp";
+  s->_to_tag = "1234";
+  s->_expires = now + 300;
+  EXPECT_TRUE(aor_store->set_aor_data("sip:5102175698@cw-ngv.com", aor_data, false, 0));
+  delete aor_data; aor_data = NULL;
+
+  aor_data = store->get_aor_data("sip:5102175698@cw-ngv.com", 0);
+  ASSERT_TRUE(aor_data != NULL);
+  EXPECT_EQ(3u, aor_data->bindings().size());
+  EXPECT_TRUE(store->set_aor_data("sip:5102175698@cw-ngv.com", aor_data, false, 0));
+  delete aor_data; aor_data = NULL;
+
+  // Refresh a binding, then check both stores see the change.
+  aor_data = store->get_aor_data("sip:5102175698@cw-ngv.com", 0);
+  ASSERT_TRUE(aor_data != NULL);
+  EXPECT_EQ(3u, aor_data->bindings().size());
+  EXPECT_EQ(1u, aor_data->subscriptions().size());
+  aor_data->get_binding("binding1")->_cseq = 20;
+  EXPECT_TRUE(store->set_aor_data("sip:5102175698@cw-ngv.com", aor_data, false, 0));
+  delete aor_data; aor_data = NULL;
+
+  aor_data = aor_store->get_aor_data("sip:5102175698@cw-ngv.com", 0);
+  ASSERT_TRUE(aor_data != NULL);
+  EXPECT_EQ(3u, aor_data->bindings().size());
+  EXPECT_EQ(20, aor_data->get_binding("binding1")->_cseq);
+  EXPECT_EQ(1u, aor_data->subscriptions().size());
+  delete aor_data; aor_data = NULL;
+
+  // A binding refresh conflicts with a concurrent removal of the binding.
+  RegStore::AoR* aor_data1 = store->get_aor_data("sip:5102175698@cw-ngv.com", 0);
+  RegStore::AoR* aor_data2 = store->get_aor_data("sip:5102175698@cw-ngv.com", 0);
+  ASSERT_TRUE(aor_data1 != NULL);
+  ASSERT_TRUE(aor_data2 != NULL);
+  aor_data1->remove_binding("binding2");
+  aor_data2->get_binding("binding2")->_cseq = 30;
+  EXPECT_TRUE(store->set_aor_data("sip:5102175698@cw-ngv.com", aor_data1, false, 0));
+  EXPECT_FALSE(store->set_aor_data("sip:5102175698@cw-ngv.com", aor_data2, false, 0));
+  delete aor_data1; aor_data1 = NULL;
+  delete aor_data2; aor_data2 = NULL;
+
+  // Concurrent additions of different bindings conflict on the index, and
+  // the second succeeds when retried.
+  aor_data1 = store->get_aor_data("sip:5102175698@cw-ngv.com", 0);
+  aor_data2 = store->get_aor_data("sip:5102175698@cw-ngv.com", 0);
+  ASSERT_TRUE(aor_data1 != NULL);
+  ASSERT_TRUE(aor_data2 != NULL);
+  EXPECT_EQ(2u, aor_data1->bindings().size());
+  *aor_data1->get_binding("binding5") = *aor_data1->get_binding("binding1");
+  *aor_data2->get_binding("binding6") = *aor_data2->get_binding("binding1");
+  EXPECT_TRUE(store->set_aor_data("sip:5102175698@cw-ngv.com", aor_data1, false, 0));
+  EXPECT_FALSE(store->set_aor_data("sip:5102175698@cw-ngv.com", aor_data2, false, 0));
+  delete aor_data1; aor_data1 = NULL;
+  delete aor_data2; aor_data2 = NULL;
+
+  aor_data = store->get_aor_data("sip:5102175698@cw-ngv.com", 0);
+  ASSERT_TRUE(aor_data != NULL);
+  *aor_data->get_binding("binding6") = *aor_data->get_binding("binding1");
+  EXPECT_TRUE(store->set_aor_data("sip:5102175698@cw-ngv.com", aor_data, false, 0));
+  delete aor_data; aor_data = NULL;
+
+  aor_data = aor_store->get_aor_data("sip:5102175698@cw-ngv.com", 0);
+  ASSERT_TRUE(aor_data != NULL);
+  EXPECT_EQ(4u, aor_data->bindings().size());
+  EXPECT_TRUE(aor_data->bindings().find("binding2") == aor_data->bindings().end());
+  delete aor_data; aor_data = NULL;
+
+  delete store; store = NULL;
+  delete aor_store; aor_store = NULL;
+  delete datastore; datastore = NULL;
+  delete chronos_connection; chronos_connection = NULL;
+}
+
+/// LocalStore that counts the reads made, and the most that were in progress
+/// at once.  Each read is slowed down so that concurrent reads overlap.
+class CountingStore : public LocalStore
+{
+public:
+  CountingStore() : reads(0), in_progress(0), max_in_progress(0) {}
+
+  Store::Status get_data(const std::string& table,
+                         const std::string& key,
+                         std::string& data,
+                         uint64_t& cas,
+                         SAS::TrailId trail = 0)
+  {
+    ++reads;
+    int now_in_progress = ++in_progress;
+    int max = max_in_progress;
+    while ((now_in_progress > max) &&
+           (!max_in_progress.compare_exchange_weak(max, now_in_progress)))
+    {
+    }
+    usleep(20000);
+    Store::Status status = LocalStore::get_data(table, key, data, cas, trail);
+    --in_progress;
+    return status;
+  }
+
+  std::atomic<int> reads;
+  std::atomic<int> in_progress;
+  std::atomic<int> max_in_progress;
+};
+
+TEST_F(RegStoreTest, PerBindingConcurrentReads)
+{
+  // Reading an AoR in the per-binding layout makes one read for the index
+  // and one for each binding and subscription, and with a dispatcher the
+  // bindings and subscriptions are read concurrently.
+  ChronosConnection* chronos_connection = new FakeChronosConnection();
+  CountingStore* datastore = new CountingStore();
+  AsyncDispatcher* dispatcher = new AsyncDispatcher(4);
+  RegStore* store = new RegStore(datastore,
+                                 chronos_connection,
+                                 RegStore::FORMAT_BINARY,
+                                 RegStore::LAYOUT_PER_BINDING,
+                                 NULL,
+                                 dispatcher);
+
+  int now = time(NULL);
+  RegStore::AoR* aor_data = store->get_aor_data("sip:5102175698@cw-ngv.com", 0);
+  ASSERT_TRUE(aor_data != NULL);
+  for (int ii = 1; ii <= 5; ++ii)
+  {
+    RegStore::AoR::Binding* b = aor_data->get_binding("binding" + std::to_string(ii));
+    b->_uri = "<sip:5102175698@192.91.191.29:59934;transport=tcp;ob>";
+    b->_cid = "gfYHoZGaFaRNxhlV0WIwoS-f91NoJ2gq";
+    b->_cseq = ii;
+    b->_expires = now + 300;
+    b->_priority = 0;
+    b->_emergency_registration = false;
+  }
+  RegStore::AoR::Subscription* s = aor_data->get_subscription("1234");
+  s->_req_uri = "sip:5102175698@192.91.191.29:59934;transport=tcp";
+  s->_to_tag = "1234";
+  s->_expires = now + 300;
+  EXPECT_TRUE(store->set_aor_data("sip:5102175698@cw-ngv.com", aor_data, false, 0));
+  delete aor_data; aor_data = NULL;
+
+  datastore->reads = 0;
+  datastore->max_in_progress = 0;
+  aor_data = store->get_aor_data("sip:5102175698@cw-ngv.com", 0);
+  ASSERT_TRUE(aor_data != NULL);
+  EXPECT_EQ(5u, aor_data->bindings().size());
+  EXPECT_EQ(1u, aor_data->subscriptions().size());
+  EXPECT_EQ(3, aor_data->get_binding("binding3")->_cseq);
+  EXPECT_EQ(7, datastore->reads);
+  EXPECT_LT(1, datastore->max_in_progress);
+  delete aor_data; aor_data = NULL;
+
+  dispatcher->stop();
+  delete store; store = NULL;
+  delete dispatcher; dispatcher = NULL;
+  delete datastore; datastore = NULL;
+  delete chronos_connection; chronos_connection = NULL;
+}
+
+TEST_F(RegStoreTest, BatchReads)
+{
+  // Reading a batch of AoRs returns the same data as reading them one at a
+  // time, whether or not the reads are made concurrently.
+  ChronosConnection* chronos_connection = new FakeChronosConnection();
+  LocalStore* datastore = new LocalStore();
+  AsyncDispatcher* dispatcher = new AsyncDispatcher(2);
+  RegStore* serial_store = new RegStore(datastore, chronos_connection);
+  RegStore* store = new RegStore(datastore,
+                                 chronos_connection,
+                                 RegStore::FORMAT_BINARY,
+                                 RegStore::LAYOUT_AOR,
+                                 NULL,
+                                 dispatcher);
+
+  int now = time(NULL);
+  std::vector<std::string> aor_ids;
+  for (int ii = 0; ii < 6; ++ii)
+  {
+    std::string aor_id = "sip:510217569" + std::to_string(ii) + "@cw-ngv.com";
+    aor_ids.push_back(aor_id);
+
+    // Leave the last AoR empty.
+    if (ii < 5)
+    {
+      RegStore::AoR* aor_data = store->get_aor_data(aor_id, 0);
+      ASSERT_TRUE(aor_data != NULL);
+      RegStore::AoR::Binding* b = aor_data->get_binding("binding");
+      b->_uri = "<sip:510217569" + std::to_string(ii) + "@192.91.191.29:59934;transport=tcp;ob>";
+      b->_cid = "gfYHoZGaFaRNxhlV0WIwoS-f91NoJ2gq";
+      b->_cseq = ii;
+      b->_expires = now + 300;
+      b->_priority = 0;
+      b->_emergency_registration = false;
+      EXPECT_TRUE(store->set_aor_data(aor_id, aor_data, false, 0));
+      delete aor_data;
+    }
+  }
+
+  std::vector<RegStore::AoR*> aor_data;
+  std::vector<RegStore::AoR*> serial_aor_data;
+  store->get_aor_data_batch(aor_ids, aor_data, 0);
+  serial_store->get_aor_data_batch(aor_ids, serial_aor_data, 0);
+  ASSERT_EQ(aor_ids.size(), aor_data.size());
+  ASSERT_EQ(aor_ids.size(), serial_aor_data.size());
+
+  for (size_t ii = 0; ii < aor_ids.size(); ++ii)
+  {
+    ASSERT_TRUE(aor_data[ii] != NULL);
+    ASSERT_TRUE(serial_aor_data[ii] != NULL);
+    RegStore::AoR* expected = store->get_aor_data(aor_ids[ii], 0);
+    ASSERT_TRUE(expected != NULL);
+    EXPECT_EQ(expected->bindings().size(), aor_data[ii]->bindings().size());
+    EXPECT_EQ(expected->bindings().size(), serial_aor_data[ii]->bindings().size());
+    if (!expected->bindings().empty())
+    {
+      EXPECT_EQ(expected->get_binding("binding")->_uri,
+                aor_data[ii]->get_binding("binding")->_uri);
+      EXPECT_EQ(expected->get_binding("binding")->_uri,
+                serial_aor_data[ii]->get_binding("binding")->_uri);
+    }
+    delete expected;
+    delete aor_data[ii];
+    delete serial_aor_data[ii];
+  }
+
+  // An empty batch returns no data.
+  aor_data.clear();
+  store->get_aor_data_batch(std::vector<std::string>(), aor_data, 0);
+  EXPECT_TRUE(aor_data.empty());
+
+  delete store; store = NULL;
+  delete serial_store; serial_store = NULL;
+  delete dispatcher; dispatcher = NULL;
+  delete datastore; datastore = NULL;
+  delete chronos_connection; chronos_connection = NULL;
+}
+
+TEST_F(RegStoreTest, CASRetryStats)
+{
+  // Discard any counts left by earlier tests.
+  std::vector<std::string> stats;
+  RegStore::get_cas_retry_stats(stats);
+
+  RegStore::record_cas_retries(RegStore::OP_REGISTER, 0);
+  RegStore::record_cas_retries(RegStore::OP_REGISTER, 3);
+  RegStore::record_cas_retries(RegStore::OP_DEREGISTER, 1);
+
+  // Each operation reports the number of updates, the total retries and the
+  // maximum retries for one update.
+  stats.clear();
+  RegStore::get_cas_retry_stats(stats);
+  ASSERT_EQ(3u * RegStore::NUM_OPERATIONS, stats.size());
+  EXPECT_EQ("2", stats[3 * RegStore::OP_REGISTER]);
+  EXPECT_EQ("3", stats[3 * RegStore::OP_REGISTER + 1]);
+  EXPECT_EQ("3", stats[3 * RegStore::OP_REGISTER + 2]);
+  EXPECT_EQ("0", stats[3 * RegStore::OP_SUBSCRIBE]);
+  EXPECT_EQ("1", stats[3 * RegStore::OP_DEREGISTER]);
+  EXPECT_EQ("1", stats[3 * RegStore::OP_DEREGISTER + 2]);
+
+  // The counts are reset once reported.
+  stats.clear();
+  RegStore::get_cas_retry_stats(stats);
+  EXPECT_EQ("0", stats[3 * RegStore::OP_REGISTER]);
+}
+
+TEST_F(RegStoreTest, ExpireBindingsAndSubscriptions)
+{
+  // Expired bindings and subscriptions are removed, and the latest expiry
+  // time of the remaining bindings is returned.
+  ChronosConnection* chronos_connection = new FakeChronosConnection();
+  LocalStore* datastore = new LocalStore();
+  RegStore* store = new RegStore(datastore, chronos_connection);
+  std::string binding_prefix = "urn:uuid:00000000-0000-0000-0000-b4dd32817622:";
+
+  // The bindings expire at 1000 to 1009, and the subscription at 2000.
+  RegStore::AoR* aor_data = build_aor(10);
+
+  // Bring the subscription's expiry forward, so it expires first.
+  aor_data->get_subscription("1234")->_expires = 900;
+  store->expire_subscriptions(aor_data, 899);
+  EXPECT_EQ(1u, aor_data->subscriptions().size());
+  store->expire_subscriptions(aor_data, 900);
+  EXPECT_EQ(0u, aor_data->subscriptions().size());
+
+  // Nothing has expired yet, and the latest expiry time is returned.
+  EXPECT_EQ(1009, store->expire_bindings(aor_data, 999, 0));
+  EXPECT_EQ(10u, aor_data->bindings().size());
+
+  // Extend the first binding and bring the last one forward.  The bindings
+  // that expire by 1003 are then 1 to 3 and 9.
+  aor_data->get_binding(binding_prefix + "0")->_expires = 1500;
+  aor_data->get_binding(binding_prefix + "9")->_expires = 1001;
+  EXPECT_EQ(1500, store->expire_bindings(aor_data, 1003, 0));
+  EXPECT_EQ(6u, aor_data->bindings().size());
+  EXPECT_TRUE(aor_data->bindings().find(binding_prefix + "0") != aor_data->bindings().end());
+  EXPECT_TRUE(aor_data->bindings().find(binding_prefix + "9") == aor_data->bindings().end());
+
+  // Removed bindings no longer count towards the latest expiry time.
+  aor_data->remove_binding(binding_prefix + "0");
+  EXPECT_EQ(1008, store->expire_bindings(aor_data, 1003, 0));
+
+  // Expiring a copy of the AoR leaves the original alone.
+  RegStore::AoR copy(*aor_data);
+  EXPECT_EQ(1008, store->expire_bindings(&copy, 1006, 0));
+  EXPECT_EQ(2u, copy.bindings().size());
+  EXPECT_EQ(5u, aor_data->bindings().size());
+
+  // Once all the bindings have expired, the current time is returned.
+  EXPECT_EQ(1100, store->expire_bindings(aor_data, 1100, 0));
+  EXPECT_EQ(0u, aor_data->bindings().size());
+
+  delete aor_data; aor_data = NULL;
+  delete store; store = NULL;
+  delete datastore; datastore = NULL;
+  delete chronos_connection; chronos_connection = NULL;
+}
+
+// Compares the time taken to serialize and deserialize AoRs of different
+// sizes in each format.  This checks nothing that SerializationFormats
+// doesn't, so only runs when disabled tests are requested.  The timings are
+// recorded as properties in the XML output.
+TEST_F(RegStoreTest, DISABLED_SerializationBenchmark)
+{
+  int sizes[] = {1, 10, 100};
+  for (size_t ii = 0; ii < sizeof(sizes) / sizeof(sizes[0]); ++ii)
+  {
+    RegStore::AoR* aor_data = build_aor(sizes[ii]);
+    int iterations = 2000 / sizes[ii];
+
+    for (int format = RegStore::FORMAT_LEGACY; format <= RegStore::FORMAT_BINARY; ++format)
+    {
+      std::string data;
+      Utils::StopWatch stop_watch;
+      stop_watch.start();
+
+      for (int jj = 0; jj < iterations; ++jj)
+      {
+        data = RegStore::serialize_aor(aor_data, (RegStore::SerializerFormat)format);
+        RegStore::AoR* copy = RegStore::deserialize_aor("sip:5102175698@cw-ngv.com", data);
+        ASSERT_TRUE(copy != NULL);
+        EXPECT_EQ((size_t)sizes[ii], copy->bindings().size());
+        delete copy;
+      }
+
+      unsigned long elapsed_us = 0;
+      stop_watch.read(elapsed_us);
+      std::string name = std::string((format == RegStore::FORMAT_LEGACY) ? "legacy" : "binary") +
+                         "_" + std::to_string(sizes[ii]) + "_bindings";
+      RecordProperty(name + "_us", (int)(elapsed_us / iterations));
+      RecordProperty(name + "_bytes", (int)data.size());
+    }
+
+    delete aor_data;
+  }
+}
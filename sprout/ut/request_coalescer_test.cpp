@@ -0,0 +1,254 @@
+/**
+ * @file request_coalescer_test.cpp UT for coalescing identical concurrent requests.
+ *
+ * Project Clearwater - IMS in the Cloud
+ * Copyright (C) 2014  Metaswitch Networks Ltd
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or (at your
+ * option) any later version, along with the "Special Exception" for use of
+ * the program along with SSL, set forth below. This program is distributed
+ * in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+ * without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details. You should have received a copy of the GNU General Public
+ * License along with this program.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ *
+ * The author can be reached by email at clearwater@metaswitch.com or by
+ * post at Metaswitch Networks Ltd, 100 Church St, Enfield EN2 6BQ, UK
+ *
+ * Special Exception
+ * Metaswitch Networks Ltd  grants you permission to copy, modify,
+ * propagate, and distribute a work formed by combining OpenSSL with The
+ * Software, or a work derivative of such a combination, even if such
+ * copying, modification, propagation, or distribution would otherwise
+ * violate the terms of the GPL. You must comply with the GPL in all
+ * respects for all of the code used other than OpenSSL.
+ * "OpenSSL" means OpenSSL toolkit software distributed by the OpenSSL
+ * Project and licensed under the OpenSSL Licenses, or a work based on such
+ * software and licensed under the OpenSSL Licenses.
+ * "OpenSSL Licenses" means the OpenSSL License and Original SSLeay License
+ * under which the OpenSSL Project distributes the OpenSSL toolkit software,
+ * as those licenses appear in the file LICENSE-OPENSSL.
+ */
+
+///
+///----------------------------------------------------------------------------
+
+#include <pthread.h>
+#include <unistd.h>
+
+#include "gtest/gtest.h"
+
+#include "basetest.hpp"
+#include "mock_sas.h"
+#include "request_coalescer.h"
+#include "sproutsasevent.h"
+
+using namespace std;
+
+/// Fixture for RequestCoalescerTest.
+class RequestCoalescerTest : public BaseTest
+{
+  RequestCoalescer* _coalescer;
+
+  RequestCoalescerTest()
+  {
+    _coalescer = new RequestCoalescer("hss_coalesced_requests", NULL);
+  }
+
+  virtual ~RequestCoalescerTest()
+  {
+    delete _coalescer; _coalescer = NULL;
+  }
+};
+
+/// Server that counts the requests it is sent, and can be held up so that
+/// other requests arrive while one is in progress.
+struct FakeServer
+{
+  FakeServer() : requests(0), hold(false)
+  {
+    pthread_mutex_init(&lock, NULL);
+    pthread_cond_init(&cond, NULL);
+  }
+
+  ~FakeServer()
+  {
+    pthread_cond_destroy(&cond);
+    pthread_mutex_destroy(&lock);
+  }
+
+  long handle(std::string& response)
+  {
+    pthread_mutex_lock(&lock);
+    int request = ++requests;
+    while (hold)
+    {
+      pthread_cond_wait(&cond, &lock);
+    }
+    pthread_mutex_unlock(&lock);
+
+    response = body + std::to_string(request);
+    return 200;
+  }
+
+  void release()
+  {
+    pthread_mutex_lock(&lock);
+    hold = false;
+    pthread_cond_broadcast(&cond);
+    pthread_mutex_unlock(&lock);
+  }
+
+  int requests;
+  bool hold;
+  std::string body;
+  pthread_mutex_t lock;
+  pthread_cond_t cond;
+};
+
+struct RequestThread
+{
+  RequestCoalescer* coalescer;
+  SAS::TrailId trail;
+  FakeServer* server;
+  long http_code;
+  std::string response;
+  pthread_t thread;
+};
+
+static void* send_request(void* p)
+{
+  RequestThread* t = (RequestThread*)p;
+  FakeServer* server = t->server;
+  t->http_code = t->coalescer->send("GET /impu/sip%3A6505550231%40homedomain/reg-data",
+                                    t->trail,
+                                    t->response,
+                                    [server](std::string& response)
+                                    {
+                                      return server->handle(response);
+                                    },
+                                    [](long http_code, const std::string& response)
+                                    {
+                                      return (response.find("aka") == std::string::npos);
+                                    });
+  return NULL;
+}
+
+/// Starts a request on each thread, holding the server until all the
+/// requests have been made.
+static void send_concurrent_requests(RequestCoalescer* coalescer,
+                                     FakeServer* server,
+                                     RequestThread* threads,
+                                     int num_threads)
+{
+  server->hold = true;
+
+  for (int ii = 0; ii < num_threads; ++ii)
+  {
+    threads[ii].coalescer = coalescer;
+    threads[ii].server = server;
+    threads[ii].trail = ii + 1;
+    threads[ii].http_code = 0;
+    pthread_create(&threads[ii].thread, NULL, send_request, &threads[ii]);
+
+    // Give the first request time to reach the server, and the others time
+    // to wait for it.
+    usleep(50000);
+  }
+
+  server->release();
+
+  for (int ii = 0; ii < num_threads; ++ii)
+  {
+    pthread_join(threads[ii].thread, NULL);
+  }
+}
+
+TEST_F(RequestCoalescerTest, SingleRequest)
+{
+  FakeServer server;
+  server.body = "reg-data";
+  std::string response;
+
+  for (int ii = 1; ii <= 2; ++ii)
+  {
+    // Requests made one after the other are each sent.
+    EXPECT_EQ(200, _coalescer->send("GET /impu/sip%3A6505550231%40homedomain/reg-data",
+                                    0,
+                                    response,
+                                    [&server](std::string& response)
+                                    {
+                                      return server.handle(response);
+                                    }));
+    EXPECT_EQ("reg-data" + std::to_string(ii), response);
+  }
+
+  EXPECT_EQ(2, server.requests);
+  EXPECT_EQ(2u, _coalescer->_requests);
+  EXPECT_EQ(0u, _coalescer->_coalesced);
+  EXPECT_TRUE(_coalescer->_calls.empty());
+}
+
+TEST_F(RequestCoalescerTest, ConcurrentRequestsCoalesced)
+{
+  // Requests made while the same request is in progress share its
+  // response.
+  FakeServer server;
+  server.body = "reg-data";
+  RequestThread threads[4];
+  send_concurrent_requests(_coalescer, &server, threads, 4);
+
+  EXPECT_EQ(1, server.requests);
+  for (int ii = 0; ii < 4; ++ii)
+  {
+    EXPECT_EQ(200, threads[ii].http_code);
+    EXPECT_EQ("reg-data1", threads[ii].response);
+  }
+  EXPECT_EQ(1u, _coalescer->_requests);
+  EXPECT_EQ(3u, _coalescer->_coalesced);
+  EXPECT_TRUE(_coalescer->_calls.empty());
+}
+
+TEST_F(RequestCoalescerTest, CoalescedRequestsLoggedOnOwnTrail)
+{
+  // Only the first request reaches the server, so its trail has the HTTP
+  // request and response.  The others log the response they shared on
+  // their own trails.
+  mock_sas_collect_messages(true);
+
+  FakeServer server;
+  server.body = "reg-data";
+  RequestThread threads[2];
+  send_concurrent_requests(_coalescer, &server, threads, 2);
+
+  MockSASMessage* event = mock_sas_find_event(SASEvent::HTTP_HOMESTEAD_COALESCED);
+  ASSERT_TRUE(event != NULL);
+  EXPECT_EQ(threads[1].trail, event->trail);
+  EXPECT_EQ(200u, event->static_params[0]);
+  EXPECT_EQ("GET /impu/sip%3A6505550231%40homedomain/reg-data", event->var_params[0]);
+  EXPECT_EQ(std::to_string(threads[0].trail), event->var_params[1]);
+  EXPECT_EQ("reg-data1", event->var_params[2]);
+
+  mock_sas_collect_messages(false);
+}
+
+TEST_F(RequestCoalescerTest, UnshareableResponse)
+{
+  // Callers waiting for a response that can't be shared send their own
+  // requests.
+  FakeServer server;
+  server.body = "aka";
+  RequestThread threads[2];
+  send_concurrent_requests(_coalescer, &server, threads, 2);
+
+  EXPECT_EQ(2, server.requests);
+  EXPECT_EQ("aka1", threads[0].response);
+  EXPECT_EQ("aka2", threads[1].response);
+  EXPECT_EQ(2u, _coalescer->_requests);
+  EXPECT_EQ(0u, _coalescer->_coalesced);
+  EXPECT_EQ(1u, _coalescer->_unshared);
+}
@@ -0,0 +1,148 @@
+/**
+ * @file scscf_assignment_cache_test.cpp UT for the I-CSCF S-CSCF assignment cache.
+ *
+ * Project Clearwater - IMS in the Cloud
+ * Copyright (C) 2014  Metaswitch Networks Ltd
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or (at your
+ * option) any later version, along with the "Special Exception" for use of
+ * the program along with SSL, set forth below. This program is distributed
+ * in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+ * without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details. You should have received a copy of the GNU General Public
+ * License along with this program.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ *
+ * The author can be reached by email at clearwater@metaswitch.com or by
+ * post at Metaswitch Networks Ltd, 100 Church St, Enfield EN2 6BQ, UK
+ *
+ * Special Exception
+ * Metaswitch Networks Ltd  grants you permission to copy, modify,
+ * propagate, and distribute a work formed by combining OpenSSL with The
+ * Software, or a work derivative of such a combination, even if such
+ * copying, modification, propagation, or distribution would otherwise
+ * violate the terms of the GPL. You must comply with the GPL in all
+ * respects for all of the code used other than OpenSSL.
+ * "OpenSSL" means OpenSSL toolkit software distributed by the OpenSSL
+ * Project and licensed under the OpenSSL Licenses, or a work based on such
+ * software and licensed under the OpenSSL Licenses.
+ * "OpenSSL Licenses" means the OpenSSL License and Original SSLeay License
+ * under which the OpenSSL Project distributes the OpenSSL toolkit software,
+ * as those licenses appear in the file LICENSE-OPENSSL.
+ */
+
+///
+///----------------------------------------------------------------------------
+#include "gtest/gtest.h"
+
+extern "C" {
+#include <pjsip.h>
+}
+
+#include "basetest.hpp"
+#include "test_interposer.hpp"
+#include "scscf_assignment_cache.h"
+
+using namespace std;
+
+/// Fixture for SCSCFAssignmentCacheTest.  Time is frozen so entries only
+/// become stale when the test advances time.  The behaviour common to all
+/// the caches is tested by ShardedLRUCacheTest.
+class SCSCFAssignmentCacheTest : public BaseTest
+{
+  SCSCFAssignmentCache* _cache;
+
+  SCSCFAssignmentCacheTest()
+  {
+    cwtest_completely_control_time();
+    _cache = new SCSCFAssignmentCache(100, 5000, NULL);
+  }
+
+  virtual ~SCSCFAssignmentCacheTest()
+  {
+    delete _cache; _cache = NULL;
+    cwtest_reset_time();
+  }
+
+  /// Builds a query result naming an S-CSCF.
+  SCSCFAssignmentCache::Assignment build_assignment(const std::string& scscf)
+  {
+    SCSCFAssignmentCache::Assignment assignment;
+    assignment.status_code = PJSIP_SC_OK;
+    assignment.queried_caps = true;
+    assignment.caps.scscf = scscf;
+    assignment.caps.mandatory_caps.push_back(123);
+    assignment.caps.optional_caps.push_back(345);
+    return assignment;
+  }
+};
+
+TEST_F(SCSCFAssignmentCacheTest, HitAndStale)
+{
+  SCSCFAssignmentCache::Assignment assignment;
+  uint64_t generation;
+  EXPECT_FALSE(_cache->get("LIR term sip:6505550231@homedomain", assignment, generation));
+
+  _cache->put("LIR term sip:6505550231@homedomain",
+              build_assignment("sip:scscf1.homedomain:5058;transport=TCP"),
+              generation);
+
+  ASSERT_TRUE(_cache->get("LIR term sip:6505550231@homedomain", assignment, generation));
+  EXPECT_EQ(PJSIP_SC_OK, assignment.status_code);
+  EXPECT_TRUE(assignment.queried_caps);
+  EXPECT_EQ("sip:scscf1.homedomain:5058;transport=TCP", assignment.caps.scscf);
+  ASSERT_EQ(1u, assignment.caps.mandatory_caps.size());
+  EXPECT_EQ(123, assignment.caps.mandatory_caps[0]);
+  ASSERT_EQ(1u, assignment.caps.optional_caps.size());
+  EXPECT_EQ(345, assignment.caps.optional_caps[0]);
+
+  // The entry can't be used once it is older than the TTL.
+  cwtest_advance_time_ms(5001);
+  EXPECT_FALSE(_cache->get("LIR term sip:6505550231@homedomain", assignment, generation));
+}
+
+TEST_F(SCSCFAssignmentCacheTest, NegativeEntry)
+{
+  SCSCFAssignmentCache::Assignment assignment;
+  uint64_t generation;
+  _cache->get("LIR term sip:unknown@homedomain", assignment, generation);
+  assignment.status_code = PJSIP_SC_NOT_FOUND;
+  assignment.queried_caps = false;
+  _cache->put("LIR term sip:unknown@homedomain", assignment, generation);
+
+  // Unknown subscribers are cached too, and counted as negative hits.
+  assignment.status_code = PJSIP_SC_OK;
+  ASSERT_TRUE(_cache->get("LIR term sip:unknown@homedomain", assignment, generation));
+  EXPECT_EQ(PJSIP_SC_NOT_FOUND, assignment.status_code);
+  EXPECT_EQ("", assignment.caps.scscf);
+  EXPECT_EQ(1u, _cache->_negative_hits);
+}
+
+TEST_F(SCSCFAssignmentCacheTest, Invalidate)
+{
+  SCSCFAssignmentCache::Assignment assignment;
+  uint64_t generation;
+  uint64_t old_generation;
+  _cache->get("LIR term sip:6505550231@homedomain", assignment, generation);
+  _cache->put("LIR term sip:6505550231@homedomain",
+              build_assignment("sip:scscf1.homedomain:5058;transport=TCP"),
+              generation);
+
+  // Routing to the S-CSCF failed, so the entry is removed.  A query made
+  // before then isn't cached, but the result of the new query is.
+  _cache->get("LIR term sip:6505550231@homedomain", assignment, old_generation);
+  generation = _cache->invalidate("LIR term sip:6505550231@homedomain");
+  EXPECT_FALSE(_cache->get("LIR term sip:6505550231@homedomain", assignment, generation));
+  _cache->put("LIR term sip:6505550231@homedomain",
+              build_assignment("sip:scscf1.homedomain:5058;transport=TCP"),
+              old_generation);
+  EXPECT_FALSE(_cache->get("LIR term sip:6505550231@homedomain", assignment, generation));
+  _cache->put("LIR term sip:6505550231@homedomain",
+              build_assignment("sip:scscf2.homedomain:5058;transport=TCP"),
+              generation);
+  ASSERT_TRUE(_cache->get("LIR term sip:6505550231@homedomain", assignment, generation));
+  EXPECT_EQ("sip:scscf2.homedomain:5058;transport=TCP", assignment.caps.scscf);
+}
@@ -35,6 +35,7 @@
  */
 
 #include <string>
+#include <unistd.h>
 #include "gmock/gmock.h"
 #include "gtest/gtest.h"
 #include <boost/lexical_cast.hpp>
@@ -2015,6 +2016,77 @@ TEST_F(SCSCFTest, TestSimpleMultipart)
   doSuccessfulFlow(msg, testing::MatchesRegex(".*wuntootreefower.*"), hdrs);
 }
 
+// Test the HSS read for a new AS chain being run on an asynchronous
+// dispatcher thread, with the request parked until the read completes.
+TEST_F(SCSCFTest, AsyncHSSRead)
+{
+  SCOPED_TRACE("");
+  register_uri(_store, _hss_connection, "6505551234", "homedomain", "sip:wuntootreefower@10.114.61.213:5061;transport=tcp;ob");
+  AsyncDispatcher dispatcher(1);
+  _proxy->_async_dispatcher = &dispatcher;
+  Message msg;
+  pjsip_msg* out;
+
+  // Send INVITE.  Wait for the dispatcher thread to pick up the HSS read,
+  // then stop the dispatcher, which waits for the read to finish.  The
+  // worker threads aren't running, so the parked request is resumed on the
+  // dispatcher thread.
+  inject_msg(msg.get_request());
+  while (dispatcher.queue_size() > 0)
+  {
+    usleep(1000);
+  }
+  dispatcher.stop();
+  _proxy->_async_dispatcher = NULL;
+  ASSERT_EQ(2, txdata_count());
+
+  // 100 Trying goes back
+  out = current_txdata()->msg;
+  RespMatcher(100).matches(out);
+  free_txdata();
+
+  // INVITE passed on to the registered binding, so the HSS data was applied
+  // to the transaction.
+  out = current_txdata()->msg;
+  ReqMatcher req("INVITE");
+  ASSERT_NO_FATAL_FAILURE(req.matches(out));
+  EXPECT_THAT(req.uri(), testing::MatchesRegex(".*wuntootreefower.*"));
+
+  // Send 200 OK back
+  inject_msg(respond_to_current_txdata(200));
+  ASSERT_EQ(1, txdata_count());
+  out = current_txdata()->msg;
+  RespMatcher(200).matches(out);
+  free_txdata();
+}
+
+// Test that a request parked waiting for the HSS is still resumed (and
+// rejected) if the dispatcher is stopped before the read is run.
+TEST_F(SCSCFTest, AsyncHSSReadSkippedOnShutdown)
+{
+  SCOPED_TRACE("");
+  register_uri(_store, _hss_connection, "6505551234", "homedomain", "sip:wuntootreefower@10.114.61.213:5061;transport=tcp;ob");
+  AsyncDispatcher dispatcher(1);
+  dispatcher.stop();
+  _proxy->_async_dispatcher = &dispatcher;
+  Message msg;
+  pjsip_msg* out;
+
+  inject_msg(msg.get_request());
+  _proxy->_async_dispatcher = NULL;
+  ASSERT_EQ(2, txdata_count());
+
+  // 100 Trying goes back
+  out = current_txdata()->msg;
+  RespMatcher(100).matches(out);
+  free_txdata();
+
+  // The read was skipped, so the request is rejected.
+  out = current_txdata()->msg;
+  RespMatcher(404).matches(out);
+  free_txdata();
+}
+
 // Test emergency registrations receive calls.
 TEST_F(SCSCFTest, TestReceiveCallToEmergencyBinding)
 {
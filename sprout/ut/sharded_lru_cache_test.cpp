@@ -0,0 +1,335 @@
+/**
+ * @file sharded_lru_cache_test.cpp UT for the sharded LRU cache template.
+ *
+ * Project Clearwater - IMS in the Cloud
+ * Copyright (C) 2014  Metaswitch Networks Ltd
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or (at your
+ * option) any later version, along with the "Special Exception" for use of
+ * the program along with SSL, set forth below. This program is distributed
+ * in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+ * without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details. You should have received a copy of the GNU General Public
+ * License along with this program.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ *
+ * The author can be reached by email at clearwater@metaswitch.com or by
+ * post at Metaswitch Networks Ltd, 100 Church St, Enfield EN2 6BQ, UK
+ *
+ * Special Exception
+ * Metaswitch Networks Ltd  grants you permission to copy, modify,
+ * propagate, and distribute a work formed by combining OpenSSL with The
+ * Software, or a work derivative of such a combination, even if such
+ * copying, modification, propagation, or distribution would otherwise
+ * violate the terms of the GPL. You must comply with the GPL in all
+ * respects for all of the code used other than OpenSSL.
+ * "OpenSSL" means OpenSSL toolkit software distributed by the OpenSSL
+ * Project and licensed under the OpenSSL Licenses, or a work based on such
+ * software and licensed under the OpenSSL Licenses.
+ * "OpenSSL Licenses" means the OpenSSL License and Original SSLeay License
+ * under which the OpenSSL Project distributes the OpenSSL toolkit software,
+ * as those licenses appear in the file LICENSE-OPENSSL.
+ */
+
+///
+///----------------------------------------------------------------------------
+#include "gtest/gtest.h"
+
+#include <functional>
+#include <memory>
+#include <string>
+
+#include "basetest.hpp"
+#include "test_interposer.hpp"
+#include "sharded_lru_cache.h"
+
+using namespace std;
+
+/// Converts between the numbers the tests use and each type of value cached.
+template<class V> struct TestValues;
+
+template<> struct TestValues<int>
+{
+  static int make(int n) { return n; }
+  static int number(const int& v) { return v; }
+};
+
+template<> struct TestValues<std::string>
+{
+  static std::string make(int n) { return std::to_string(n); }
+  static int number(const std::string& v) { return std::stoi(v); }
+};
+
+template<> struct TestValues<std::shared_ptr<const std::string> >
+{
+  static std::shared_ptr<const std::string> make(int n)
+  {
+    return std::make_shared<const std::string>(std::to_string(n));
+  }
+  static int number(const std::shared_ptr<const std::string>& v)
+  {
+    return std::stoi(*v);
+  }
+};
+
+/// Fixture for ShardedLRUCacheTest, run for each type of value.  Time is
+/// frozen so entries only expire when the test advances time.  The cache
+/// holds two entries per shard, and entries live for 5s.
+template<class V>
+class ShardedLRUCacheTest : public BaseTest
+{
+public:
+  typedef ShardedLRUCache<V> Cache;
+
+  Cache* _cache;
+
+  ShardedLRUCacheTest()
+  {
+    cwtest_completely_control_time();
+    _cache = new Cache(2 * Cache::NUM_SHARDS, 5000);
+  }
+
+  virtual ~ShardedLRUCacheTest()
+  {
+    delete _cache; _cache = NULL;
+    cwtest_reset_time();
+  }
+
+  /// Looks up a key, returning the number cached or -1 on a miss.
+  int get(const std::string& key)
+  {
+    V value;
+    uint64_t generation;
+    return (_cache->get(key, value, generation)) ?
+             TestValues<V>::number(value) : -1;
+  }
+
+  /// Caches a number regardless of invalidations.
+  void put(const std::string& key, int n)
+  {
+    _cache->put(key, TestValues<V>::make(n));
+  }
+
+  /// Returns the shard a key is in.
+  static int shard(const std::string& key)
+  {
+    return std::hash<std::string>()(key) % Cache::NUM_SHARDS;
+  }
+
+  /// Returns a key other than the one supplied in the same shard.
+  static std::string key_in_same_shard(const std::string& key)
+  {
+    for (int ii = 0; ; ++ii)
+    {
+      std::string other = "key" + std::to_string(ii);
+      if ((other != key) && (shard(other) == shard(key)))
+      {
+        return other;
+      }
+    }
+  }
+};
+
+typedef ::testing::Types<int,
+                         std::string,
+                         std::shared_ptr<const std::string> > CachedValueTypes;
+TYPED_TEST_CASE(ShardedLRUCacheTest, CachedValueTypes);
+
+TYPED_TEST(ShardedLRUCacheTest, HitAndExpiry)
+{
+  TypeParam value;
+  uint64_t generation;
+  EXPECT_FALSE(this->_cache->get("key", value, generation));
+  EXPECT_TRUE(this->_cache->put("key", TestValues<TypeParam>::make(1), generation));
+
+  // The age of the entry is returned with it.
+  cwtest_advance_time_ms(1000);
+  uint64_t age_ms = 0;
+  ASSERT_TRUE(this->_cache->get("key", value, generation, nullptr, &age_ms));
+  EXPECT_EQ(1, TestValues<TypeParam>::number(value));
+  EXPECT_EQ(1000u, age_ms);
+
+  // Other keys aren't affected.
+  EXPECT_EQ(-1, this->get("other"));
+
+  // The entry can't be used once it is older than the TTL.
+  cwtest_advance_time_ms(4001);
+  EXPECT_EQ(-1, this->get("key"));
+
+  typename TestFixture::Cache::Stats stats;
+  this->_cache->get_stats(stats);
+  EXPECT_EQ(1u, stats.hits);
+  EXPECT_EQ(3u, stats.misses);
+  EXPECT_EQ(1u, stats.expired);
+  EXPECT_EQ(0u, stats.entries);
+}
+
+TYPED_TEST(ShardedLRUCacheTest, NoExpiry)
+{
+  typename TestFixture::Cache cache(10, 0);
+  TypeParam value;
+  uint64_t generation;
+  cache.put("key", TestValues<TypeParam>::make(1));
+  cwtest_advance_time_ms(3600000);
+  EXPECT_TRUE(cache.get("key", value, generation));
+}
+
+TYPED_TEST(ShardedLRUCacheTest, Extend)
+{
+  this->put("key", 1);
+
+  // Extending the entry keeps it for longer than the TTL, but never
+  // shortens it.
+  this->_cache->extend("key", 10000);
+  this->_cache->extend("key", 1000);
+  cwtest_advance_time_ms(9000);
+  EXPECT_EQ(1, this->get("key"));
+  cwtest_advance_time_ms(1001);
+  EXPECT_EQ(-1, this->get("key"));
+
+  // Extending doesn't create entries that aren't cached.
+  this->_cache->extend("other", 10000);
+  EXPECT_EQ(-1, this->get("other"));
+}
+
+TYPED_TEST(ShardedLRUCacheTest, ExtendAfterInvalidate)
+{
+  this->_cache->invalidate("key");
+  uint64_t generation = this->_cache->generation();
+  this->_cache->put("key", TestValues<TypeParam>::make(1), generation);
+
+  // A value cached by someone else after the key was invalidated again
+  // isn't extended by the caller that cached the first value.
+  this->_cache->invalidate("key");
+  this->put("key", 2);
+  this->_cache->extend("key", 10000, generation);
+  cwtest_advance_time_ms(5001);
+  EXPECT_EQ(-1, this->get("key"));
+
+  // It can be extended using a generation from after the invalidation.
+  this->put("key", 2);
+  this->_cache->extend("key", 10000, this->_cache->generation());
+  cwtest_advance_time_ms(5001);
+  EXPECT_EQ(2, this->get("key"));
+}
+
+TYPED_TEST(ShardedLRUCacheTest, Usable)
+{
+  this->put("key", 1);
+
+  // Entries that the caller can't use are misses.
+  TypeParam value;
+  uint64_t generation;
+  EXPECT_FALSE(this->_cache->get("key", value, generation,
+                                 [](const TypeParam& v)
+                                 { return (TestValues<TypeParam>::number(v) == 2); }));
+  EXPECT_TRUE(this->_cache->get("key", value, generation,
+                                [](const TypeParam& v)
+                                { return (TestValues<TypeParam>::number(v) == 1); }));
+}
+
+TYPED_TEST(ShardedLRUCacheTest, Invalidate)
+{
+  this->put("key", 1);
+
+  TypeParam old_value;
+  EXPECT_TRUE(this->_cache->invalidate("key", &old_value));
+  EXPECT_EQ(1, TestValues<TypeParam>::number(old_value));
+  EXPECT_EQ(-1, this->get("key"));
+
+  // Invalidating a key that isn't cached has no effect on other keys.
+  this->put("other", 2);
+  EXPECT_FALSE(this->_cache->invalidate("key"));
+  EXPECT_EQ(2, this->get("other"));
+
+  typename TestFixture::Cache::Stats stats;
+  this->_cache->get_stats(stats);
+  EXPECT_EQ(1u, stats.invalidations);
+  EXPECT_EQ(1u, stats.entries);
+}
+
+TYPED_TEST(ShardedLRUCacheTest, Generations)
+{
+  TypeParam value;
+  uint64_t generation;
+  uint64_t other_generation;
+  std::string other = TestFixture::key_in_same_shard("key");
+
+  // A value read before the key was invalidated isn't cached after it.
+  EXPECT_FALSE(this->_cache->get("key", value, generation));
+  this->_cache->invalidate("key");
+  EXPECT_FALSE(this->_cache->put("key", TestValues<TypeParam>::make(1), generation));
+  EXPECT_EQ(-1, this->get("key"));
+
+  // A value read after the invalidation is.
+  generation = this->_cache->generation();
+  EXPECT_TRUE(this->_cache->put("key", TestValues<TypeParam>::make(2), generation));
+  EXPECT_EQ(2, this->get("key"));
+
+  // Invalidating one key doesn't stop values for other keys in the same
+  // shard being cached.
+  EXPECT_FALSE(this->_cache->get(other, value, other_generation));
+  this->_cache->invalidate("key");
+  EXPECT_TRUE(this->_cache->put(other, TestValues<TypeParam>::make(3), other_generation));
+  EXPECT_EQ(3, this->get(other));
+}
+
+TYPED_TEST(ShardedLRUCacheTest, EvictedInvalidation)
+{
+  // Once the record of an invalidation has been evicted, values read before
+  // it can't be cached, but values read after it can.
+  TypeParam value;
+  uint64_t generation;
+  EXPECT_FALSE(this->_cache->get("key", value, generation));
+  this->_cache->invalidate("key");
+
+  std::string other = TestFixture::key_in_same_shard("key");
+  this->put(other, 1);
+  this->put(TestFixture::key_in_same_shard(other), 2);
+
+  EXPECT_FALSE(this->_cache->put("key", TestValues<TypeParam>::make(3), generation));
+  EXPECT_EQ(-1, this->get("key"));
+
+  generation = this->_cache->generation();
+  EXPECT_TRUE(this->_cache->put("key", TestValues<TypeParam>::make(4), generation));
+  EXPECT_EQ(4, this->get("key"));
+}
+
+TYPED_TEST(ShardedLRUCacheTest, Eviction)
+{
+  // Cache more entries than fit, reading the first one back as they are
+  // added so it is always the most recently used.
+  const int num_entries = 10 * TestFixture::Cache::NUM_SHARDS;
+  this->put("first", 0);
+
+  for (int ii = 1; ii < num_entries; ++ii)
+  {
+    this->put("key" + std::to_string(ii), ii);
+    EXPECT_EQ(0, this->get("first"));
+  }
+
+  // Each shard holds no more than its share of the entries.
+  for (int ii = 0; ii < TestFixture::Cache::NUM_SHARDS; ++ii)
+  {
+    EXPECT_GE(2u, this->_cache->_shards[ii].entries.size());
+    EXPECT_EQ(this->_cache->_shards[ii].entries.size(),
+              this->_cache->_shards[ii].lru.size());
+  }
+
+  typename TestFixture::Cache::Stats stats;
+  this->_cache->get_stats(stats);
+  EXPECT_EQ((size_t)num_entries, stats.entries + stats.evictions);
+}
+
+TYPED_TEST(ShardedLRUCacheTest, Disabled)
+{
+  typename TestFixture::Cache cache(0, 5000);
+  TypeParam value;
+  uint64_t generation;
+  cache.put("key", TestValues<TypeParam>::make(1));
+  EXPECT_FALSE(cache.get("key", value, generation));
+  EXPECT_FALSE(cache.invalidate("key"));
+}
@@ -0,0 +1,243 @@
+/**
+ * @file slab_cache_test.cpp UT for the slab cache.
+ *
+ * Project Clearwater - IMS in the Cloud
+ * Copyright (C) 2014  Metaswitch Networks Ltd
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or (at your
+ * option) any later version, along with the "Special Exception" for use of
+ * the program along with SSL, set forth below. This program is distributed
+ * in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+ * without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details. You should have received a copy of the GNU General Public
+ * License along with this program.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ *
+ * The author can be reached by email at clearwater@metaswitch.com or by
+ * post at Metaswitch Networks Ltd, 100 Church St, Enfield EN2 6BQ, UK
+ *
+ * Special Exception
+ * Metaswitch Networks Ltd  grants you permission to copy, modify,
+ * propagate, and distribute a work formed by combining OpenSSL with The
+ * Software, or a work derivative of such a combination, even if such
+ * copying, modification, propagation, or distribution would otherwise
+ * violate the terms of the GPL. You must comply with the GPL in all
+ * respects for all of the code used other than OpenSSL.
+ * "OpenSSL" means OpenSSL toolkit software distributed by the OpenSSL
+ * Project and licensed under the OpenSSL Licenses, or a work based on such
+ * software and licensed under the OpenSSL Licenses.
+ * "OpenSSL Licenses" means the OpenSSL License and Original SSLeay License
+ * under which the OpenSSL Project distributes the OpenSSL toolkit software,
+ * as those licenses appear in the file LICENSE-OPENSSL.
+ */
+
+///
+///----------------------------------------------------------------------------
+
+#include <stdint.h>
+#include <pthread.h>
+#include "gtest/gtest.h"
+
+#include "basetest.hpp"
+#include "slab_cache.h"
+
+using namespace std;
+
+/// Fixture for SlabCacheTest.
+class SlabCacheTest : public BaseTest
+{
+  SlabCacheTest()
+  {
+    // Clear the statistics from any earlier tests.
+    uint_fast64_t hits;
+    uint_fast64_t misses;
+    uint_fast64_t remote_frees;
+    SlabCache::get_stats(hits, misses, remote_frees);
+  }
+
+  virtual ~SlabCacheTest()
+  {
+  }
+};
+
+class TestObject : public SlabAllocated
+{
+public:
+  virtual ~TestObject() {}
+  char data[100];
+};
+
+class LargeTestObject : public TestObject
+{
+public:
+  char more_data[4000];
+};
+
+TEST_F(SlabCacheTest, ReusesFreedBlocks)
+{
+  void* block = SlabCache::alloc(200);
+  SlabCache::free(block, 200);
+
+  // Anything in the same size class reuses the block.
+  void* block2 = SlabCache::alloc(240);
+  EXPECT_EQ(block, block2);
+  SlabCache::free(block2, 240);
+
+  // The first allocation may also have hit the cache if earlier tests left
+  // blocks on this thread's lists, but the second one must have done.
+  uint_fast64_t hits;
+  uint_fast64_t misses;
+  uint_fast64_t remote_frees;
+  SlabCache::get_stats(hits, misses, remote_frees);
+  EXPECT_LE(1u, hits);
+  EXPECT_EQ(2u, hits + misses);
+
+  // The statistics are reset by reading them.
+  SlabCache::get_stats(hits, misses, remote_frees);
+  EXPECT_EQ(0u, hits);
+  EXPECT_EQ(0u, misses);
+  EXPECT_EQ(0u, remote_frees);
+}
+
+TEST_F(SlabCacheTest, SizeClasses)
+{
+  void* small = SlabCache::alloc(10);
+  SlabCache::free(small, 10);
+
+  // A larger allocation doesn't use the smaller block.
+  void* larger = SlabCache::alloc(1000);
+  EXPECT_NE(small, larger);
+  SlabCache::free(larger, 1000);
+
+  // Allocations above the largest size class go to the heap.
+  void* huge = SlabCache::alloc(SlabCache::MAX_BLOCK_SIZE + 1);
+  SlabCache::free(huge, SlabCache::MAX_BLOCK_SIZE + 1);
+
+  // Only the two cacheable allocations are counted.
+  uint_fast64_t hits;
+  uint_fast64_t misses;
+  uint_fast64_t remote_frees;
+  SlabCache::get_stats(hits, misses, remote_frees);
+  EXPECT_EQ(2u, hits + misses);
+}
+
+TEST_F(SlabCacheTest, SlabAllocatedObjects)
+{
+  TestObject* obj = new TestObject();
+  delete obj;
+  obj = new TestObject();
+
+  // Deleting through the base class uses the size of the derived class.
+  TestObject* large = new LargeTestObject();
+  delete large;
+  delete obj;
+
+  // The large object is too big for the cache, so isn't counted.
+  uint_fast64_t hits;
+  uint_fast64_t misses;
+  uint_fast64_t remote_frees;
+  SlabCache::get_stats(hits, misses, remote_frees);
+  EXPECT_LE(1u, hits);
+  EXPECT_EQ(2u, hits + misses);
+}
+
+static void* alloc_on_thread(void* p)
+{
+  return SlabCache::alloc(100);
+}
+
+TEST_F(SlabCacheTest, PerThreadLists)
+{
+  // A block freed on this thread isn't visible to other threads.
+  void* block = SlabCache::alloc(100);
+  SlabCache::free(block, 100);
+
+  pthread_t thread;
+  void* other_block;
+  pthread_create(&thread, NULL, alloc_on_thread, NULL);
+  pthread_join(thread, &other_block);
+  EXPECT_NE(block, other_block);
+
+  // Blocks allocated on threads that have exited can still be freed here
+  // (they go back to the heap).
+  SlabCache::free(other_block, 100);
+}
+
+struct FreeOnThreadData
+{
+  void** blocks;
+  int num_blocks;
+};
+
+static void* free_on_thread(void* p)
+{
+  FreeOnThreadData* data = (FreeOnThreadData*)p;
+  for (int ii = 0; ii < data->num_blocks; ++ii)
+  {
+    SlabCache::free(data->blocks[ii], 100);
+  }
+  return NULL;
+}
+
+TEST_F(SlabCacheTest, ExitedThreadListsFreed)
+{
+  // Make sure this thread has its lists before counting them.
+  void* block = SlabCache::alloc(100);
+  SlabCache::free(block, 100);
+  int live_lists = SlabCache::live_thread_lists();
+
+  pthread_t thread;
+  void* other_block;
+  pthread_create(&thread, NULL, alloc_on_thread, NULL);
+  pthread_join(thread, &other_block);
+
+  // The thread has exited, but its block still points at its lists, so they
+  // are kept until the block is freed.
+  EXPECT_EQ(live_lists + 1, SlabCache::live_thread_lists());
+  SlabCache::free(other_block, 100);
+  EXPECT_EQ(live_lists, SlabCache::live_thread_lists());
+
+  // A thread that only frees blocks has none in use when it exits, so its
+  // lists are freed straight away.
+  block = SlabCache::alloc(100);
+  FreeOnThreadData data = {&block, 1};
+  pthread_create(&thread, NULL, free_on_thread, &data);
+  pthread_join(thread, NULL);
+  EXPECT_EQ(live_lists, SlabCache::live_thread_lists());
+}
+
+TEST_F(SlabCacheTest, ReturnsBlocksToOwningThread)
+{
+  // Model transactions that are created on this thread but destroyed on
+  // another - each round allocates a set of blocks here and frees them on a
+  // new thread.  The blocks are returned to this thread, so after the first
+  // round every allocation hits the cache.
+  const int NUM_BLOCKS = 100;
+  const int NUM_ROUNDS = 10;
+  void* blocks[NUM_BLOCKS];
+  FreeOnThreadData data = {blocks, NUM_BLOCKS};
+
+  for (int round = 0; round < NUM_ROUNDS; ++round)
+  {
+    for (int ii = 0; ii < NUM_BLOCKS; ++ii)
+    {
+      blocks[ii] = SlabCache::alloc(100);
+    }
+
+    pthread_t thread;
+    pthread_create(&thread, NULL, free_on_thread, &data);
+    pthread_join(thread, NULL);
+  }
+
+  uint_fast64_t hits;
+  uint_fast64_t misses;
+  uint_fast64_t remote_frees;
+  SlabCache::get_stats(hits, misses, remote_frees);
+  EXPECT_EQ((uint_fast64_t)(NUM_BLOCKS * NUM_ROUNDS), hits + misses);
+  EXPECT_LE((uint_fast64_t)(NUM_BLOCKS * (NUM_ROUNDS - 1)), hits);
+  EXPECT_EQ((uint_fast64_t)(NUM_BLOCKS * NUM_ROUNDS), remote_frees);
+
+}
@@ -137,10 +137,15 @@ TEST_F(StackTest, DISABLED_SimpleLifeCycle)
                               NULL,                         // SIPResolver
                               7,                            // #PJsip threads
                               9,                            // #worker threads
+                              9,                            // Max #worker threads
+                              3,                            // #worker queues
+                              std::vector<unsigned int>(),  // Max queue depths
+                              8,                            // Worker batch size
                               1,                            // RR strategy
                               60 * 10,                      // Session refresh interval
                               NULL,                         // Quiescing manager
                               NULL,                         // Load monitor
+                              std::vector<int>(),           // Target latencies
                               "");                          // CDF domain
   ASSERT_EQ(PJ_SUCCESS, rc) << PjStatus(rc);
   EXPECT_TRUE(log.contains("Listening on port 9408"));
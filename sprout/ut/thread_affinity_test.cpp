@@ -0,0 +1,173 @@
+/**
+ * @file thread_affinity_test.cpp UT for the thread affinity utilities.
+ *
+ * Project Clearwater - IMS in the Cloud
+ * Copyright (C) 2014  Metaswitch Networks Ltd
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or (at your
+ * option) any later version, along with the "Special Exception" for use of
+ * the program along with SSL, set forth below. This program is distributed
+ * in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+ * without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details. You should have received a copy of the GNU General Public
+ * License along with this program.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ *
+ * The author can be reached by email at clearwater@metaswitch.com or by
+ * post at Metaswitch Networks Ltd, 100 Church St, Enfield EN2 6BQ, UK
+ *
+ * Special Exception
+ * Metaswitch Networks Ltd  grants you permission to copy, modify,
+ * propagate, and distribute a work formed by combining OpenSSL with The
+ * Software, or a work derivative of such a combination, even if such
+ * copying, modification, propagation, or distribution would otherwise
+ * violate the terms of the GPL. You must comply with the GPL in all
+ * respects for all of the code used other than OpenSSL.
+ * "OpenSSL" means OpenSSL toolkit software distributed by the OpenSSL
+ * Project and licensed under the OpenSSL Licenses, or a work based on such
+ * software and licensed under the OpenSSL Licenses.
+ * "OpenSSL Licenses" means the OpenSSL License and Original SSLeay License
+ * under which the OpenSSL Project distributes the OpenSSL toolkit software,
+ * as those licenses appear in the file LICENSE-OPENSSL.
+ */
+
+///
+///----------------------------------------------------------------------------
+#include <pthread.h>
+#include "gtest/gtest.h"
+
+#include "basetest.hpp"
+#include "thread_affinity.h"
+
+using namespace std;
+
+/// Fixture for ThreadAffinityTest.
+class ThreadAffinityTest : public BaseTest
+{
+  ThreadAffinityTest()
+  {
+  }
+
+  virtual ~ThreadAffinityTest()
+  {
+  }
+};
+
+TEST_F(ThreadAffinityTest, ParseSingleCPUs)
+{
+  cpu_set_t cpus;
+  EXPECT_TRUE(ThreadAffinity::parse_cpu_list("0,2,5", cpus));
+  EXPECT_EQ(3, CPU_COUNT(&cpus));
+  EXPECT_TRUE(CPU_ISSET(0, &cpus));
+  EXPECT_TRUE(CPU_ISSET(2, &cpus));
+  EXPECT_TRUE(CPU_ISSET(5, &cpus));
+  EXPECT_EQ("0,2,5", ThreadAffinity::cpu_list(cpus));
+}
+
+TEST_F(ThreadAffinityTest, ParseRanges)
+{
+  cpu_set_t cpus;
+  EXPECT_TRUE(ThreadAffinity::parse_cpu_list("0-3, 8,10-11", cpus));
+  EXPECT_EQ(7, CPU_COUNT(&cpus));
+  EXPECT_EQ("0-3,8,10-11", ThreadAffinity::cpu_list(cpus));
+}
+
+TEST_F(ThreadAffinityTest, ParseInvalid)
+{
+  cpu_set_t cpus;
+  EXPECT_FALSE(ThreadAffinity::parse_cpu_list("", cpus));
+  EXPECT_FALSE(ThreadAffinity::parse_cpu_list("a", cpus));
+  EXPECT_FALSE(ThreadAffinity::parse_cpu_list("1-", cpus));
+  EXPECT_FALSE(ThreadAffinity::parse_cpu_list("3-1", cpus));
+  EXPECT_FALSE(ThreadAffinity::parse_cpu_list("100000", cpus));
+}
+
+static void* pin_thread(void* p)
+{
+  // Pin to the CPUs the thread is already allowed to use, so the test works
+  // whatever CPUs are available.
+  cpu_set_t cpus;
+  pthread_getaffinity_np(pthread_self(), sizeof(cpus), &cpus);
+  bool* pinned = (bool*)p;
+  *pinned = ThreadAffinity::pin_thread("ut-pinned", cpus, false);
+  return NULL;
+}
+
+TEST_F(ThreadAffinityTest, PinThread)
+{
+  bool pinned = false;
+  pthread_t thread;
+  pthread_create(&thread, NULL, &pin_thread, &pinned);
+  pthread_join(thread, NULL);
+  EXPECT_TRUE(pinned);
+
+  // The placement has been recorded.
+  vector<string> placements;
+  ThreadAffinity::get_placements(placements);
+  bool found = false;
+  for (size_t ii = 0; ii < placements.size(); ++ii)
+  {
+    if (placements[ii].find("ut-pinned cpus=") == 0)
+    {
+      found = true;
+    }
+  }
+  EXPECT_TRUE(found);
+
+  // The placement is forgotten once the thread is removed.
+  ThreadAffinity::remove_placement("ut-pinned");
+  placements.clear();
+  ThreadAffinity::get_placements(placements);
+  for (size_t ii = 0; ii < placements.size(); ++ii)
+  {
+    EXPECT_NE(0u, placements[ii].find("ut-pinned cpus="));
+  }
+}
+
+static void* unpin_child_thread(void* p)
+{
+  // This thread has inherited the single CPU its parent is pinned to.
+  ThreadAffinity::unpin_thread("ut-unpinned");
+  cpu_set_t* cpus = (cpu_set_t*)p;
+  pthread_getaffinity_np(pthread_self(), sizeof(*cpus), cpus);
+  return NULL;
+}
+
+static void* pin_parent_thread(void* p)
+{
+  // Pin to the first CPU this thread may use, then create a child thread.
+  cpu_set_t cpus;
+  pthread_getaffinity_np(pthread_self(), sizeof(cpus), &cpus);
+  int cpu = 0;
+  while (!CPU_ISSET(cpu, &cpus))
+  {
+    ++cpu;
+  }
+  CPU_ZERO(&cpus);
+  CPU_SET(cpu, &cpus);
+  ThreadAffinity::pin_thread("ut-parent", cpus, false);
+
+  pthread_t thread;
+  pthread_create(&thread, NULL, &unpin_child_thread, p);
+  pthread_join(thread, NULL);
+  return NULL;
+}
+
+TEST_F(ThreadAffinityTest, UnpinThread)
+{
+  cpu_set_t process_cpus;
+  pthread_getaffinity_np(pthread_self(), sizeof(process_cpus), &process_cpus);
+  ThreadAffinity::save_process_cpus();
+
+  // A thread created by a pinned thread goes back to the original affinity
+  // when it is unpinned.
+  cpu_set_t child_cpus;
+  CPU_ZERO(&child_cpus);
+  pthread_t thread;
+  pthread_create(&thread, NULL, &pin_parent_thread, &child_cpus);
+  pthread_join(thread, NULL);
+  EXPECT_TRUE(CPU_EQUAL(&process_cpus, &child_cpus));
+}
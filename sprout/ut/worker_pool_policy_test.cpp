@@ -0,0 +1,125 @@
+/**
+ * @file worker_pool_policy_test.cpp UT for the worker thread pool sizing policy.
+ *
+ * Project Clearwater - IMS in the Cloud
+ * Copyright (C) 2014  Metaswitch Networks Ltd
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or (at your
+ * option) any later version, along with the "Special Exception" for use of
+ * the program along with SSL, set forth below. This program is distributed
+ * in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+ * without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details. You should have received a copy of the GNU General Public
+ * License along with this program.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ *
+ * The author can be reached by email at clearwater@metaswitch.com or by
+ * post at Metaswitch Networks Ltd, 100 Church St, Enfield EN2 6BQ, UK
+ *
+ * Special Exception
+ * Metaswitch Networks Ltd  grants you permission to copy, modify,
+ * propagate, and distribute a work formed by combining OpenSSL with The
+ * Software, or a work derivative of such a combination, even if such
+ * copying, modification, propagation, or distribution would otherwise
+ * violate the terms of the GPL. You must comply with the GPL in all
+ * respects for all of the code used other than OpenSSL.
+ * "OpenSSL" means OpenSSL toolkit software distributed by the OpenSSL
+ * Project and licensed under the OpenSSL Licenses, or a work based on such
+ * software and licensed under the OpenSSL Licenses.
+ * "OpenSSL Licenses" means the OpenSSL License and Original SSLeay License
+ * under which the OpenSSL Project distributes the OpenSSL toolkit software,
+ * as those licenses appear in the file LICENSE-OPENSSL.
+ */
+
+///
+///----------------------------------------------------------------------------
+#include "gtest/gtest.h"
+
+#include "basetest.hpp"
+#include "worker_pool_policy.h"
+
+using namespace std;
+
+/// Fixture for WorkerPoolPolicyTest.
+class WorkerPoolPolicyTest : public BaseTest
+{
+  WorkerPoolPolicyTest()
+  {
+  }
+
+  virtual ~WorkerPoolPolicyTest()
+  {
+  }
+};
+
+TEST_F(WorkerPoolPolicyTest, QueueShare)
+{
+  // Threads are shared evenly, with the remainder going to the first queues.
+  EXPECT_EQ(4, WorkerPoolPolicy::queue_share(10, 3, 0));
+  EXPECT_EQ(3, WorkerPoolPolicy::queue_share(10, 3, 1));
+  EXPECT_EQ(3, WorkerPoolPolicy::queue_share(10, 3, 2));
+  EXPECT_EQ(5, WorkerPoolPolicy::queue_share(10, 2, 1));
+  EXPECT_EQ(1, WorkerPoolPolicy::queue_share(1, 1, 0));
+}
+
+TEST_F(WorkerPoolPolicyTest, GrowWhenBlocked)
+{
+  unsigned long high_wait = WorkerPoolPolicy::GROW_WAIT_US + 1;
+
+  // The wait is high and at least half the workers are blocked on I/O.
+  EXPECT_EQ(WorkerPoolPolicy::GROW,
+            WorkerPoolPolicy::review(high_wait, 4, 2, 0, 2, 8));
+
+  // Fewer than half the workers are blocked, so they are busy on the CPU and
+  // another thread wouldn't help.
+  EXPECT_EQ(WorkerPoolPolicy::NO_CHANGE,
+            WorkerPoolPolicy::review(high_wait, 4, 1, 0, 2, 8));
+
+  // The wait isn't high enough.
+  EXPECT_EQ(WorkerPoolPolicy::NO_CHANGE,
+            WorkerPoolPolicy::review(WorkerPoolPolicy::GROW_WAIT_US, 4, 4, 0, 2, 8));
+}
+
+TEST_F(WorkerPoolPolicyTest, MaxSize)
+{
+  // A pool at its maximum size never grows.
+  unsigned long high_wait = WorkerPoolPolicy::GROW_WAIT_US + 1;
+  EXPECT_EQ(WorkerPoolPolicy::GROW,
+            WorkerPoolPolicy::review(high_wait, 7, 7, 0, 2, 8));
+  EXPECT_EQ(WorkerPoolPolicy::NO_CHANGE,
+            WorkerPoolPolicy::review(high_wait, 8, 8, 0, 2, 8));
+
+  // Nor does a fixed size pool.
+  EXPECT_EQ(WorkerPoolPolicy::NO_CHANGE,
+            WorkerPoolPolicy::review(high_wait, 4, 4, 0, 4, 4));
+}
+
+TEST_F(WorkerPoolPolicyTest, RetireWhenIdle)
+{
+  unsigned long low_wait = WorkerPoolPolicy::SHRINK_WAIT_US - 1;
+
+  // The wait is low and more than one worker is idle.
+  EXPECT_EQ(WorkerPoolPolicy::SHRINK,
+            WorkerPoolPolicy::review(low_wait, 4, 0, 2, 2, 8));
+
+  // Only one worker is idle, so retiring it would leave none spare.
+  EXPECT_EQ(WorkerPoolPolicy::NO_CHANGE,
+            WorkerPoolPolicy::review(low_wait, 4, 0, 1, 2, 8));
+
+  // The wait isn't low enough.
+  EXPECT_EQ(WorkerPoolPolicy::NO_CHANGE,
+            WorkerPoolPolicy::review(WorkerPoolPolicy::SHRINK_WAIT_US, 4, 0, 4, 2, 8));
+}
+
+TEST_F(WorkerPoolPolicyTest, MinSize)
+{
+  // A pool at its minimum size never shrinks.
+  unsigned long low_wait = WorkerPoolPolicy::SHRINK_WAIT_US - 1;
+  EXPECT_EQ(WorkerPoolPolicy::SHRINK,
+            WorkerPoolPolicy::review(low_wait, 3, 0, 3, 2, 8));
+  EXPECT_EQ(WorkerPoolPolicy::NO_CHANGE,
+            WorkerPoolPolicy::review(low_wait, 2, 0, 2, 2, 8));
+}
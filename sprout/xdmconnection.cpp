@@ -47,6 +47,7 @@
 #include "httpconnection.h"
 #include "xdmconnection.h"
 #include "accumulator.h"
+#include "stack.h"
 
 /// Main constructor.
 XDMConnection::XDMConnection(const std::string& server,
@@ -93,7 +94,9 @@ bool XDMConnection::get_simservs(const std::string& user,
 
   std::string url = "/org.etsi.ngn.simservs/users/" + Utils::url_escape(user) + "/simservs.xml";
 
+  worker_blocked(true);
   HTTPCode http_code = _http->send_get(url, xml_data, user, trail);
+  worker_blocked(false);
 
   unsigned long latency_us = 0;
   if (stopWatch.read(latency_us))
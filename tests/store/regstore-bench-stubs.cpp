@@ -0,0 +1,71 @@
+// Stack stubs for the RegStore benchmark.
+//
+// The RegStore objects call into the SIP stack to report statistics, to
+// mark worker threads as blocked and to send NOTIFYs when bindings expire.
+// The benchmark has no SIP stack (and its bindings never expire while it
+// runs), so these stand in for stack.o, pjutils.o and notify_utils.o, which
+// would otherwise pull in the rest of sprout.
+
+#include "stack.h"
+#include "pjutils.h"
+#include "notify_utils.h"
+
+struct stack_data_struct stack_data;
+
+void post_to_worker(const std::function<void()>& callback)
+{
+  // There are no worker threads, so run the callback immediately.
+  callback();
+}
+
+void worker_blocked(bool blocked)
+{
+}
+
+void add_stats_reporter(const void* owner,
+                        const std::function<void()>& reporter)
+{
+}
+
+void remove_stats_reporter(const void* owner)
+{
+}
+
+pj_status_t NotifyUtils::create_notify(pjsip_tx_data** tdata_notify,
+                                       RegStore::AoR::Subscription* subscription,
+                                       std::string aor,
+                                       int cseq,
+                                       std::map<std::string, RegStore::AoR::Binding> bindings,
+                                       NotifyUtils::DocState doc_state,
+                                       NotifyUtils::RegistrationState reg_state,
+                                       NotifyUtils::ContactState contact_state,
+                                       NotifyUtils::ContactEvent contact_event,
+                                       NotifyUtils::SubscriptionState subscription_state,
+                                       int expiry)
+{
+  return PJ_ENOTSUP;
+}
+
+pj_status_t PJUtils::send_request(pjsip_tx_data* tdata,
+                                  int retries,
+                                  void* token,
+                                  pjsip_endpt_send_callback cb,
+                                  bool log_sas_branch)
+{
+  return PJ_ENOTSUP;
+}
+
+pjsip_uri* PJUtils::uri_from_string(const std::string& uri_s,
+                                    pj_pool_t* pool,
+                                    pj_bool_t force_name_addr)
+{
+  return NULL;
+}
+
+pj_str_t PJUtils::uri_to_pj_str(pjsip_uri_context_e context,
+                                const pjsip_uri* uri,
+                                pj_pool_t* pool)
+{
+  pj_str_t s = {NULL, 0};
+  return s;
+}
@@ -0,0 +1,716 @@
+// RegStore benchmark.
+//
+// Runs a mix of registration operations against a RegStore from a number
+// of threads for a fixed time, and reports the throughput, the latency
+// percentiles of each operation, the CAS retry rate and the size of the
+// stored AoRs.  The AoRs used are chosen with a Zipf distribution, so a few
+// are much busier than the rest (as with shared enterprise AoRs).
+//
+// The store is either a memcached cluster (given by a memstore config file,
+// as used by sprout) or an in-process local store, which is useful for
+// measuring the cost of serialization on its own.
+
+#include <getopt.h>
+#include <math.h>
+#include <pthread.h>
+#include <time.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <algorithm>
+#include <atomic>
+#include <fstream>
+#include <iostream>
+#include <random>
+#include <string>
+#include <vector>
+
+#include <json/json.h>
+
+#include "log.h"
+#include "logger.h"
+#include "utils.h"
+#include "store.h"
+#include "localstore.h"
+#include "memcachedstore.h"
+#include "regstore.h"
+#include "aor_cache.h"
+#include "aor_write_coalescer.h"
+#include "latency_histogram.h"
+
+// Operations in the mix.
+enum OpType
+{
+  OP_REGISTER,
+  OP_REFRESH,
+  OP_DEREGISTER,
+  OP_SUBSCRIBE,
+  OP_LOOKUP,
+  NUM_OP_TYPES
+};
+
+static const char* OP_NAMES[NUM_OP_TYPES] =
+{
+  "register",
+  "refresh",
+  "deregister",
+  "subscribe",
+  "lookup"
+};
+
+// Options variables - all are read-only once the threads are started.
+std::string memstore_config;
+int num_threads = 1;
+int duration_s = 10;
+int num_aors = 10000;
+int num_bindings = 1;
+double zipf_exponent = 1.0;
+std::string mix = "register=10,refresh=60,deregister=5,subscribe=5,lookup=20";
+int weights[NUM_OP_TYPES];
+int total_weight = 0;
+int expires = 3600;
+RegStore::SerializerFormat format = RegStore::FORMAT_BINARY;
+RegStore::StorageLayout layout = RegStore::LAYOUT_AOR;
+int aor_cache_size = 0;
+bool coalesce_aor_writes = false;
+std::string json_file;
+std::string aor_domain = "bench.example.com";
+int log_level = 2;
+
+// Pointer to the store object - read-only once the threads are started.
+RegStore* store;
+
+// Cumulative probabilities of the AoRs being picked.
+std::vector<double> aor_cdf;
+
+// Results, updated by all the threads.
+LatencyHistogram latencies[NUM_OP_TYPES];
+std::atomic<uint_fast64_t> op_counts[NUM_OP_TYPES];
+std::atomic<uint_fast64_t> op_errors[NUM_OP_TYPES];
+std::atomic<uint_fast64_t> updates;
+std::atomic<uint_fast64_t> cas_retries;
+std::atomic<int> max_cas_retries;
+
+static uint64_t now_us()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static std::string aor_name(int index)
+{
+  return "sip:bench" + std::to_string(index) + "@" + aor_domain;
+}
+
+/// Sets up the cumulative probabilities for a Zipf distribution over the
+/// AoRs, so AoR k (counting from 1) is picked with probability proportional
+/// to 1/k^s.  An exponent of zero picks the AoRs uniformly.
+static void init_zipf()
+{
+  aor_cdf.resize(num_aors);
+  double sum = 0.0;
+  for (int ii = 0; ii < num_aors; ++ii)
+  {
+    sum += 1.0 / pow((double)(ii + 1), zipf_exponent);
+    aor_cdf[ii] = sum;
+  }
+  for (int ii = 0; ii < num_aors; ++ii)
+  {
+    aor_cdf[ii] /= sum;
+  }
+}
+
+static int pick_aor(std::mt19937_64& rng)
+{
+  double u = std::uniform_real_distribution<double>(0.0, 1.0)(rng);
+  int index = std::lower_bound(aor_cdf.begin(), aor_cdf.end(), u) - aor_cdf.begin();
+  return (index < num_aors) ? index : num_aors - 1;
+}
+
+static OpType pick_op(std::mt19937_64& rng)
+{
+  int w = std::uniform_int_distribution<int>(0, total_weight - 1)(rng);
+  int op = 0;
+  while (w >= weights[op])
+  {
+    w -= weights[op];
+    ++op;
+  }
+  return (OpType)op;
+}
+
+/// Fills in a binding as a REGISTER would.
+static void fill_binding(RegStore::AoR::Binding* b,
+                         const std::string& binding_id,
+                         int index)
+{
+  b->_uri = "<sip:bench" + std::to_string(index) + "@192.91.191.29:59934;transport=tcp;ob>";
+  b->_cid = "gfYHoZGaFaRNxhlV0WIwoS-" + binding_id;
+  b->_cseq++;
+  b->_expires = time(NULL) + expires;
+  b->_priority = 1000;
+  b->_path_headers.clear();
+  b->_path_headers.push_back("<sip:abcdefgh@bono1.homedomain;lr>");
+  b->_params["+sip.instance"] = "\"<urn:uuid:00000000-0000-0000-0000-" + binding_id + ">\"";
+  b->_params["reg-id"] = "1";
+  b->_params["+sip.ice"] = "";
+  b->_private_id = "bench" + std::to_string(index) + "@" + aor_domain;
+  b->_emergency_registration = false;
+}
+
+/// Fills in a subscription as a SUBSCRIBE would.
+static void fill_subscription(RegStore::AoR::Subscription* s,
+                              const std::string& to_tag,
+                              int index)
+{
+  s->_req_uri = "sip:bench" + std::to_string(index) + "@192.91.191.29:59934;transport=tcp";
+  s->_from_uri = "<" + aor_name(index) + ">";
+  s->_from_tag = "4321";
+  s->_to_uri = "<" + aor_name(index) + ">";
+  s->_to_tag = to_tag;
+  s->_cid = "xyzabc@192.91.191.29";
+  s->_route_uris.clear();
+  s->_route_uris.push_back("sip:abcdefgh@bono1.homedomain;lr");
+  s->_expires = time(NULL) + expires;
+}
+
+/// Makes an update to an AoR, recording the CAS retries.  Returns false if
+/// the update failed.
+static bool update(int index, const RegStore::Mutation& mutation)
+{
+  bool all_bindings_expired;
+  int retries = 0;
+  RegStore::AoR* aor_data = store->update_aor_data(aor_name(index),
+                                                   mutation,
+                                                   false,
+                                                   0,
+                                                   all_bindings_expired,
+                                                   retries);
+  updates++;
+  cas_retries += retries;
+  int max_retries = max_cas_retries;
+  while ((retries > max_retries) &&
+         (!max_cas_retries.compare_exchange_weak(max_retries, retries)))
+  {
+  }
+
+  bool success = (aor_data != NULL);
+  delete aor_data;
+  return success;
+}
+
+static bool run_op(OpType op, int index, std::mt19937_64& rng)
+{
+  int slot = std::uniform_int_distribution<int>(0, num_bindings - 1)(rng);
+  std::string binding_id = "binding" + std::to_string(slot);
+  bool success = true;
+
+  switch (op)
+  {
+    case OP_REGISTER:
+      success = update(index, [&](RegStore::AoR* aor_data)
+      {
+        fill_binding(aor_data->get_binding(binding_id), binding_id, index);
+      });
+      break;
+
+    case OP_REFRESH:
+      success = update(index, [&](RegStore::AoR* aor_data)
+      {
+        // Refresh the chosen binding if it exists, or register it if not.
+        RegStore::AoR::Bindings::const_iterator i = aor_data->bindings().find(binding_id);
+        if (i != aor_data->bindings().end())
+        {
+          RegStore::AoR::Binding* b = aor_data->get_binding(binding_id);
+          b->_cseq++;
+          b->_expires = time(NULL) + expires;
+        }
+        else
+        {
+          fill_binding(aor_data->get_binding(binding_id), binding_id, index);
+        }
+      });
+      break;
+
+    case OP_DEREGISTER:
+      success = update(index, [&](RegStore::AoR* aor_data)
+      {
+        aor_data->remove_binding(binding_id);
+      });
+      break;
+
+    case OP_SUBSCRIBE:
+      success = update(index, [&](RegStore::AoR* aor_data)
+      {
+        std::string to_tag = "sub" + std::to_string(slot);
+        fill_subscription(aor_data->get_subscription(to_tag), to_tag, index);
+      });
+      break;
+
+    case OP_LOOKUP:
+      {
+        RegStore::AoR* aor_data = store->lookup_aor_data(aor_name(index), 0);
+        success = (aor_data != NULL);
+        delete aor_data;
+      }
+      break;
+
+    default:
+      break;
+  }
+
+  return success;
+}
+
+/// Writes every AoR with the full number of bindings.  The AoRs are shared
+/// between the threads.
+static void* populate_thread(void* p)
+{
+  long tid = (long)p;
+
+  for (int index = tid; index < num_aors; index += num_threads)
+  {
+    bool success = update(index, [&](RegStore::AoR* aor_data)
+    {
+      for (int jj = 0; jj < num_bindings; ++jj)
+      {
+        std::string binding_id = "binding" + std::to_string(jj);
+        fill_binding(aor_data->get_binding(binding_id), binding_id, index);
+      }
+    });
+
+    if (!success)
+    {
+      printf("%ld: Failed to write %s\n", tid, aor_name(index).c_str());
+      exit(1);
+    }
+  }
+
+  return NULL;
+}
+
+static void* bench_thread(void* p)
+{
+  long tid = (long)p;
+  std::mt19937_64 rng(tid + 1);
+  uint64_t end_us = now_us() + (uint64_t)duration_s * 1000000;
+
+  while (true)
+  {
+    uint64_t start_us = now_us();
+    if (start_us >= end_us)
+    {
+      break;
+    }
+
+    OpType op = pick_op(rng);
+    int index = pick_aor(rng);
+    bool success = run_op(op, index, rng);
+
+    latencies[op].record(now_us() - start_us);
+    op_counts[op]++;
+    if (!success)
+    {
+      op_errors[op]++;
+    }
+  }
+
+  return NULL;
+}
+
+static void run_threads(void* (*func)(void*))
+{
+  std::vector<pthread_t> threads;
+
+  for (int ii = 0; ii < num_threads; ++ii)
+  {
+    pthread_t tid;
+    pthread_create(&tid, NULL, func, (void*)(long)ii);
+    threads.push_back(tid);
+  }
+
+  for (int ii = 0; ii < num_threads; ++ii)
+  {
+    pthread_join(threads[ii], NULL);
+  }
+}
+
+/// Parses the operation mix, returning false if it is invalid.
+static bool parse_mix(const std::string& s)
+{
+  for (int ii = 0; ii < NUM_OP_TYPES; ++ii)
+  {
+    weights[ii] = 0;
+  }
+
+  std::vector<std::string> entries;
+  Utils::split_string(s, ',', entries, 0, true);
+
+  for (std::vector<std::string>::const_iterator i = entries.begin();
+       i != entries.end();
+       ++i)
+  {
+    size_t eq = i->find('=');
+    if (eq == std::string::npos)
+    {
+      return false;
+    }
+
+    std::string name = i->substr(0, eq);
+    int op = 0;
+    while ((op < NUM_OP_TYPES) && (name != OP_NAMES[op]))
+    {
+      ++op;
+    }
+    if (op == NUM_OP_TYPES)
+    {
+      return false;
+    }
+    weights[op] = atoi(i->substr(eq + 1).c_str());
+  }
+
+  total_weight = 0;
+  for (int ii = 0; ii < NUM_OP_TYPES; ++ii)
+  {
+    total_weight += weights[ii];
+  }
+  return (total_weight > 0);
+}
+
+/// Works out the mean size of the stored AoRs and their mean number of
+/// bindings, from a sample of up to 1000 AoRs.
+static void measure_aors(double& bytes_per_aor, double& bindings_per_aor)
+{
+  int step = (num_aors > 1000) ? num_aors / 1000 : 1;
+  uint64_t bytes = 0;
+  uint64_t bindings = 0;
+  int sampled = 0;
+
+  for (int index = 0; index < num_aors; index += step)
+  {
+    RegStore::AoR* aor_data = store->get_aor_data(aor_name(index), 0);
+    if (aor_data != NULL)
+    {
+      bytes += RegStore::serialize_aor(aor_data, format).size();
+      bindings += aor_data->bindings().size();
+      ++sampled;
+      delete aor_data;
+    }
+  }
+
+  bytes_per_aor = (sampled > 0) ? (double)bytes / sampled : 0.0;
+  bindings_per_aor = (sampled > 0) ? (double)bindings / sampled : 0.0;
+}
+
+static void usage(char* command)
+{
+  printf("%s [options]\n", command);
+  printf("Options:\n\n"
+         " -M, --memstore <config_file>   Use the memcached cluster in the config file (default is\n"
+         "                                an in-process local store)\n"
+         " -t, --threads <threads>        Number of threads to run (default is 1)\n"
+         " -d, --duration <seconds>       How long to run for (default is 10)\n"
+         " -n, --aors <aors>              Number of AoRs (default is 10000)\n"
+         " -b, --bindings <bindings>      Number of bindings per AoR (default is 1)\n"
+         " -z, --zipf <exponent>          Exponent of the Zipf distribution of AoR popularity, zero\n"
+         "                                for uniform (default is 1.0)\n"
+         " -x, --mix <mix>                Weights of the operations, as a comma separated list of\n"
+         "                                <operation>=<weight> where the operations are register,\n"
+         "                                refresh, deregister, subscribe and lookup (default is\n"
+         "                                register=10,refresh=60,deregister=5,subscribe=5,lookup=20)\n"
+         " -e, --expires <expires>        Expiry of bindings and subscriptions (default is 3600)\n"
+         "     --legacy-aor-format        Write AoRs in the legacy format\n"
+         "     --per-binding-storage      Store each binding and subscription as a separate record\n"
+         "     --aor-cache-size <aors>    Cache up to this many AoRs for lookups (default is 0)\n"
+         "     --coalesce-aor-writes      Combine concurrent updates to the same AoR\n"
+         " -j, --json <file>              Write the results as JSON to the file, or to standard\n"
+         "                                output if the file is -\n"
+         " -D, --domain <domain>          AoR domain (default is bench.example.com)\n"
+         " -L, --log-level <log-level>    Specifies the log level (default is 2)\n");
+}
+
+enum
+{
+  OPT_LEGACY_AOR_FORMAT = 256,
+  OPT_PER_BINDING_STORAGE,
+  OPT_AOR_CACHE_SIZE,
+  OPT_COALESCE_AOR_WRITES
+};
+
+int main (int argc, char *argv[])
+{
+  // Parse the command line options
+  while (true)
+  {
+    static struct option long_options[] =
+    {
+      {"memstore",            required_argument,         0, 'M'},
+      {"threads",             required_argument,         0, 't'},
+      {"duration",            required_argument,         0, 'd'},
+      {"aors",                required_argument,         0, 'n'},
+      {"bindings",            required_argument,         0, 'b'},
+      {"zipf",                required_argument,         0, 'z'},
+      {"mix",                 required_argument,         0, 'x'},
+      {"expires",             required_argument,         0, 'e'},
+      {"legacy-aor-format",   no_argument,               0, OPT_LEGACY_AOR_FORMAT},
+      {"per-binding-storage", no_argument,               0, OPT_PER_BINDING_STORAGE},
+      {"aor-cache-size",      required_argument,         0, OPT_AOR_CACHE_SIZE},
+      {"coalesce-aor-writes", no_argument,               0, OPT_COALESCE_AOR_WRITES},
+      {"json",                required_argument,         0, 'j'},
+      {"domain",              required_argument,         0, 'D'},
+      {"log-level",           required_argument,         0, 'L'},
+      {0, 0, 0, 0}
+    };
+
+    // getopt_long stores the option index here.
+    int option_index = 0;
+
+    int c = getopt_long(argc, argv, "M:t:d:n:b:z:x:e:j:D:L:", long_options, &option_index);
+
+    // Detect the end of the options.
+    if (c == -1)
+    {
+      break;
+    }
+
+    switch (c)
+    {
+      case 'M':
+        memstore_config = std::string(optarg);
+        break;
+
+      case 't':
+        num_threads = atoi(optarg);
+        break;
+
+      case 'd':
+        duration_s = atoi(optarg);
+        break;
+
+      case 'n':
+        num_aors = atoi(optarg);
+        break;
+
+      case 'b':
+        num_bindings = atoi(optarg);
+        break;
+
+      case 'z':
+        zipf_exponent = atof(optarg);
+        break;
+
+      case 'x':
+        mix = std::string(optarg);
+        break;
+
+      case 'e':
+        expires = atoi(optarg);
+        break;
+
+      case OPT_LEGACY_AOR_FORMAT:
+        format = RegStore::FORMAT_LEGACY;
+        break;
+
+      case OPT_PER_BINDING_STORAGE:
+        layout = RegStore::LAYOUT_PER_BINDING;
+        break;
+
+      case OPT_AOR_CACHE_SIZE:
+        aor_cache_size = atoi(optarg);
+        break;
+
+      case OPT_COALESCE_AOR_WRITES:
+        coalesce_aor_writes = true;
+        break;
+
+      case 'j':
+        json_file = std::string(optarg);
+        break;
+
+      case 'D':
+        aor_domain = std::string(optarg);
+        break;
+
+      case 'L':
+        log_level = atoi(optarg);
+        break;
+
+      default:
+        usage(argv[0]);
+        exit(1);
+    }
+  }
+
+  if ((num_threads < 1) || (num_aors < 1) || (num_bindings < 1) ||
+      (duration_s < 1) || (!parse_mix(mix)))
+  {
+    usage(argv[0]);
+    exit(1);
+  }
+
+  // The human readable results are omitted if the JSON results are going to
+  // standard output.
+  bool print = (json_file != "-");
+
+  if (print)
+  {
+    printf("Store = %s\n", (memstore_config != "") ? memstore_config.c_str() : "local");
+    printf("%d threads for %d seconds\n", num_threads, duration_s);
+    printf("%d AoRs with %d bindings, Zipf exponent %g\n", num_aors, num_bindings, zipf_exponent);
+    printf("Mix = %s\n", mix.c_str());
+  }
+
+  Log::setLoggingLevel(log_level);
+  Log::setLogger(new Logger());
+
+  // Open the store.
+  Store* data_store;
+  if (memstore_config != "")
+  {
+    data_store = (Store*)new MemcachedStore(false, memstore_config);
+  }
+  else
+  {
+    data_store = (Store*)new LocalStore();
+  }
+
+  AoRCache* aor_cache = (aor_cache_size > 0) ?
+                          new AoRCache(aor_cache_size, 500, NULL) : NULL;
+  AoRWriteCoalescer* aor_write_coalescer = (coalesce_aor_writes) ?
+                                             new AoRWriteCoalescer(NULL) : NULL;
+
+  // Timers are never set, so no Chronos connection is needed.
+  store = new RegStore(data_store,
+                       NULL,
+                       format,
+                       layout,
+                       aor_cache,
+                       NULL,
+                       aor_write_coalescer);
+
+  for (int ii = 0; ii < NUM_OP_TYPES; ++ii)
+  {
+    op_counts[ii] = 0;
+    op_errors[ii] = 0;
+  }
+  max_cas_retries = 0;
+
+  init_zipf();
+
+  uint64_t start_us = now_us();
+  run_threads(populate_thread);
+  double populate_s = (double)(now_us() - start_us) / 1000000.0;
+
+  if (print)
+  {
+    printf("Wrote %d AoRs in %g seconds\n", num_aors, populate_s);
+  }
+
+  // Only count the retries made while running the mix.
+  updates = 0;
+  cas_retries = 0;
+  max_cas_retries = 0;
+
+  start_us = now_us();
+  run_threads(bench_thread);
+  double elapsed_s = (double)(now_us() - start_us) / 1000000.0;
+
+  double bytes_per_aor;
+  double bindings_per_aor;
+  measure_aors(bytes_per_aor, bindings_per_aor);
+
+  uint_fast64_t total_ops = 0;
+  Json::Value operations(Json::objectValue);
+
+  for (int ii = 0; ii < NUM_OP_TYPES; ++ii)
+  {
+    std::vector<uint_fast64_t> counts;
+    latencies[ii].snapshot(counts);
+    uint_fast64_t count = op_counts[ii];
+    total_ops += count;
+
+    Json::Value& result = operations[OP_NAMES[ii]];
+    result["count"] = (Json::UInt64)count;
+    result["errors"] = (Json::UInt64)op_errors[ii];
+    result["ops_per_sec"] = count / elapsed_s;
+    result["p50_us"] = (Json::UInt64)LatencyHistogram::percentile(counts, 0.5);
+    result["p99_us"] = (Json::UInt64)LatencyHistogram::percentile(counts, 0.99);
+    result["p999_us"] = (Json::UInt64)LatencyHistogram::percentile(counts, 0.999);
+
+    if ((print) && (count > 0))
+    {
+      printf("  %-10s %10lu ops %10.1f ops/s  p50 %6luus  p99 %6luus  p99.9 %6luus  %lu errors\n",
+             OP_NAMES[ii],
+             (unsigned long)count,
+             count / elapsed_s,
+             (unsigned long)result["p50_us"].asUInt64(),
+             (unsigned long)result["p99_us"].asUInt64(),
+             (unsigned long)result["p999_us"].asUInt64(),
+             (unsigned long)op_errors[ii]);
+    }
+  }
+
+  double cas_retry_rate = (updates > 0) ? (double)cas_retries / updates : 0.0;
+
+  if (print)
+  {
+    printf("Completed %lu operations in %g seconds\n", (unsigned long)total_ops, elapsed_s);
+    printf("  = %g operations per second\n", total_ops / elapsed_s);
+    printf("CAS retries per update = %g (maximum %d)\n", cas_retry_rate, (int)max_cas_retries);
+    printf("Mean AoR size = %g bytes with %g bindings\n", bytes_per_aor, bindings_per_aor);
+  }
+
+  if (json_file != "")
+  {
+    Json::Value root(Json::objectValue);
+    Json::Value& config = root["config"];
+    config["store"] = (memstore_config != "") ? memstore_config : "local";
+    config["threads"] = num_threads;
+    config["duration_s"] = duration_s;
+    config["aors"] = num_aors;
+    config["bindings"] = num_bindings;
+    config["zipf_exponent"] = zipf_exponent;
+    config["mix"] = mix;
+    config["format"] = (format == RegStore::FORMAT_LEGACY) ? "legacy" : "binary";
+    config["layout"] = (layout == RegStore::LAYOUT_PER_BINDING) ? "per-binding" : "aor";
+    config["aor_cache_size"] = aor_cache_size;
+    config["coalesce_aor_writes"] = coalesce_aor_writes;
+
+    Json::Value& results = root["results"];
+    results["populate_s"] = populate_s;
+    results["elapsed_s"] = elapsed_s;
+    results["operations_total"] = (Json::UInt64)total_ops;
+    results["ops_per_sec"] = total_ops / elapsed_s;
+    results["cas_retry_rate"] = cas_retry_rate;
+    results["max_cas_retries"] = (int)max_cas_retries;
+    results["bytes_per_aor"] = bytes_per_aor;
+    results["bindings_per_aor"] = bindings_per_aor;
+    results["operations"] = operations;
+
+    Json::StyledWriter writer;
+    std::string output = writer.write(root);
+
+    if (json_file == "-")
+    {
+      std::cout << output;
+    }
+    else
+    {
+      std::ofstream out(json_file.c_str());
+      out << output;
+      if (!out)
+      {
+        printf("Failed to write results to %s\n", json_file.c_str());
+        exit(1);
+      }
+    }
+  }
+
+  delete store;
+  delete aor_write_coalescer;
+  delete aor_cache;
+  delete data_store;
+
+  exit(0);
+}